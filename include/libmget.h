@@ -197,6 +197,7 @@ MGET_BEGIN_DECLS
 #define MGET_HTTP_CONNECTION_PTR 2008
 #define MGET_HTTP_RESPONSE_KEEPHEADER 2009
 #define MGET_HTTP_MAX_REDIRECTIONS 2010
+#define MGET_HTTP_CONNECTION_POOL 2011
 
 void
 	mget_global_init(int key, ...) G_GNUC_MGET_NULL_TERMINATED;
@@ -225,6 +226,8 @@ int
 	mget_strncasecmp(const char *s1, const char *s2, size_t n) G_GNUC_MGET_PURE;
 void
    mget_memtohex(const unsigned char *src, size_t src_len, char *dst, size_t dst_size) G_GNUC_MGET_NONNULL_ALL;
+long long
+	mget_get_timemillis(void);
 ssize_t
 	mget_fdgetline(char **buf, size_t *bufsize, int fd) G_GNUC_MGET_NONNULL_ALL;
 ssize_t
@@ -602,7 +605,9 @@ typedef struct _MGET_DECOMPRESSOR MGET_DECOMPRESSOR;
 enum {
 	mget_content_encoding_identity,
 	mget_content_encoding_gzip,
-	mget_content_encoding_deflate
+	mget_content_encoding_deflate,
+	mget_content_encoding_brotli,
+	mget_content_encoding_zstd
 };
 
 MGET_DECOMPRESSOR *
@@ -613,6 +618,12 @@ void
 	mget_decompress_close(MGET_DECOMPRESSOR *dc);
 int
 	mget_decompress(MGET_DECOMPRESSOR *dc, char *src, size_t srclen);
+void
+	mget_decompress_set_buffer(MGET_DECOMPRESSOR *dc, char *buf, size_t size);
+void
+	mget_decompress_set_output(MGET_DECOMPRESSOR *dc, mget_buffer_t *body);
+const char *
+	mget_decompress_accept_encoding(void);
 
 /*
  * URI/IRI routines
@@ -853,6 +864,10 @@ void
 
 typedef struct _TCP MGET_TCP;
 
+// what a non-blocking connection waits for
+#define MGET_IO_READABLE 1
+#define MGET_IO_WRITABLE 2
+
 void
 	mget_tcp_close(MGET_TCP **tcp) G_GNUC_MGET_NONNULL_ALL;
 void
@@ -865,6 +880,12 @@ void
 	mget_tcp_set_dns_caching(int caching);
 int
 	mget_tcp_get_dns_caching(void) G_GNUC_MGET_PURE;
+void
+	mget_tcp_set_dns_cache_ttl(int ttl);
+void
+	mget_tcp_set_dns_negative_ttl(int ttl);
+void
+	mget_tcp_get_dns_cache_stats(unsigned long long *hits, unsigned long long *misses) G_GNUC_MGET_NONNULL_ALL;
 int
 	mget_tcp_get_family(void)  G_GNUC_MGET_CONST;
 int
@@ -879,8 +900,20 @@ void
 	mget_tcp_set_bind_address(const char *bind_address);
 struct addrinfo *
 	mget_tcp_resolve(const char *restrict name, const char *restrict port) G_GNUC_MGET_NONNULL((1));
+void
+	mget_tcp_addrinfo_free(struct addrinfo **addrinfo);
+void
+	mget_tcp_prefetch(const char *host, const char *port);
 MGET_TCP *
 	mget_tcp_connect(struct addrinfo *addrinfo, const char *hostname) G_GNUC_MGET_NONNULL((1));
+MGET_TCP *
+	mget_tcp_connect_async(struct addrinfo *addrinfo, const char *hostname) G_GNUC_MGET_NONNULL((1));
+int
+	mget_tcp_connect_continue(MGET_TCP *tcp) G_GNUC_MGET_NONNULL_ALL;
+int
+	mget_tcp_get_sockfd(const MGET_TCP *tcp) G_GNUC_MGET_NONNULL_ALL G_GNUC_MGET_PURE;
+const char *
+	mget_tcp_get_alpn(MGET_TCP *tcp) G_GNUC_MGET_NONNULL_ALL;
 ssize_t
 	mget_tcp_vprintf(MGET_TCP *tcp, const char *fmt, va_list args) G_GNUC_MGET_PRINTF_FORMAT(2,0) G_GNUC_MGET_NONNULL_ALL;
 ssize_t
@@ -889,6 +922,8 @@ ssize_t
 	mget_tcp_write(MGET_TCP *tcp, const char *buf, size_t count) G_GNUC_MGET_NONNULL_ALL;
 ssize_t
 	mget_tcp_read(MGET_TCP *tcp, char *buf, size_t count) G_GNUC_MGET_NONNULL_ALL;
+ssize_t
+	mget_tcp_splice(MGET_TCP *tcp, int fd, size_t count) G_GNUC_MGET_NONNULL_ALL;
 
 /*
  * SSL routines
@@ -905,6 +940,8 @@ ssize_t
 #define MGET_SSL_CHECK_CERTIFICATE 6
 #define MGET_SSL_CERT_TYPE         7
 #define MGET_SSL_PRIVATE_KEY_TYPE  8
+#define MGET_SSL_ALPN              9
+#define MGET_SSL_SESSION_CACHE     10
 
 void
 	mget_ssl_init(void);
@@ -916,8 +953,18 @@ void
 	mget_ssl_set_config_int(int key, int value);
 void *
 	mget_ssl_open(int sockfd, const char *hostname, int connect_timeout) G_GNUC_MGET_NONNULL_ALL;
+void *
+	mget_ssl_open_async(int sockfd, const char *hostname) G_GNUC_MGET_NONNULL_ALL;
+int
+	mget_ssl_handshake(void *session) G_GNUC_MGET_NONNULL_ALL;
+int
+	mget_ssl_get_alpn(void *session, char *buf, size_t bufsize) G_GNUC_MGET_NONNULL_ALL;
 void
 	mget_ssl_close(void **session) G_GNUC_MGET_NONNULL_ALL;
+int
+	mget_ssl_session_cache_save(const char *fname) G_GNUC_MGET_NONNULL_ALL;
+int
+	mget_ssl_session_cache_load(const char *fname) G_GNUC_MGET_NONNULL_ALL;
 void
 	mget_ssl_set_check_certificate(char value);
 
@@ -1014,7 +1061,9 @@ typedef struct {
 	time_t
 		last_modified;
 	char
-		reason[32];
+		reason[32],
+		content_type_buf[64], // content_type points here if short enough
+		content_type_encoding_buf[32]; // same for content_type_encoding
 	short
 		major;
 	short
@@ -1029,6 +1078,8 @@ typedef struct {
 		content_length_valid;
 	char
 		keep_alive;
+	char
+		accept_ranges; // server accepts byte ranges (Accept-Ranges: bytes)
 } MGET_HTTP_RESPONSE;
 
 typedef struct {
@@ -1043,11 +1094,25 @@ typedef struct {
 	const char *
 		scheme;
 	mget_buffer_t *
-		buf;
+		buf; // holds data that has been read ahead, e.g. the start of a pipelined response
+	struct _MGET_HTTP2 *
+		h2; // HTTP/2 session, NULL for HTTP/1.x
+	int
+		pending; // requests sent without having received the response header yet
+	int
+		users; // threads sharing an HTTP/2 connection
 	unsigned
-		print_response_headers : 1;
+		print_response_headers : 1,
+		pooled : 1; // counted by the connection pool
 } MGET_HTTP_CONNECTION;
 
+// incremental response reader for non-blocking connections
+typedef struct _MGET_HTTP_RESPONSE_READER MGET_HTTP_RESPONSE_READER;
+
+#define MGET_HTTP_READER_AGAIN  0
+#define MGET_HTTP_READER_HEADER 1
+#define MGET_HTTP_READER_DONE   2
+
 int
 	http_isseperator(char c);
 int
@@ -1081,6 +1146,8 @@ const char *
 	http_parse_content_encoding(const char *s, char *content_encoding) G_GNUC_MGET_NONNULL_ALL;
 const char *
 	http_parse_connection(const char *s, char *keep_alive) G_GNUC_MGET_NONNULL_ALL;
+const char *
+	http_parse_accept_ranges(const char *s, char *accept_ranges) G_GNUC_MGET_NONNULL_ALL;
 const char *
 	http_parse_setcookie(const char *s, MGET_COOKIE *cookie) G_GNUC_MGET_NONNULL_ALL;
 
@@ -1136,6 +1203,16 @@ MGET_HTTP_RESPONSE *
 	http_get_header(MGET_IRI *iri) G_GNUC_MGET_NONNULL_ALL;
 MGET_HTTP_RESPONSE *
 	http_parse_response(char *buf) G_GNUC_MGET_NONNULL_ALL;
+MGET_HTTP_RESPONSE *
+	http_get_response_header(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags) G_GNUC_MGET_NONNULL((1));
+int
+	http_get_response_body_cb(MGET_HTTP_CONNECTION *conn, MGET_HTTP_RESPONSE *resp,
+								 int (*parse_body)(void *context, const char *data, size_t length),
+								 void *context) G_GNUC_MGET_NONNULL((1,2,3));
+int
+	http_get_response_body_fd(MGET_HTTP_CONNECTION *conn, MGET_HTTP_RESPONSE *resp, int fd) G_GNUC_MGET_NONNULL((1,2));
+int
+	http_get_response_body(MGET_HTTP_CONNECTION *conn, MGET_HTTP_RESPONSE *resp, mget_buffer_t *body) G_GNUC_MGET_NONNULL_ALL;
 MGET_HTTP_RESPONSE *
 	http_get_response_cb(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags,
 								 int (*parse_body)(void *context, const char *data, size_t length),
@@ -1149,15 +1226,54 @@ MGET_HTTP_RESPONSE *
 
 MGET_HTTP_CONNECTION *
 	http_open(const MGET_IRI *iri) G_GNUC_MGET_NONNULL_ALL;
+MGET_HTTP_CONNECTION *
+	http_open_async(const MGET_IRI *iri) G_GNUC_MGET_NONNULL_ALL;
+void
+	http_prefetch(const MGET_IRI *iri) G_GNUC_MGET_NONNULL_ALL;
+void
+	http_get_connection_stats(unsigned long long *connects) G_GNUC_MGET_NONNULL_ALL;
+MGET_HTTP_CONNECTION *
+	http_pool_open(const MGET_IRI *iri) G_GNUC_MGET_NONNULL_ALL;
+MGET_HTTP_CONNECTION *
+	http_pool_checkout(const MGET_IRI *iri) G_GNUC_MGET_NONNULL_ALL;
+void
+	http_pool_checkin(MGET_HTTP_CONNECTION **conn);
+void
+	http_pool_close(MGET_HTTP_CONNECTION **conn);
+void
+	http_pool_set_limits(int max_per_host, int max_total);
+void
+	http_pool_set_idle_timeout(int timeout);
+void
+	http_pool_free(void);
+void
+	http_set_http2(int enable);
 MGET_HTTP_REQUEST *
 	http_create_request(const MGET_IRI *iri, const char *method) G_GNUC_MGET_NONNULL_ALL;
 void
 	http_close(MGET_HTTP_CONNECTION **conn) G_GNUC_MGET_NONNULL_ALL;
 int
 	http_send_request(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req) G_GNUC_MGET_NONNULL_ALL;
+int
+	http_send_requests(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST **reqs, int nreqs) G_GNUC_MGET_NONNULL_ALL;
 ssize_t
 	http_request_to_buffer(MGET_HTTP_REQUEST *req, mget_buffer_t *buf) G_GNUC_MGET_NONNULL_ALL;
 
+MGET_HTTP_RESPONSE_READER *
+	http_response_reader_alloc(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags) G_GNUC_MGET_NONNULL((1));
+void
+	http_response_reader_free(MGET_HTTP_RESPONSE_READER **reader);
+void
+	http_response_reader_set_body_cb(MGET_HTTP_RESPONSE_READER *reader,
+								 int (*parse_body)(void *context, const char *data, size_t length),
+								 void *context) G_GNUC_MGET_NONNULL((1));
+void
+	http_response_reader_set_body(MGET_HTTP_RESPONSE_READER *reader, mget_buffer_t *body) G_GNUC_MGET_NONNULL((1));
+int
+	http_response_reader_read(MGET_HTTP_RESPONSE_READER *reader) G_GNUC_MGET_NONNULL_ALL;
+MGET_HTTP_RESPONSE *
+	http_response_reader_get_response(MGET_HTTP_RESPONSE_READER *reader) G_GNUC_MGET_NONNULL_ALL G_GNUC_MGET_PURE;
+
 /*
  * Highlevel HTTP routines
  */
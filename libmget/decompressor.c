@@ -29,8 +29,15 @@
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <zlib.h>
+#if WITH_BROTLIDEC
+#include <brotli/decode.h>
+#endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #include <libmget.h>
 #include "private.h"
@@ -39,6 +46,14 @@ struct _MGET_DECOMPRESSOR {
 	union {
 		z_stream
 		strm;
+#if WITH_BROTLIDEC
+		BrotliDecoderState
+		*brotli_strm;
+#endif
+#if WITH_ZSTD
+		ZSTD_DStream
+		*zstd_strm;
+#endif
 	} extra;
 	int
 		(*decompress)(MGET_DECOMPRESSOR *dc, char *src, size_t srclen),
@@ -46,10 +61,38 @@ struct _MGET_DECOMPRESSOR {
 	void
 		(*exit)(MGET_DECOMPRESSOR *dc),
 		*context; // given to put_data()
+	mget_buffer_t
+		*body; // whole-buffer mode: decompressed data is appended here instead of going to put_data()
 	char
-		encoding;
+		*outbuf; // gzip/deflate output is collected here and given to put_data() when full
+	size_t
+		outsize,
+		outlen;
+	char
+		encoding,
+		own_outbuf, // outbuf has been allocated by us
+		stopped; // put_data() returned < 0, it gets no more data
 };
 
+#define OUTBUF_SIZE 65536
+
+static void _output(MGET_DECOMPRESSOR *dc, const char *data, size_t length)
+{
+	if (dc->body)
+		mget_buffer_memcat(dc->body, data, length);
+	else if (dc->put_data && !dc->stopped && dc->put_data(dc->context, data, length) < 0)
+		dc->stopped = 1;
+}
+
+static void _flush(MGET_DECOMPRESSOR *dc)
+{
+	if (dc->outlen) {
+		if (dc->put_data && !dc->stopped && dc->put_data(dc->context, dc->outbuf, dc->outlen) < 0)
+			dc->stopped = 1;
+		dc->outlen = 0;
+	}
+}
+
 static int gzip_init(z_stream *strm)
 {
 	memset(strm, 0, sizeof(*strm));
@@ -64,16 +107,18 @@ static int gzip_init(z_stream *strm)
 	return 0;
 }
 
+// no Z_SYNC_FLUSH: zlib may keep back output until it has enough, we just give it as much room
+// as we have. Output is handed over when the buffer is full or the stream ends, not per call.
+
 static int gzip_decompress(MGET_DECOMPRESSOR *dc, char *src, size_t srclen)
 {
 	z_stream *strm;
-	char dst[10240];
+	mget_buffer_t *body = dc->body;
 	int status;
 
 	if (!srclen) {
 		// special case to avoid decompress errors
-		if (dc->put_data)
-			dc->put_data(dc->context, "", 0);
+		_output(dc, "", 0);
 
 		return 0;
 	}
@@ -83,17 +128,33 @@ static int gzip_decompress(MGET_DECOMPRESSOR *dc, char *src, size_t srclen)
 	strm->avail_in = srclen;
 
 	do {
-		strm->next_out = (unsigned char *)dst;
-		strm->avail_out = sizeof(dst);
+		if (body) {
+			// inflate directly into the caller's buffer
+			if (body->size - body->length < 4096)
+				mget_buffer_realloc(body, body->size * 2 + OUTBUF_SIZE);
+
+			strm->next_out = (unsigned char *)body->data + body->length;
+			strm->avail_out = body->size - body->length;
+
+			status = inflate(strm, Z_NO_FLUSH);
 
-		status = inflate(strm, Z_SYNC_FLUSH);
-		if ((status == Z_OK || status == Z_STREAM_END) && strm->avail_out<sizeof(dst)) {
-			if (dc->put_data)
-				dc->put_data(dc->context, dst, sizeof(dst) - strm->avail_out);
+			body->length = body->size - strm->avail_out;
+			body->data[body->length] = 0;
+		} else {
+			strm->next_out = (unsigned char *)dc->outbuf + dc->outlen;
+			strm->avail_out = dc->outsize - dc->outlen;
+
+			status = inflate(strm, Z_NO_FLUSH);
+
+			dc->outlen = dc->outsize - strm->avail_out;
+			if (!strm->avail_out || status == Z_STREAM_END)
+				_flush(dc);
 		}
-	} while (status == Z_OK && !strm->avail_out);
+		// with a full output buffer there might be more output pending, even without input
+	} while (status == Z_OK && (strm->avail_in || !strm->avail_out) && !dc->stopped);
 
-	if (status == Z_OK || status == Z_STREAM_END)
+	// Z_BUF_ERROR just means that no progress was possible
+	if (status == Z_OK || status == Z_STREAM_END || status == Z_BUF_ERROR)
 		return 0;
 
 	error_printf(_("Failed to uncompress gzip stream (%d)\n"), status);
@@ -122,10 +183,111 @@ static int deflate_init(z_stream *strm)
 	return 0;
 }
 
+#if WITH_BROTLIDEC
+static int brotli_init(BrotliDecoderState **strm)
+{
+	if (!(*strm = BrotliDecoderCreateInstance(NULL, NULL, NULL))) {
+		error_printf(_("Failed to init brotli decompression\n"));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int brotli_decompress(MGET_DECOMPRESSOR *dc, char *src, size_t srclen)
+{
+	BrotliDecoderState *strm;
+	BrotliDecoderResult status;
+	uint8_t dst[10240], *next_out;
+	const uint8_t *next_in;
+	size_t avail_in, avail_out;
+
+	if (!srclen) {
+		// special case to avoid decompress errors
+		_output(dc, "", 0);
+
+		return 0;
+	}
+
+	strm = dc->extra.brotli_strm;
+	next_in = (const uint8_t *)src;
+	avail_in = srclen;
+
+	do {
+		next_out = dst;
+		avail_out = sizeof(dst);
+
+		status = BrotliDecoderDecompressStream(strm, &avail_in, &next_in, &avail_out, &next_out, NULL);
+		if (status != BROTLI_DECODER_RESULT_ERROR && avail_out < sizeof(dst))
+			_output(dc, (char *)dst, sizeof(dst) - avail_out);
+	} while (status == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+
+	if (status != BROTLI_DECODER_RESULT_ERROR)
+		return 0;
+
+	error_printf(_("Failed to uncompress brotli stream (%s)\n"), BrotliDecoderErrorString(BrotliDecoderGetErrorCode(strm)));
+	return -1;
+}
+
+static void brotli_exit(MGET_DECOMPRESSOR *dc)
+{
+	BrotliDecoderDestroyInstance(dc->extra.brotli_strm);
+}
+#endif
+
+#if WITH_ZSTD
+static int zstd_init(ZSTD_DStream **strm)
+{
+	if (!(*strm = ZSTD_createDStream()) || ZSTD_isError(ZSTD_initDStream(*strm))) {
+		error_printf(_("Failed to init zstd decompression\n"));
+		ZSTD_freeDStream(*strm);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int zstd_decompress(MGET_DECOMPRESSOR *dc, char *src, size_t srclen)
+{
+	ZSTD_inBuffer in = { src, srclen, 0 };
+	ZSTD_outBuffer out;
+	char dst[10240];
+	size_t rc;
+
+	if (!srclen) {
+		// special case to avoid decompress errors
+		_output(dc, "", 0);
+
+		return 0;
+	}
+
+	do {
+		out.dst = dst;
+		out.size = sizeof(dst);
+		out.pos = 0;
+
+		rc = ZSTD_decompressStream(dc->extra.zstd_strm, &out, &in);
+		if (ZSTD_isError(rc)) {
+			error_printf(_("Failed to uncompress zstd stream (%s)\n"), ZSTD_getErrorName(rc));
+			return -1;
+		}
+
+		if (out.pos)
+			_output(dc, dst, out.pos);
+	} while (in.pos < in.size || out.pos == out.size); // a full output buffer might leave data in the decoder
+
+	return 0;
+}
+
+static void zstd_exit(MGET_DECOMPRESSOR *dc)
+{
+	ZSTD_freeDStream(dc->extra.zstd_strm);
+}
+#endif
+
 static int identity(MGET_DECOMPRESSOR *dc, char *src, size_t srclen)
 {
-	if (dc->put_data)
-		dc->put_data(dc->context, src, srclen);
+	_output(dc, src, srclen);
 
 	return 0;
 }
@@ -137,16 +299,33 @@ MGET_DECOMPRESSOR *mget_decompress_open(int encoding,
 	MGET_DECOMPRESSOR *dc = xcalloc(1, sizeof(MGET_DECOMPRESSOR));
 	int rc = 0;
 
-	if (encoding == mget_content_encoding_gzip) {
-		if ((rc = gzip_init(&dc->extra.strm)) == 0) {
+	if (encoding == mget_content_encoding_gzip || encoding == mget_content_encoding_deflate) {
+		if (encoding == mget_content_encoding_gzip)
+			rc = gzip_init(&dc->extra.strm);
+		else
+			rc = deflate_init(&dc->extra.strm);
+
+		if (rc == 0) {
 			dc->decompress = gzip_decompress;
 			dc->exit = gzip_exit;
+			dc->outbuf = xmalloc(OUTBUF_SIZE);
+			dc->outsize = OUTBUF_SIZE;
+			dc->own_outbuf = 1;
 		}
-	} else if (encoding == mget_content_encoding_deflate) {
-		if ((rc = deflate_init(&dc->extra.strm)) == 0) {
-			dc->decompress = gzip_decompress;
-			dc->exit = gzip_exit;
+#if WITH_BROTLIDEC
+	} else if (encoding == mget_content_encoding_brotli) {
+		if ((rc = brotli_init(&dc->extra.brotli_strm)) == 0) {
+			dc->decompress = brotli_decompress;
+			dc->exit = brotli_exit;
 		}
+#endif
+#if WITH_ZSTD
+	} else if (encoding == mget_content_encoding_zstd) {
+		if ((rc = zstd_init(&dc->extra.zstd_strm)) == 0) {
+			dc->decompress = zstd_decompress;
+			dc->exit = zstd_exit;
+		}
+#endif
 	} else {
 		// identity
 		dc->decompress = identity;
@@ -163,20 +342,70 @@ MGET_DECOMPRESSOR *mget_decompress_open(int encoding,
 	return dc;
 }
 
+// give gzip/deflate output to put_data() in pieces of up to <size> bytes, collected in <buf>.
+// <buf> must stay valid until mget_decompress_close().
+
+void mget_decompress_set_buffer(MGET_DECOMPRESSOR *dc, char *buf, size_t size)
+{
+	if (dc && dc->outbuf) {
+		_flush(dc);
+
+		if (dc->own_outbuf) {
+			xfree(dc->outbuf);
+			dc->own_outbuf = 0;
+		}
+
+		dc->outbuf = buf;
+		dc->outsize = size;
+	}
+}
+
+// whole-buffer mode: append the decompressed data directly to <body> instead of calling put_data().
+// the fastest way to get a body into memory, gzip/deflate inflate without any intermediate copy.
+
+void mget_decompress_set_output(MGET_DECOMPRESSOR *dc, mget_buffer_t *body)
+{
+	if (dc) {
+		_flush(dc);
+		dc->body = body;
+	}
+}
+
 void mget_decompress_close(MGET_DECOMPRESSOR *dc)
 {
 	if (dc) {
+		_flush(dc); // e.g. a truncated stream
 		if (dc->exit)
 			dc->exit(dc);
+		if (dc->own_outbuf)
+			xfree(dc->outbuf);
 		xfree(dc);
 	}
 }
 
+// returns -1 if <src> could not be decompressed or put_data() returned < 0 to stop the stream
+
 int mget_decompress(MGET_DECOMPRESSOR *dc, char *src, size_t srclen)
 {
 	if (dc) {
-		return dc->decompress(dc, src, srclen);
+		int rc = dc->decompress(dc, src, srclen);
+
+		return dc->stopped ? -1 : rc;
 	}
 
 	return 0;
 }
+
+// value for the Accept-Encoding request header, offering what has been compiled in
+
+const char *mget_decompress_accept_encoding(void)
+{
+	return "gzip, deflate"
+#if WITH_BROTLIDEC
+		", br"
+#endif
+#if WITH_ZSTD
+		", zstd"
+#endif
+		;
+}
@@ -35,11 +35,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include <libmget.h>
@@ -75,6 +78,9 @@ static MGET_IRI
 	*http_proxy,
 	*https_proxy;
 
+static int
+	http2_enabled; // offer HTTP/2 via ALPN and share HTTP/2 connections in the pool
+
 int http_isseperator(char c)
 {
 	// return strchr("()<>@,;:\\\"/[]?={} \t", c) != NULL;
@@ -432,6 +438,10 @@ const char *http_parse_content_encoding(const char *s, char *content_encoding)
 		*content_encoding = mget_content_encoding_gzip;
 	else if (!strcasecmp(s, "deflate"))
 		*content_encoding = mget_content_encoding_deflate;
+	else if (!strcasecmp(s, "br"))
+		*content_encoding = mget_content_encoding_brotli;
+	else if (!strcasecmp(s, "zstd"))
+		*content_encoding = mget_content_encoding_zstd;
 	else
 		*content_encoding = mget_content_encoding_identity;
 
@@ -440,13 +450,27 @@ const char *http_parse_content_encoding(const char *s, char *content_encoding)
 	return s;
 }
 
+// Accept-Ranges = "Accept-Ranges" ":" acceptable-ranges
+// acceptable-ranges = 1#range-unit | "none"
+
+const char *http_parse_accept_ranges(const char *s, char *accept_ranges)
+{
+	while (isblank(*s)) s++;
+
+	*accept_ranges = !strncasecmp(s, "bytes", 5) && !http_istoken(s[5]);
+
+	while (http_istoken(*s)) s++;
+
+	return s;
+}
+
 const char *http_parse_connection(const char *s, char *keep_alive)
 {
 	while (isblank(*s)) s++;
 
-	if (!strcasecmp(s, "keep-alive"))
+	if (!strncasecmp(s, "keep-alive", 10))
 		*keep_alive = 1;
-	else
+	else if (!strncasecmp(s, "close", 5))
 		*keep_alive = 0;
 
 	while (http_istoken(*s)) s++;
@@ -788,74 +812,263 @@ const char *http_parse_setcookie(const char *s, MGET_COOKIE *cookie)
 
 /* content of <buf> will be destroyed */
 
+// the header fields we are interested in, looked up by a perfect hash over
+// length, first and last character of the name (see _header_field())
+
+enum {
+	HEADER_LOCATION = 1,
+	HEADER_LINK,
+	HEADER_DIGEST,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_CONTENT_ENCODING,
+	HEADER_CONTENT_TYPE,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONNECTION,
+	HEADER_LAST_MODIFIED,
+	HEADER_SET_COOKIE,
+	HEADER_WWW_AUTHENTICATE,
+	HEADER_ACCEPT_RANGES
+};
+
+#define HEADER_HASH(len, first, last) ((((len) << 2) + ((first) | 0x20) + ((last) | 0x20)) & 31)
+
+static const struct {
+	const char *
+		name;
+	unsigned char
+		len,
+		id;
+} _header_fields[32] = {
+	[HEADER_HASH(8, 'l', 'n')] = { "Location", 8, HEADER_LOCATION },
+	[HEADER_HASH(4, 'l', 'k')] = { "Link", 4, HEADER_LINK },
+	[HEADER_HASH(6, 'd', 't')] = { "Digest", 6, HEADER_DIGEST },
+	[HEADER_HASH(17, 't', 'g')] = { "Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING },
+	[HEADER_HASH(16, 'c', 'g')] = { "Content-Encoding", 16, HEADER_CONTENT_ENCODING },
+	[HEADER_HASH(12, 'c', 'e')] = { "Content-Type", 12, HEADER_CONTENT_TYPE },
+	[HEADER_HASH(14, 'c', 'h')] = { "Content-Length", 14, HEADER_CONTENT_LENGTH },
+	[HEADER_HASH(10, 'c', 'n')] = { "Connection", 10, HEADER_CONNECTION },
+	[HEADER_HASH(13, 'l', 'd')] = { "Last-Modified", 13, HEADER_LAST_MODIFIED },
+	[HEADER_HASH(10, 's', 'e')] = { "Set-Cookie", 10, HEADER_SET_COOKIE },
+	[HEADER_HASH(16, 'w', 'e')] = { "WWW-Authenticate", 16, HEADER_WWW_AUTHENTICATE },
+	[HEADER_HASH(13, 'a', 's')] = { "Accept-Ranges", 13, HEADER_ACCEPT_RANGES }
+};
+
+static int G_GNUC_MGET_NONNULL_ALL _header_field(const char *name, size_t len)
+{
+	int n = HEADER_HASH(len, name[0], name[len - 1]);
+
+	if (_header_fields[n].len == len && !strncasecmp(name, _header_fields[n].name, len))
+		return _header_fields[n].id;
+
+	return 0;
+}
+
+// copy a string into a fixed-size buffer of the response, only long values go to the heap
+static const char *_strndup_fixed(char *fixed, size_t size, const char *s, size_t n)
+{
+	if (n >= size)
+		return strndup(s, n);
+
+	memcpy(fixed, s, n);
+	fixed[n] = 0;
+
+	return fixed;
+}
+
+// same as http_parse_content_type(), but without allocations for the usual short values
+static void G_GNUC_MGET_NONNULL_ALL _parse_content_type(const char *s, MGET_HTTP_RESPONSE *resp)
+{
+	const char *p, *v;
+	size_t n, vlen;
+
+	while (isblank(*s)) s++;
+
+	for (p = s; *s && (http_istoken(*s) || *s == '/'); s++);
+	if (resp->content_type != resp->content_type_buf)
+		xfree(resp->content_type);
+	resp->content_type = _strndup_fixed(resp->content_type_buf, sizeof(resp->content_type_buf), p, s - p);
+
+	while (*s) {
+		while (isblank(*s) || *s == ';') s++;
+
+		for (p = s; http_istoken(*s); s++);
+		for (n = s - p; isblank(*s); s++);
+		if (*s != '=') {
+			while (*s && *s != ';') s++;
+			continue;
+		}
+
+		for (s++; isblank(*s); s++);
+
+		if (*s == '\"') {
+			for (v = ++s; *s && *s != '\"'; s++)
+				if (*s == '\\' && s[1]) s++;
+			vlen = s - v;
+			if (*s) s++;
+		} else {
+			for (v = s; http_istoken(*s); s++);
+			vlen = s - v;
+		}
+
+		if (n == 7 && !strncasecmp(p, "charset", 7)) {
+			if (resp->content_type_encoding != resp->content_type_encoding_buf)
+				xfree(resp->content_type_encoding);
+			resp->content_type_encoding = _strndup_fixed(resp->content_type_encoding_buf, sizeof(resp->content_type_encoding_buf), v, vlen);
+			break;
+		}
+	}
+}
+
+// parse up to <max> decimal digits, returns -1 if there are none
+static int _parse_digits(const char **s, int max)
+{
+	const char *p = *s;
+	int n = 0;
+
+	for (; max && isdigit(*p); p++, max--)
+		n = n * 10 + (*p - '0');
+
+	if (p == *s)
+		return -1;
+
+	*s = p;
+	return n;
+}
+
 /* buf must be 0-terminated */
 MGET_HTTP_RESPONSE *http_parse_response(char *buf)
 {
 	const char *s;
-	char *line, *eol, name[32];
+	char *line, *eol, *end;
 	MGET_HTTP_RESPONSE *resp = NULL;
+	int major, minor, code;
+	size_t len;
+
+	for (s = buf; isspace(*s); s++);
+
+	// status line: HTTP/<major>.<minor> <code> [reason phrase]
+	// the reason phrase may be empty (always with HTTP/2)
+	major = minor = code = -1;
+	if (!strncmp(s, "HTTP/", 5)) {
+		s += 5;
+		if ((major = _parse_digits(&s, 3)) >= 0) {
+			minor = 0; // 'HTTP/2' comes without minor version
+			if (*s == '.') {
+				s++;
+				minor = _parse_digits(&s, 3);
+			}
+		}
+		if (isblank(*s)) {
+			while (isblank(*s)) s++;
+			code = _parse_digits(&s, 3);
+		}
+	}
 
-	resp = xcalloc(1, sizeof(MGET_HTTP_RESPONSE));
-
-	if (sscanf(buf, " HTTP/%3hd.%3hd %3hd %31[^\r\n] ",
-		&resp->major, &resp->minor, &resp->code, resp->reason) >= 3 && (eol = strchr(buf + 10, '\n'))) {
-		// eol[-1]=0;
-		// log_printf("# %s\n",buf);
-	} else {
+	if (major < 0 || minor < 0 || code < 0) {
 		error_printf(_("HTTP response header not found\n"));
-		xfree(resp);
 		return NULL;
 	}
 
-	for (line = eol + 1; eol && *line && *line != '\r'; line = eol + 1) {
-		eol = strchr(line + 1, '\n');
-		while (eol && isblank(eol[1])) { // handle split lines
-			*eol = eol[-1] = ' ';
-			eol = strchr(eol + 1, '\n');
+	resp = xcalloc(1, sizeof(MGET_HTTP_RESPONSE));
+	resp->major = (short)major;
+	resp->minor = (short)minor;
+	resp->code = (short)code;
+
+	while (isblank(*s)) s++;
+	for (len = 0; s[len] && s[len] != '\r' && s[len] != '\n'; len++);
+	if (len >= sizeof(resp->reason))
+		len = sizeof(resp->reason) - 1;
+	memcpy(resp->reason, s, len);
+
+	// HTTP/1.1 connections are persistent unless the server says 'Connection: close'
+	resp->keep_alive = resp->major > 1 || (resp->major == 1 && resp->minor >= 1);
+
+	// from here on, lines are found by memchr() which is much faster than strchr() on long headers
+	end = (char *)s + strlen(s);
+	eol = memchr(s, '\n', end - s);
+
+	for (line = eol ? eol + 1 : end; line < end; line = eol + 1) {
+		if (!(eol = memchr(line, '\n', end - line)))
+			eol = end;
+
+		while (eol + 1 < end && isblank(eol[1])) { // handle split lines
+			*eol = ' ';
+			if (eol[-1] == '\r')
+				eol[-1] = ' ';
+			if (!(eol = memchr(eol + 1, '\n', end - eol - 1)))
+				eol = end;
 		}
 
-		if (eol)
-			eol[-1] = 0;
+		len = eol - line;
+		if (len && line[len - 1] == '\r')
+			len--;
+		if (!len)
+			break; // empty line: end of header
+
+		line[len] = 0;
+
+		// log_printf("# %s\n",line);
 
-		// log_printf("# %p %s\n",eol,line);
+		for (s = line; http_istoken(*s); s++);
+		if (!(len = s - line))
+			continue;
 
-		s = http_parse_name_fixed(line, name, sizeof(name));
+		while (*s && *s != ':') s++;
+		if (*s)
+			s++;
 		// s now points directly after :
 
-		if (resp->code / 100 == 3 && !strcasecmp(name, "Location")) {
-			xfree(resp->location);
-			http_parse_location(s, &resp->location);
-		} else if (resp->code / 100 == 3 && !strcasecmp(name, "Link")) {
-			// log_printf("s=%.31s\n",s);
-			MGET_HTTP_LINK link;
-			http_parse_link(s, &link);
-			// log_printf("link->uri=%s\n",link.uri);
-			if (!resp->links)
-				resp->links = mget_vector_create(8, 8, NULL);
-			mget_vector_add(resp->links, &link, sizeof(link));
-		} else if (!strcasecmp(name, "Digest")) {
+		switch (_header_field(line, len)) {
+		case HEADER_LOCATION:
+			if (resp->code / 100 == 3) {
+				xfree(resp->location);
+				http_parse_location(s, &resp->location);
+			}
+			break;
+		case HEADER_LINK:
+			if (resp->code / 100 == 3) {
+				MGET_HTTP_LINK link;
+				http_parse_link(s, &link);
+				if (!resp->links)
+					resp->links = mget_vector_create(8, 8, NULL);
+				mget_vector_add(resp->links, &link, sizeof(link));
+			}
+			break;
+		case HEADER_DIGEST:
+		{
 			// http://tools.ietf.org/html/rfc3230
 			MGET_HTTP_DIGEST digest;
 			http_parse_digest(s, &digest);
-			// log_printf("%s: %s\n",digest.algorithm,digest.encoded_digest);
 			if (!resp->digests)
 				resp->digests = mget_vector_create(4, 4, NULL);
 			mget_vector_add(resp->digests, &digest, sizeof(digest));
-		} else if (!strcasecmp(name, "Transfer-Encoding")) {
+			break;
+		}
+		case HEADER_TRANSFER_ENCODING:
 			http_parse_transfer_encoding(s, &resp->transfer_encoding);
-		} else if (!strcasecmp(name, "Content-Encoding")) {
+			break;
+		case HEADER_CONTENT_ENCODING:
 			http_parse_content_encoding(s, &resp->content_encoding);
-		} else if (!strcasecmp(name, "Content-Type")) {
-			http_parse_content_type(s, &resp->content_type, &resp->content_type_encoding);
-		} else if (!strcasecmp(name, "Content-Length")) {
+			break;
+		case HEADER_CONTENT_TYPE:
+			_parse_content_type(s, resp);
+			break;
+		case HEADER_CONTENT_LENGTH:
 			resp->content_length = (size_t)atoll(s);
 			resp->content_length_valid = 1;
-		} else if (!strcasecmp(name, "Connection")) {
+			break;
+		case HEADER_CONNECTION:
 			http_parse_connection(s, &resp->keep_alive);
-// Last-Modified: Thu, 07 Feb 2008 15:03:24 GMT
-		} else if (!strcasecmp(name, "Last-Modified")) {
+			break;
+		case HEADER_ACCEPT_RANGES:
+			http_parse_accept_ranges(s, &resp->accept_ranges);
+			break;
+		case HEADER_LAST_MODIFIED:
+			// Last-Modified: Thu, 07 Feb 2008 15:03:24 GMT
 			resp->last_modified = parse_rfc1123_date(s);
-		} else if (!strcasecmp(name, "Set-Cookie")) {
+			break;
+		case HEADER_SET_COOKIE:
+		{
 			// this is a parser. content validation must be done by higher level functions.
 			MGET_COOKIE cookie;
 			http_parse_setcookie(s, &cookie);
@@ -863,20 +1076,28 @@ MGET_HTTP_RESPONSE *http_parse_response(char *buf)
 			if (!resp->cookies)
 				resp->cookies = mget_vector_create(4, 4, NULL);
 			mget_vector_add(resp->cookies, &cookie, sizeof(cookie));
-		} else if (!strcasecmp(name, "WWW-Authenticate")) {
+			break;
+		}
+		case HEADER_WWW_AUTHENTICATE:
+		{
 			MGET_HTTP_CHALLENGE challenge;
 			http_parse_challenge(s, &challenge);
 
 			if (!resp->challenges)
 				resp->challenges = mget_vector_create(2, 2, NULL);
 			mget_vector_add(resp->challenges, &challenge, sizeof(challenge));
+			break;
+		}
 		}
+
+		if (eol == end)
+			break;
 	}
 
 	// a workaround for broken server configurations
 	// see http://mail-archives.apache.org/mod_mbox/httpd-dev/200207.mbox/<3D2D4E76.4010502@talex.com.pl>
 	if (resp->content_encoding == mget_content_encoding_gzip &&
-		!strcasecmp(resp->content_type, "application/x-gzip"))
+		!mget_strcasecmp(resp->content_type, "application/x-gzip"))
 	{
 		debug_printf("Broken server configuration gzip workaround triggered\n");
 		resp->content_encoding =  mget_content_encoding_identity;
@@ -957,8 +1178,10 @@ void http_free_response(MGET_HTTP_RESPONSE **resp)
 		(*resp)->challenges = NULL;
 		http_free_cookies(&(*resp)->cookies);
 		(*resp)->cookies = NULL;
-		xfree((*resp)->content_type);
-		xfree((*resp)->content_type_encoding);
+		if ((*resp)->content_type != (*resp)->content_type_buf)
+			xfree((*resp)->content_type);
+		if ((*resp)->content_type_encoding != (*resp)->content_type_encoding_buf)
+			xfree((*resp)->content_type_encoding);
 		xfree((*resp)->location);
 		// xfree((*resp)->reason);
 		mget_buffer_free(&(*resp)->header);
@@ -1131,392 +1354,1853 @@ void http_set_config_int(int key, int value)
 }
 */
 
-MGET_HTTP_CONNECTION *http_open(const MGET_IRI *iri)
-{
-	MGET_HTTP_CONNECTION
-		*conn = xcalloc(1, sizeof(MGET_HTTP_CONNECTION));
-	const char
-		*port,
-		*host;
-	int
-		ssl = iri->scheme == IRI_SCHEME_HTTPS;
-
-	if (!conn)
-		return NULL;
+// the host to connect to for <iri>, which is the proxy if one is set
 
+static void _http_get_peer(const MGET_IRI *iri, const char **host, const char **port)
+{
 	if (iri->scheme == IRI_SCHEME_HTTP && http_proxy) {
-		host = http_proxy->host;
-		port = http_proxy->resolv_port;
+		*host = http_proxy->host;
+		*port = http_proxy->resolv_port;
 	} else if (iri->scheme == IRI_SCHEME_HTTPS && https_proxy) {
-		host = https_proxy->host;
-		port = https_proxy->resolv_port;
-//		port = https_proxy->port && *https_proxy->port) ? https_proxy->port : https_proxy->scheme;
+		*host = https_proxy->host;
+		*port = https_proxy->resolv_port;
+//		*port = https_proxy->port && *https_proxy->port) ? https_proxy->port : https_proxy->scheme;
 	} else {
-		host = iri->host;
-		port = iri->resolv_port;
+		*host = iri->host;
+		*port = iri->resolv_port;
 	}
+}
 
-	if ((conn->addrinfo = mget_tcp_resolve(host, port)) == NULL)
-		goto error;
-
-	if ((conn->tcp = mget_tcp_connect(conn->addrinfo, ssl ? host : NULL)) != NULL) {
-		conn->esc_host = iri->host ? strdup(iri->host) : NULL;
-		conn->port = iri->resolv_port;
-		conn->scheme = iri->scheme;
-		conn->buf = mget_buffer_alloc(102400); // reusable buffer, large enough for most requests and responses
-		return conn;
-	}
+/*
+ * HTTP/2 (RFC 7540) with HPACK header compression (RFC 7541).
+ *
+ * HTTP/2 is used when the server selects 'h2' via ALPN, see http_set_http2().
+ * Each request is sent on its own stream and the connection may be used by several
+ * threads at once: a thread waiting for its response reads and dispatches the frames
+ * of all streams, the other threads sleep until their stream has news.
+ * http_send_request(), http_get_response_header() and http_get_response_body_cb()
+ * hide the differences to HTTP/1.1.
+ */
 
-error:
-	http_close(&conn);
-	return NULL;
-}
+#define H2_FRAME_DATA          0x0
+#define H2_FRAME_HEADERS       0x1
+#define H2_FRAME_RST_STREAM    0x3
+#define H2_FRAME_SETTINGS      0x4
+#define H2_FRAME_PUSH_PROMISE  0x5
+#define H2_FRAME_PING          0x6
+#define H2_FRAME_GOAWAY        0x7
+#define H2_FRAME_WINDOW_UPDATE 0x8
+#define H2_FRAME_CONTINUATION  0x9
+
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+
+#define H2_CANCEL 0x8 // RST_STREAM error code
+
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_FRAME_SIZE 16384 // the default, we don't ask for larger frames
+#define H2_STREAM_WINDOW (1 << 20) // receive window of each stream
+#define H2_CONNECTION_WINDOW (16 << 20) // receive window of the connection
+#define H2_HEADER_TABLE_SIZE 4096 // size of the HPACK dynamic table (the default)
+#define H2_MAX_HEADER_BLOCK (256 * 1024) // HEADERS + CONTINUATION frames of one header block
+
+#define H2_LENGTH(p) (((size_t)(p)[0] << 16) | ((size_t)(p)[1] << 8) | (p)[2])
+#define H2_UINT32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (p)[3])
+
+typedef struct {
+	char
+		*name,
+		*value;
+	size_t
+		size; // as defined by RFC 7541 4.1
+} HPACK_ENTRY;
+
+typedef struct _H2_STREAM H2_STREAM;
+
+struct _H2_STREAM {
+	const MGET_HTTP_REQUEST
+		*req; // to find the stream until the response header has been taken
+	MGET_HTTP_RESPONSE
+		*resp; // to find the stream while reading the body
+	mget_buffer_t
+		*header, // response header in HTTP/1.1 notation
+		*data; // body data not consumed yet
+	H2_STREAM
+		*next;
+	size_t
+		consumed; // bytes consumed since the last WINDOW_UPDATE
+	uint32_t
+		id;
+	char
+		closed, // END_STREAM received
+		error; // stream reset or connection lost
+};
 
-void http_close(MGET_HTTP_CONNECTION **conn)
-{
-	if (conn && *conn) {
-		mget_tcp_close(&(*conn)->tcp);
-		if (!mget_tcp_get_dns_caching())
-			freeaddrinfo((*conn)->addrinfo);
-		xfree((*conn)->esc_host);
-		// xfree((*conn)->port);
-		// xfree((*conn)->scheme);
-		mget_buffer_free(&(*conn)->buf);
-		xfree(*conn);
-	}
-}
+struct _MGET_HTTP2 {
+	pthread_mutex_t
+		mutex, // protects the session, except reading from the socket (see 'reading')
+		write_mutex; // frames must not be interleaved
+	pthread_cond_t
+		cond; // frames have been dispatched
+	H2_STREAM
+		*streams;
+	HPACK_ENTRY
+		*table; // HPACK dynamic table, oldest entry first
+	mget_buffer_t
+		*header_block, // HEADERS + CONTINUATION fragments
+		*control; // frames to send, created while dispatching (ACKs, WINDOW_UPDATE)
+	size_t
+		table_size,
+		table_max, // set by the server with a dynamic table size update, up to H2_HEADER_TABLE_SIZE
+		consumed; // connection bytes consumed since the last WINDOW_UPDATE
+	uint32_t
+		header_stream, // stream of the incomplete header block
+		next_stream_id,
+		max_concurrent_streams,
+		max_frame_size;
+	int
+		table_len,
+		table_alloc;
+	char
+		header_end_stream, // the header block ends the stream
+		reading, // a thread reads from the connection
+		goaway, // no new streams
+		broken;
+};
 
-int http_send_request(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req)
-{
-	ssize_t nbytes;
+typedef struct _MGET_HTTP2 HTTP2;
 
-	if ((nbytes = http_request_to_buffer(req, conn->buf)) < 0) {
-		error_printf(_("Failed to create request buffer\n"));
-		return -1;
-	}
+static const struct {
+	const char
+		*name,
+		*value;
+} hpack_static_table[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
 
-	if (mget_tcp_write(conn->tcp, conn->buf->data, nbytes) != nbytes) {
-		// An error will be written by the mget_tcp_write function.
-		// error_printf(_("Failed to send %zd bytes (%d)\n"), nbytes, errno);
-		return -1;
-	}
+// RFC 7541 Appendix B, canonical Huffman code: number of codes per bit length
+static const unsigned char hpack_huff_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
 
-	debug_printf("# sent %zd bytes:\n%s", nbytes, conn->buf->data);
+// the symbols ordered by code
+static const unsigned short hpack_huff_symbol[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256
+};
 
-	return 0;
-}
+// decode the Huffman coded string <in> (RFC 7541 5.2), bit by bit using the canonical code
 
-ssize_t http_request_to_buffer(MGET_HTTP_REQUEST *req, mget_buffer_t *buf)
+int http2_hpack_huffman_decode(const unsigned char *in, size_t inlen, mget_buffer_t *out)
 {
-	int it, use_proxy = 0;
+	size_t bitpos = 0, nbits = inlen * 8;
 
-//	buffer_sprintf(buf, "%s /%s HTTP/1.1\r\nHOST: %s", req->method, req->esc_resource.data ? req->esc_resource.data : "",);
+	while (bitpos < nbits) {
+		int code = 0, first = 0, index = 0, len, ones = 1;
+		unsigned bit, symbol = 256;
 
-	mget_buffer_strcpy(buf, req->method);
-	mget_buffer_memcat(buf, " ", 1);
-	if (http_proxy && req->scheme == IRI_SCHEME_HTTP) {
-		use_proxy = 1;
-		mget_buffer_strcat(buf, req->scheme);
-		mget_buffer_memcat(buf, "://", 3);
-		mget_buffer_bufcat(buf, &req->esc_host);
-	} else if (https_proxy && req->scheme == IRI_SCHEME_HTTPS) {
-		use_proxy = 1;
-		mget_buffer_strcat(buf, req->scheme);
-		mget_buffer_memcat(buf, "://", 3);
-		mget_buffer_bufcat(buf, &req->esc_host);
-	}
-	mget_buffer_memcat(buf, "/", 1);
-	mget_buffer_bufcat(buf, &req->esc_resource);
-	mget_buffer_memcat(buf, " HTTP/1.1\r\n", 11);
-	mget_buffer_memcat(buf, "Host: ", 6);
-	mget_buffer_bufcat(buf, &req->esc_host);
-	mget_buffer_memcat(buf, "\r\n", 2);
+		for (len = 1; len <= 30; len++) {
+			if (bitpos >= nbits) {
+				// padding: the most significant bits of EOS (all ones), less than 8 bits
+				return len <= 8 && ones ? 0 : -1;
+			}
 
-	for (it = 0; it < mget_vector_size(req->lines); it++) {
-		mget_buffer_strcat(buf, mget_vector_get(req->lines, it));
-		if (buf->data[buf->length - 1] != '\n') {
-			mget_buffer_memcat(buf, "\r\n", 2);
+			bit = (in[bitpos >> 3] >> (7 - (bitpos & 7))) & 1;
+			bitpos++;
+			ones &= bit;
+
+			code |= bit;
+			if (code - first < hpack_huff_count[len]) {
+				symbol = hpack_huff_symbol[index + code - first];
+				break;
+			}
+			index += hpack_huff_count[len];
+			first = (first + hpack_huff_count[len]) << 1;
+			code <<= 1;
 		}
-	}
 
-	if (use_proxy)
-		mget_buffer_strcat(buf, "Proxy-Connection: keep-alive\r\n");
+		if (symbol == 256)
+			return -1; // EOS must not be used
 
-	mget_buffer_memcat(buf, "\r\n", 2); // end-of-header
+		mget_buffer_memcat(out, (char *)&(unsigned char){ (unsigned char)symbol }, 1);
+	}
 
-	return buf->length;
+	return 0;
 }
 
-MGET_HTTP_RESPONSE *http_get_response_cb(
-	MGET_HTTP_CONNECTION *conn,
-	MGET_HTTP_REQUEST *req,
-	unsigned int flags,
-	int (*parse_body)(void *context, const char *data, size_t length),
-	void *context) // given to parse_body
-{
-	size_t bufsize, body_len = 0, body_size = 0;
-	ssize_t nbytes, nread = 0;
-	char *buf, *p = NULL;
-	MGET_HTTP_RESPONSE *resp = NULL;
-	MGET_DECOMPRESSOR *dc = NULL;
+// RFC 7541 5.1 integer representation with a prefix of <prefix_bits>
 
-	// reuse generic connection buffer
-	buf = conn->buf->data;
-	bufsize = conn->buf->size;
+int http2_hpack_decode_int(const unsigned char **p, const unsigned char *end, int prefix_bits, size_t *value)
+{
+	unsigned max = (1U << prefix_bits) - 1;
+	int shift = 0;
 
-	while ((nbytes = mget_tcp_read(conn->tcp, buf + nread, bufsize - nread)) > 0) {
-		debug_printf("nbytes %zd nread %zd %zd\n", nbytes, nread, bufsize);
-		nread += nbytes;
-		buf[nread] = 0; // 0-terminate to allow string functions
+	if (*p >= end)
+		return -1;
 
-		if (nread < 4) continue;
+	if ((*value = *(*p)++ & max) < max)
+		return 0;
 
-		if (nread == nbytes)
-			p = buf;
-		else
-			p = buf + nread - nbytes - 3;
+	while (*p < end && shift < 28) {
+		*value += (size_t)(**p & 0x7F) << shift;
+		if (!(*(*p)++ & 0x80))
+			return 0;
+		shift += 7;
+	}
 
-		if ((p = strstr(p, "\r\n\r\n"))) {
-			// found end-of-header
-			*p = 0;
+	return -1;
+}
 
-			debug_printf("# got header %zd bytes:\n%s\n\n", p - buf, buf);
+static int _hpack_decode_string(const unsigned char **p, const unsigned char *end, mget_buffer_t *out)
+{
+	size_t length;
+	int huffman;
 
-			if (req && (flags&MGET_HTTP_RESPONSE_KEEPHEADER)) {
-				mget_buffer_t *header = mget_buffer_init(NULL, NULL, p - buf + 4);
-				mget_buffer_memcpy(header, buf, p - buf);
-				mget_buffer_memcat(header, "\r\n\r\n", 4);
+	if (*p >= end)
+		return -1;
 
-				if (!(resp = http_parse_response(buf))) {
-					mget_buffer_free(&header);
-					goto cleanup; // something is wrong with the header
-				}
+	huffman = **p & 0x80;
 
-				resp->header = header;
+	if (http2_hpack_decode_int(p, end, 7, &length) || length > (size_t)(end - *p))
+		return -1;
 
-			} else {
-				if (!(resp = http_parse_response(buf)))
-					goto cleanup; // something is wrong with the header
-			}
+	out->length = 0;
+	if (huffman) {
+		if (http2_hpack_huffman_decode(*p, length, out))
+			return -1;
+	} else
+		mget_buffer_memcat(out, *p, length);
 
-			if (req && !strcasecmp(req->method, "HEAD"))
-				goto cleanup; // a HEAD response won't have a body
+	*p += length;
+	return 0;
+}
 
-			p += 4; // skip \r\n\r\n to point to body
-			break;
-		}
+static void _hpack_table_evict(HTTP2 *h2, size_t max_size)
+{
+	int n;
 
-		if ((size_t)nread + 1024 > bufsize) {
-			mget_buffer_ensure_capacity(conn->buf, bufsize + 1024);
-			buf = conn->buf->data;
-			bufsize = conn->buf->size;
-		}
+	for (n = 0; n < h2->table_len && h2->table_size > max_size; n++) {
+		h2->table_size -= h2->table[n].size;
+		xfree(h2->table[n].name);
+		xfree(h2->table[n].value);
 	}
-	if (!nread) goto cleanup;
 
-	if (!resp || resp->code / 100 == 1 || resp->code == 204 || resp->code == 304 ||
-		(resp->transfer_encoding == transfer_encoding_identity && resp->content_length == 0 && resp->content_length_valid)) {
-		// - body not included, see RFC 2616 4.3
-		// - body empty, see RFC 2616 4.4
-		goto cleanup;
+	if (n) {
+		h2->table_len -= n;
+		memmove(h2->table, h2->table + n, h2->table_len * sizeof(HPACK_ENTRY));
 	}
+}
 
-	dc = mget_decompress_open(resp->content_encoding, parse_body, context);
+static void _hpack_table_add(HTTP2 *h2, const mget_buffer_t *name, const mget_buffer_t *value)
+{
+	size_t size = name->length + value->length + 32;
 
-	// calculate number of body bytes so far read
-	body_len = nread - (p - buf);
-	// move already read body data to buf
-	memmove(buf, p, body_len);
-	buf[body_len] = 0;
+	// an entry larger than the table empties the table
+	_hpack_table_evict(h2, size <= h2->table_max ? h2->table_max - size : 0);
 
-	if (resp->transfer_encoding != transfer_encoding_identity) {
-		size_t chunk_size = 0;
-		char *end;
-
-		debug_printf("method 1 %zd %zd:\n", body_len, body_size);
-		// RFC 2616 3.6.1
-		// Chunked-Body   = *chunk last-chunk trailer CRLF
-		// chunk          = chunk-size [ chunk-extension ] CRLF chunk-data CRLF
-		// chunk-size     = 1*HEX
-		// last-chunk     = 1*("0") [ chunk-extension ] CRLF
-		// chunk-extension= *( ";" chunk-ext-name [ "=" chunk-ext-val ] )
-		// chunk-ext-name = token
-		// chunk-ext-val  = token | quoted-string
-		// chunk-data     = chunk-size(OCTET)
-		// trailer        = *(entity-header CRLF)
-		// entity-header  = extension-header = message-header
-		// message-header = field-name ":" [ field-value ]
-		// field-name     = token
-		// field-value    = *( field-content | LWS )
-		// field-content  = <the OCTETs making up the field-value
-		//                  and consisting of either *TEXT or combinations
-		//                  of token, separators, and quoted-string>
+	if (size > h2->table_max)
+		return;
 
-/*
-			length := 0
-			read chunk-size, chunk-extension (if any) and CRLF
-			while (chunk-size > 0) {
-				read chunk-data and CRLF
-				append chunk-data to entity-body
-				length := length + chunk-size
-				read chunk-size and CRLF
-			}
-			read entity-header
-			while (entity-header not empty) {
-				append entity-header to existing header fields
-				read entity-header
-			}
-			Content-Length := length
-			Remove "chunked" from Transfer-Encoding
-*/
+	if (h2->table_len >= h2->table_alloc) {
+		h2->table_alloc = h2->table_alloc ? h2->table_alloc * 2 : 32;
+		h2->table = xrealloc(h2->table, h2->table_alloc * sizeof(HPACK_ENTRY));
+	}
 
-		// read each chunk, stripping the chunk info
-		p = buf;
-		for (;;) {
-			//log_printf("#1 p='%.16s'\n",p);
-			// read: chunk-size [ chunk-extension ] CRLF
-			while ((!(end = strchr(p, '\r')) || end[1] != '\n')) {
-				if ((nbytes = mget_tcp_read(conn->tcp, buf + body_len, bufsize - body_len)) <= 0)
-					goto cleanup;
-
-				body_len += nbytes;
-				buf[body_len] = 0;
-				debug_printf("a nbytes %zd body_len %zd\n", nbytes, body_len);
-			}
-			end += 2;
-
-			// now p points to chunk-size (hex)
-			chunk_size = strtoll(p, NULL, 16);
-			debug_printf("chunk size is %zd\n", chunk_size);
-			if (chunk_size == 0) {
-				// now read 'trailer CRLF' which is '*(entity-header CRLF) CRLF'
-				if (*end == '\r' && end[1] == '\n') // shortcut for the most likely case (empty trailer)
-					goto cleanup;
-
-				debug_printf("reading trailer\n");
-				while (!strstr(end, "\r\n\r\n")) {
-					if (body_len > 3) {
-						// just need to keep the last 3 bytes to avoid buffer resizing
-						memmove(buf, buf + body_len - 3, 4); // plus 0 terminator, just in case
-						body_len = 3;
-					}
-					if ((nbytes = mget_tcp_read(conn->tcp, buf + body_len, bufsize - body_len)) <= 0)
-						goto cleanup;
+	h2->table[h2->table_len].name = strndup(name->data, name->length);
+	h2->table[h2->table_len].value = strndup(value->data, value->length);
+	h2->table[h2->table_len++].size = size;
+	h2->table_size += size;
+}
 
-					body_len += nbytes;
-					buf[body_len] = 0;
-					end = buf;
-					debug_printf("a nbytes %zd\n", nbytes);
-				}
-				debug_printf("end of trailer \n");
-				goto cleanup;
-			}
+// copy name and/or value of the table entry <index> (static table first, then the newest dynamic entry)
 
-			p = end + chunk_size + 2;
-			if (p <= buf + body_len) {
-				debug_printf("1 skip chunk_size %zd\n", chunk_size);
-				mget_decompress(dc, end, chunk_size);
-				continue;
-			}
+static int _hpack_table_get(HTTP2 *h2, size_t index, mget_buffer_t *name, mget_buffer_t *value)
+{
+	const char *n, *v;
+
+	if (index == 0)
+		return -1;
 
-			mget_decompress(dc, end, (buf + body_len) - end);
+	if (index <= countof(hpack_static_table)) {
+		n = hpack_static_table[index - 1].name;
+		v = hpack_static_table[index - 1].value;
+	} else if ((index -= countof(hpack_static_table)) <= (size_t)h2->table_len) {
+		n = h2->table[h2->table_len - index].name;
+		v = h2->table[h2->table_len - index].value;
+	} else
+		return -1;
 
-			chunk_size = p - (buf + body_len); // in fact needed bytes to have chunk_size+2 in buf
+	if (name)
+		mget_buffer_strcpy(name, n);
+	if (value)
+		mget_buffer_strcpy(value, v);
 
-			debug_printf("need at least %zd more bytes\n", chunk_size);
+	return 0;
+}
 
-			while (chunk_size > 0) {
-				if ((nbytes = mget_tcp_read(conn->tcp, buf, bufsize)) <= 0)
-					goto cleanup;
-				debug_printf("a nbytes=%zd chunk_size=%zd\n", nread, chunk_size);
+// decode a header block into an HTTP/1.1 style header (without status line).
+// returns the :status or -1 on error.
 
-				if (chunk_size <= (size_t)nbytes) {
-					if (chunk_size == 1 || !strncmp(buf + chunk_size - 2, "\r\n", 2)) {
-						debug_printf("chunk completed\n");
-						// p=end+chunk_size+2;
-					} else {
-						error_printf(_("Expected end-of-chunk not found\n"));
-						goto cleanup;
-					}
-					if (chunk_size > 2)
-						mget_decompress(dc, buf, chunk_size - 2);
-					body_len = nbytes - chunk_size;
-					if (body_len)
-						memmove(buf, buf + chunk_size, body_len);
-					buf[body_len] = 0;
-					p = buf;
-					break;
-				} else {
-					chunk_size -= nbytes;
-					if (chunk_size >= 2)
-						mget_decompress(dc, buf, nbytes);
-					else
-						mget_decompress(dc, buf, nbytes - 1); // special case: we got a partial end-of-chunk
-				}
+int http2_hpack_decode(HTTP2 *h2, const unsigned char *p, size_t length, mget_buffer_t *header)
+{
+	const unsigned char *end = p + length;
+	char name_static[128], value_static[1024];
+	mget_buffer_t name, value;
+	size_t index;
+	int status = 0, ret = 0;
+
+	mget_buffer_init(&name, name_static, sizeof(name_static));
+	mget_buffer_init(&value, value_static, sizeof(value_static));
+
+	while (p < end && ret == 0) {
+		if (*p & 0x80) {
+			// indexed header field
+			if ((ret = http2_hpack_decode_int(&p, end, 7, &index)) == 0)
+				ret = _hpack_table_get(h2, index, &name, &value);
+		} else if ((*p & 0xE0) == 0x20) {
+			// dynamic table size update
+			if ((ret = http2_hpack_decode_int(&p, end, 5, &index)) == 0 && (ret = index > H2_HEADER_TABLE_SIZE ? -1 : 0) == 0) {
+				h2->table_max = index;
+				_hpack_table_evict(h2, index);
 			}
-		}
-	} else if (resp->content_length_valid) {
-		// read content_length bytes
-		debug_printf("method 2\n");
+			continue;
+		} else {
+			// literal header field, with incremental indexing (01), without indexing (0000) or never indexed (0001)
+			int add = (*p & 0xC0) == 0x40;
 
-		if (body_len)
-			mget_decompress(dc, buf, body_len);
+			if ((ret = http2_hpack_decode_int(&p, end, add ? 6 : 4, &index)) == 0) {
+				if (index)
+					ret = _hpack_table_get(h2, index, &name, NULL);
+				else
+					ret = _hpack_decode_string(&p, end, &name);
+			}
 
-		while (body_len < resp->content_length && ((nbytes = mget_tcp_read(conn->tcp, buf, bufsize)) > 0)) {
-			body_len += nbytes;
-			debug_printf("nbytes %zd total %zd/%zd\n", nbytes, body_len, resp->content_length);
-			mget_decompress(dc, buf, nbytes);
+			if (ret == 0 && (ret = _hpack_decode_string(&p, end, &value)) == 0 && add)
+				_hpack_table_add(h2, &name, &value);
 		}
-		if (nbytes < 0)
-			error_printf(_("Failed to read %zd bytes (%d)\n"), nbytes, errno);
-		if (body_len < resp->content_length)
-			error_printf(_("Just got %zu of %zu bytes\n"), body_len, body_size);
-		else if (body_len > resp->content_length)
-			error_printf(_("Body too large: %zu instead of %zu bytes\n"), body_len, resp->content_length);
-		resp->content_length = body_len;
-	} else {
-		// read as long as we can
-		debug_printf("method 3\n");
 
-		if (body_len)
-			mget_decompress(dc, buf, body_len);
+		if (ret)
+			break;
 
-		while ((nbytes = mget_tcp_read(conn->tcp, buf, bufsize)) > 0) {
-			body_len += nbytes;
-			debug_printf("nbytes %zd total %zd\n", nbytes, body_len);
-			mget_decompress(dc, buf, nbytes);
+		if (name.length == 7 && !memcmp(name.data, ":status", 7))
+			status = atoi(value.data);
+		else if (*name.data != ':') {
+			mget_buffer_memcat(header, "\r\n", 2);
+			mget_buffer_bufcat(header, &name);
+			mget_buffer_memcat(header, ": ", 2);
+			mget_buffer_bufcat(header, &value);
 		}
-		resp->content_length = body_len;
 	}
 
-cleanup:
-	mget_decompress_close(dc);
+	mget_buffer_deinit(&name);
+	mget_buffer_deinit(&value);
 
-	return resp;
+	return ret ? -1 : status;
 }
 
-static int _get_body(void *userdata, const char *data, size_t length)
+static void _hpack_encode_int(mget_buffer_t *buf, unsigned char first, int prefix_bits, size_t value)
 {
-	mget_buffer_memcat((mget_buffer_t *)userdata, data, length);
+	size_t max = (1U << prefix_bits) - 1;
+	unsigned char c;
 
-	return 0;
-}
+	if (value < max) {
+		c = first | (unsigned char)value;
+		mget_buffer_memcat(buf, &c, 1);
+		return;
+	}
 
-// get response, resp->body points to body in memory
+	c = first | (unsigned char)max;
+	mget_buffer_memcat(buf, &c, 1);
 
-MGET_HTTP_RESPONSE *http_get_response(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags)
+	for (value -= max; value >= 128; value >>= 7) {
+		c = (unsigned char)((value & 0x7F) | 0x80);
+		mget_buffer_memcat(buf, &c, 1);
+	}
+
+	c = (unsigned char)value;
+	mget_buffer_memcat(buf, &c, 1);
+}
+
+// literal header field without indexing (RFC 7541 6.2.2), <index> 0 means new name.
+// we never add to the server's dynamic table, so the encoder has no state.
+
+static void _hpack_encode_literal(mget_buffer_t *buf, size_t index, const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	_hpack_encode_int(buf, 0x00, 4, index);
+
+	if (!index) {
+		size_t it;
+
+		_hpack_encode_int(buf, 0x00, 7, namelen);
+		for (it = 0; it < namelen; it++) {
+			char c = (char)tolower((unsigned char)name[it]);
+			mget_buffer_memcat(buf, &c, 1);
+		}
+	}
+
+	_hpack_encode_int(buf, 0x00, 7, valuelen);
+	mget_buffer_memcat(buf, value, valuelen);
+}
+
+// create the header block for <req>
+
+static void _hpack_encode_request(mget_buffer_t *buf, const MGET_HTTP_REQUEST *req)
+{
+	static const char *skip[] = { // connection-specific fields are not allowed (RFC 7540 8.1.2.2)
+		"Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "Upgrade", "Host"
+	};
+	char path_static[256];
+	mget_buffer_t path;
+	int it;
+
+	if (!strcmp(req->method, "GET"))
+		mget_buffer_memcat(buf, "\x82", 1);
+	else
+		_hpack_encode_literal(buf, 2, NULL, 0, req->method, strlen(req->method));
+
+	mget_buffer_memcat(buf, req->scheme == IRI_SCHEME_HTTPS ? "\x87" : "\x86", 1);
+	_hpack_encode_literal(buf, 1, NULL, 0, req->esc_host.data, req->esc_host.length);
+
+	mget_buffer_init(&path, path_static, sizeof(path_static));
+	mget_buffer_memcpy(&path, "/", 1);
+	mget_buffer_bufcat(&path, (mget_buffer_t *)&req->esc_resource);
+	_hpack_encode_literal(buf, 4, NULL, 0, path.data, path.length);
+	mget_buffer_deinit(&path);
+
+	// each line may contain several header fields separated by CRLF
+	for (it = 0; it < mget_vector_size(req->lines); it++) {
+		const char *s, *name, *colon, *value, *eol;
+
+		for (s = mget_vector_get(req->lines, it); *s; s = *eol ? eol + 1 : eol) {
+			if (!(eol = strchr(s, '\n')))
+				eol = s + strlen(s);
+
+			name = s;
+			if ((colon = memchr(s, ':', eol - s)) && colon > name) {
+				const char *e = eol;
+				unsigned n;
+
+				for (value = colon + 1; value < e && isblank(*value); value++);
+				while (e > value && (e[-1] == '\r' || isblank(e[-1]))) e--;
+
+				for (n = 0; n < countof(skip); n++) {
+					if (strlen(skip[n]) == (size_t)(colon - name) && !strncasecmp(name, skip[n], colon - name))
+						break;
+				}
+
+				if (n == countof(skip))
+					_hpack_encode_literal(buf, 0, name, colon - name, value, e - value);
+			}
+		}
+	}
+}
+
+static void _h2_frame_header(mget_buffer_t *buf, size_t length, int type, int flags, uint32_t stream_id)
+{
+	unsigned char header[H2_FRAME_HEADER_SIZE] = {
+		(unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length,
+		(unsigned char)type, (unsigned char)flags,
+		(unsigned char)(stream_id >> 24), (unsigned char)(stream_id >> 16), (unsigned char)(stream_id >> 8), (unsigned char)stream_id
+	};
+
+	mget_buffer_memcat(buf, header, sizeof(header));
+}
+
+static void _h2_frame_uint32(mget_buffer_t *buf, int type, uint32_t stream_id, uint32_t value)
+{
+	unsigned char payload[4] = {
+		(unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value
+	};
+
+	_h2_frame_header(buf, 4, type, 0, stream_id);
+	mget_buffer_memcat(buf, payload, 4);
+}
+
+static int _h2_write(MGET_HTTP_CONNECTION *conn, const mget_buffer_t *buf)
+{
+	if (mget_tcp_write(conn->tcp, buf->data, buf->length) != (ssize_t)buf->length)
+		return -1;
+
+	return 0;
+}
+
+// send the frames that have been queued while dispatching (h2->mutex must not be locked)
+
+static void _h2_flush_control(MGET_HTTP_CONNECTION *conn)
+{
+	HTTP2 *h2 = conn->h2;
+	mget_buffer_t *control;
+
+	pthread_mutex_lock(&h2->write_mutex);
+	pthread_mutex_lock(&h2->mutex);
+	control = h2->control;
+	h2->control = mget_buffer_alloc(256);
+	pthread_mutex_unlock(&h2->mutex);
+
+	if (control->length && _h2_write(conn, control)) {
+		pthread_mutex_lock(&h2->mutex);
+		h2->broken = 1;
+		pthread_mutex_unlock(&h2->mutex);
+	}
+
+	pthread_mutex_unlock(&h2->write_mutex);
+	mget_buffer_free(&control);
+}
+
+// give flow control credit for consumed data, <stream> may be NULL
+
+static void _h2_update_windows(HTTP2 *h2, H2_STREAM *stream)
+{
+	if (stream && !stream->closed && stream->consumed >= H2_STREAM_WINDOW / 2) {
+		_h2_frame_uint32(h2->control, H2_FRAME_WINDOW_UPDATE, stream->id, (uint32_t)stream->consumed);
+		stream->consumed = 0;
+	}
+
+	if (h2->consumed >= H2_CONNECTION_WINDOW / 2) {
+		_h2_frame_uint32(h2->control, H2_FRAME_WINDOW_UPDATE, 0, (uint32_t)h2->consumed);
+		h2->consumed = 0;
+	}
+}
+
+static H2_STREAM *_h2_find_stream(HTTP2 *h2, uint32_t id)
+{
+	H2_STREAM *stream;
+
+	for (stream = h2->streams; stream && stream->id != id; stream = stream->next);
+
+	return stream;
+}
+
+static void _h2_remove_stream(HTTP2 *h2, H2_STREAM *stream)
+{
+	H2_STREAM **pp;
+
+	for (pp = &h2->streams; *pp && *pp != stream; pp = &(*pp)->next);
+	if (*pp)
+		*pp = stream->next;
+
+	// tell the server that we are not interested any more
+	if (!stream->closed && !stream->error && !h2->broken)
+		_h2_frame_uint32(h2->control, H2_FRAME_RST_STREAM, stream->id, H2_CANCEL);
+
+	// unread data still counts for the connection window
+	if (stream->data) {
+		h2->consumed += stream->data->length;
+		mget_buffer_free(&stream->data);
+	}
+	mget_buffer_free(&stream->header);
+	xfree(stream);
+}
+
+static void _h2_fail(HTTP2 *h2)
+{
+	H2_STREAM *stream;
+
+	h2->broken = 1;
+	for (stream = h2->streams; stream; stream = stream->next)
+		stream->error = 1;
+}
+
+static int _h2_header_block_done(HTTP2 *h2)
+{
+	H2_STREAM *stream = _h2_find_stream(h2, h2->header_stream);
+	mget_buffer_t *header = mget_buffer_alloc(1024);
+	int status;
+
+	// decode in any case to keep the dynamic table in sync
+	status = http2_hpack_decode(h2, (unsigned char *)h2->header_block->data, h2->header_block->length, header);
+
+	if (status >= 0 && stream) {
+		if (status >= 200 && !stream->header) {
+			// the response header, informational (1xx) responses and trailers are skipped
+			char line[32];
+
+			snprintf(line, sizeof(line), "HTTP/2.0 %d ", status);
+			stream->header = mget_buffer_alloc(header->length + sizeof(line));
+			mget_buffer_strcpy(stream->header, line);
+			mget_buffer_bufcat(stream->header, header);
+		}
+
+		if (h2->header_end_stream)
+			stream->closed = 1;
+	}
+
+	mget_buffer_free(&header);
+	h2->header_stream = 0;
+
+	if (status < 0) {
+		error_printf(_("HPACK decoding failed\n"));
+		return -1;
+	}
+
+	return 0;
+}
+
+// handle a received frame, called with h2->mutex locked.
+// returns -1 on connection errors.
+
+int http2_handle_frame(HTTP2 *h2, const unsigned char *frame)
+{
+	size_t length = H2_LENGTH(frame), padding = 0;
+	int type = frame[3], flags = frame[4];
+	uint32_t id = H2_UINT32(frame + 5) & 0x7FFFFFFF;
+	const unsigned char *p = frame + H2_FRAME_HEADER_SIZE, *end = p + length;
+	H2_STREAM *stream;
+
+	// a header block must not be interrupted (RFC 7540 6.10)
+	if (h2->header_stream && type != H2_FRAME_CONTINUATION)
+		return -1;
+
+	if ((type == H2_FRAME_DATA || type == H2_FRAME_HEADERS) && (flags & H2_FLAG_PADDED)) {
+		if (!length || (padding = *p++) >= length)
+			return -1;
+		end -= padding;
+	}
+
+	switch (type) {
+	case H2_FRAME_DATA:
+		if (!id)
+			return -1;
+
+		if ((stream = _h2_find_stream(h2, id)) && !stream->closed && !stream->error) {
+			if (!stream->data)
+				stream->data = mget_buffer_alloc(end - p > 10240 ? end - p : 10240);
+			mget_buffer_memcat(stream->data, p, end - p);
+			stream->consumed += length - (end - p); // padding
+			h2->consumed += length - (end - p);
+			if (flags & H2_FLAG_END_STREAM)
+				stream->closed = 1;
+			_h2_update_windows(h2, stream);
+		} else {
+			h2->consumed += length; // nobody waits for the data
+			_h2_update_windows(h2, NULL);
+		}
+		break;
+
+	case H2_FRAME_HEADERS:
+		if (flags & H2_FLAG_PRIORITY)
+			p += 5;
+		if (p > end || !id)
+			return -1;
+
+		h2->header_stream = id;
+		h2->header_end_stream = flags & H2_FLAG_END_STREAM;
+		mget_buffer_memcpy(h2->header_block, p, end - p);
+		if (flags & H2_FLAG_END_HEADERS)
+			return _h2_header_block_done(h2);
+		break;
+
+	case H2_FRAME_CONTINUATION:
+		if (!h2->header_stream || id != h2->header_stream)
+			return -1;
+
+		// the block is kept until it is complete, its size has to be limited
+		if (h2->header_block->length + (end - p) > H2_MAX_HEADER_BLOCK)
+			return -1;
+
+		mget_buffer_memcat(h2->header_block, p, end - p);
+		if (flags & H2_FLAG_END_HEADERS)
+			return _h2_header_block_done(h2);
+		break;
+
+	case H2_FRAME_RST_STREAM:
+		if (length != 4)
+			return -1;
+		if ((stream = _h2_find_stream(h2, id))) {
+			debug_printf("HTTP/2 stream %u reset (%u)\n", id, H2_UINT32(p));
+			stream->error = 1;
+		}
+		break;
+
+	case H2_FRAME_SETTINGS:
+		if (id || length % 6)
+			return -1;
+		if (flags & H2_FLAG_ACK)
+			break;
+
+		for (; p < end; p += 6) {
+			uint32_t value = H2_UINT32(p + 2);
+
+			switch ((p[0] << 8) | p[1]) {
+			case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+				h2->max_concurrent_streams = value;
+				break;
+			case H2_SETTINGS_MAX_FRAME_SIZE:
+				if (value < H2_MAX_FRAME_SIZE || value > 0xFFFFFF)
+					return -1;
+				h2->max_frame_size = value;
+				break;
+			}
+			// we don't use the server's dynamic table and we don't send DATA,
+			// so the other settings don't matter.
+		}
+
+		_h2_frame_header(h2->control, 0, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0);
+		break;
+
+	case H2_FRAME_PING:
+		if (id || length != 8)
+			return -1;
+		if (!(flags & H2_FLAG_ACK)) {
+			_h2_frame_header(h2->control, 8, H2_FRAME_PING, H2_FLAG_ACK, 0);
+			mget_buffer_memcat(h2->control, p, 8);
+		}
+		break;
+
+	case H2_FRAME_GOAWAY:
+		if (id || length < 8)
+			return -1;
+
+		h2->goaway = 1;
+		id = H2_UINT32(p) & 0x7FFFFFFF; // last stream processed by the server
+		debug_printf("HTTP/2 GOAWAY (last stream %u, error %u)\n", id, H2_UINT32(p + 4));
+
+		for (stream = h2->streams; stream; stream = stream->next) {
+			if (stream->id > id)
+				stream->error = 1;
+		}
+		break;
+
+	case H2_FRAME_PUSH_PROMISE: // we disabled server push
+		return -1;
+
+	default: // PRIORITY, WINDOW_UPDATE (we don't send DATA), unknown frame types
+		break;
+	}
+
+	return 0;
+}
+
+// wait for news on the connection, called with h2->mutex locked.
+// if no other thread is reading, read from the connection and dispatch the frames.
+
+static void _h2_wait(MGET_HTTP_CONNECTION *conn)
+{
+	HTTP2 *h2 = conn->h2;
+	mget_buffer_t *buf = conn->buf; // only used by the reading thread
+	size_t pos = 0;
+	ssize_t nbytes = 1;
+
+	if (h2->broken)
+		return;
+
+	if (h2->reading) {
+		pthread_cond_wait(&h2->cond, &h2->mutex);
+		return;
+	}
+
+	h2->reading = 1;
+	pthread_mutex_unlock(&h2->mutex);
+
+	// read until there is at least one complete frame
+	while (buf->length < H2_FRAME_HEADER_SIZE || buf->length < H2_FRAME_HEADER_SIZE + H2_LENGTH((unsigned char *)buf->data)) {
+		if (buf->length >= H2_FRAME_HEADER_SIZE && H2_LENGTH((unsigned char *)buf->data) > H2_MAX_FRAME_SIZE) {
+			nbytes = -1;
+			break;
+		}
+
+		if ((nbytes = mget_tcp_read(conn->tcp, buf->data + buf->length, buf->size - buf->length)) <= 0)
+			break;
+
+		buf->length += nbytes;
+	}
+
+	pthread_mutex_lock(&h2->mutex);
+
+	if (nbytes <= 0) {
+		debug_printf("HTTP/2 connection to %s lost\n", conn->esc_host);
+		_h2_fail(h2);
+	} else {
+		while (buf->length - pos >= H2_FRAME_HEADER_SIZE) {
+			size_t length = H2_LENGTH((unsigned char *)buf->data + pos);
+
+			if (length > H2_MAX_FRAME_SIZE) {
+				_h2_fail(h2);
+				break;
+			}
+
+			if (buf->length - pos < H2_FRAME_HEADER_SIZE + length)
+				break;
+
+			if (http2_handle_frame(h2, (unsigned char *)buf->data + pos)) {
+				error_printf(_("HTTP/2 protocol error on connection to %s\n"), conn->esc_host);
+				_h2_fail(h2);
+				break;
+			}
+
+			pos += H2_FRAME_HEADER_SIZE + length;
+		}
+
+		if ((buf->length -= pos))
+			memmove(buf->data, buf->data + pos, buf->length);
+	}
+
+	h2->reading = 0;
+	pthread_cond_broadcast(&h2->cond);
+
+	if (h2->control->length) {
+		pthread_mutex_unlock(&h2->mutex);
+		_h2_flush_control(conn);
+		pthread_mutex_lock(&h2->mutex);
+	}
+}
+
+// the state of an HTTP/2 session, without the connection
+
+HTTP2 *http2_session_alloc(void)
+{
+	HTTP2 *h2 = xcalloc(1, sizeof(HTTP2));
+
+	pthread_mutex_init(&h2->mutex, NULL);
+	pthread_mutex_init(&h2->write_mutex, NULL);
+	pthread_cond_init(&h2->cond, NULL);
+	h2->header_block = mget_buffer_alloc(1024);
+	h2->control = mget_buffer_alloc(256);
+	h2->table_max = H2_HEADER_TABLE_SIZE;
+	h2->next_stream_id = 1;
+	h2->max_concurrent_streams = 100; // until the server tells us
+	h2->max_frame_size = H2_MAX_FRAME_SIZE;
+
+	return h2;
+}
+
+void http2_session_free(HTTP2 **h2)
+{
+	int it;
+
+	if (!*h2)
+		return;
+
+	for (it = 0; it < (*h2)->table_len; it++) {
+		xfree((*h2)->table[it].name);
+		xfree((*h2)->table[it].value);
+	}
+	xfree((*h2)->table);
+
+	mget_buffer_free(&(*h2)->header_block);
+	mget_buffer_free(&(*h2)->control);
+	pthread_cond_destroy(&(*h2)->cond);
+	pthread_mutex_destroy(&(*h2)->write_mutex);
+	pthread_mutex_destroy(&(*h2)->mutex);
+	xfree(*h2);
+}
+
+// size of the HPACK dynamic table as defined by RFC 7541 4.1
+
+size_t http2_hpack_table_size(const HTTP2 *h2)
+{
+	return h2->table_size;
+}
+
+static int _h2_open(MGET_HTTP_CONNECTION *conn)
+{
+	static const unsigned char settings[] = {
+		0, H2_SETTINGS_ENABLE_PUSH, 0, 0, 0, 0,
+		0, H2_SETTINGS_INITIAL_WINDOW_SIZE,
+		(H2_STREAM_WINDOW >> 24) & 0xFF, (H2_STREAM_WINDOW >> 16) & 0xFF, (H2_STREAM_WINDOW >> 8) & 0xFF, H2_STREAM_WINDOW & 0xFF
+	};
+	mget_buffer_t *buf = mget_buffer_alloc(128);
+	int rc;
+
+	conn->h2 = http2_session_alloc();
+	conn->buf->length = 0;
+
+	// connection preface (RFC 7540 3.5)
+	mget_buffer_strcpy(buf, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+	_h2_frame_header(buf, sizeof(settings), H2_FRAME_SETTINGS, 0, 0);
+	mget_buffer_memcat(buf, settings, sizeof(settings));
+	_h2_frame_uint32(buf, H2_FRAME_WINDOW_UPDATE, 0, H2_CONNECTION_WINDOW - 65535);
+
+	rc = _h2_write(conn, buf);
+	mget_buffer_free(&buf);
+
+	if (rc)
+		return -1;
+
+	debug_printf("HTTP/2 connection to %s\n", conn->esc_host);
+	return 0;
+}
+
+static void _h2_close(MGET_HTTP_CONNECTION *conn)
+{
+	HTTP2 *h2 = conn->h2;
+
+	if (!h2->broken && conn->tcp) {
+		// GOAWAY, last stream 0, NO_ERROR
+		mget_buffer_t *buf = mget_buffer_alloc(32);
+
+		_h2_frame_header(buf, 8, H2_FRAME_GOAWAY, 0, 0);
+		mget_buffer_memcat(buf, "\0\0\0\0\0\0\0\0", 8);
+		_h2_write(conn, buf);
+		mget_buffer_free(&buf);
+	}
+
+	while (h2->streams) {
+		h2->streams->error = 1;
+		_h2_remove_stream(h2, h2->streams);
+	}
+
+	http2_session_free(&conn->h2);
+}
+
+// whether the connection takes another stream
+
+static int _h2_usable(MGET_HTTP_CONNECTION *conn)
+{
+	HTTP2 *h2 = conn->h2;
+	int usable;
+
+	pthread_mutex_lock(&h2->mutex);
+	usable = !h2->goaway && !h2->broken && (uint32_t)conn->users < h2->max_concurrent_streams;
+	pthread_mutex_unlock(&h2->mutex);
+
+	return usable;
+}
+
+// open a stream and send the request header
+
+static int _h2_send_request(MGET_HTTP_CONNECTION *conn, const MGET_HTTP_REQUEST *req)
+{
+	HTTP2 *h2 = conn->h2;
+	H2_STREAM *stream = xcalloc(1, sizeof(H2_STREAM));
+	mget_buffer_t *block = mget_buffer_alloc(1024), *buf;
+	size_t pos, max_frame_size;
+	int rc = -1;
+
+	_hpack_encode_request(block, req);
+	buf = mget_buffer_alloc(block->length + 64);
+
+	// stream ids have to be sent in increasing order
+	pthread_mutex_lock(&h2->write_mutex);
+	pthread_mutex_lock(&h2->mutex);
+
+	if (h2->goaway || h2->broken || h2->next_stream_id > 0x7FFFFFFF) {
+		h2->goaway = 1;
+		pthread_mutex_unlock(&h2->mutex);
+		pthread_mutex_unlock(&h2->write_mutex);
+		xfree(stream);
+		goto out;
+	}
+
+	stream->id = h2->next_stream_id;
+	stream->req = req;
+	stream->next = h2->streams;
+	h2->streams = stream;
+	h2->next_stream_id += 2;
+	max_frame_size = h2->max_frame_size;
+
+	pthread_mutex_unlock(&h2->mutex);
+
+	// HEADERS + CONTINUATION frames, no request body
+	for (pos = 0; pos == 0 || pos < block->length;) {
+		size_t n = block->length - pos > max_frame_size ? max_frame_size : block->length - pos;
+		int flags = pos + n == block->length ? H2_FLAG_END_HEADERS : 0;
+
+		if (pos == 0)
+			_h2_frame_header(buf, n, H2_FRAME_HEADERS, flags | H2_FLAG_END_STREAM, stream->id);
+		else
+			_h2_frame_header(buf, n, H2_FRAME_CONTINUATION, flags, stream->id);
+
+		mget_buffer_memcat(buf, block->data + pos, n);
+		if ((pos += n) == 0)
+			break; // empty header block, can't happen
+	}
+
+	if ((rc = _h2_write(conn, buf)) == 0)
+		debug_printf("# sent HTTP/2 stream %u: %s /%s\n", stream->id, req->method, req->esc_resource.data ? req->esc_resource.data : "");
+
+	pthread_mutex_unlock(&h2->write_mutex);
+
+	if (rc) {
+		pthread_mutex_lock(&h2->mutex);
+		_h2_fail(h2);
+		pthread_mutex_unlock(&h2->mutex);
+	}
+
+out:
+	mget_buffer_free(&buf);
+	mget_buffer_free(&block);
+	return rc;
+}
+
+// wait for the response header of the stream belonging to <req>.
+// without <req>, the oldest stream still waiting for its header is taken.
+
+static MGET_HTTP_RESPONSE *_h2_get_response_header(MGET_HTTP_CONNECTION *conn, const MGET_HTTP_REQUEST *req, unsigned int flags)
+{
+	HTTP2 *h2 = conn->h2;
+	H2_STREAM *stream, *s;
+	MGET_HTTP_RESPONSE *resp = NULL;
+	mget_buffer_t *header;
+
+	pthread_mutex_lock(&h2->mutex);
+
+	// the list is newest first
+	for (stream = NULL, s = h2->streams; s; s = s->next) {
+		if (req ? s->req == req : s->req != NULL)
+			stream = s;
+	}
+
+	if (!stream) {
+		pthread_mutex_unlock(&h2->mutex);
+		return NULL;
+	}
+
+	while (!stream->header && !stream->error && !stream->closed && !h2->broken)
+		_h2_wait(conn);
+
+	stream->req = NULL;
+
+	if (!(header = stream->header)) {
+		_h2_remove_stream(h2, stream);
+		pthread_mutex_unlock(&h2->mutex);
+		_h2_flush_control(conn);
+		return NULL;
+	}
+
+	stream->header = NULL;
+	pthread_mutex_unlock(&h2->mutex);
+
+	debug_printf("# got header %zu bytes:\n%s\n\n", header->length, header->data);
+
+	if (flags & MGET_HTTP_RESPONSE_KEEPHEADER) {
+		mget_buffer_t *keep = mget_buffer_init(NULL, NULL, header->length + 4);
+
+		mget_buffer_bufcpy(keep, header);
+		mget_buffer_memcat(keep, "\r\n\r\n", 4);
+
+		if ((resp = http_parse_response(header->data)))
+			resp->header = keep;
+		else
+			mget_buffer_free(&keep);
+	} else
+		resp = http_parse_response(header->data);
+
+	mget_buffer_free(&header);
+
+	pthread_mutex_lock(&h2->mutex);
+	if (resp && (!req || strcasecmp(req->method, "HEAD")))
+		stream->resp = resp; // the body is read by http_get_response_body_cb()
+	else
+		_h2_remove_stream(h2, stream);
+	pthread_mutex_unlock(&h2->mutex);
+
+	return resp;
+}
+
+static int _h2_get_response_body_cb(
+	MGET_HTTP_CONNECTION *conn,
+	MGET_HTTP_RESPONSE *resp,
+	int (*parse_body)(void *context, const char *data, size_t length),
+	void *context,
+	mget_buffer_t *body)
+{
+	HTTP2 *h2 = conn->h2;
+	H2_STREAM *stream;
+	MGET_DECOMPRESSOR *dc;
+	mget_buffer_t *data = mget_buffer_alloc(10240), *tmp;
+	size_t body_len = 0;
+	int ret, stopped = 0;
+
+	pthread_mutex_lock(&h2->mutex);
+
+	for (stream = h2->streams; stream && stream->resp != resp; stream = stream->next);
+
+	if (!stream) {
+		pthread_mutex_unlock(&h2->mutex);
+		mget_buffer_free(&data);
+		return -1;
+	}
+
+	dc = mget_decompress_open(resp->content_encoding, parse_body, context);
+	if (body)
+		mget_decompress_set_output(dc, body);
+
+	for (;;) {
+		while ((!stream->data || !stream->data->length) && !stream->closed && !stream->error && !h2->broken)
+			_h2_wait(conn);
+
+		if (!stream->data || !stream->data->length || stream->error)
+			break;
+
+		// take the data and process it without blocking the other threads
+		tmp = stream->data;
+		stream->data = data;
+		data = tmp;
+		pthread_mutex_unlock(&h2->mutex);
+
+		stopped = mget_decompress(dc, data->data, data->length) < 0;
+		body_len += data->length;
+
+		pthread_mutex_lock(&h2->mutex);
+		stream->consumed += data->length;
+		h2->consumed += data->length;
+		data->length = 0;
+
+		if (stopped)
+			break; // stopped by parse_body(), _h2_remove_stream() cancels the stream
+
+		_h2_update_windows(h2, stream);
+
+		if (h2->control->length) {
+			pthread_mutex_unlock(&h2->mutex);
+			_h2_flush_control(conn);
+			pthread_mutex_lock(&h2->mutex);
+		}
+	}
+
+	ret = stream->closed && !stream->error && !stopped ? 0 : -1;
+	_h2_remove_stream(h2, stream);
+	pthread_mutex_unlock(&h2->mutex);
+	_h2_flush_control(conn);
+
+	mget_decompress_close(dc);
+	mget_buffer_free(&data);
+
+	if (ret == 0 && resp->content_length_valid && body_len != resp->content_length)
+		error_printf(_("Just got %zu of %zu bytes\n"), body_len, resp->content_length);
+	resp->content_length = body_len;
+
+	return ret;
+}
+
+// connections opened so far, see http_get_connection_stats()
+static unsigned long long
+	nconnects;
+
+static MGET_HTTP_CONNECTION *_http_open(const MGET_IRI *iri, int async)
+{
+	MGET_HTTP_CONNECTION
+		*conn = xcalloc(1, sizeof(MGET_HTTP_CONNECTION));
+	const char
+		*port,
+		*host;
+	int
+		ssl = iri->scheme == IRI_SCHEME_HTTPS;
+
+	if (!conn)
+		return NULL;
+
+	_http_get_peer(iri, &host, &port);
+
+	if ((conn->addrinfo = mget_tcp_resolve(host, port)) == NULL)
+		goto error;
+
+	conn->esc_host = iri->host ? strdup(iri->host) : NULL;
+	conn->port = iri->resolv_port;
+	conn->scheme = iri->scheme;
+
+	if (async) {
+		// the TLS handshake is done later, so the hostname has to stay valid
+		if (host == iri->host)
+			host = conn->esc_host;
+
+		conn->tcp = mget_tcp_connect_async(conn->addrinfo, ssl ? host : NULL);
+	} else
+		conn->tcp = mget_tcp_connect(conn->addrinfo, ssl ? host : NULL);
+
+	if (conn->tcp) {
+		const char *alpn;
+
+		conn->buf = mget_buffer_alloc(102400); // reusable buffer, large enough for most requests and responses
+
+		if (!async && (alpn = mget_tcp_get_alpn(conn->tcp)) && !strcmp(alpn, "h2") && _h2_open(conn))
+			goto error;
+
+		__atomic_add_fetch(&nconnects, 1, __ATOMIC_RELAXED);
+		return conn;
+	}
+
+error:
+	http_close(&conn);
+	return NULL;
+}
+
+MGET_HTTP_CONNECTION *http_open(const MGET_IRI *iri)
+{
+	return _http_open(iri, 0);
+}
+
+// open a connection for non-blocking I/O.
+// the connection has to be completed with mget_tcp_connect_continue(conn->tcp)
+// before sending a request.
+
+MGET_HTTP_CONNECTION *http_open_async(const MGET_IRI *iri)
+{
+	return _http_open(iri, 1);
+}
+
+// number of connections opened (TCP connect plus TLS handshake, if any), to see how well they are reused
+
+void http_get_connection_stats(unsigned long long *connects)
+{
+	*connects = __atomic_load_n(&nconnects, __ATOMIC_RELAXED);
+}
+
+// resolve the host (or proxy) of <iri> in the background,
+// so that a later http_open() finds the address in the DNS cache
+
+void http_prefetch(const MGET_IRI *iri)
+{
+	const char *host, *port;
+
+	_http_get_peer(iri, &host, &port);
+	mget_tcp_prefetch(host, port);
+}
+
+void http_close(MGET_HTTP_CONNECTION **conn)
+{
+	if (conn && *conn) {
+		if ((*conn)->h2)
+			_h2_close(*conn);
+		mget_tcp_close(&(*conn)->tcp);
+		mget_tcp_addrinfo_free(&(*conn)->addrinfo);
+		xfree((*conn)->esc_host);
+		// xfree((*conn)->port);
+		// xfree((*conn)->scheme);
+		mget_buffer_free(&(*conn)->buf);
+		xfree(*conn);
+	}
+}
+
+/*
+ * Connection pool, shared by all threads.
+ * Idle keep-alive connections are kept per scheme/host/port and handed out again
+ * instead of opening new connections.
+ * Pooled connections (idle or checked out) count against the per-host and the global limit
+ * until they are closed by http_pool_close().
+ * An HTTP/2 connection is shared: it is handed out to several threads at once and only
+ * becomes idle when the last user checks it in.
+ */
+
+typedef struct _POOL_ENTRY POOL_ENTRY;
+
+typedef struct {
+	POOL_ENTRY
+		*idle; // idle connections, most recently used first
+	MGET_HTTP_CONNECTION
+		*shared; // HTTP/2 connection handed out to further users
+	int
+		nconns; // idle + checked out
+	char
+		connecting, // waiting for the first connection to learn whether the server talks HTTP/2
+		http1; // the server did not choose HTTP/2
+} POOL_HOST;
+
+struct _POOL_ENTRY {
+	MGET_HTTP_CONNECTION
+		*conn;
+	POOL_HOST
+		*host;
+	POOL_ENTRY
+		*host_next, // next idle connection to the same host
+		*prev, // all idle connections, least recently used first
+		*next;
+	long long
+		idle_since; // ms
+};
+
+static struct {
+	pthread_mutex_t
+		mutex;
+	pthread_cond_t
+		released; // a connection has been checked in or closed
+	MGET_STRINGMAP
+		*hosts;
+	POOL_ENTRY
+		*lru_head,
+		*lru_tail;
+	int
+		nconns,
+		max_per_host, // 0: no limit
+		max_total, // 0: no limit
+		idle_timeout; // ms, < 0: keep idle connections forever
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.released = PTHREAD_COND_INITIALIZER,
+	.idle_timeout = 30 * 1000
+};
+
+// limits for the number of pooled connections, 0 means unlimited
+void http_pool_set_limits(int max_per_host, int max_total)
+{
+	pool.max_per_host = max_per_host;
+	pool.max_total = max_total;
+}
+
+// time in ms after that idle connections are closed, 0 disables keeping idle connections
+void http_pool_set_idle_timeout(int timeout)
+{
+	pool.idle_timeout = timeout;
+}
+
+static POOL_HOST *_pool_get_host(const char *scheme, const char *host, const char *port)
+{
+	POOL_HOST *pool_host;
+	char key[1024];
+
+	snprintf(key, sizeof(key), "%s://%s:%s", scheme, host ? host : "", port ? port : "");
+
+	if (!pool.hosts)
+		pool.hosts = mget_stringmap_create_nocase(16);
+
+	if (!(pool_host = mget_stringmap_get(pool.hosts, key))) {
+		pool_host = xcalloc(1, sizeof(POOL_HOST));
+		mget_stringmap_put_noalloc(pool.hosts, strdup(key), pool_host);
+	}
+
+	return pool_host;
+}
+
+static void _pool_unlink(POOL_ENTRY *entry)
+{
+	POOL_ENTRY **pp;
+
+	for (pp = &entry->host->idle; *pp != entry; pp = &(*pp)->host_next)
+		;
+	*pp = entry->host_next;
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		pool.lru_head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		pool.lru_tail = entry->prev;
+}
+
+// close an idle connection, the pool has to be locked
+
+static void _pool_close_idle(POOL_ENTRY *entry)
+{
+	MGET_HTTP_CONNECTION *conn = entry->conn;
+
+	_pool_unlink(entry);
+	entry->host->nconns--;
+	pool.nconns--;
+	if (entry->host->shared == conn)
+		entry->host->shared = NULL;
+	xfree(entry);
+
+	debug_printf("close idle connection %s\n", conn->esc_host);
+	http_close(&conn);
+
+	pthread_cond_broadcast(&pool.released);
+}
+
+static void _pool_reap(void)
+{
+	long long now;
+
+	if (pool.idle_timeout < 0)
+		return;
+
+	for (now = mget_get_timemillis(); pool.lru_head && now - pool.lru_head->idle_since >= pool.idle_timeout;)
+		_pool_close_idle(pool.lru_head);
+}
+
+// an idle connection is readable if the server closed it (or sent garbage)
+
+static int _conn_is_alive(MGET_HTTP_CONNECTION *conn)
+{
+	struct pollfd pollfd[1] = {
+		{ mget_tcp_get_sockfd(conn->tcp), POLLIN, 0}};
+
+	return poll(pollfd, 1, 0) == 0;
+}
+
+static POOL_ENTRY *_pool_find_idle(POOL_HOST *host, MGET_HTTP_CONNECTION *conn)
+{
+	POOL_ENTRY *entry;
+
+	for (entry = host->idle; entry && entry->conn != conn; entry = entry->host_next)
+		;
+
+	return entry;
+}
+
+static MGET_HTTP_CONNECTION *_pool_checkout(POOL_HOST *host)
+{
+	MGET_HTTP_CONNECTION *conn;
+
+	if ((conn = host->shared)) {
+		POOL_ENTRY *entry = conn->users ? NULL : _pool_find_idle(host, conn);
+
+		// an idle HTTP/2 connection becomes readable by GOAWAY or when closed by the server
+		if (_h2_usable(conn) && (!entry || _conn_is_alive(conn))) {
+			if (entry) {
+				_pool_unlink(entry);
+				xfree(entry);
+			}
+			conn->users++;
+			return conn;
+		}
+
+		// no new streams, the last user closes the connection
+		host->shared = NULL;
+		if (entry)
+			_pool_close_idle(entry);
+	}
+
+	while (host->idle) {
+		if (_conn_is_alive(host->idle->conn)) {
+			POOL_ENTRY *entry = host->idle;
+
+			conn = entry->conn;
+			_pool_unlink(entry);
+			xfree(entry);
+			return conn;
+		}
+
+		_pool_close_idle(host->idle);
+	}
+
+	return NULL;
+}
+
+// get an idle connection for <iri> from the pool, NULL if there is none.
+
+MGET_HTTP_CONNECTION *http_pool_checkout(const MGET_IRI *iri)
+{
+	MGET_HTTP_CONNECTION *conn;
+
+	pthread_mutex_lock(&pool.mutex);
+	_pool_reap();
+	conn = _pool_checkout(_pool_get_host(iri->scheme, iri->host, iri->resolv_port));
+	pthread_mutex_unlock(&pool.mutex);
+
+	return conn;
+}
+
+// get an idle connection for <iri> from the pool or open a new one.
+// waits until the per-host and global limits allow opening a connection.
+
+MGET_HTTP_CONNECTION *http_pool_open(const MGET_IRI *iri)
+{
+	MGET_HTTP_CONNECTION *conn = NULL;
+	POOL_HOST *host;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	host = _pool_get_host(iri->scheme, iri->host, iri->resolv_port);
+
+	for (;;) {
+		_pool_reap();
+
+		if ((conn = _pool_checkout(host)))
+			break;
+
+		// the connection being opened might be an HTTP/2 connection that we can share
+		if (host->connecting) {
+			pthread_cond_wait(&pool.released, &pool.mutex);
+			continue;
+		}
+
+		if (!pool.max_per_host || host->nconns < pool.max_per_host) {
+			if (!pool.max_total || pool.nconns < pool.max_total) {
+				int probe = http2_enabled && iri->scheme == IRI_SCHEME_HTTPS && !host->http1;
+
+				// count the connection before opening to not exceed the limits meanwhile
+				host->nconns++;
+				pool.nconns++;
+				host->connecting = probe;
+
+				pthread_mutex_unlock(&pool.mutex);
+				conn = http_open(iri);
+				pthread_mutex_lock(&pool.mutex);
+
+				host->connecting = 0;
+
+				if (conn) {
+					conn->pooled = 1;
+					if (conn->h2) {
+						conn->users = 1;
+						host->shared = conn;
+					} else if (probe)
+						host->http1 = 1;
+				} else {
+					host->nconns--;
+					pool.nconns--;
+				}
+				pthread_cond_broadcast(&pool.released);
+				break;
+			}
+
+			if (pool.lru_head) {
+				// make room by closing the least recently used idle connection
+				_pool_close_idle(pool.lru_head);
+				continue;
+			}
+		}
+
+		pthread_cond_wait(&pool.released, &pool.mutex);
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	return conn;
+}
+
+// give a connection back to the pool for reuse.
+// connections not opened by http_pool_open() (e.g. by http_open_async()) are taken over
+// if the limits allow, else they are closed.
+
+void http_pool_checkin(MGET_HTTP_CONNECTION **conn)
+{
+	POOL_HOST *host;
+	POOL_ENTRY *entry;
+
+	if (!conn || !*conn)
+		return;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	host = _pool_get_host((*conn)->scheme, (*conn)->esc_host, (*conn)->port);
+
+	if (!(*conn)->pooled) {
+		(*conn)->pooled = 1;
+		host->nconns++;
+		pool.nconns++;
+
+		if ((*conn)->h2) {
+			(*conn)->users = 1;
+			if (!host->shared)
+				host->shared = *conn;
+		}
+	}
+
+	if ((*conn)->h2) {
+		// other threads may still use the connection
+		if (--(*conn)->users > 0) {
+			*conn = NULL;
+			pthread_cond_broadcast(&pool.released);
+			pthread_mutex_unlock(&pool.mutex);
+			return;
+		}
+
+		if (host->shared != *conn || !_h2_usable(*conn)) {
+			if (host->shared == *conn)
+				host->shared = NULL;
+			host->nconns--;
+			pool.nconns--;
+			pthread_cond_broadcast(&pool.released);
+			pthread_mutex_unlock(&pool.mutex);
+			http_close(conn);
+			return;
+		}
+	}
+
+	// connections with outstanding (pipelined) responses or unexpected data can't be reused
+	if (!pool.idle_timeout || (!(*conn)->h2 && ((*conn)->pending || (*conn)->buf->length)) ||
+		(pool.max_per_host && host->nconns > pool.max_per_host) ||
+		(pool.max_total && pool.nconns > pool.max_total))
+	{
+		if (host->shared == *conn)
+			host->shared = NULL;
+		host->nconns--;
+		pool.nconns--;
+		pthread_cond_broadcast(&pool.released);
+		pthread_mutex_unlock(&pool.mutex);
+		http_close(conn);
+		return;
+	}
+
+	entry = xcalloc(1, sizeof(POOL_ENTRY));
+	entry->conn = *conn;
+	entry->host = host;
+	entry->idle_since = mget_get_timemillis();
+
+	entry->host_next = host->idle;
+	host->idle = entry;
+
+	if ((entry->prev = pool.lru_tail))
+		pool.lru_tail->next = entry;
+	else
+		pool.lru_head = entry;
+	pool.lru_tail = entry;
+
+	*conn = NULL;
+
+	pthread_cond_broadcast(&pool.released);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+// close a connection that has been checked out or opened by http_pool_open()
+
+void http_pool_close(MGET_HTTP_CONNECTION **conn)
+{
+	if (!conn || !*conn)
+		return;
+
+	if ((*conn)->pooled) {
+		POOL_HOST *host;
+
+		pthread_mutex_lock(&pool.mutex);
+		host = _pool_get_host((*conn)->scheme, (*conn)->esc_host, (*conn)->port);
+
+		if ((*conn)->h2) {
+			// no new users, the last user closes the connection
+			if (host->shared == *conn)
+				host->shared = NULL;
+
+			if (--(*conn)->users > 0) {
+				pthread_mutex_lock(&(*conn)->h2->mutex);
+				(*conn)->h2->goaway = 1;
+				pthread_mutex_unlock(&(*conn)->h2->mutex);
+				*conn = NULL;
+				pthread_mutex_unlock(&pool.mutex);
+				return;
+			}
+		}
+
+		host->nconns--;
+		pool.nconns--;
+		pthread_cond_broadcast(&pool.released);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	http_close(conn);
+}
+
+// close all idle connections and free the pool.
+// checked out connections have to be closed by http_pool_close() before.
+
+void http_pool_free(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+
+	while (pool.lru_head)
+		_pool_close_idle(pool.lru_head);
+
+	mget_stringmap_free(&pool.hosts);
+	pool.nconns = 0;
+
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+int http_send_request(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req)
+{
+	return http_send_requests(conn, &req, 1);
+}
+
+static ssize_t _request_to_buffer(MGET_HTTP_REQUEST *req, mget_buffer_t *buf);
+
+// send several requests with one write (pipelining).
+// the responses have to be read in the same order.
+
+int http_send_requests(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST **reqs, int nreqs)
+{
+	char sbuf[4096];
+	mget_buffer_t tmp, *buf;
+	ssize_t nbytes = 0;
+	int it, rc = 0;
+
+	if (conn->h2) {
+		// one stream per request
+		for (it = 0; it < nreqs && rc == 0; it++)
+			rc = _h2_send_request(conn, reqs[it]);
+		return rc;
+	}
+
+	// data read ahead (the start of the next response) must not be overwritten
+	if (conn->buf->length)
+		buf = mget_buffer_init(&tmp, sbuf, sizeof(sbuf));
+	else
+		buf = conn->buf;
+
+	for (buf->length = 0, it = 0; it < nreqs && nbytes >= 0; it++)
+		nbytes = _request_to_buffer(reqs[it], buf);
+
+	if (nbytes < 0) {
+		error_printf(_("Failed to create request buffer\n"));
+		rc = -1;
+	} else if (mget_tcp_write(conn->tcp, buf->data, nbytes) != nbytes) {
+		// An error will be written by the mget_tcp_write function.
+		// error_printf(_("Failed to send %zd bytes (%d)\n"), nbytes, errno);
+		rc = -1;
+	} else {
+		debug_printf("# sent %zd bytes:\n%s", nbytes, buf->data);
+		conn->pending += nreqs;
+	}
+
+	if (buf == conn->buf)
+		buf->length = 0;
+	else
+		mget_buffer_deinit(buf);
+
+	return rc;
+}
+
+ssize_t http_request_to_buffer(MGET_HTTP_REQUEST *req, mget_buffer_t *buf)
+{
+	buf->length = 0;
+
+	return _request_to_buffer(req, buf);
+}
+
+// append <req> to <buf>
+
+static ssize_t _request_to_buffer(MGET_HTTP_REQUEST *req, mget_buffer_t *buf)
+{
+	int it, use_proxy = 0;
+
+//	buffer_sprintf(buf, "%s /%s HTTP/1.1\r\nHOST: %s", req->method, req->esc_resource.data ? req->esc_resource.data : "",);
+
+	mget_buffer_strcat(buf, req->method);
+	mget_buffer_memcat(buf, " ", 1);
+	if (http_proxy && req->scheme == IRI_SCHEME_HTTP) {
+		use_proxy = 1;
+		mget_buffer_strcat(buf, req->scheme);
+		mget_buffer_memcat(buf, "://", 3);
+		mget_buffer_bufcat(buf, &req->esc_host);
+	} else if (https_proxy && req->scheme == IRI_SCHEME_HTTPS) {
+		use_proxy = 1;
+		mget_buffer_strcat(buf, req->scheme);
+		mget_buffer_memcat(buf, "://", 3);
+		mget_buffer_bufcat(buf, &req->esc_host);
+	}
+	mget_buffer_memcat(buf, "/", 1);
+	mget_buffer_bufcat(buf, &req->esc_resource);
+	mget_buffer_memcat(buf, " HTTP/1.1\r\n", 11);
+	mget_buffer_memcat(buf, "Host: ", 6);
+	mget_buffer_bufcat(buf, &req->esc_host);
+	mget_buffer_memcat(buf, "\r\n", 2);
+
+	for (it = 0; it < mget_vector_size(req->lines); it++) {
+		mget_buffer_strcat(buf, mget_vector_get(req->lines, it));
+		if (buf->data[buf->length - 1] != '\n') {
+			mget_buffer_memcat(buf, "\r\n", 2);
+		}
+	}
+
+	if (use_proxy)
+		mget_buffer_strcat(buf, "Proxy-Connection: keep-alive\r\n");
+
+	mget_buffer_memcat(buf, "\r\n", 2); // end-of-header
+
+	return buf->length;
+}
+
+MGET_HTTP_RESPONSE *http_get_response_cb(
+	MGET_HTTP_CONNECTION *conn,
+	MGET_HTTP_REQUEST *req,
+	unsigned int flags,
+	int (*parse_body)(void *context, const char *data, size_t length),
+	void *context) // given to parse_body
 {
 	MGET_HTTP_RESPONSE *resp;
-	mget_buffer_t *body = mget_buffer_alloc(102400);
 
-	resp = http_get_response_cb(conn, req, flags, _get_body, body);
+	if (!(resp = http_get_response_header(conn, req, flags)))
+		return NULL;
 
-	if (resp) {
-		resp->body = body;
-		resp->content_length = body->length;
-	} else {
-		mget_buffer_free(&body);
-	}
+	if (req && !strcasecmp(req->method, "HEAD"))
+		return resp; // a HEAD response won't have a body
+
+	http_get_response_body_cb(conn, resp, parse_body, context);
+
+	return resp;
+}
+
+// get response, resp->body points to body in memory
+
+MGET_HTTP_RESPONSE *http_get_response(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags)
+{
+	MGET_HTTP_RESPONSE *resp;
+
+	if (!(resp = http_get_response_header(conn, req, flags)))
+		return NULL;
+
+	resp->body = mget_buffer_alloc(102400);
+
+	if (!req || strcasecmp(req->method, "HEAD")) // a HEAD response won't have a body
+		http_get_response_body(conn, resp, resp->body);
+
+	resp->content_length = resp->body->length;
 
 	return resp;
 }
@@ -1534,11 +3218,578 @@ static int _get_file(void *context, const char *data, size_t length)
 
 MGET_HTTP_RESPONSE *http_get_response_fd(MGET_HTTP_CONNECTION *conn, int fd, unsigned int flags)
 {
-	MGET_HTTP_RESPONSE *resp = http_get_response_cb(conn, NULL, flags, _get_file, &fd);
+	MGET_HTTP_RESPONSE *resp;
+
+	if ((resp = http_get_response_header(conn, NULL, flags)))
+		http_get_response_body_fd(conn, resp, fd);
 
 	return resp;
 }
 
+/*
+ * Response reader for non-blocking connections (e.g. driven by epoll/poll).
+ * Each call of http_response_reader_read() processes the data available on the
+ * connection and keeps track of where we are within the response.
+ */
+
+enum {
+	READER_HEADER,
+	READER_BODY_START, // header parsed, body data may be left in conn->buf
+	READER_CHUNK_SIZE,
+	READER_CHUNK_EXTENSION,
+	READER_CHUNK_DATA,
+	READER_CHUNK_END,
+	READER_TRAILER_LINE_START,
+	READER_TRAILER_LINE,
+	READER_BODY_LENGTH,
+	READER_BODY_UNTIL_CLOSE,
+	READER_DONE,
+	READER_ERROR // broken chunk framing or body processing stopped
+};
+
+struct _MGET_HTTP_RESPONSE_READER {
+	MGET_HTTP_CONNECTION
+		*conn;
+	MGET_HTTP_RESPONSE
+		*resp;
+	MGET_DECOMPRESSOR
+		*dc;
+	int
+		(*parse_body)(void *context, const char *data, size_t length);
+	void
+		*context;
+	mget_buffer_t
+		*body; // the body goes directly into this buffer, see http_response_reader_set_body()
+	size_t
+		remaining, // bytes left of current chunk or body
+		body_len, // body bytes received (without chunk framing)
+		scanned; // header bytes that have been searched for the end of header
+	unsigned int
+		flags;
+	char
+		state,
+		head, // response to a HEAD request, no body
+		readahead, // conn->buf already contains the start of the response
+		stopped; // the body data could not be processed, see _reader_body_data()
+};
+
+static void _reader_init(MGET_HTTP_RESPONSE_READER *reader, MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->conn = conn;
+	reader->flags = flags;
+	reader->head = req && !strcasecmp(req->method, "HEAD");
+	reader->state = READER_HEADER;
+	reader->readahead = conn->buf->length > 0;
+}
+
+// data left in conn->buf (e.g. from a previous pipelined response) is taken as the start of the response
+
+MGET_HTTP_RESPONSE_READER *http_response_reader_alloc(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags)
+{
+	MGET_HTTP_RESPONSE_READER *reader = xmalloc(sizeof(MGET_HTTP_RESPONSE_READER));
+
+	_reader_init(reader, conn, req, flags);
+
+	return reader;
+}
+
+void http_response_reader_free(MGET_HTTP_RESPONSE_READER **reader)
+{
+	if (reader && *reader) {
+		mget_decompress_close((*reader)->dc);
+		xfree(*reader);
+	}
+}
+
+// the response is available after http_response_reader_read() returned MGET_HTTP_READER_HEADER.
+// it belongs to the caller and won't be freed by http_response_reader_free().
+
+MGET_HTTP_RESPONSE *http_response_reader_get_response(MGET_HTTP_RESPONSE_READER *reader)
+{
+	return reader->resp;
+}
+
+// set the callback for the body data, should be done when the header has been read.
+// without callback, the body is read but thrown away.
+
+void http_response_reader_set_body_cb(
+	MGET_HTTP_RESPONSE_READER *reader,
+	int (*parse_body)(void *context, const char *data, size_t length),
+	void *context)
+{
+	reader->parse_body = parse_body;
+	reader->context = context;
+}
+
+// let the body be appended to <body>. Compressed bodies are decompressed directly into it.
+
+void http_response_reader_set_body(MGET_HTTP_RESPONSE_READER *reader, mget_buffer_t *body)
+{
+	reader->body = body;
+}
+
+static int _discard_body(G_GNUC_MGET_UNUSED void *context, G_GNUC_MGET_UNUSED const char *data, G_GNUC_MGET_UNUSED size_t length)
+{
+	return 0;
+}
+
+// a parse_body() callback returning < 0 (or undecodable data) stops reading the body.
+// the rest of the body stays unread, the connection can't be used any more.
+
+static void _reader_body_data(MGET_HTTP_RESPONSE_READER *reader, char *data, size_t length)
+{
+	reader->body_len += length;
+	if (mget_decompress(reader->dc, data, length) < 0)
+		reader->stopped = 1;
+}
+
+// feed body data into the reader's state machine.
+// the data is consumed completely, except when the body ends within <data>.
+// small chunk payloads are moved together within <data> (over the already consumed chunk framing)
+// and handed over as one piece. Else a server sending tiny chunks costs a write() per chunk.
+// returns the number of bytes consumed.
+
+#define CHUNK_JOIN_MAX 4096
+
+static size_t G_GNUC_MGET_NONNULL_ALL _reader_parse_body(MGET_HTTP_RESPONSE_READER *reader, char *data, size_t length)
+{
+	char *p = data, *end = data + length, *q;
+	char *run = NULL; // chunk payload collected so far
+	size_t n, run_len = 0;
+
+	while (p < end && reader->state != READER_DONE && reader->state != READER_ERROR && !reader->stopped) {
+		switch (reader->state) {
+		case READER_CHUNK_SIZE:
+			// chunk-size [ chunk-extension ] CRLF
+			for (; p < end && isxdigit((unsigned char)*p); p++) {
+				if (reader->remaining >> (sizeof(size_t) * 8 - 4)) {
+					error_printf(_("Chunk size too large\n"));
+					reader->state = READER_ERROR;
+					break;
+				}
+				reader->remaining = (reader->remaining << 4) | (isdigit((unsigned char)*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+			}
+			if (p < end && reader->state == READER_CHUNK_SIZE)
+				reader->state = READER_CHUNK_EXTENSION;
+			break;
+
+		case READER_CHUNK_EXTENSION:
+			if (*p == '\r' && p + 1 < end && p[1] == '\n')
+				q = p + 1; // no extension, the usual case
+			else if (!(q = memchr(p, '\n', end - p))) {
+				p = end;
+				break;
+			}
+			p = q + 1;
+			debug_printf("chunk size is %zu\n", reader->remaining);
+			reader->state = reader->remaining ? READER_CHUNK_DATA : READER_TRAILER_LINE_START;
+			break;
+
+		case READER_CHUNK_DATA:
+			if ((n = (size_t)(end - p)) > reader->remaining)
+				n = reader->remaining;
+			if (!run) {
+				run = p;
+				run_len = n;
+			} else if (n <= CHUNK_JOIN_MAX) {
+				memmove(run + run_len, p, n);
+				run_len += n;
+			} else {
+				_reader_body_data(reader, run, run_len);
+				run = p;
+				run_len = n;
+			}
+			p += n;
+			if ((reader->remaining -= n) == 0)
+				reader->state = READER_CHUNK_END;
+			break;
+
+		case READER_CHUNK_END:
+			// CRLF after chunk-data
+			if (*p == '\r' && p + 1 < end && p[1] == '\n')
+				q = p + 1;
+			else if (!(q = memchr(p, '\n', end - p))) {
+				p = end;
+				break;
+			}
+			p = q + 1;
+			reader->state = READER_CHUNK_SIZE;
+			break;
+
+		case READER_TRAILER_LINE_START:
+			// trailer CRLF, the most likely case is an empty trailer
+			if (*p == '\n')
+				reader->state = READER_DONE;
+			else if (*p != '\r')
+				reader->state = READER_TRAILER_LINE;
+			p++;
+			break;
+
+		case READER_TRAILER_LINE:
+			if (!(q = memchr(p, '\n', end - p))) {
+				p = end;
+				break;
+			}
+			p = q + 1;
+			reader->state = READER_TRAILER_LINE_START;
+			break;
+
+		case READER_BODY_LENGTH:
+			if ((n = (size_t)(end - p)) > reader->remaining) {
+				// with pipelining, the next response follows
+				if (!reader->conn->pending)
+					error_printf(_("Body too large: %zu instead of %zu bytes\n"), reader->body_len + n, reader->resp->content_length);
+				n = reader->remaining;
+			}
+			_reader_body_data(reader, p, n);
+			p += n;
+			if ((reader->remaining -= n) == 0)
+				reader->state = READER_DONE;
+			break;
+
+		case READER_BODY_UNTIL_CLOSE:
+			_reader_body_data(reader, p, end - p);
+			return length;
+		}
+	}
+
+	if (run_len)
+		_reader_body_data(reader, run, run_len);
+
+	return p - data;
+}
+
+// parse the body data in conn->buf.
+// data behind the end of the body is kept in conn->buf for the next response.
+
+static void G_GNUC_MGET_NONNULL_ALL _reader_consume(MGET_HTTP_RESPONSE_READER *reader)
+{
+	mget_buffer_t *buf = reader->conn->buf;
+	size_t n = _reader_parse_body(reader, buf->data, buf->length);
+
+	if ((buf->length -= n))
+		memmove(buf->data, buf->data + n, buf->length);
+	buf->data[buf->length] = 0;
+
+	if (reader->stopped && reader->state != READER_DONE)
+		reader->state = READER_ERROR;
+}
+
+// the header has been parsed, set up reading of the body
+
+static void G_GNUC_MGET_NONNULL_ALL _reader_start_body(MGET_HTTP_RESPONSE_READER *reader)
+{
+	MGET_HTTP_RESPONSE *resp = reader->resp;
+
+	if (reader->head || resp->code / 100 == 1 || resp->code == 204 || resp->code == 304 ||
+		(resp->transfer_encoding == transfer_encoding_identity && resp->content_length == 0 && resp->content_length_valid)) {
+		// - body not included, see RFC 2616 4.3
+		// - body empty, see RFC 2616 4.4
+		reader->state = READER_DONE;
+		return;
+	}
+
+	reader->dc = mget_decompress_open(resp->content_encoding, reader->parse_body ? reader->parse_body : _discard_body, reader->context);
+	if (reader->body)
+		mget_decompress_set_output(reader->dc, reader->body);
+
+	if (resp->transfer_encoding != transfer_encoding_identity) {
+		reader->state = READER_CHUNK_SIZE;
+		reader->remaining = 0;
+	} else if (resp->content_length_valid) {
+		reader->state = READER_BODY_LENGTH;
+		reader->remaining = resp->content_length;
+	} else
+		reader->state = READER_BODY_UNTIL_CLOSE;
+
+	// body data that has been read together with the header
+	if (reader->conn->buf->length)
+		_reader_consume(reader);
+}
+
+// search the empty line that terminates the header, CRLF as well as bare LF line endings are accepted.
+// <scanned> keeps the position to resume at, so each byte is looked at only once over all reads.
+// returns a pointer to the end of the last header line or NULL, <body> points behind the empty line.
+
+static char *_find_end_of_header(char *data, size_t length, size_t *scanned, char **body)
+{
+	char *p = data + *scanned, *end = data + length;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		if (p + 1 < end && p[1] == '\n') {
+			*body = p + 2;
+			return p > data && p[-1] == '\r' ? p - 1 : p;
+		}
+
+		if (p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+			*body = p + 3;
+			return p > data && p[-1] == '\r' ? p - 1 : p;
+		}
+
+		if (p + 2 >= end) {
+			// the empty line might just be incomplete
+			*scanned = p - data;
+			return NULL;
+		}
+
+		p++;
+	}
+
+	*scanned = length;
+	return NULL;
+}
+
+static int G_GNUC_MGET_NONNULL_ALL _reader_parse_header(MGET_HTTP_RESPONSE_READER *reader)
+{
+	mget_buffer_t *buf = reader->conn->buf;
+	char *p, *body;
+
+	if (!(p = _find_end_of_header(buf->data, buf->length, &reader->scanned, &body)))
+		return 0;
+
+	// found end-of-header
+	*p = 0;
+
+	debug_printf("# got header %zu bytes:\n%s\n\n", (size_t)(p - buf->data), buf->data);
+
+	if (reader->flags & MGET_HTTP_RESPONSE_KEEPHEADER) {
+		mget_buffer_t *header = mget_buffer_init(NULL, NULL, p - buf->data + 4);
+
+		mget_buffer_memcpy(header, buf->data, p - buf->data);
+		mget_buffer_memcat(header, "\r\n\r\n", 4);
+
+		if (!(reader->resp = http_parse_response(buf->data))) {
+			mget_buffer_free(&header);
+			return -1; // something is wrong with the header
+		}
+
+		reader->resp->header = header;
+	} else {
+		if (!(reader->resp = http_parse_response(buf->data)))
+			return -1; // something is wrong with the header
+	}
+
+	// move already read body data to the start of the connection buffer
+	buf->length -= body - buf->data;
+	memmove(buf->data, body, buf->length);
+	buf->data[buf->length] = 0;
+
+	if (reader->conn->pending > 0)
+		reader->conn->pending--;
+
+	reader->state = READER_BODY_START;
+
+	return 1;
+}
+
+// read and process the data available on the (non-blocking) connection.
+// returns
+//   MGET_HTTP_READER_AGAIN: wait until the connection is readable and call again
+//   MGET_HTTP_READER_HEADER: the response header is complete (see http_response_reader_get_response()),
+//     call again to read the body
+//   MGET_HTTP_READER_DONE: the response is complete
+//   -1: error, e.g. the connection has been closed too early
+
+int http_response_reader_read(MGET_HTTP_RESPONSE_READER *reader)
+{
+	mget_buffer_t *buf = reader->conn->buf;
+	ssize_t nbytes = 0;
+	int rc, nreads;
+
+	if (reader->readahead) {
+		// the header might be complete already
+		reader->readahead = 0;
+
+		if ((rc = _reader_parse_header(reader)) == 1)
+			return MGET_HTTP_READER_HEADER;
+		else if (rc < 0)
+			return -1;
+	}
+
+	if (reader->state == READER_BODY_START)
+		_reader_start_body(reader);
+
+	// limit the number of reads to not let other connections starve
+	for (nreads = 0; reader->state != READER_DONE && reader->state != READER_ERROR && nreads < 16; nreads++) {
+		if (reader->state == READER_HEADER) {
+			if (buf->size - buf->length < 1024)
+				mget_buffer_ensure_capacity(buf, buf->size + 10240);
+
+			if ((nbytes = mget_tcp_read(reader->conn->tcp, buf->data + buf->length, buf->size - buf->length)) <= 0)
+				break;
+
+			buf->length += nbytes;
+			buf->data[buf->length] = 0; // 0-terminate to allow string functions
+
+			if ((rc = _reader_parse_header(reader)) == 1)
+				return MGET_HTTP_READER_HEADER;
+			else if (rc < 0)
+				return -1;
+		} else {
+			if ((nbytes = mget_tcp_read(reader->conn->tcp, buf->data, buf->size)) <= 0)
+				break;
+
+			buf->length = nbytes;
+			_reader_consume(reader);
+		}
+	}
+
+	if (reader->state == READER_DONE || (nbytes == 0 && reader->state == READER_BODY_UNTIL_CLOSE)) {
+		if (reader->state == READER_BODY_UNTIL_CLOSE)
+			reader->resp->keep_alive = 0; // the server closed the connection
+		reader->state = READER_DONE;
+		reader->resp->content_length = reader->body_len;
+		return MGET_HTTP_READER_DONE;
+	}
+
+	if (reader->state == READER_ERROR)
+		return -1;
+
+	if (nreads == 16 || (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+		return MGET_HTTP_READER_AGAIN;
+
+	if (reader->resp && reader->state == READER_BODY_LENGTH)
+		error_printf(_("Just got %zu of %zu bytes\n"), reader->body_len, reader->resp->content_length);
+
+	return -1;
+}
+
+// read and parse the response header.
+// body data that has already been read is left in conn->buf (conn->buf->length bytes)
+// to be picked up by http_get_response_body_cb().
+
+MGET_HTTP_RESPONSE *http_get_response_header(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, unsigned int flags)
+{
+	MGET_HTTP_RESPONSE_READER reader;
+	int rc;
+
+	if (conn->h2)
+		return _h2_get_response_header(conn, req, flags);
+
+	_reader_init(&reader, conn, req, flags);
+
+	while ((rc = http_response_reader_read(&reader)) == MGET_HTTP_READER_AGAIN);
+
+	if (rc != MGET_HTTP_READER_HEADER) {
+		http_free_response(&reader.resp);
+		return NULL;
+	}
+
+	return reader.resp;
+}
+
+// read the response body belonging to <resp>, decompress it and hand it over to parse_body().
+// must be called directly after http_get_response_header(), but not for responses to HEAD requests.
+// data behind the end of the body stays in conn->buf for the next (pipelined) response.
+// returns 0 if the body has been read completely, -1 on error or if parse_body() returned < 0
+
+static int _get_response_body(
+	MGET_HTTP_CONNECTION *conn,
+	MGET_HTTP_RESPONSE *resp,
+	int (*parse_body)(void *context, const char *data, size_t length),
+	void *context,
+	mget_buffer_t *body)
+{
+	MGET_HTTP_RESPONSE_READER reader;
+	int rc;
+
+	if (conn->h2)
+		return _h2_get_response_body_cb(conn, resp, parse_body, context, body);
+
+	_reader_init(&reader, conn, NULL, 0);
+	reader.resp = resp;
+	reader.state = READER_BODY_START;
+	reader.readahead = 0;
+	reader.body = body;
+	http_response_reader_set_body_cb(&reader, parse_body, context);
+
+	while ((rc = http_response_reader_read(&reader)) == MGET_HTTP_READER_AGAIN);
+
+	mget_decompress_close(reader.dc);
+
+	if (rc != MGET_HTTP_READER_DONE) {
+		resp->content_length = reader.body_len;
+		return -1;
+	}
+
+	return 0;
+}
+
+int http_get_response_body_cb(
+	MGET_HTTP_CONNECTION *conn,
+	MGET_HTTP_RESPONSE *resp,
+	int (*parse_body)(void *context, const char *data, size_t length),
+	void *context) // given to parse_body
+{
+	return _get_response_body(conn, resp, parse_body, context, NULL);
+}
+
+// same as http_get_response_body_cb(), but the body is appended to <body>.
+// compressed bodies are decompressed directly into the buffer, without copying.
+
+// the Content-Length of a response is not trusted for more than this, the buffer grows with the data
+#define BODY_PREALLOC_MAX (4 * 1024 * 1024)
+
+int http_get_response_body(MGET_HTTP_CONNECTION *conn, MGET_HTTP_RESPONSE *resp, mget_buffer_t *body)
+{
+	// an uncompressed body with known length needs exactly this much
+	if (resp->content_length_valid && resp->content_encoding == mget_content_encoding_identity)
+		mget_buffer_ensure_capacity(body, body->length + (resp->content_length < BODY_PREALLOC_MAX ? resp->content_length : BODY_PREALLOC_MAX));
+
+	return _get_response_body(conn, resp, NULL, NULL, body);
+}
+
+// write the body of <resp> into <fd>.
+// plain HTTP bodies without transfer and content encoding are moved from the socket
+// to <fd> by mget_tcp_splice(), without passing them through the connection buffer.
+// returns 0 if the body is complete, -1 on error.
+// resp->content_length is set to the number of body bytes written.
+
+int http_get_response_body_fd(MGET_HTTP_CONNECTION *conn, MGET_HTTP_RESPONSE *resp, int fd)
+{
+	mget_buffer_t *buf = conn->buf;
+	size_t length, body_len;
+	ssize_t nbytes = 0;
+
+	if (conn->h2 || resp->transfer_encoding != transfer_encoding_identity ||
+		resp->content_encoding != mget_content_encoding_identity ||
+		resp->code / 100 == 1 || resp->code == 204 || resp->code == 304)
+	{
+		return http_get_response_body_cb(conn, resp, _get_file, &fd);
+	}
+
+	length = resp->content_length_valid ? resp->content_length : SIZE_MAX;
+
+	// body data read together with the header, with pipelining followed by the next response
+	if ((body_len = buf->length < length ? buf->length : length)) {
+		nbytes = write(fd, buf->data, body_len);
+		if (nbytes == -1 || (size_t)nbytes != body_len)
+			error_printf(_("Failed to write %zu bytes of data (%d)\n"), body_len, errno);
+
+		if ((buf->length -= body_len))
+			memmove(buf->data, buf->data + body_len, buf->length);
+		buf->data[buf->length] = 0;
+	}
+
+	while (body_len < length && (nbytes = mget_tcp_splice(conn->tcp, fd, length - body_len)) > 0)
+		body_len += nbytes;
+
+	resp->content_length = body_len;
+
+	if (length == SIZE_MAX) {
+		resp->keep_alive = 0; // the server closed the connection
+		return nbytes < 0 ? -1 : 0;
+	}
+
+	if (body_len < length) {
+		error_printf(_("Just got %zu of %zu bytes\n"), body_len, length);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
 // get response, resp->body points to body in memory (nested func/trampoline version)
 HTTP_RESPONSE *http_get_response(HTTP_CONNECTION *conn, HTTP_REQUEST *req)
@@ -1612,3 +3863,11 @@ void http_set_https_proxy(const char *proxy, const char *encoding)
 	mget_iri_free(&https_proxy);
 	https_proxy = mget_iri_parse(proxy, encoding);
 }
+
+// HTTP/2 is offered to HTTPS servers via ALPN, it has to be enabled before opening connections
+
+void http_set_http2(int enable)
+{
+	http2_enabled = !!enable;
+	mget_ssl_set_config_string(MGET_SSL_ALPN, enable ? "h2,http/1.1" : NULL);
+}
@@ -51,7 +51,8 @@ MGET_HTTP_RESPONSE *mget_http_get(int first_key, ...)
 		unsigned int
 			cookies_enabled : 1,
 			keep_header : 1,
-			free_uri : 1;
+			free_uri : 1,
+			use_pool : 1;
 	} bits = {
 		.cookies_enabled = !!mget_global_get_int(MGET_COOKIES_ENABLED)
 	};
@@ -85,6 +86,10 @@ MGET_HTTP_RESPONSE *mget_http_get(int first_key, ...)
 		case MGET_HTTP_MAX_REDIRECTIONS:
 			max_redirections = va_arg(args, int);
 			break;
+		case MGET_HTTP_CONNECTION_POOL:
+			// take connections from and give them back to the shared pool (see http_pool_open())
+			bits.use_pool = !!va_arg(args, int);
+			break;
 		default:
 			error_printf(_("Unknown option %d\n"), key);
 			goto out;
@@ -138,6 +143,12 @@ MGET_HTTP_RESPONSE *mget_http_get(int first_key, ...)
 			!mget_strcmp(conn->port, uri->resolv_port))
 		{
 			info_printf("reuse connection %s\n", conn->esc_host);
+		} else if (bits.use_pool && !connp) {
+			http_pool_checkin(&conn);
+			if ((conn = http_pool_checkout(uri)))
+				info_printf("reuse connection %s\n", conn->esc_host);
+			else if ((conn = http_pool_open(uri)))
+				info_printf("opened connection %s\n", conn->esc_host);
 		} else {
 			if (conn) {
 				info_printf("close connection %s\n", conn->esc_host);
@@ -155,12 +166,15 @@ MGET_HTTP_RESPONSE *mget_http_get(int first_key, ...)
 
 		http_free_request(&req);
 
-		if (!resp)
+		if (!resp) {
+			if (bits.use_pool && !connp)
+				http_pool_close(&conn); // might be broken
 			goto out;
+		}
 
 		// server doesn't support or want keep-alive
 		if (!resp->keep_alive)
-			http_close(&conn);
+			http_pool_close(&conn);
 
 		if (bits.cookies_enabled) {
 			// check and normalization of received cookies
@@ -210,6 +224,8 @@ MGET_HTTP_RESPONSE *mget_http_get(int first_key, ...)
 out:
 	if (connp) {
 		*connp = conn;
+	} else if (bits.use_pool) {
+		http_pool_checkin(&conn);
 	} else {
 		http_close(&conn);
 	}
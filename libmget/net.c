@@ -53,17 +53,23 @@
 struct _TCP {
 	void *
 		ssl_session;
+	struct addrinfo *
+		connect_addrinfo; // next address to try, see mget_tcp_connect_async()
+	const char *
+		ssl_hostname; // TLS handshake still has to be done, see mget_tcp_connect_async()
 	int
 		sockfd,
 		timeout;
 	char
-		ssl;
+		alpn[16], // protocol negotiated via ALPN
+		ssl,
+		connecting; // non-blocking connect() in progress
 };
 
 // global settings
 static int
 	// timeouts in milliseconds
-	// there is no real 'connect timeout', since connects are async
+	// the connect timeout limits the whole connection procedure (all addresses, see _tcp_connect_race())
 	dns_timeout = -1,
 	connect_timeout = -1,
 	timeout = -1, // read and write timeouts are the same
@@ -81,25 +87,210 @@ struct ADDR_ENTRY {
 		*host,
 		*port;
 	struct addrinfo
-		*addrinfo;
+		*addrinfo; // NULL: negative entry, the host could not be resolved
+	struct ADDR_ENTRY
+		*next; // list of retired entries or prefetch queue
+	struct addrinfo
+		head; // handed out by lookups: copy of the first address, followed by the others
+	time_t
+		expires; // 0: never
+	int
+		error, // getaddrinfo() error code of a negative entry
+		refs; // lookups not yet released by mget_tcp_addrinfo_free()
+	char
+		resolving, // prefetch entry: a resolver thread is working on it
+		retired; // replaced in the cache, freed with the last reference
 };
 
-// resolver / DNS cache container
-static MGET_VECTOR
-	*dns_cache;
+// resolver / DNS cache container.
+// it is split into shards with their own lock, so threads don't serialize on lookups.
+// the addresses of an entry are handed out without copying (e.g. a connection may still be
+// established with them), so replaced entries are retired and freed when the last lookup
+// is released.
+#define DNS_CACHE_SHARDS 16
+
+static struct dns_shard {
+	pthread_mutex_t
+		mutex;
+	MGET_HASHMAP
+		*entries;
+	struct ADDR_ENTRY
+		*retired;
+	unsigned long long
+		hits,
+		misses;
+} dns_cache[DNS_CACHE_SHARDS];
+static int
+	dns_caching,
+	dns_cache_ttl = 300, // seconds, < 0: entries never expire
+	dns_negative_ttl = 60; // seconds, 0: failures are not cached
 
-struct addrinfo *mget_tcp_resolve(const char *host, const char *port)
+static unsigned int G_GNUC_MGET_PURE G_GNUC_MGET_NONNULL_ALL hash_addr(const struct ADDR_ENTRY *entry)
+{
+	unsigned int hash = 0; // use 0 as SALT if hash table attacks doesn't matter
+	const char *p;
+
+	for (p = entry->host; *p; p++)
+		hash = hash * 101 + (unsigned char)tolower(*p);
+
+	hash = hash * 101 + ':';
+
+	for (p = entry->port; *p; p++)
+		hash = hash * 101 + (unsigned char)tolower(*p);
+
+	return hash;
+}
+
+static int G_GNUC_MGET_PURE G_GNUC_MGET_NONNULL_ALL compare_addr(const struct ADDR_ENTRY *a1, const struct ADDR_ENTRY *a2)
+{
+	int n;
+
+	if ((n = strcasecmp(a1->host, a2->host)) == 0)
+		return strcasecmp(a1->port, a2->port);
+
+	return n;
+}
+
+// the low bits of the hash select the hashmap bucket, so use the high bits for the shard
+static struct dns_shard * G_GNUC_MGET_NONNULL_ALL _dns_shard(const struct ADDR_ENTRY *entry)
+{
+	return &dns_cache[(hash_addr(entry) >> 16) % DNS_CACHE_SHARDS];
+}
+
+// returns 1 if <host>:<port> has been found in the cache (*addrinfo is NULL for negative entries),
+// 0 if not or if the entry has expired.
+// lookups for prefetching are not counted.
+// with <ref>, *addrinfo has to be released with mget_tcp_addrinfo_free().
+
+static int G_GNUC_MGET_NONNULL_ALL _dns_cache_get(const char *host, const char *port, struct addrinfo **addrinfo, int *error, int prefetch, int ref)
+{
+	struct ADDR_ENTRY *entryp, entry = { .host = host, .port = port };
+	struct dns_shard *shard = _dns_shard(&entry);
+	int found = 0;
+
+	pthread_mutex_lock(&shard->mutex);
+	if ((entryp = mget_hashmap_get(shard->entries, &entry)) && (!entryp->expires || entryp->expires > time(NULL))) {
+		*addrinfo = entryp->addrinfo ? &entryp->head : NULL;
+		*error = entryp->error;
+		if (entryp->addrinfo)
+			entryp->refs += ref;
+		found = 1;
+	}
+
+	if (!prefetch) {
+		if (found)
+			shard->hits++;
+		else
+			shard->misses++;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return found;
+}
+
+// insert the result of a resolution (<addrinfo> or <error>) into the cache.
+// returns the addrinfo to be used, which is the cached one if another thread has been faster.
+// with <ref>, it has to be released with mget_tcp_addrinfo_free().
+
+static struct addrinfo * G_GNUC_MGET_NONNULL((1,2)) _dns_cache_put(const char *host, const char *port, struct addrinfo *addrinfo, int error, int ref)
+{
+	size_t hostlen = strlen(host) + 1, portlen = strlen(port) + 1;
+	struct ADDR_ENTRY *old, *entryp = xmalloc(sizeof(struct ADDR_ENTRY) + hostlen + portlen);
+	struct dns_shard *shard;
+	time_t now = time(NULL);
+	int ttl = addrinfo ? dns_cache_ttl : dns_negative_ttl;
+
+	entryp->host = ((char *)entryp) + sizeof(struct ADDR_ENTRY);
+	entryp->port = ((char *)entryp) + sizeof(struct ADDR_ENTRY) + hostlen;
+	strcpy((char *)entryp->host, host); // ugly cast, but semantically ok
+	strcpy((char *)entryp->port, port); // ugly cast, but semantically ok
+	entryp->addrinfo = addrinfo;
+	entryp->next = NULL;
+	entryp->expires = ttl >= 0 ? now + ttl : 0;
+	entryp->error = error;
+	entryp->refs = addrinfo ? ref : 0;
+	entryp->resolving = entryp->retired = 0;
+	if (addrinfo)
+		entryp->head = *addrinfo;
+
+	shard = _dns_shard(entryp);
+
+	pthread_mutex_lock(&shard->mutex);
+	if ((old = mget_hashmap_get(shard->entries, entryp))) {
+		if (old->addrinfo && (!old->expires || old->expires > now)) {
+			// another thread resolved the same host meanwhile
+			old->refs += ref;
+			pthread_mutex_unlock(&shard->mutex);
+			if (addrinfo)
+				freeaddrinfo(addrinfo);
+			xfree(entryp);
+			return &old->head;
+		}
+
+		mget_hashmap_remove_nofree(shard->entries, old);
+		if (old->refs) {
+			old->retired = 1;
+			old->next = shard->retired;
+			shard->retired = old;
+		} else {
+			if (old->addrinfo)
+				freeaddrinfo(old->addrinfo);
+			xfree(old);
+		}
+	}
+	mget_hashmap_put_ident_noalloc(shard->entries, entryp);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return addrinfo ? &entryp->head : NULL;
+}
+
+static void _print_resolve_error(const char *host, const char *port, int error)
+{
+	if (port)
+		error_printf(_("Failed to resolve %s:%s (%s)\n"), host, port, gai_strerror(error));
+	else
+		error_printf(_("Failed to resolve %s (%s)\n"), host, gai_strerror(error));
+}
+
+// failures that are worth to be remembered for a while
+static int G_GNUC_MGET_CONST _is_negative_cacheable(int error)
 {
-	if (dns_cache) {
-		struct ADDR_ENTRY *entryp, entry = { .host = host, .port = port };
+	switch (error) {
+	case EAI_NONAME:
+	case EAI_AGAIN:
+#ifdef EAI_NODATA
+	case EAI_NODATA:
+#endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// <prefetch> is set when resolving in the background: errors are not printed, only cached
+
+static int
+	_dns_prefetch_wait(const char *host, const char *port);
 
-		pthread_mutex_lock(&dns_mutex);
-		entryp = mget_vector_get(dns_cache, mget_vector_find(dns_cache, &entry));
-		pthread_mutex_unlock(&dns_mutex);
+// without <caching>, the result is not looked up or stored in the DNS cache.
+// the result of a prefetch is not handed out, so it doesn't need to be released.
 
-		if (entryp) {
+static struct addrinfo *_tcp_resolve(const char *host, const char *port, int prefetch, int caching)
+{
+	if (caching) {
+		struct addrinfo *addrinfo;
+		int error;
+
+		// if not found, a resolver thread might just be working on it
+		if (_dns_cache_get(host ? host : "", port ? port : "", &addrinfo, &error, prefetch, !prefetch) ||
+			(!prefetch && _dns_prefetch_wait(host ? host : "", port ? port : "") &&
+			_dns_cache_get(host ? host : "", port ? port : "", &addrinfo, &error, 1, 1)))
+		{
 			// DNS cache entry found
-			return entryp->addrinfo;
+			if (!addrinfo && !prefetch)
+				_print_resolve_error(host, port, error);
+
+			return addrinfo;
 		}
 	}
 
@@ -161,10 +352,12 @@ struct addrinfo *mget_tcp_resolve(const char *host, const char *port)
 		}
 
 		if (rc) {
-			if (port)
-				error_printf(_("Failed to resolve %s:%s (%s)\n"), host, port, gai_strerror(rc));
-			else
-				error_printf(_("Failed to resolve %s (%s)\n"), host, gai_strerror(rc));
+			if (!prefetch)
+				_print_resolve_error(host, port, rc);
+
+			if (caching && dns_negative_ttl && _is_negative_cacheable(rc))
+				_dns_cache_put(host ? host : "", port ? port : "", NULL, rc, 0);
+
 			return NULL;
 		}
 
@@ -216,26 +409,205 @@ struct addrinfo *mget_tcp_resolve(const char *host, const char *port)
 			}
 		}
 
-		if (dns_cache) {
+		if (caching) {
 			// insert addrinfo into dns cache
-			size_t hostlen = host ? strlen(host) + 1 : 1;
-			size_t portlen = port ? strlen(port) + 1 : 1;
-			struct ADDR_ENTRY *entryp = xmalloc(sizeof(struct ADDR_ENTRY) + hostlen + portlen);
+			addrinfo = _dns_cache_put(host ? host : "", port ? port : "", addrinfo, 0, !prefetch);
+		}
+
+		return addrinfo;
+	}
+}
+
+// the result has to be released with mget_tcp_addrinfo_free()
+
+struct addrinfo *mget_tcp_resolve(const char *host, const char *port)
+{
+	return _tcp_resolve(host, port, 0, dns_caching);
+}
 
-			entryp->host = ((char *)entryp) + sizeof(struct ADDR_ENTRY);
-			entryp->port = ((char *)entryp) + sizeof(struct ADDR_ENTRY) + hostlen;
-			entryp->addrinfo = addrinfo;
-			strcpy((char *)entryp->host, host ? host : ""); // ugly cast, but semantically ok
-			strcpy((char *)entryp->port, port ? port : ""); // ugly cast, but semantically ok
+// release an address list returned by mget_tcp_resolve().
+// a cached list is freed when it has been replaced in the cache and this was its last user.
+// must be called before DNS caching is switched off.
 
-			pthread_mutex_lock(&dns_mutex);
-			if (mget_vector_find(dns_cache, entryp) == -1)
-				mget_vector_insert_sorted_noalloc(dns_cache, entryp);
-			pthread_mutex_unlock(&dns_mutex);
+void mget_tcp_addrinfo_free(struct addrinfo **addrinfo)
+{
+	if (!addrinfo || !*addrinfo)
+		return;
+
+	if (dns_caching) {
+		struct ADDR_ENTRY *entryp = (struct ADDR_ENTRY *)((char *)*addrinfo - offsetof(struct ADDR_ENTRY, head)), **pp;
+		struct dns_shard *shard = _dns_shard(entryp);
+
+		pthread_mutex_lock(&shard->mutex);
+		if (--entryp->refs == 0 && entryp->retired) {
+			for (pp = &shard->retired; *pp != entryp; pp = &(*pp)->next);
+			*pp = entryp->next;
+			freeaddrinfo(entryp->addrinfo);
+			xfree(entryp);
 		}
+		pthread_mutex_unlock(&shard->mutex);
+	} else
+		freeaddrinfo(*addrinfo);
 
-		return addrinfo;
+	*addrinfo = NULL;
+}
+
+// background resolver threads, filling the DNS cache for hosts that are going to be connected soon
+#define DNS_PREFETCH_THREADS 4
+
+static struct dns_prefetch {
+	pthread_mutex_t
+		mutex;
+	pthread_cond_t
+		cond, // new entries queued
+		resolved; // a resolver thread has finished an entry
+	pthread_t
+		tid[DNS_PREFETCH_THREADS];
+	MGET_HASHMAP
+		*pending; // entries queued or being resolved
+	struct ADDR_ENTRY
+		*head,
+		*tail;
+	int
+		nthreads,
+		terminate;
+} prefetch = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.resolved = PTHREAD_COND_INITIALIZER
+};
+
+static void *_dns_prefetch_thread(G_GNUC_MGET_UNUSED void *p)
+{
+	struct ADDR_ENTRY *entryp;
+
+	pthread_mutex_lock(&prefetch.mutex);
+
+	for (;;) {
+		while (!prefetch.head && !prefetch.terminate)
+			pthread_cond_wait(&prefetch.cond, &prefetch.mutex);
+
+		if (prefetch.terminate)
+			break;
+
+		entryp = prefetch.head;
+		if (!(prefetch.head = entryp->next))
+			prefetch.tail = NULL;
+		entryp->resolving = 1;
+
+		pthread_mutex_unlock(&prefetch.mutex);
+		_tcp_resolve(*entryp->host ? entryp->host : NULL, *entryp->port ? entryp->port : NULL, 1, 1);
+		pthread_mutex_lock(&prefetch.mutex);
+
+		mget_hashmap_remove(prefetch.pending, entryp);
+		pthread_cond_broadcast(&prefetch.resolved);
+	}
+
+	pthread_mutex_unlock(&prefetch.mutex);
+
+	return NULL;
+}
+
+// Start resolving <host>:<port> in the background, the result goes into the DNS cache.
+// Without DNS caching, this is a no-op.
+
+void mget_tcp_prefetch(const char *host, const char *port)
+{
+	struct ADDR_ENTRY *entryp;
+	struct addrinfo *addrinfo;
+	size_t hostlen, portlen;
+	int error, rc;
+
+	if (!dns_caching || !host)
+		return;
+
+	if (!port)
+		port = "";
+
+	if (_dns_cache_get(host, port, &addrinfo, &error, 1, 0))
+		return; // already known
+
+	hostlen = strlen(host) + 1;
+	portlen = strlen(port) + 1;
+	entryp = xcalloc(1, sizeof(struct ADDR_ENTRY) + hostlen + portlen);
+	entryp->host = ((char *)entryp) + sizeof(struct ADDR_ENTRY);
+	entryp->port = ((char *)entryp) + sizeof(struct ADDR_ENTRY) + hostlen;
+	strcpy((char *)entryp->host, host); // ugly cast, but semantically ok
+	strcpy((char *)entryp->port, port); // ugly cast, but semantically ok
+
+	pthread_mutex_lock(&prefetch.mutex);
+
+	if (!prefetch.pending)
+		prefetch.pending = mget_hashmap_create(16, -2,
+			(unsigned int(*)(const void *))hash_addr, (int(*)(const void *, const void *))compare_addr);
+
+	if (mget_hashmap_get(prefetch.pending, entryp)) {
+		pthread_mutex_unlock(&prefetch.mutex);
+		xfree(entryp);
+		return; // already queued
+	}
+
+	mget_hashmap_put_ident_noalloc(prefetch.pending, entryp);
+
+	if (prefetch.tail)
+		prefetch.tail->next = entryp;
+	else
+		prefetch.head = entryp;
+	prefetch.tail = entryp;
+
+	// start another resolver thread as long as there is more work than threads
+	if (prefetch.nthreads < DNS_PREFETCH_THREADS && prefetch.nthreads < mget_hashmap_size(prefetch.pending)) {
+		if ((rc = pthread_create(&prefetch.tid[prefetch.nthreads], NULL, _dns_prefetch_thread, NULL)) == 0)
+			prefetch.nthreads++;
+		else
+			error_printf(_("Failed to start DNS prefetch thread, error %d\n"), rc);
+	}
+
+	pthread_cond_signal(&prefetch.cond);
+	pthread_mutex_unlock(&prefetch.mutex);
+}
+
+// wait until a resolver thread is done with <host>:<port>, to not resolve it twice at the same time.
+// entries that are still queued are not waited for.
+// returns 1 if we waited.
+
+static int _dns_prefetch_wait(const char *host, const char *port)
+{
+	struct ADDR_ENTRY *entryp, entry = { .host = host, .port = port };
+	int waited = 0;
+
+	if (!prefetch.nthreads)
+		return 0;
+
+	pthread_mutex_lock(&prefetch.mutex);
+	while (!prefetch.terminate && (entryp = mget_hashmap_get(prefetch.pending, &entry)) && entryp->resolving) {
+		pthread_cond_wait(&prefetch.resolved, &prefetch.mutex);
+		waited = 1;
 	}
+	pthread_mutex_unlock(&prefetch.mutex);
+
+	return waited;
+}
+
+// stop the resolver threads and drop queued entries
+
+static void _dns_prefetch_stop(void)
+{
+	int it;
+
+	pthread_mutex_lock(&prefetch.mutex);
+	prefetch.terminate = 1;
+	pthread_cond_broadcast(&prefetch.cond);
+	pthread_cond_broadcast(&prefetch.resolved);
+	pthread_mutex_unlock(&prefetch.mutex);
+
+	for (it = 0; it < prefetch.nthreads; it++)
+		pthread_join(prefetch.tid[it], NULL);
+
+	mget_hashmap_free(&prefetch.pending);
+	prefetch.head = prefetch.tail = NULL;
+	prefetch.nthreads = 0;
+	prefetch.terminate = 0;
 }
 
 static int G_GNUC_MGET_CONST _value_to_family(int value)
@@ -282,31 +654,50 @@ int mget_tcp_get_family(void)
 	return _family_to_value(family);
 }
 
-static int G_GNUC_MGET_PURE G_GNUC_MGET_NONNULL_ALL compare_addr(struct ADDR_ENTRY *a1, struct ADDR_ENTRY *a2)
+static int _free_addrinfo(const void *key, G_GNUC_MGET_UNUSED const void *value)
 {
-	int n;
+	const struct ADDR_ENTRY *entryp = key;
 
-	if ((n = strcasecmp(a1->host, a2->host)) == 0)
-		return strcasecmp(a1->port, a2->port);
+	if (entryp->addrinfo)
+		freeaddrinfo(entryp->addrinfo);
 
-	return n;
+	return 0;
 }
 
 void mget_tcp_set_dns_caching(int caching)
 {
+	int it;
+
 	pthread_mutex_lock(&dns_mutex);
 	if (caching) {
-		if (!dns_cache)
-			dns_cache = mget_vector_create(4, -2, (int(*)(const void *, const void *))compare_addr);
-	} else {
-		if (dns_cache) {
-			int it;
+		if (!dns_caching) {
+			for (it = 0; it < DNS_CACHE_SHARDS; it++) {
+				pthread_mutex_init(&dns_cache[it].mutex, NULL);
+				dns_cache[it].entries = mget_hashmap_create(16, -2,
+					(unsigned int(*)(const void *))hash_addr, (int(*)(const void *, const void *))compare_addr);
+			}
+			dns_caching = 1;
+		}
+	} else if (dns_caching) {
+		// resolver threads write into the cache
+		_dns_prefetch_stop();
+		dns_caching = 0;
+
+		for (it = 0; it < DNS_CACHE_SHARDS; it++) {
+			struct dns_shard *shard = &dns_cache[it];
+			struct ADDR_ENTRY *entryp;
+
+			mget_hashmap_browse(shard->entries, _free_addrinfo);
+			mget_hashmap_free(&shard->entries);
 
-			for (it = 0; it < mget_vector_size(dns_cache); it++) {
-				struct ADDR_ENTRY *entryp = mget_vector_get(dns_cache, it);
+			while ((entryp = shard->retired)) {
+				shard->retired = entryp->next;
 				freeaddrinfo(entryp->addrinfo);
+				xfree(entryp);
 			}
-			mget_vector_free(&dns_cache);
+
+			shard->hits = shard->misses = 0;
+			pthread_mutex_destroy(&shard->mutex);
 		}
 	}
 	pthread_mutex_unlock(&dns_mutex);
@@ -314,7 +705,38 @@ void mget_tcp_set_dns_caching(int caching)
 
 int mget_tcp_get_dns_caching(void)
 {
-	return !!dns_cache;
+	return dns_caching;
+}
+
+// time-to-live of cache entries in seconds, < 0 means forever.
+// getaddrinfo() doesn't tell us the TTL of the DNS records.
+void mget_tcp_set_dns_cache_ttl(int ttl)
+{
+	dns_cache_ttl = ttl;
+}
+
+// time in seconds to remember that a host could not be resolved, 0 disables negative caching
+void mget_tcp_set_dns_negative_ttl(int ttl)
+{
+	dns_negative_ttl = ttl;
+}
+
+void mget_tcp_get_dns_cache_stats(unsigned long long *hits, unsigned long long *misses)
+{
+	int it;
+
+	*hits = *misses = 0;
+
+	pthread_mutex_lock(&dns_mutex);
+	if (dns_caching) {
+		for (it = 0; it < DNS_CACHE_SHARDS; it++) {
+			pthread_mutex_lock(&dns_cache[it].mutex);
+			*hits += dns_cache[it].hits;
+			*misses += dns_cache[it].misses;
+			pthread_mutex_unlock(&dns_cache[it].mutex);
+		}
+	}
+	pthread_mutex_unlock(&dns_mutex);
 }
 
 void mget_tcp_set_dns_timeout(int timeout)
@@ -364,82 +786,324 @@ void mget_tcp_set_bind_address(const char *bind_address)
 			while (*s && *s != ':')
 				s++;
 		}
+		// not cached, the bind address is kept after the DNS cache has been freed
 		if (*s == ':') {
 			*s = 0;
-			bind_addrinfo = mget_tcp_resolve(host, s + 1); // bind to host + specified port
+			bind_addrinfo = _tcp_resolve(host, s + 1, 0, 0); // bind to host + specified port
 		} else {
-			bind_addrinfo = mget_tcp_resolve(host, NULL); // bind to host on any port
+			bind_addrinfo = _tcp_resolve(host, NULL, 0, 0); // bind to host on any port
 		}
 	}
 }
 
-MGET_TCP *mget_tcp_connect(struct addrinfo *addrinfo, const char *hostname)
+// create a socket and start a non-blocking connect to <ai>.
+// returns the socket or -1 on error.
+
+static int G_GNUC_MGET_NONNULL_ALL _tcp_connect_start(struct addrinfo *ai)
 {
-	MGET_TCP *tcp = NULL;
-	struct addrinfo *ai;
-	int sockfd = -1, rc;
+	int sockfd, rc;
 	char adr[NI_MAXHOST], port[NI_MAXSERV];
 
-	for (ai = addrinfo; ai && !tcp; ai = ai->ai_next) {
-		if (mget_get_logger(MGET_LOGGER_DEBUG)->vprintf) {
-			if ((rc = getnameinfo(ai->ai_addr, ai->ai_addrlen, adr, sizeof(adr), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) == 0)
-				debug_printf("trying %s:%s...\n", adr, port);
-			else
-				debug_printf("trying ???:%s (%s)...\n", port, gai_strerror(rc));
+	if (mget_get_logger(MGET_LOGGER_DEBUG)->vprintf) {
+		if ((rc = getnameinfo(ai->ai_addr, ai->ai_addrlen, adr, sizeof(adr), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) == 0)
+			debug_printf("trying %s:%s...\n", adr, port);
+		else
+			debug_printf("trying ???:%s (%s)...\n", port, gai_strerror(rc));
+	}
+
+	if ((sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) != -1) {
+		int on = 1;
+
+		fcntl(sockfd, F_SETFL, O_NDELAY);
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+			error_printf(_("Failed to set socket option REUSEADDR\n"));
+
+		on = 1;
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+			error_printf(_("Failed to set socket option NODELAY\n"));
+
+		if (bind_addrinfo) {
+			if (mget_get_logger(MGET_LOGGER_DEBUG)->vprintf) {
+				if ((rc = getnameinfo(bind_addrinfo->ai_addr, bind_addrinfo->ai_addrlen, adr, sizeof(adr), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) == 0)
+					debug_printf("binding to %s:%s...\n", adr, port);
+				else
+					debug_printf("binding to ???:%s (%s)...\n", port, gai_strerror(rc));
+			}
+
+			if (bind(sockfd, bind_addrinfo->ai_addr, bind_addrinfo->ai_addrlen) != 0) {
+				error_printf(_("Failed to bind (%d)\n"), errno);
+				close(sockfd);
+				return -1;
+			}
+		}
+
+		if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+			errno != EINPROGRESS)
+		{
+			error_printf(_("Failed to connect (%d)\n"), errno);
+			close(sockfd);
+			return -1;
 		}
+	} else
+		error_printf(_("Failed to create socket (%d)\n"), errno);
 
-		if ((sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) != -1) {
-			int on = 1;
+	return sockfd;
+}
 
-			fcntl(sockfd, F_SETFL, O_NDELAY);
+static int G_GNUC_MGET_PURE _count_addresses(const struct addrinfo *ai)
+{
+	int n;
 
-			if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
-				error_printf(_("Failed to set socket option REUSEADDR\n"));
+	for (n = 0; ai; ai = ai->ai_next)
+		n++;
 
-			on = 1;
-			if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
-				error_printf(_("Failed to set socket option NODELAY\n"));
+	return n;
+}
 
-			if (bind_addrinfo) {
-				if (mget_get_logger(MGET_LOGGER_DEBUG)->vprintf) {
-					if ((rc = getnameinfo(bind_addrinfo->ai_addr, bind_addrinfo->ai_addrlen, adr, sizeof(adr), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) == 0)
-						debug_printf("binding to %s:%s...\n", adr, port);
-					else
-						debug_printf("binding to ???:%s (%s)...\n", port, gai_strerror(rc));
-				}
+static struct addrinfo *_next_of_family(struct addrinfo *ai, int family, int same)
+{
+	for (; ai; ai = ai->ai_next) {
+		if ((ai->ai_family == family) == same)
+			return ai;
+	}
 
-				if (bind(sockfd, bind_addrinfo->ai_addr, bind_addrinfo->ai_addrlen) != 0) {
-					error_printf(_("Failed to bind (%d)\n"), errno);
-					close(sockfd);
-					return NULL;
-				}
+	return NULL;
+}
+
+// order the addresses for connecting (RFC 8305, section 4):
+// alternate between the address families, starting with the family of the first address.
+// mget_tcp_resolve() already moved the preferred family to the front.
+
+static void G_GNUC_MGET_NONNULL_ALL _tcp_sort_candidates(struct addrinfo *addrinfo, struct addrinfo **candidates)
+{
+	int family = addrinfo->ai_family, n = 0;
+	struct addrinfo *a = addrinfo, *b = _next_of_family(addrinfo, family, 0);
+
+	while (a || b) {
+		if (a) {
+			candidates[n++] = a;
+			a = _next_of_family(a->ai_next, family, 1);
+		}
+		if (b) {
+			candidates[n++] = b;
+			b = _next_of_family(b->ai_next, family, 0);
+		}
+	}
+}
+
+// Connect to the address that answers first ('Happy Eyeballs', RFC 8305).
+// The connection attempts are started CONNECTION_ATTEMPT_DELAY ms after each other
+// (or as soon as the previous attempt failed) and race against each other.
+// The whole procedure is limited by the connect timeout.
+// returns the connected socket or -1.
+
+#define CONNECTION_ATTEMPT_DELAY 250 // ms
+
+static int G_GNUC_MGET_NONNULL_ALL _tcp_connect_race(struct addrinfo *addrinfo)
+{
+	long long start = mget_get_timemillis(), now, next_start = start;
+	int ncandidates = _count_addresses(addrinfo), nstarted = 0, npending = 0, sockfd = -1, error = 0, wait, rc, n;
+	struct addrinfo *candidates[ncandidates];
+	struct pollfd pollfds[ncandidates];
+
+	_tcp_sort_candidates(addrinfo, candidates);
+
+	while (sockfd == -1) {
+		now = mget_get_timemillis();
+
+		// start the next attempt when it is due or when nothing else is pending
+		if (nstarted < ncandidates && (now >= next_start || !npending)) {
+			pollfds[nstarted].events = POLLOUT;
+			pollfds[nstarted].revents = 0;
+			if ((pollfds[nstarted].fd = _tcp_connect_start(candidates[nstarted])) != -1) {
+				next_start = now + CONNECTION_ATTEMPT_DELAY;
+				npending++;
 			}
+			nstarted++;
+			continue;
+		}
 
-			if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) < 0 &&
-				errno != EINPROGRESS)
-			{
-				error_printf(_("Failed to connect (%d)\n"), errno);
-				close(sockfd);
-			} else {
-				tcp = xcalloc(1, sizeof(*tcp));
-				tcp->sockfd = sockfd;
-				tcp->timeout = timeout;
-				if (hostname) {
-					tcp->ssl = 1;
-					tcp->ssl_session = mget_ssl_open(tcp->sockfd, hostname, connect_timeout);
-					if (!tcp->ssl_session) {
-						mget_tcp_close(&tcp);
-						continue;
-					}
-				}
+		if (!npending) {
+			// all attempts failed
+			if (error)
+				error_printf(_("Failed to connect (%d)\n"), error);
+			break;
+		}
+
+		if (connect_timeout >= 0 && now - start >= connect_timeout) {
+			error_printf(_("Connect timeout\n"));
+			break;
+		}
+
+		// wait until the next attempt is due, but not longer than the connect timeout allows
+		wait = nstarted < ncandidates ? (int)(next_start - now) : -1;
+		if (connect_timeout >= 0 && (wait < 0 || wait > start + connect_timeout - now))
+			wait = (int)(start + connect_timeout - now);
+
+		if ((rc = poll(pollfds, nstarted, wait)) < 0) {
+			if (errno != EINTR)
+				error_printf(_("Failed to poll (%d)\n"), errno);
+			break;
+		}
+
+		for (n = 0; n < nstarted && rc > 0; n++) {
+			socklen_t len = sizeof(error);
+
+			if (pollfds[n].fd == -1 || !pollfds[n].revents)
+				continue;
+
+			rc--;
+
+			if (getsockopt(pollfds[n].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) {
+				sockfd = pollfds[n].fd; // the winner
+				pollfds[n].fd = -1;
+				break;
 			}
-		} else
-			error_printf(_("Failed to create socket (%d)\n"), errno);
+
+			if (!error)
+				error = errno;
+			debug_printf("Failed to connect (%d)\n", error);
+
+			close(pollfds[n].fd);
+			pollfds[n].fd = -1;
+			npending--;
+			next_start = now; // don't wait for starting the next attempt
+		}
+	}
+
+	// cancel all other attempts
+	for (n = 0; n < nstarted; n++) {
+		if (pollfds[n].fd != -1)
+			close(pollfds[n].fd);
+	}
+
+	return sockfd;
+}
+
+MGET_TCP *mget_tcp_connect(struct addrinfo *addrinfo, const char *hostname)
+{
+	MGET_TCP *tcp;
+	int sockfd;
+
+	if ((sockfd = _tcp_connect_race(addrinfo)) == -1)
+		return NULL;
+
+	tcp = xcalloc(1, sizeof(*tcp));
+	tcp->sockfd = sockfd;
+	tcp->timeout = timeout;
+
+	if (hostname) {
+		tcp->ssl = 1;
+		if (!(tcp->ssl_session = mget_ssl_open(tcp->sockfd, hostname, connect_timeout)))
+			mget_tcp_close(&tcp);
+	}
+
+	return tcp;
+}
+
+// start connecting to the next usable address of tcp->connect_addrinfo
+
+static int G_GNUC_MGET_NONNULL_ALL _tcp_connect_next(MGET_TCP *tcp)
+{
+	struct addrinfo *ai;
+
+	for (ai = tcp->connect_addrinfo; ai; ai = ai->ai_next) {
+		if ((tcp->sockfd = _tcp_connect_start(ai)) != -1) {
+			tcp->connect_addrinfo = ai->ai_next;
+			tcp->connecting = 1;
+			return 0;
+		}
+	}
+
+	tcp->connect_addrinfo = NULL;
+
+	return -1;
+}
+
+// Non-blocking variant of mget_tcp_connect() for event driven clients.
+// The connection (and the TLS handshake, if <hostname> is given) has to be completed by
+// calling mget_tcp_connect_continue() whenever the socket becomes ready.
+// <addrinfo> and <hostname> must stay valid until then.
+// The returned connection does non-blocking I/O (timeout 0).
+
+MGET_TCP *mget_tcp_connect_async(struct addrinfo *addrinfo, const char *hostname)
+{
+	MGET_TCP *tcp = xcalloc(1, sizeof(*tcp));
+
+	tcp->connect_addrinfo = addrinfo;
+	tcp->ssl_hostname = hostname;
+	tcp->ssl = !!hostname;
+
+	if (_tcp_connect_next(tcp)) {
+		xfree(tcp);
+		return NULL;
 	}
 
 	return tcp;
 }
 
+// returns 0 if the connection is established and ready for I/O,
+// MGET_IO_READABLE or MGET_IO_WRITABLE if we have to wait for the socket and -1 on failure.
+// the socket might change while trying the next address, see mget_tcp_get_sockfd().
+
+int mget_tcp_connect_continue(MGET_TCP *tcp)
+{
+	int rc;
+
+	while (tcp->connecting) {
+		struct pollfd pollfd[1] = {
+			{ tcp->sockfd, POLLOUT, 0}};
+		socklen_t len;
+		int error = 0;
+
+		if (poll(pollfd, 1, 0) == 0)
+			return MGET_IO_WRITABLE; // connect still in progress
+
+		len = sizeof(error);
+		if (getsockopt(tcp->sockfd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) {
+			tcp->connecting = 0;
+			break;
+		}
+
+		debug_printf("Failed to connect (%d)\n", error ? error : errno);
+
+		close(tcp->sockfd);
+		tcp->sockfd = -1;
+		tcp->connecting = 0;
+
+		if (_tcp_connect_next(tcp))
+			return -1;
+	}
+
+	if (tcp->ssl_hostname) {
+		if (!tcp->ssl_session && !(tcp->ssl_session = mget_ssl_open_async(tcp->sockfd, tcp->ssl_hostname)))
+			return -1;
+
+		if ((rc = mget_ssl_handshake(tcp->ssl_session)) != 0)
+			return rc;
+
+		tcp->ssl_hostname = NULL;
+	}
+
+	return 0;
+}
+
+int mget_tcp_get_sockfd(const MGET_TCP *tcp)
+{
+	return tcp->sockfd;
+}
+
+// the application protocol negotiated during the TLS handshake (ALPN), NULL if none
+
+const char *mget_tcp_get_alpn(MGET_TCP *tcp)
+{
+	if (!tcp->ssl_session || mget_ssl_get_alpn(tcp->ssl_session, tcp->alpn, sizeof(tcp->alpn)))
+		return NULL;
+
+	return tcp->alpn;
+}
+
 ssize_t mget_tcp_read(MGET_TCP *tcp, char *buf, size_t count)
 {
 	ssize_t rc;
@@ -464,19 +1128,139 @@ ssize_t mget_tcp_read(MGET_TCP *tcp, char *buf, size_t count)
 		rc = read(tcp->sockfd, buf, count);
 	}
 
-	if (rc < 0)
+	// with timeout 0 (non-blocking I/O) there might be nothing to read yet
+	if (rc < 0 && (tcp->timeout || (errno != EAGAIN && errno != EWOULDBLOCK)))
 		error_printf(_("Failed to read %zu bytes (%d)\n"), count, errno);
 
 	return rc;
 }
 
+static int _write_all(int fd, const char *buf, size_t count)
+{
+	ssize_t n;
+
+	for (; count; count -= n, buf += n) {
+		if ((n = write(fd, buf, count)) <= 0) {
+			error_printf(_("Failed to write %zu bytes (%d)\n"), count, errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_SPLICE
+// splice() the socket data to <fd> through the pipe <pipefd>.
+// returns the number of bytes moved, -1 on error.
+// stops early with *nosplice set if <fd> doesn't support splice() (e.g. O_APPEND files or terminals).
+
+static ssize_t _tcp_splice(MGET_TCP *tcp, int pipefd[2], int fd, size_t count, int *nosplice)
+{
+	char buf[16384];
+	size_t moved = 0, chunk = 65536;
+	ssize_t n, m = 0, left;
+
+#ifdef F_SETPIPE_SZ
+	// fewer splice() calls with a larger pipe
+	if ((n = fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024)) > 0)
+		chunk = (size_t)n;
+#endif
+
+	while (moved < count && !*nosplice) {
+		n = splice(tcp->sockfd, NULL, pipefd[1], NULL, count - moved < chunk ? count - moved : chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pollfd[1] = {
+				{ tcp->sockfd, POLLIN, 0}};
+
+			// 0: non-blocking I/O, the caller has to come back later
+			if (tcp->timeout && poll(pollfd, 1, tcp->timeout) > 0 && (pollfd[0].revents & (POLLIN | POLLHUP)))
+				continue;
+
+			if (tcp->timeout)
+				error_printf(_("Failed to read %zu bytes (%d)\n"), count - moved, errno);
+			return moved ? (ssize_t)moved : -1;
+		}
+
+		if (n <= 0) {
+			if (n < 0)
+				error_printf(_("Failed to read %zu bytes (%d)\n"), count - moved, errno);
+			return n < 0 && !moved ? -1 : (ssize_t)moved;
+		}
+
+		// empty the pipe into <fd>
+		for (left = n; left > 0; left -= m) {
+			if (!*nosplice && (m = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE)) > 0)
+				continue;
+
+			if (!*nosplice && m < 0 && errno != EINVAL) {
+				error_printf(_("Failed to write %zu bytes (%d)\n"), (size_t)left, errno);
+				return -1;
+			}
+
+			// <fd> doesn't support splice(), copy the data that is in the pipe already
+			*nosplice = 1;
+			if ((m = read(pipefd[0], buf, (size_t)left < sizeof(buf) ? (size_t)left : sizeof(buf))) <= 0 || _write_all(fd, buf, m))
+				return -1;
+		}
+
+		moved += n;
+	}
+
+	return moved;
+}
+#endif
+
+// move up to <count> bytes from the connection to <fd>, e.g. a response body into the output file.
+// with plain TCP, splice() moves the data through a pipe without copying it to user space.
+// TLS connections and file descriptors that splice() can't write to take the read()/write() way.
+// returns the number of bytes moved (less than <count> at EOF), -1 on error.
+
+ssize_t mget_tcp_splice(MGET_TCP *tcp, int fd, size_t count)
+{
+	char buf[16384];
+	size_t moved = 0;
+	ssize_t n = 0;
+
+#ifdef HAVE_SPLICE
+	int pipefd[2], nosplice = 0;
+
+	if (!tcp->ssl && count && pipe(pipefd) == 0) {
+		n = _tcp_splice(tcp, pipefd, fd, count, &nosplice);
+		close(pipefd[0]);
+		close(pipefd[1]);
+
+		if (n < 0 || (size_t)n == count || !nosplice)
+			return n; // done, error or EOF
+
+		moved = (size_t)n;
+	}
+#endif
+
+	while (moved < count) {
+		if ((n = mget_tcp_read(tcp, buf, count - moved < sizeof(buf) ? count - moved : sizeof(buf))) <= 0)
+			break;
+
+		if (_write_all(fd, buf, n))
+			return -1;
+
+		moved += n;
+	}
+
+	return n < 0 && !moved ? -1 : (ssize_t)moved;
+}
+
 ssize_t mget_tcp_write(MGET_TCP *tcp, const char *buf, size_t count)
 {
 	ssize_t nwritten = 0, n;
 	int rc;
 
-	if (tcp->ssl)
-		return mget_ssl_write_timeout(tcp->ssl_session, buf, count, timeout);
+	if (tcp->ssl) {
+		if ((n = mget_ssl_write_timeout(tcp->ssl_session, buf, count, tcp->timeout)) < 0 && !tcp->timeout && errno == EAGAIN)
+			return 0; // non-blocking I/O: try again later with the same data
+
+		return n;
+	}
 
 	while (count) {
 		// 0: no timeout / immediate
@@ -498,7 +1282,10 @@ ssize_t mget_tcp_write(MGET_TCP *tcp, const char *buf, size_t count)
 		}
 
 		n = write(tcp->sockfd, buf, count);
-			
+
+		if (n < 0 && !tcp->timeout && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return nwritten; // non-blocking I/O: the caller has to write the rest later
+
 		if (n < 0) {
 			error_printf(_("Failed to write %zu bytes (%d)\n"), count, errno);
 			return -1;
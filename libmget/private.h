@@ -52,6 +52,20 @@
 #define debug_printf mget_debug_printf
 #define debug_write mget_debug_write
 
+// HTTP/2 session state and frame handling, without a connection (http.c).
+// not part of the API, exported for the test suite.
+struct _MGET_HTTP2 *
+	http2_session_alloc(void);
+void
+	http2_session_free(struct _MGET_HTTP2 **h2);
+int
+	http2_handle_frame(struct _MGET_HTTP2 *h2, const unsigned char *frame),
+	http2_hpack_decode(struct _MGET_HTTP2 *h2, const unsigned char *p, size_t length, mget_buffer_t *header),
+	http2_hpack_decode_int(const unsigned char **p, const unsigned char *end, int prefix_bits, size_t *value),
+	http2_hpack_huffman_decode(const unsigned char *in, size_t inlen, mget_buffer_t *out);
+size_t
+	http2_hpack_table_size(const struct _MGET_HTTP2 *h2);
+
 // _MGET_LOGGER is shared between log.c and logger.c, but must no be exposed to the public
 struct _MGET_LOGGER {
 	FILE *fp;
@@ -35,6 +35,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <gnutls/gnutls.h>
@@ -49,13 +52,16 @@ static struct _config {
 		*ca_directory,
 		*ca_cert,
 		*cert_file,
-		*private_key;
+		*private_key,
+		*alpn; // comma separated list of protocols, e.g. "h2,http/1.1"
 	char
 		check_certificate,
 		cert_type,
-		private_key_type;
+		private_key_type,
+		session_cache; // resume TLS sessions
 } _config = {
 	.check_certificate=1,
+	.session_cache = 1,
 	.cert_type = MGET_SSL_X509_FMT_PEM,
 	.private_key_type = MGET_SSL_X509_FMT_PEM,
 	.secure_protocol = "AUTO",
@@ -65,6 +71,31 @@ static struct _config {
 static gnutls_certificate_credentials_t
 	_credentials;
 
+// our data attached to a GnuTLS session
+typedef struct {
+	const char
+		*hostname;
+	char
+		ticket_pending; // TLS 1.3: the session ticket arrives after the handshake
+} SESSION_CONTEXT;
+
+// TLS session cache entry, see _session_cache_add()
+typedef struct {
+	time_t
+		expires;
+	size_t
+		size;
+	unsigned char
+		data[1];
+} SESSION_ENTRY;
+
+static MGET_STRINGMAP
+	*_sessions;
+static pthread_mutex_t
+	_sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SESSION_LIFETIME (2 * 3600) // s, fallback if the expiry is unknown
+
 void mget_ssl_set_config_string(int key, const char *value)
 {
 	switch (key) {
@@ -73,6 +104,7 @@ void mget_ssl_set_config_string(int key, const char *value)
 	case MGET_SSL_CA_CERT: _config.ca_cert = value; break;
 	case MGET_SSL_CERT_FILE: _config.cert_file = value; break;
 	case MGET_SSL_PRIVATE_KEY: _config.private_key = value; break;
+	case MGET_SSL_ALPN: _config.alpn = value; break;
 	default: error_printf(_("Unknown config key %d (or value must not be a string)\n"), key);
 	}
 }
@@ -83,6 +115,7 @@ void mget_ssl_set_config_int(int key, int value)
 	case MGET_SSL_CHECK_CERTIFICATE: _config.check_certificate = (char)value; break;
 	case MGET_SSL_CERT_TYPE: _config.cert_type = (char)value; break;
 	case MGET_SSL_PRIVATE_KEY_TYPE: _config.private_key_type = (char)value; break;
+	case MGET_SSL_SESSION_CACHE: _config.session_cache = (char)value; break;
 	default: error_printf(_("Unknown config key %d (or value must not be an integer)\n"), key);
 	}
 }
@@ -307,7 +340,7 @@ static int _verify_certificate_callback(gnutls_session_t session)
 	const char *tag = _config.check_certificate ? _("ERROR") : _("WARNING");
 
 	// read hostname
-	hostname = gnutls_session_get_ptr(session);
+	hostname = ((SESSION_CONTEXT *)gnutls_session_get_ptr(session))->hostname;
 
 	/* This verification function uses the trusted CAs in the credentials
 	 * structure. So you must have installed one or more CA certificates.
@@ -505,6 +538,10 @@ void mget_ssl_deinit(void)
 	pthread_mutex_lock(&_mutex);
 
 	if (_init == 1) {
+		pthread_mutex_lock(&_sessions_mutex);
+		mget_stringmap_free(&_sessions);
+		pthread_mutex_unlock(&_sessions_mutex);
+
 		gnutls_certificate_free_credentials(_credentials);
 		gnutls_global_deinit();
 	}
@@ -546,9 +583,255 @@ static int _ready_2_write(gnutls_session_t session, int timeout)
 	return _ready_2_transfer(session, timeout, POLLOUT);
 }
 
-void *mget_ssl_open(int sockfd, const char *hostname, int connect_timeout)
+// RFC 7301 Application-Layer Protocol Negotiation, offer the protocols from _config.alpn
+
+static void _set_alpn(gnutls_session_t session)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+	gnutls_datum_t protocols[8];
+	const char *s, *e;
+	unsigned nprotocols = 0;
+	int ret;
+
+	for (s = _config.alpn; s && *s && nprotocols < countof(protocols); s = *e ? e + 1 : e) {
+		if (!(e = strchr(s, ',')))
+			e = s + strlen(s);
+
+		if (e > s) {
+			protocols[nprotocols].data = (unsigned char *)s;
+			protocols[nprotocols++].size = (unsigned)(e - s);
+		}
+	}
+
+	if (nprotocols && (ret = gnutls_alpn_set_protocols(session, protocols, nprotocols, 0)) < 0)
+		error_printf("GnuTLS: %s\n", gnutls_strerror(ret));
+#else
+	(void)session; // ALPN needs GnuTLS 3.2
+#endif
+}
+
+// copy the protocol selected by the server via ALPN into <buf>.
+// returns 0 on success, -1 if no protocol has been negotiated.
+
+int mget_ssl_get_alpn(void *session, char *buf, size_t bufsize)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+	gnutls_datum_t protocol;
+
+	if (gnutls_alpn_get_selected_protocol(session, &protocol) || protocol.size >= bufsize)
+		return -1;
+
+	memcpy(buf, protocol.data, protocol.size);
+	buf[protocol.size] = 0;
+
+	return 0;
+#else
+	(void)session; (void)buf; (void)bufsize;
+	return -1;
+#endif
+}
+
+/*
+ * TLS session cache.
+ * The session data (session ID or ticket) of the last connection to a host is kept
+ * to resume the session with the next connection, saving the asymmetric crypto
+ * and (with TLS 1.2) a round trip.
+ * mget_ssl_session_cache_save() and mget_ssl_session_cache_load() keep it across runs.
+ */
+
+static void _session_cache_add(const char *hostname, const unsigned char *data, size_t size, time_t expires)
+{
+	SESSION_ENTRY *entry = xmalloc(sizeof(SESSION_ENTRY) + size);
+
+	entry->expires = expires;
+	entry->size = size;
+	memcpy(entry->data, data, size);
+
+	pthread_mutex_lock(&_sessions_mutex);
+	if (!_sessions)
+		_sessions = mget_stringmap_create_nocase(16);
+	mget_stringmap_put_noalloc(_sessions, strdup(hostname), entry);
+	pthread_mutex_unlock(&_sessions_mutex);
+}
+
+// remember the session data of an established session
+
+static void _session_cache_store(gnutls_session_t session)
+{
+	const char *hostname = ((SESSION_CONTEXT *)gnutls_session_get_ptr(session))->hostname;
+	gnutls_datum_t data;
+	time_t expires;
+
+	if (gnutls_session_get_data2(session, &data) || !data.size)
+		return;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+	if ((expires = gnutls_db_check_entry_expire_time(&data)) <= 0)
+#endif
+		expires = time(NULL) + SESSION_LIFETIME;
+
+	_session_cache_add(hostname, data.data, data.size, expires);
+	gnutls_free(data.data);
+}
+
+static void _session_cache_handshake_done(gnutls_session_t session)
+{
+	if (!_config.session_cache)
+		return;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	// gnutls_session_get_data2() would wait for the ticket, get it later with the received data
+	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_3) {
+		((SESSION_CONTEXT *)gnutls_session_get_ptr(session))->ticket_pending = 1;
+		return;
+	}
+#endif
+
+	_session_cache_store(session);
+}
+
+static void _session_cache_check_ticket(gnutls_session_t session)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	SESSION_CONTEXT *ctx = gnutls_session_get_ptr(session);
+
+	if (ctx->ticket_pending && (gnutls_session_get_flags(session) & GNUTLS_SFLAGS_SESSION_TICKET)) {
+		ctx->ticket_pending = 0;
+		_session_cache_store(session);
+	}
+#else
+	(void)session;
+#endif
+}
+
+static void _session_cache_resume(gnutls_session_t session, const char *hostname)
+{
+	SESSION_ENTRY *entry;
+	int ret;
+
+	if (!_config.session_cache)
+		return;
+
+	pthread_mutex_lock(&_sessions_mutex);
+
+	if (_sessions && (entry = mget_stringmap_get(_sessions, hostname))) {
+		if (entry->expires > time(NULL)) {
+			if ((ret = gnutls_session_set_data(session, entry->data, entry->size)))
+				debug_printf("GnuTLS: %s\n", gnutls_strerror(ret));
+		} else
+			mget_stringmap_remove(_sessions, hostname);
+	}
+
+	pthread_mutex_unlock(&_sessions_mutex);
+}
+
+static FILE *_session_fp;
+static time_t _session_now;
+
+static int G_GNUC_MGET_NONNULL_ALL _session_save(const char *hostname, const void *value)
+{
+	const SESSION_ENTRY *entry = value;
+
+	if (entry->expires > _session_now) {
+		char *data = mget_base64_encode_alloc((const char *)entry->data, (int)entry->size);
+
+		fprintf(_session_fp, "%s %lld %s\n", hostname, (long long)entry->expires, data);
+		xfree(data);
+	}
+
+	return 0;
+}
+
+// save the cached sessions to <fname>.
+// the file contains secret session keys, so only the owner may read it.
+
+int mget_ssl_session_cache_save(const char *fname)
+{
+	FILE *fp;
+	int fd, ret = -1;
+
+	if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1 || !(fp = fdopen(fd, "w"))) {
+		error_printf(_("Failed to open TLS session file '%s': %s\n"), fname, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	fchmod(fd, 0600); // the file may have existed before
+
+	fputs("# TLS session cache\n", fp);
+	fputs("#Generated by Mget " PACKAGE_VERSION ". Contains secret keys, keep it private.\n\n", fp);
+
+	pthread_mutex_lock(&_sessions_mutex);
+	if (_sessions) {
+		_session_fp = fp;
+		_session_now = time(NULL);
+		mget_stringmap_browse(_sessions, _session_save);
+	}
+	pthread_mutex_unlock(&_sessions_mutex);
+
+	if (!ferror(fp))
+		ret = 0;
+
+	if (fclose(fp))
+		ret = -1;
+
+	if (ret)
+		error_printf(_("Failed to write to TLS session file '%s': %s\n"), fname, strerror(errno));
+
+	return ret;
+}
+
+// load sessions saved by mget_ssl_session_cache_save(), expired entries are skipped.
+// returns the number of sessions loaded or -1 if the file can't be read.
+
+int mget_ssl_session_cache_load(const char *fname)
+{
+	FILE *fp;
+	char *buf = NULL, *host, *expires, *data;
+	size_t bufsize = 0;
+	time_t now = time(NULL);
+	int nsessions = 0;
+
+	if (!(fp = fopen(fname, "r"))) {
+		if (errno != ENOENT)
+			error_printf(_("Failed to open TLS session file '%s': %s\n"), fname, strerror(errno));
+		return -1;
+	}
+
+	while (mget_getline(&buf, &bufsize, fp) >= 0) {
+		if (*buf == '#' || !(host = strtok(buf, " \t\r\n")))
+			continue;
+
+		if (!(expires = strtok(NULL, " \t\r\n")) || !(data = strtok(NULL, " \t\r\n")))
+			continue;
+
+		if (atoll(expires) > now) {
+			int len = (int)strlen(data);
+			char *decoded = xmalloc(((len + 3) / 4) * 3 + 1);
+
+			// damaged data just lets the resumption fail
+			len = mget_base64_decode(decoded, data, len);
+			_session_cache_add(host, (unsigned char *)decoded, len, (time_t)atoll(expires));
+			xfree(decoded);
+			nsessions++;
+		}
+	}
+
+	xfree(buf);
+	fclose(fp);
+
+	debug_printf("loaded %d TLS sessions from '%s'\n", nsessions, fname);
+
+	return nsessions;
+}
+
+// create a client session on <sockfd>, the handshake is not done yet
+
+static gnutls_session_t _ssl_session_new(int sockfd, const char *hostname)
 {
 	gnutls_session_t session;
+	SESSION_CONTEXT *ctx;
 	int ret;
 
 	mget_ssl_init();
@@ -559,11 +842,14 @@ void *mget_ssl_open(int sockfd, const char *hostname, int connect_timeout)
 	// very old gnutls version, likely to not work.
 	gnutls_init(&session, GNUTLS_CLIENT);
 #endif
-	gnutls_session_set_ptr(session, (void *)hostname);
+	ctx = xcalloc(1, sizeof(SESSION_CONTEXT));
+	ctx->hostname = hostname;
+	gnutls_session_set_ptr(session, ctx);
 	// RFC 6066 SNI Server Name Indication
 	gnutls_server_name_set(session, GNUTLS_NAME_DNS, hostname, strlen(hostname));
 	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, _credentials);
 	gnutls_transport_set_ptr(session, (gnutls_transport_ptr_t)(ptrdiff_t)sockfd);
+	_session_cache_resume(session, hostname);
 
 	if (!strncasecmp(_config.secure_protocol, "SSL", 3))
 		ret = gnutls_priority_set_direct(session, "NORMAL:-VERS-TLS-ALL:+VERS-SSL3.0", NULL);
@@ -577,6 +863,17 @@ void *mget_ssl_open(int sockfd, const char *hostname, int connect_timeout)
 		error_printf("GnuTLS: %s\n", gnutls_strerror(ret));
 	}
 
+	return session;
+}
+
+void *mget_ssl_open(int sockfd, const char *hostname, int connect_timeout)
+{
+	gnutls_session_t session = _ssl_session_new(sockfd, hostname);
+	int ret;
+
+	// non-blocking (async) sessions only speak HTTP/1.1, see http_open_async()
+	_set_alpn(session);
+
 	// Perform the TLS handshake
 	for (;;) {
 		ret = gnutls_handshake(session);
@@ -609,19 +906,57 @@ void *mget_ssl_open(int sockfd, const char *hostname, int connect_timeout)
 		gnutls_perror(ret);
 		mget_ssl_close((void **)&session);
 	} else {
-		debug_printf("Handshake completed\n");
+		debug_printf("Handshake completed%s\n", gnutls_session_is_resumed(session) ? " (resumed)" : "");
+		_session_cache_handshake_done(session);
 	}
 
 	return session;
 }
 
+// create a session for a non-blocking socket.
+// the handshake is done by calling mget_ssl_handshake() until it returns 0.
+
+void *mget_ssl_open_async(int sockfd, const char *hostname)
+{
+	return _ssl_session_new(sockfd, hostname);
+}
+
+// continue the handshake of a session created by mget_ssl_open_async().
+// returns 0 when the handshake is complete, MGET_IO_READABLE or MGET_IO_WRITABLE
+// if we have to wait for the socket and -1 on failure.
+
+int mget_ssl_handshake(void *session)
+{
+	int ret = gnutls_handshake(session);
+
+	if (ret == 0) {
+		if (mget_get_logger(MGET_LOGGER_DEBUG))
+			_print_info(session);
+
+		debug_printf("Handshake completed%s\n", gnutls_session_is_resumed(session) ? " (resumed)" : "");
+		_session_cache_handshake_done(session);
+		return 0;
+	}
+
+	if (gnutls_error_is_fatal(ret)) {
+		debug_printf("Handshake failed (%d)\n", ret);
+		gnutls_perror(ret);
+		return -1;
+	}
+
+	return gnutls_record_get_direction(session) ? MGET_IO_WRITABLE : MGET_IO_READABLE;
+}
+
 void mget_ssl_close(void **session)
 {
 	gnutls_session_t s = *session;
 
 	if (s) {
+		void *ctx = gnutls_session_get_ptr(s);
+
 		gnutls_bye(s, GNUTLS_SHUT_RDWR);
 		gnutls_deinit(s);
+		xfree(ctx);
 		*session = NULL;
 	}
 }
@@ -637,8 +972,17 @@ ssize_t mget_ssl_read_timeout(void *session, char *buf, size_t count, int timeou
 
 		nbytes=gnutls_record_recv(session, buf, count);
 
+		// a TLS 1.3 session ticket is received like application data
+		_session_cache_check_ticket(session);
+
 		if (nbytes >= 0 || nbytes != GNUTLS_E_AGAIN)
 			break;
+
+		if (!timeout) {
+			// non-blocking I/O, nothing to read yet
+			errno = EAGAIN;
+			return -1;
+		}
 	}
 
 	return nbytes < -1 ? -1 : nbytes;
@@ -646,10 +990,17 @@ ssize_t mget_ssl_read_timeout(void *session, char *buf, size_t count, int timeou
 
 ssize_t mget_ssl_write_timeout(void *session, const char *buf, size_t count, int timeout)
 {
+	ssize_t nbytes;
 	int rc;
 
 	if ((rc=_ready_2_write(session, timeout)) <= 0)
 		return rc;
 
-	return gnutls_record_send(session, buf, count);
+	if ((nbytes = gnutls_record_send(session, buf, count)) == GNUTLS_E_AGAIN || nbytes == GNUTLS_E_INTERRUPTED) {
+		// has to be called again with the same data
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return nbytes;
 }
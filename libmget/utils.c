@@ -34,6 +34,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <libmget.h>
 #include "private.h"
@@ -111,3 +112,14 @@ void mget_memtohex(const unsigned char *src, size_t src_len, char *dst, size_t d
 
 	*dst = 0;
 }
+
+// milliseconds of a monotonic clock, for measuring timeouts and durations
+
+long long mget_get_timemillis(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
@@ -84,11 +84,11 @@ MGET_IRI *blacklist_add(MGET_IRI *iri)
 	if (!blacklist)
 		blacklist = mget_hashmap_create(128, -2, (unsigned int(*)(const void *))hash_iri, (int(*)(const void *, const void *))mget_iri_compare);
 
-	if (mget_iri_supported(iri)) {
-		if (mget_hashmap_put_ident_noalloc(blacklist, iri) == 0) {
-			// info_printf("Added to blacklist: %s\n",iri->uri);
-			return iri;
-		}
+	// check before, mget_hashmap_put_ident_noalloc() would just xfree() a duplicate
+	if (mget_iri_supported(iri) && !mget_hashmap_get(blacklist, iri)) {
+		mget_hashmap_put_ident_noalloc(blacklist, iri);
+		// info_printf("Added to blacklist: %s\n",iri->uri);
+		return iri;
 	}
 
 	mget_iri_free(&iri);
@@ -0,0 +1,251 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Message channels between main thread and downloaders
+ *
+ * A channel is a bounded ring of typed messages (D. Vyukov's bounded queue):
+ * senders claim a slot with one compare-and-swap, the receiver needs no atomic
+ * read-modify-write at all. Nothing is formatted or parsed on the way.
+ *
+ * The receiver sleeps in poll() / epoll_wait() on the channel's file descriptor.
+ * It announces that with channel_idle(), only then a sender pays for the write()
+ * that wakes it up.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <libmget.h>
+
+#include "mget.h"
+#include "log.h"
+#include "channel.h"
+
+typedef struct {
+	MESSAGE
+		msg;
+	size_t
+		seq; // == position: free for the sender, == position + 1: ready for the receiver
+} SLOT;
+
+struct _CHANNEL {
+	SLOT
+		*slots;
+	size_t
+		mask,
+		head, // next position for senders
+		tail; // next position for the receiver
+	int
+		fd[2], // wakeup: read end, write end (the same for eventfd)
+		waiting, // the receiver sleeps on fd[0]
+		closed; // the receiver is gone, don't wait for room any more
+};
+
+CHANNEL *channel_create(int size)
+{
+	CHANNEL *channel = xcalloc(1, sizeof(CHANNEL));
+	size_t n;
+
+	// a power of 2, to find the slot by masking the position
+	for (n = 2; n < (size_t)size; n <<= 1)
+		;
+
+	channel->slots = xcalloc(n, sizeof(SLOT));
+	channel->mask = n - 1;
+	while (n--)
+		channel->slots[n].seq = n;
+
+	// the receiver might not run yet, the first message has to wake it up
+	channel->waiting = 1;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	if ((channel->fd[0] = channel->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		error_printf_exit(_("Failed to create eventfd (%d)\n"), errno);
+#else
+	if (pipe(channel->fd) == -1)
+		error_printf_exit(_("Failed to create pipe (%d)\n"), errno);
+	fcntl(channel->fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(channel->fd[1], F_SETFL, O_NONBLOCK);
+#endif
+
+	return channel;
+}
+
+void channel_free_message(MESSAGE *msg)
+{
+	mget_iri_free(&msg->iri);
+	xfree(msg->text);
+}
+
+void channel_free(CHANNEL **channel)
+{
+	if (*channel) {
+		MESSAGE msg;
+
+		while (channel_receive(*channel, &msg))
+			channel_free_message(&msg);
+
+		close((*channel)->fd[0]);
+		if ((*channel)->fd[1] != (*channel)->fd[0])
+			close((*channel)->fd[1]);
+
+		xfree((*channel)->slots);
+		xfree(*channel);
+	}
+}
+
+int channel_get_fd(CHANNEL *channel)
+{
+	return channel->fd[0];
+}
+
+// the receiver stops reading, from now on messages are dropped instead of waiting for room
+
+void channel_close(CHANNEL *channel)
+{
+	__atomic_store_n(&channel->closed, 1, __ATOMIC_RELEASE);
+}
+
+// copy <msg> into the channel. if it is full, wait for the receiver to make room.
+// after channel_close() the message is freed instead.
+
+void channel_send(CHANNEL *channel, const MESSAGE *msg)
+{
+	size_t pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+	SLOT *slot;
+
+	for (;;) {
+		intptr_t diff;
+
+		slot = &channel->slots[pos & channel->mask];
+		diff = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&channel->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else {
+			if (diff < 0) {
+				// full
+				if (__atomic_load_n(&channel->closed, __ATOMIC_ACQUIRE)) {
+					MESSAGE dropped = *msg;
+
+					channel_free_message(&dropped);
+					return;
+				}
+				sched_yield();
+			}
+			pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->msg = *msg;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	// pairs with the fence in channel_idle(): either the receiver sees the message or we see it waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&channel->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&channel->waiting, 0, __ATOMIC_ACQ_REL)) {
+		uint64_t one = 1;
+
+		if (write(channel->fd[1], &one, sizeof(one)) == -1 && errno != EAGAIN)
+			error_printf(_("Failed to wake up message receiver (%d)\n"), errno);
+	}
+}
+
+void channel_send_type(CHANNEL *channel, int id, int type)
+{
+	MESSAGE msg = { .type = type, .id = id };
+
+	channel_send(channel, &msg);
+}
+
+void channel_send_iri(CHANNEL *channel, int id, int type, MGET_IRI *iri)
+{
+	MESSAGE msg = { .type = type, .id = id, .iri = iri };
+
+	if (iri)
+		channel_send(channel, &msg);
+}
+
+// send a status line
+
+void channel_printf(CHANNEL *channel, int id, const char *fmt, ...)
+{
+	MESSAGE msg = { .type = MSG_STATUS, .id = id };
+	va_list args;
+
+	va_start(args, fmt);
+	if (vasprintf(&msg.text, fmt, args) != -1)
+		channel_send(channel, &msg);
+	va_end(args);
+}
+
+// only the receiver thread may call this. returns 0 if there is no message.
+
+int channel_receive(CHANNEL *channel, MESSAGE *msg)
+{
+	size_t pos = channel->tail;
+	SLOT *slot = &channel->slots[pos & channel->mask];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+
+	*msg = slot->msg;
+	__atomic_store_n(&slot->seq, pos + channel->mask + 1, __ATOMIC_RELEASE);
+	channel->tail = pos + 1;
+
+	return 1;
+}
+
+// the receiver wants to sleep on channel_get_fd().
+// returns 0 if messages came in meanwhile, the receiver has to fetch them first.
+
+int channel_idle(CHANNEL *channel)
+{
+	char buf[64];
+	SLOT *slot = &channel->slots[channel->tail & channel->mask];
+
+	// reset the wakeup from the last time
+	while (read(channel->fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	__atomic_store_n(&channel->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == channel->tail + 1) {
+		__atomic_store_n(&channel->waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
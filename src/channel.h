@@ -0,0 +1,83 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Header file for the message channels between main thread and downloaders
+ *
+ */
+
+#ifndef _MGET_CHANNEL_H
+#define _MGET_CHANNEL_H
+
+#include <libmget.h>
+
+enum {
+	// main thread -> downloader
+	MSG_GO, // download downloader->job / downloader->part
+	MSG_CHECK, // check the complete Metalink file of job
+	// downloader -> main thread
+	MSG_READY, // the current job is done, job / part: the one taken next (NULL: waiting for 'go')
+	MSG_CHECKED, // job has been checked
+	MSG_STATUS, // text
+	MSG_ADD_URI, // iri
+	MSG_REDIRECT, // iri
+	MSG_SEGMENTS, // number = size, text = file name
+	MSG_METALINK_NAME, // text
+	MSG_METALINK_SIZE, // number
+	MSG_METALINK_MIRROR, // iri, number = priority, tag = location
+	MSG_METALINK_HASH, // tag = type, text = hex value
+	MSG_METALINK_PIECE // number = length, tag = type, text = hex value
+};
+
+// text and iri are allocated by the sender and belong to the receiver
+typedef struct {
+	MGET_IRI
+		*iri;
+	void
+		*job, // JOB
+		*part; // PART
+	char
+		*text;
+	long long
+		number;
+	int
+		type,
+		id; // downloader
+	char
+		tag[16];
+} MESSAGE;
+
+// bounded ring of messages, any number of senders and one receiver
+typedef struct _CHANNEL CHANNEL;
+
+CHANNEL
+	*channel_create(int size);
+int
+	channel_receive(CHANNEL *channel, MESSAGE *msg) G_GNUC_MGET_NONNULL_ALL,
+	channel_idle(CHANNEL *channel) G_GNUC_MGET_NONNULL_ALL,
+	channel_get_fd(CHANNEL *channel) G_GNUC_MGET_NONNULL_ALL G_GNUC_MGET_PURE;
+void
+	channel_send(CHANNEL *channel, const MESSAGE *msg) G_GNUC_MGET_NONNULL_ALL,
+	channel_close(CHANNEL *channel) G_GNUC_MGET_NONNULL_ALL,
+	channel_send_type(CHANNEL *channel, int id, int type) G_GNUC_MGET_NONNULL_ALL,
+	channel_send_iri(CHANNEL *channel, int id, int type, MGET_IRI *iri) G_GNUC_MGET_NONNULL((1)),
+	channel_printf(CHANNEL *channel, int id, const char *fmt, ...) G_GNUC_MGET_NONNULL((1,3)) G_GNUC_MGET_PRINTF_FORMAT(3,4),
+	channel_free_message(MESSAGE *msg) G_GNUC_MGET_NONNULL_ALL,
+	channel_free(CHANNEL **channel);
+
+#endif /* _MGET_CHANNEL_H */
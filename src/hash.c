@@ -40,6 +40,7 @@
 
 #include <libmget.h>
 
+#include "mget.h"
 #include "log.h"
 #include "hash.h"
 
@@ -68,6 +69,8 @@ static G_GNUC_MGET_NONNULL((1)) gnutls_digest_algorithm_t get_algorithm(const ch
 	return -1;
 }
 
+// hash <length> bytes of <fd> from <offset> on, without changing the file position.
+// several threads may hash different ranges of the same file.
 // return 0 = OK, -1 = failed
 int hash_file_fd(const char *type, int fd, char *digest_hex, size_t digest_hex_size, off_t offset, off_t length)
 {
@@ -93,30 +96,37 @@ int hash_file_fd(const char *type, int fd, char *digest_hex, size_t digest_hex_s
 		unsigned char digest[gnutls_hash_get_len(algorithm)];
 		char *buf = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, offset);
 
+#ifdef HAVE_POSIX_FADVISE
+		// the range is read once from start to end
+		posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
 		if (buf == MAP_FAILED) {
-			// Fallback to read
+			// Fallback to read, e.g. if offset is not page aligned
 			ssize_t nbytes = 0;
 			gnutls_hash_hd_t dig;
 
 			buf = alloca(65536);
 
 			gnutls_hash_init(&dig, algorithm);
-			while (length > 0 && (nbytes = read(fd, buf, 65536)) > 0) {
+			while (length > 0 && (nbytes = pread(fd, buf, length < 65536 ? (size_t)length : 65536, offset)) > 0) {
 				gnutls_hash(dig, buf, nbytes);
-				
-				if (nbytes <= length)
-					length -= nbytes;
-				else
-					length = 0;
+				offset += nbytes;
+				length -= nbytes;
 			}
 			gnutls_hash_deinit(dig, digest);
 
 			if (nbytes < 0) {
 				error_printf("%s: Failed to read %llu bytes\n", __func__, (unsigned long long)length);
-				close(fd);
 				return -1;
 			}
+
+			mget_memtohex(digest, sizeof(digest), digest_hex, digest_hex_size);
+			ret = 0;
 		} else {
+#ifdef HAVE_MADVISE
+			madvise(buf, length, MADV_SEQUENTIAL);
+#endif
 			if (gnutls_hash_fast(algorithm, buf, length, digest) == 0) {
 				mget_memtohex(digest, sizeof(digest), digest_hex, digest_hex_size);
 				ret = 0;
@@ -149,3 +159,61 @@ int hash_file(const char *type, const char *fname, char *digest_hex, size_t dige
 {
 	return hash_file_offset(type, fname, digest_hex, digest_hex_size, 0, 0);
 }
+
+// incremental hashing of data as it comes in, e.g. while downloading
+
+struct _HASH_CONTEXT {
+	gnutls_hash_hd_t
+		dig;
+	int
+		algorithm;
+};
+
+// return 0 = OK, -1 = failed (e.g. unknown hash type)
+int hash_init(HASH_CONTEXT **ctx, const char *type)
+{
+	gnutls_hash_hd_t dig;
+	int algorithm;
+
+	*ctx = NULL;
+
+	if ((algorithm = get_algorithm(type)) < 0 || gnutls_hash_init(&dig, algorithm) != 0)
+		return -1;
+
+	*ctx = xmalloc(sizeof(HASH_CONTEXT));
+	(*ctx)->dig = dig;
+	(*ctx)->algorithm = algorithm;
+
+	return 0;
+}
+
+void hash_update(HASH_CONTEXT *ctx, const void *data, size_t length)
+{
+	gnutls_hash(ctx->dig, data, length);
+}
+
+// finish the computation and free <ctx>
+// return 0 = OK, -1 = failed
+int hash_finish(HASH_CONTEXT **ctx, char *digest_hex, size_t digest_hex_size)
+{
+	if (!*ctx)
+		return -1;
+
+	{
+		unsigned char digest[gnutls_hash_get_len((*ctx)->algorithm)];
+
+		gnutls_hash_deinit((*ctx)->dig, digest);
+		mget_memtohex(digest, sizeof(digest), digest_hex, digest_hex_size);
+	}
+
+	xfree(*ctx);
+	return 0;
+}
+
+void hash_free(HASH_CONTEXT **ctx)
+{
+	if (*ctx) {
+		gnutls_hash_deinit((*ctx)->dig, NULL);
+		xfree(*ctx);
+	}
+}
@@ -27,10 +27,18 @@
 #ifndef _MGET_HASH_H
 #define _MGET_HASH_H
 
+// running checksum computation, see hash_init()
+typedef struct _HASH_CONTEXT HASH_CONTEXT;
+
 int
+   hash_init(HASH_CONTEXT **ctx, const char *type) G_GNUC_MGET_NONNULL_ALL,
+   hash_finish(HASH_CONTEXT **ctx, char *digest_hex, size_t digest_hex_size) G_GNUC_MGET_NONNULL_ALL,
    hash_file_fd(const char *type, int fd, char *digest_hex, size_t digest_hex_size, off_t offset, off_t length) G_GNUC_MGET_NONNULL_ALL,
    hash_file_offset(const char *type, const char *fname, char *digest_hex, size_t digest_hex_size, off_t offset, off_t length) G_GNUC_MGET_NONNULL_ALL,
    hash_file(const char *type, const char *fname, char *digest_hex, size_t digest_hex_size) G_GNUC_MGET_NONNULL_ALL;
+void
+   hash_update(HASH_CONTEXT *ctx, const void *data, size_t length) G_GNUC_MGET_NONNULL_ALL,
+   hash_free(HASH_CONTEXT **ctx) G_GNUC_MGET_NONNULL_ALL;
 
 
 #endif /* _MGET_HASH_H */
@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -46,12 +47,40 @@
 static MGET_LIST
 	*queue;
 
+// protects the progress of parts in flight, shared by the main thread and the downloaders
+static pthread_mutex_t
+	parts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// protects the mirror statistics, updated by the downloaders
+static pthread_mutex_t
+	mirrors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// every MIRROR_EXPLORE-th mirror selection goes to the least measured mirror
+#define MIRROR_EXPLORE 8
+// a mirror with at least this many errors and more errors than good requests is demoted
+#define MIRROR_MAX_ERRORS 3
+// mirrors slower than 1/MIRROR_SLOW_FACTOR of the fastest one are not explored any more
+#define MIRROR_SLOW_FACTOR 8
+
+// protects the checksums computed while downloading
+static pthread_mutex_t
+	hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the state file of a download is synced to disk at most every STATE_SAVE_INTERVAL ms
+#define STATE_SAVE_INTERVAL 5000
+
 static int free_mirror(MIRROR *mirror)
 {
 	mget_iri_free(&mirror->iri);
 	return 0;
 }
 
+static int free_piece(PIECE *piece)
+{
+	hash_free(&piece->stream.ctx);
+	return 0;
+}
+
 void job_free(JOB *job)
 {
 	if (job) {
@@ -60,9 +89,14 @@ void job_free(JOB *job)
 		mget_vector_free(&job->mirrors);
 		mget_vector_free(&job->hashes);
 		mget_vector_free(&job->parts);
+		mget_vector_browse(job->pieces, (int (*)(void *))free_piece);
 		mget_vector_free(&job->pieces);
+		hash_free(&job->stream.ctx);
+		if (job->fd != -1)
+			close(job->fd);
 		xfree(job->name);
 		xfree(job->local_filename);
+		xfree(job->state_pieces);
 	}
 }
 
@@ -89,11 +123,14 @@ void job_create_parts(JOB *job)
 			part.length = fsize;
 		}
 
+		part.mirror = it;
 		mget_vector_add(job->parts, &part, sizeof(PART));
 
 		part.position += part.length;
 		fsize -= piece->length;
 	}
+
+	queue_index_parts(job);
 }
 
 static int G_GNUC_MGET_PURE _compare_mirror(MIRROR **m1, MIRROR **m2)
@@ -109,6 +146,102 @@ void job_sort_mirrors(JOB *job)
 	}
 }
 
+// account a request for a part to mirror <index>.
+// <bytes> have been received within <millis> ms, the response header came after <latency> ms.
+// <ok> is 0 if the part could not be completed.
+
+void job_mirror_report(JOB *job, int index, off_t bytes, long long millis, long long latency, int ok)
+{
+	MIRROR *mirror;
+
+	pthread_mutex_lock(&mirrors_mutex);
+
+	if ((mirror = mget_vector_get(job->mirrors, index))) {
+		mirror->requests++;
+		mirror->bytes += bytes;
+		mirror->millis += millis > 0 ? millis : 1;
+		mirror->latency += latency;
+
+		if (!ok && ++mirror->errors >= MIRROR_MAX_ERRORS && mirror->errors * 2 > mirror->requests && !mirror->demoted) {
+			mirror->demoted = 1;
+			info_printf(_("Mirror %s demoted after %d errors\n"), mirror->iri->host, mirror->errors);
+		}
+
+		debug_printf("mirror %s: %lld bytes/s, %lld ms latency, %d/%d errors\n",
+			mirror->iri->host, mirror->bytes * 1000 / mirror->millis,
+			mirror->latency / mirror->requests, mirror->errors, mirror->requests);
+	}
+
+	pthread_mutex_unlock(&mirrors_mutex);
+}
+
+// measured throughput of a mirror, weighted by its success rate (bytes/s)
+
+static long long G_GNUC_MGET_PURE _mirror_score(const MIRROR *mirror)
+{
+	if (!mirror->requests)
+		return 0;
+
+	return mirror->bytes * 1000 / mirror->millis * (mirror->requests - mirror->errors) / mirror->requests;
+}
+
+// choose the mirror for the next request of a part.
+// as long as nothing has been measured, the mirrors are used in turn, starting at <hint>.
+// then the fastest healthy mirror is chosen, except every MIRROR_EXPLORE-th time, when
+// the least measured mirror (that is not known to be slow) gets a chance.
+// <avoid> is the mirror that just failed, or -1. it is only chosen if there is no other.
+// returns the index of the mirror in job->mirrors.
+
+int job_mirror_select(JOB *job, int hint, int avoid)
+{
+	MIRROR *mirror;
+	long long score, best_score = -1;
+	int it, n = mget_vector_size(job->mirrors), best = -1, measured = 0;
+
+	if (n <= 1)
+		return 0;
+
+	pthread_mutex_lock(&mirrors_mutex);
+
+	for (it = 0; it < n; it++) {
+		mirror = mget_vector_get(job->mirrors, it);
+		measured |= mirror->requests > 0;
+
+		if (it != avoid && !mirror->demoted && (score = _mirror_score(mirror)) > best_score) {
+			best_score = score;
+			best = it;
+		}
+	}
+
+	if (best == -1) {
+		// all mirrors demoted (or just one left to avoid)
+		best = (avoid + 1) % n;
+	} else if (!measured) {
+		best = hint % n;
+		if (best == avoid)
+			best = (best + 1) % n;
+	} else if (++job->mirror_pos % MIRROR_EXPLORE == 0) {
+		int explore = -1;
+
+		for (it = 0; it < n; it++) {
+			mirror = mget_vector_get(job->mirrors, it);
+
+			if (it == avoid || mirror->demoted || (mirror->requests && _mirror_score(mirror) * MIRROR_SLOW_FACTOR < best_score))
+				continue;
+
+			if (explore == -1 || mirror->requests < ((MIRROR *)mget_vector_get(job->mirrors, explore))->requests)
+				explore = it;
+		}
+
+		if (explore != -1)
+			best = explore;
+	}
+
+	pthread_mutex_unlock(&mirrors_mutex);
+
+	return best;
+}
+
 /*
 void job_create_parts(JOB *job)
 {
@@ -148,12 +281,184 @@ void job_create_parts(JOB *job)
 }
 */
 
+// split the file of a job into up to <nparts> parts of at least <min_length> bytes.
+// a job without mirrors downloads its parts from the job's own URL.
+
+void job_create_segments(JOB *job, int nparts, off_t min_length)
+{
+	PART part;
+	off_t length;
+	int it;
+
+	if (job->size / min_length < nparts)
+		nparts = (int)(job->size / min_length);
+	if (nparts < 1)
+		nparts = 1;
+
+	length = job->size / nparts;
+
+	if (!job->parts)
+		job->parts = mget_vector_create(nparts, 4, NULL);
+	else
+		mget_vector_clear(job->parts);
+
+	memset(&part, 0, sizeof(PART));
+
+	for (it = 0; it < nparts; it++) {
+		// the last part takes the remainder
+		part.length = it < nparts - 1 ? length : job->size - part.position;
+		mget_vector_add(job->parts, &part, sizeof(PART));
+		part.position += part.length;
+	}
+
+	queue_index_parts(job);
+}
+
+// returns 1 if all parts of the job have been downloaded and no downloader is busy with them any more
+
+int job_parts_done(JOB *job)
+{
+	int it, done = 1;
+
+	pthread_mutex_lock(&parts_mutex);
+	for (it = 0; it < mget_vector_size(job->parts) && done; it++) {
+		PART *part = mget_vector_get(job->parts, it);
+
+		done = part->done && !part->inuse;
+	}
+	pthread_mutex_unlock(&parts_mutex);
+
+	return done;
+}
+
+// a downloader is about to write <length> bytes at <offset> of its part.
+// returns the number of bytes to write, less than <length> if the part has been
+// shortened by job_split_part() or completed by its endgame twin.
+
+size_t job_part_reserve(PART *part, off_t offset, size_t length)
+{
+	pthread_mutex_lock(&parts_mutex);
+
+	if (part->done || offset >= part->length)
+		length = 0;
+	else if ((off_t)length > part->length - offset)
+		length = (size_t)(part->length - offset);
+
+	part->received = offset + length;
+
+	pthread_mutex_unlock(&parts_mutex);
+
+	return length;
+}
+
+// a downloader got <length> bytes of its part. returns 1 if the part is complete.
+
+int job_part_finished(PART *part, off_t length)
+{
+	int done;
+
+	pthread_mutex_lock(&parts_mutex);
+
+	if (length == part->length) {
+		// whoever wins the endgame completes both parts,
+		// the front of the twin's range had been written before the race started
+		part->done = 1;
+		if (part->twin)
+			part->twin->done = 1;
+	}
+	done = part->done;
+
+	pthread_mutex_unlock(&parts_mutex);
+
+	return done;
+}
+
+// a downloader gave up <part> of <job>. it is not handed out again, the job fails
+// when all of its parts are done - unless the endgame twin of the part completes it.
+
+void job_part_failed(JOB *job, PART *part)
+{
+	pthread_mutex_lock(&parts_mutex);
+
+	if (!part->done) {
+		part->done = 1;
+		if (!part->twin || part->twin->done)
+			job->failed = 1;
+	}
+
+	pthread_mutex_unlock(&parts_mutex);
+}
+
+// give an idle downloader a share of the part in flight with the most bytes left.
+// if that is at least 2 * <min_length>, the back half is split off into a new part.
+// else (endgame) the rest of the part is downloaded a second time, from the next mirror.
+// the first downloader to finish wins, the other one stops (see job_part_reserve()).
+// returns the new part, already marked in use, or NULL.
+
+static PART *job_split_part(JOB *job, off_t min_length)
+{
+	PART part, *largest = NULL, *newpart;
+	off_t remaining = 0;
+	int it;
+
+	pthread_mutex_lock(&parts_mutex);
+
+	for (it = 0; it < mget_vector_size(job->parts); it++) {
+		PART *p = mget_vector_get(job->parts, it);
+
+		if (p->inuse && !p->done && !p->twin && p->length - p->received > remaining) {
+			largest = p;
+			remaining = p->length - p->received;
+		}
+	}
+
+	if (!largest) {
+		pthread_mutex_unlock(&parts_mutex);
+		return NULL;
+	}
+
+	memset(&part, 0, sizeof(PART));
+	part.mirror = largest->mirror + 1;
+	part.inuse = 1;
+
+	if (remaining >= 2 * min_length) {
+		part.position = largest->position + largest->received + remaining / 2;
+		part.length = largest->position + largest->length - part.position;
+		largest->length -= part.length;
+		debug_printf("split part at %llu, %llu bytes\n", (unsigned long long)part.position, (unsigned long long)part.length);
+	} else {
+		part.position = largest->position + largest->received;
+		part.length = remaining;
+		part.endgame = 1;
+		debug_printf("endgame for part at %llu, %llu bytes\n", (unsigned long long)part.position, (unsigned long long)part.length);
+	}
+
+	newpart = mget_vector_get(job->parts, mget_vector_add(job->parts, &part, sizeof(PART)));
+
+	if (newpart->endgame) {
+		newpart->twin = largest;
+		largest->twin = newpart;
+	}
+
+	pthread_mutex_unlock(&parts_mutex);
+
+	return newpart;
+}
+
 PART *job_add_part(JOB *job, PART *part)
 {
+	PART *newpart;
+
 	if (!job->parts)
 		job_create_parts(job);
 
-	return mget_vector_get(job->parts, mget_vector_add(job->parts, part, sizeof(PART)));
+	newpart = mget_vector_get(job->parts, mget_vector_add(job->parts, part, sizeof(PART)));
+	memset(&newpart->free_link, 0, sizeof(QUEUE_LINK));
+
+	if (!newpart->inuse && !newpart->done)
+		queue_release_part(job, newpart);
+
+	return newpart;
 }
 
 // check hash for part of a file
@@ -218,20 +523,461 @@ static int check_file_fd(HASH *hash, int fd)
 	return -1;
 }
 
-void job_validate_file(JOB *job)
+// start over with a checksum computed while downloading
+
+static void _stream_reset(STREAM_HASH *stream)
+{
+	hash_free(&stream->ctx);
+	stream->hashed = 0;
+	stream->result = 0;
+}
+
+// feed the downloaded <data> at file offset <position> into the checksum <hash> of the file range
+// [<start>, <start> + <size>). only data that continues the range in order is used,
+// data already seen (e.g. from an endgame twin) or behind a gap is ignored.
+// returns the result of the checksum if the range has just been completed, else 0.
+
+static int _stream_hash(STREAM_HASH *stream, const HASH *hash, off_t start, off_t size, off_t position, const char *data, size_t length)
+{
+	off_t skip, n;
+	int result = 0;
+
+	pthread_mutex_lock(&hash_mutex);
+
+	if (stream->busy || stream->result || stream->hashed < 0
+		|| position > start + stream->hashed || position + (off_t)length <= start + stream->hashed)
+	{
+		pthread_mutex_unlock(&hash_mutex);
+		return 0;
+	}
+
+	if (!stream->ctx && hash_init(&stream->ctx, hash->type)) {
+		stream->hashed = -1; // hash type not available
+		pthread_mutex_unlock(&hash_mutex);
+		return 0;
+	}
+
+	skip = start + stream->hashed - position;
+	if ((n = (off_t)length - skip) > size - stream->hashed)
+		n = size - stream->hashed;
+
+	stream->busy = 1;
+	pthread_mutex_unlock(&hash_mutex);
+
+	// hashing goes in parallel for different ranges
+	hash_update(stream->ctx, data + skip, (size_t)n);
+
+	pthread_mutex_lock(&hash_mutex);
+	stream->busy = 0;
+
+	if (stream->hashed < 0) {
+		// the data could not be written meanwhile, see job_hash_failed()
+		hash_free(&stream->ctx);
+	} else if ((stream->hashed += n) == size) {
+		char sum[128 + 1]; // large enough for sha-512 hex
+
+		if (hash_finish(&stream->ctx, sum, sizeof(sum)) == 0)
+			result = stream->result = strcasecmp(sum, hash->hash_hex) ? -1 : 1;
+		else
+			stream->hashed = -1;
+	}
+
+	pthread_mutex_unlock(&hash_mutex);
+
+	return result;
+}
+
+// a downloader got <length> bytes of data at file offset <position>.
+// the pieces are verified as soon as their last byte came in, the checksum of the
+// complete file as long as the data comes in in order.
+
+void job_hash_data(JOB *job, off_t position, const char *data, size_t length)
+{
+	int it, n = mget_vector_size(job->pieces);
+
+	if (!length)
+		return;
+
+	if (n > 0) {
+		PIECE *piece = mget_vector_get(job->pieces, 0);
+
+		// all pieces but the last have the same length
+		it = piece->length > 0 ? (int)(position / piece->length) : 0;
+		if (it >= n)
+			it = n - 1;
+		while (it > 0 && ((PIECE *)mget_vector_get(job->pieces, it))->position > position)
+			it--;
+
+		for (; it < n; it++) {
+			piece = mget_vector_get(job->pieces, it);
+
+			if (piece->position >= position + (off_t)length)
+				break;
+
+			switch (_stream_hash(&piece->stream, &piece->hash, piece->position, piece->length, position, data, length)) {
+			case 1:
+				debug_printf("Piece %d/%d OK\n", it + 1, n);
+				break;
+			case -1:
+				info_printf(_("Piece %d/%d not OK\n"), it + 1, n);
+				break;
+			}
+		}
+	}
+
+	if (job->stream_type)
+		_stream_hash(&job->stream, job->stream_type, 0, job->size, position, data, length);
+}
+
+// the data at file offset <position> could not be written (completely).
+// the checksums of the ranges it belongs to can't be computed while downloading any more,
+// these ranges are checked with the data in the file when the job is validated.
+
+static void _stream_fail(STREAM_HASH *stream)
+{
+	stream->hashed = -1;
+	stream->result = 0;
+
+	// else freed by the downloader that is feeding data, see _stream_hash()
+	if (!stream->busy)
+		hash_free(&stream->ctx);
+}
+
+void job_hash_failed(JOB *job, off_t position, size_t length)
+{
+	int it;
+
+	pthread_mutex_lock(&hash_mutex);
+
+	for (it = 0; it < mget_vector_size(job->pieces); it++) {
+		PIECE *piece = mget_vector_get(job->pieces, it);
+
+		if (piece->position < position + (off_t)length && position < piece->position + piece->length)
+			_stream_fail(&piece->stream);
+	}
+
+	_stream_fail(&job->stream);
+
+	pthread_mutex_unlock(&hash_mutex);
+}
+
+// returns 1 if the complete file has been verified while it came in
+
+static int _stream_verified(JOB *job)
+{
+	int it, n = mget_vector_size(job->pieces);
+
+	if (job->stream.result)
+		return job->stream.result == 1;
+
+	for (it = 0; it < n; it++) {
+		PIECE *piece = mget_vector_get(job->pieces, it);
+
+		if (piece->stream.result != 1)
+			return 0;
+	}
+
+	return n > 0;
+}
+
+// Metalink download state, kept in <job->name>.mget next to the downloaded file:
+// the verified pieces and the mirror statistics, to resume without checking everything again.
+
+// save the state of <job>, called whenever a part has been completed.
+// the file is replaced atomically, after the data it describes has been written to disk.
+// syncing blocks the caller, so unless <force> is given, the state is only saved if the set
+// of verified pieces changed, at most every STATE_SAVE_INTERVAL ms. what is not saved when
+// mget is interrupted is checked again from the file when the download is resumed.
+
+void job_save_state(JOB *job, int force)
+{
+	FILE *fp;
+	char *pieces;
+	long long now = mget_get_timemillis();
+	int fd, it, n, ret = -1;
+
+	if (!job->name || !job->pieces)
+		return;
+
+	if (!force && now - job->state_saved < STATE_SAVE_INTERVAL)
+		return;
+
+	// one character per piece, 1 = verified
+	n = mget_vector_size(job->pieces);
+	pieces = xmalloc(n + 1);
+	pthread_mutex_lock(&hash_mutex);
+	for (it = 0; it < n; it++) {
+		PIECE *piece = mget_vector_get(job->pieces, it);
+
+		pieces[it] = piece->stream.result == 1 ? '1' : '0';
+	}
+	pthread_mutex_unlock(&hash_mutex);
+	pieces[n] = 0;
+
+	if (!force && job->state_pieces && !strcmp(job->state_pieces, pieces)) {
+		xfree(pieces);
+		return;
+	}
+
+	xfree(job->state_pieces);
+	job->state_pieces = pieces;
+	job->state_saved = now;
+
+	char fname[strlen(job->name) + 16], tmpname[strlen(job->name) + 16];
+
+	// pieces must not be marked verified before their data is safe
+	if ((fd = open(job->name, O_WRONLY)) != -1) {
+		fdatasync(fd);
+		close(fd);
+	}
+
+	snprintf(fname, sizeof(fname), "%s.mget", job->name);
+	snprintf(tmpname, sizeof(tmpname), "%s.mget.tmp", job->name);
+
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || !(fp = fdopen(fd, "w"))) {
+		error_printf(_("Failed to open state file '%s': %s\n"), tmpname, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		xfree(job->state_pieces);
+		return;
+	}
+
+	fputs("# Metalink download state\n", fp);
+	fputs("#Generated by Mget " PACKAGE_VERSION ". Removed when the download is complete.\n\n", fp);
+	fprintf(fp, "size %llu\n", (unsigned long long)job->size);
+
+	fprintf(fp, "pieces %s\n", pieces);
+
+	pthread_mutex_lock(&mirrors_mutex);
+	for (it = 0; it < mget_vector_size(job->mirrors); it++) {
+		MIRROR *mirror = mget_vector_get(job->mirrors, it);
+
+		fprintf(fp, "mirror %lld %lld %lld %d %d %d %s\n",
+			mirror->bytes, mirror->millis, mirror->latency, mirror->requests, mirror->errors, mirror->demoted, mirror->iri->uri);
+	}
+	pthread_mutex_unlock(&mirrors_mutex);
+
+	if (fflush(fp) == 0 && !ferror(fp) && fsync(fd) == 0)
+		ret = 0;
+
+	if (fclose(fp))
+		ret = -1;
+
+	if (ret == 0 && rename(tmpname, fname) == -1)
+		ret = -1;
+
+	if (ret) {
+		error_printf(_("Failed to write state file '%s': %s\n"), fname, strerror(errno));
+		unlink(tmpname);
+		xfree(job->state_pieces); // try again with the next part
+	}
+}
+
+// restore the state saved by job_save_state(), if it belongs to the file.
+// pieces beyond the end of the file are not taken as verified.
+
+static void _load_state(JOB *job)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t bufsize = 0;
+	unsigned long long size;
+	struct stat st;
+	int it, n = mget_vector_size(job->pieces), pos, valid = 0;
+
+	if (!job->name || stat(job->name, &st) == -1)
+		return;
+
+	char fname[strlen(job->name) + 16];
+
+	snprintf(fname, sizeof(fname), "%s.mget", job->name);
+
+	if (!(fp = fopen(fname, "r"))) {
+		if (errno != ENOENT)
+			error_printf(_("Failed to open state file '%s': %s\n"), fname, strerror(errno));
+		return;
+	}
+
+	while (mget_getline(&buf, &bufsize, fp) >= 0) {
+		if (*buf == '#')
+			continue;
+
+		if (sscanf(buf, "size %llu", &size) == 1) {
+			valid = (off_t)size == job->size;
+		} else if (valid && !strncmp(buf, "pieces ", 7) && (int)strlen(buf + 7) == n) {
+			for (it = 0; it < n; it++) {
+				PIECE *piece = mget_vector_get(job->pieces, it);
+
+				off_t end = piece->position + piece->length < job->size ? piece->position + piece->length : job->size;
+
+				if (buf[7 + it] == '1' && end <= st.st_size)
+					piece->stream.result = 1;
+			}
+		} else if (valid && !strncmp(buf, "mirror ", 7)) {
+			MIRROR mirror;
+			int demoted;
+
+			pos = 0;
+			if (sscanf(buf + 7, "%lld %lld %lld %d %d %d %n", &mirror.bytes, &mirror.millis, &mirror.latency,
+				&mirror.requests, &mirror.errors, &demoted, &pos) < 6 || !pos)
+				continue;
+
+			for (it = 0; it < mget_vector_size(job->mirrors); it++) {
+				MIRROR *m = mget_vector_get(job->mirrors, it);
+
+				if (!strcmp(m->iri->uri, buf + 7 + pos)) {
+					m->bytes = mirror.bytes;
+					m->millis = mirror.millis;
+					m->latency = mirror.latency;
+					m->requests = mirror.requests;
+					m->errors = mirror.errors;
+					m->demoted = (char)demoted;
+					break;
+				}
+			}
+		}
+	}
+
+	if (valid)
+		info_printf(_("Loaded download state from '%s'\n"), fname);
+
+	xfree(buf);
+	fclose(fp);
+}
+
+// the file is complete and verified, the state file is not needed any more
+
+static void _file_ok(JOB *job)
+{
+	char fname[strlen(job->name) + 16];
+
+	job->hash_ok = 1;
+
+	snprintf(fname, sizeof(fname), "%s.mget", job->name);
+	if (unlink(fname) == -1 && errno != ENOENT)
+		error_printf(_("Failed to remove state file '%s': %s\n"), fname, strerror(errno));
+}
+
+// the pieces of a file are checked by several threads in parallel
+
+struct validate_context {
+	JOB
+		*job;
+	char
+		*bad; // pieces to download again
+	pthread_mutex_t
+		mutex;
+	int
+		next, // next piece to check
+		checked,
+		id; // downloader
+	CHANNEL
+		*channel; // progress goes here, NULL for none
+};
+
+static void *_validate_pieces_thread(void *p)
+{
+	struct validate_context *ctx = p;
+	JOB *job = ctx->job;
+	int fd, it, n = mget_vector_size(job->pieces);
+
+	// own file descriptor, so that each thread gets its own readahead
+	fd = open(job->name, O_RDONLY);
+
+	for (;;) {
+		PIECE *piece;
+		off_t length;
+
+		pthread_mutex_lock(&ctx->mutex);
+		it = ctx->next++;
+		pthread_mutex_unlock(&ctx->mutex);
+
+		if (it >= n)
+			break;
+
+		piece = mget_vector_get(job->pieces, it);
+		if ((length = job->size - piece->position) > piece->length)
+			length = piece->length;
+
+		// pieces that have been verified while downloading are not read again
+		if (piece->stream.result != 1 && length > 0)
+			ctx->bad[it] = piece->stream.result == -1 || fd == -1 || check_piece_hash(&piece->hash, fd, piece->position, length) != 1;
+
+		pthread_mutex_lock(&ctx->mutex);
+		if (ctx->channel && (ctx->checked + 1) * 10 / n != ctx->checked * 10 / n) {
+			// the downloader might be busy with another job meanwhile
+			MESSAGE msg = { .type = MSG_STATUS, .id = ctx->id, .job = job };
+
+			if (asprintf(&msg.text, "%s: %d/%d pieces checked", job->name, ctx->checked + 1, n) != -1)
+				channel_send(ctx->channel, &msg);
+		}
+		ctx->checked++;
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	return NULL;
+}
+
+// check the pieces of the job's file with one thread per CPU core.
+// bad[n] is set to 1 for each piece n that has to be downloaded again.
+
+static void _validate_pieces(JOB *job, char *bad, CHANNEL *channel, int id)
+{
+	struct validate_context ctx = { .job = job, .bad = bad, .channel = channel, .id = id };
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads, it, rc;
+	pthread_t *tids;
+
+	nthreads = ncpus > 1 ? (int)ncpus : 1;
+	if (nthreads > mget_vector_size(job->pieces))
+		nthreads = mget_vector_size(job->pieces);
+
+	pthread_mutex_init(&ctx.mutex, NULL);
+	tids = xmalloc(nthreads * sizeof(pthread_t));
+
+	// the calling thread is one of the workers
+	for (it = 1; it < nthreads; it++) {
+		if ((rc = pthread_create(&tids[it], NULL, _validate_pieces_thread, &ctx)) != 0) {
+			error_printf(_("Failed to start checksum thread, error %d\n"), rc);
+			break;
+		}
+	}
+	nthreads = it;
+
+	_validate_pieces_thread(&ctx);
+
+	for (it = 1; it < nthreads; it++)
+		pthread_join(tids[it], NULL);
+
+	xfree(tids);
+	pthread_mutex_destroy(&ctx.mutex);
+}
+
+// check which pieces of the file are missing or invalid and add the parts for them to <parts>.
+// what has been verified while downloading is not read again.
+// progress is reported to <channel> as downloader <id> (NULL for none).
+
+static void _validate_file(JOB *job, MGET_VECTOR *parts, CHANNEL *channel, int id)
 {
 	PART part;
 	off_t fsize = job->size;
-	int fd, rc = -1, it;
+	int fd, rc = -1, it, n = mget_vector_size(job->pieces);
 	struct stat st;
+	char *bad;
 
 	memset(&part, 0, sizeof(PART));
 
-	// create space to hold enough parts
-	if (!job->parts)
-		job->parts = mget_vector_create(mget_vector_size(job->pieces), 4, NULL);
-	else
-		mget_vector_clear(job->parts);
+	if (!job->stream_type)
+		job->stream_type = mget_vector_get(job->hashes, 0);
+
+	if (_stream_verified(job)) {
+		info_printf(_("Checksum OK for '%s'\n"), job->name);
+		_file_ok(job);
+		return;
+	}
 
 	// truncate file if needed
 	if (stat(job->name, &st) == 0 && st.st_size > fsize) {
@@ -240,9 +986,29 @@ void job_validate_file(JOB *job)
 				job->name, (unsigned long long)st.st_size, (unsigned long long)fsize);
 	}
 
-	if ((fd = open(job->name, O_RDONLY)) != -1) {
-		// file exists, check which piece is invalid and requeue it
+	if ((fd = open(job->name, O_RDONLY)) == -1) {
+		// nothing downloaded yet
+		for (it = 0; it < n; it++) {
+			PIECE *piece = mget_vector_get(job->pieces, it);
+
+			if (fsize >= piece->length) {
+				part.length = piece->length;
+			} else {
+				part.length = fsize;
+			}
+
+			part.mirror = it;
+			mget_vector_add(parts, &part, sizeof(PART));
 
+			part.position += part.length;
+			fsize -= piece->length;
+		}
+
+		return;
+	}
+
+	if (!n) {
+		// without pieces, only the checksum of the complete file can be checked
 		for (it = 0; errno != EINTR && it < mget_vector_size(job->hashes); it++) {
 			HASH *hash = mget_vector_get(job->hashes, it);
 
@@ -251,61 +1017,87 @@ void job_validate_file(JOB *job)
 
 			if (rc == 1) {
 				info_printf(_("Checksum OK for '%s'\n"), job->name);
-				job->hash_ok = 1;
-				return;
-			}
+				_file_ok(job);
+			} else
+				info_printf(_("Bad checksum for '%s'\n"), job->name);
 
 			break;
 		}
 
 		if (rc == -1) {
 			// failed to check file, assume file is ok
-			job->hash_ok = 1;
+			_file_ok(job);
 			info_printf(_("Failed to build checksum, assuming file to be OK\n"));
-			return;
-		} else
-			info_printf(_("Bad checksum for '%s'\n"), job->name);
+		}
 
-//		if (vec_size(job->pieces) < 1)
-//			return;
+		close(fd);
+		return;
+	}
 
-		for (it = 0; errno != EINTR && it < mget_vector_size(job->pieces); it++) {
-			PIECE *piece = mget_vector_get(job->pieces, it);
-			HASH *hash = &piece->hash;
+	close(fd);
 
-			if (fsize >= piece->length) {
-				part.length = piece->length;
-			} else {
-				part.length = (size_t)fsize;
-			}
+	// file exists, check which piece is invalid and requeue it.
+	// the pieces cover the whole file, there is no need for a pass with the checksum of the file.
+	bad = xcalloc(n, 1);
+	_validate_pieces(job, bad, channel, id);
 
-			if ((rc = check_piece_hash(hash, fd, part.position, part.length)) != 1) {
-				info_printf(_("Piece %d/%d not OK - requeuing\n"), it + 1, mget_vector_size(job->pieces));
-				mget_vector_add(job->parts, &part, sizeof(PART));
-				debug_printf("  need to download %llu bytes from pos=%llu\n",
-					(unsigned long long)part.length, (unsigned long long)part.position);
-			}
+	for (it = 0; it < n; it++) {
+		PIECE *piece = mget_vector_get(job->pieces, it);
 
-			part.position += part.length;
-			fsize -= piece->length;
+		if (fsize >= piece->length) {
+			part.length = piece->length;
+		} else {
+			part.length = (size_t)fsize;
 		}
-		close(fd);
-	} else {
-		for (it = 0; it < mget_vector_size(job->pieces); it++) {
-			PIECE *piece = mget_vector_get(job->pieces, it);
-
-			if (fsize >= piece->length) {
-				part.length = piece->length;
-			} else {
-				part.length = fsize;
-			}
 
-			mget_vector_add(job->parts, &part, sizeof(PART));
-
-			part.position += part.length;
-			fsize -= piece->length;
+		if (!bad[it]) {
+			piece->stream.result = 1; // verified
+		} else {
+			info_printf(_("Piece %d/%d not OK - requeuing\n"), it + 1, n);
+			part.mirror = it;
+			mget_vector_add(parts, &part, sizeof(PART));
+			debug_printf("  need to download %llu bytes from pos=%llu\n",
+				(unsigned long long)part.length, (unsigned long long)part.position);
+
+			// the piece is checked again while it comes in, the complete file can't be any more
+			_stream_reset(&piece->stream);
+			_stream_reset(&job->stream);
+			job->stream.hashed = -1;
 		}
+
+		part.position += part.length;
+		fsize -= piece->length;
 	}
+
+	xfree(bad);
+
+	if (!mget_vector_size(parts)) {
+		info_printf(_("Checksum OK for '%s'\n"), job->name);
+		_file_ok(job);
+	} else
+		job_save_state(job, 1);
+}
+
+// (re-)create the parts of the job for what is missing or invalid in its file.
+// called by a downloader, while the main loop and other downloaders may look at the parts.
+
+void job_validate_file(JOB *job, CHANNEL *channel, int id)
+{
+	MGET_VECTOR *parts = mget_vector_create(mget_vector_size(job->pieces) + 1, 4, NULL), *old;
+
+	// resume from where a previous run stopped
+	if (!job->parts)
+		_load_state(job);
+
+	_validate_file(job, parts, channel, id);
+
+	// the main loop indexes the new parts when we report back, see queue_index_parts()
+	pthread_mutex_lock(&parts_mutex);
+	old = job->parts;
+	job->parts = parts;
+	pthread_mutex_unlock(&parts_mutex);
+
+	mget_vector_free(&old);
 }
 
 /*
@@ -337,6 +1129,108 @@ void job_resume(JOB *job)
 }
  */
 
+// the scheduler keeps the jobs in sets, so that work is handed out without walking the queue.
+// ready: jobs waiting for a downloader and jobs with parts waiting for a downloader.
+// in flight: jobs being downloaded and jobs whose remaining parts are all being downloaded.
+// jobs that are done are removed from the queue by the main loop.
+// only the main thread changes the sets.
+
+static QUEUE_SET
+	ready,
+	inflight;
+static MGET_STRINGMAP
+	*hosts; // "scheme://host:port" -> QUEUE_SET of ready jobs without parts, for pipelining
+
+static void _set_remove(QUEUE_LINK *link)
+{
+	QUEUE_SET *set = link->set;
+
+	if (!set)
+		return;
+
+	if (link->prev)
+		link->prev->next = link->next;
+	else
+		set->first = link->next;
+
+	if (link->next)
+		link->next->prev = link->prev;
+	else
+		set->last = link->prev;
+
+	link->prev = link->next = NULL;
+	link->set = NULL;
+	set->count--;
+}
+
+static void _set_append(QUEUE_SET *set, QUEUE_LINK *link, void *owner)
+{
+	_set_remove(link);
+
+	link->owner = owner;
+	link->set = set;
+	link->next = NULL;
+	if ((link->prev = set->last))
+		set->last->next = link;
+	else
+		set->first = link;
+	set->last = link;
+	set->count++;
+}
+
+static void _set_prepend(QUEUE_SET *set, QUEUE_LINK *link, void *owner)
+{
+	_set_remove(link);
+
+	link->owner = owner;
+	link->set = set;
+	link->prev = NULL;
+	if ((link->next = set->first))
+		set->first->prev = link;
+	else
+		set->last = link;
+	set->first = link;
+	set->count++;
+}
+
+// returns the set of ready jobs for the scheme, host and port of <iri>
+
+static QUEUE_SET *_host_set(const MGET_IRI *iri, int create)
+{
+	const char
+		*scheme = iri->scheme ? iri->scheme : "",
+		*host = iri->host ? iri->host : "",
+		*port = iri->resolv_port ? iri->resolv_port : "";
+	char key[strlen(scheme) + strlen(host) + strlen(port) + 8];
+	QUEUE_SET *set = NULL;
+
+	snprintf(key, sizeof(key), "%s://%s:%s", scheme, host, port);
+
+	if (hosts)
+		set = mget_stringmap_get(hosts, key);
+
+	if (!set && create) {
+		QUEUE_SET empty = { NULL, NULL, 0 };
+
+		if (!hosts)
+			hosts = mget_stringmap_create(128);
+
+		// empty sets are kept, there is one per host
+		mget_stringmap_put(hosts, key, &empty, sizeof(empty));
+		set = mget_stringmap_get(hosts, key);
+	}
+
+	return set;
+}
+
+// <job> is being downloaded or all of its parts are
+
+static void _job_inflight(JOB *job)
+{
+	_set_remove(&job->host_link);
+	_set_append(&inflight, &job->link, job);
+}
+
 JOB *queue_add(MGET_IRI *iri)
 {
 	if (iri) {
@@ -344,9 +1238,14 @@ JOB *queue_add(MGET_IRI *iri)
 
 		memset(&job, 0, sizeof(JOB));
 		job.iri = iri;
+		job.fd = -1;
 
 		jobp = mget_list_append(&queue, &job, sizeof(JOB));
 
+		_set_append(&ready, &jobp->link, jobp);
+		jobp->host = _host_set(iri, 1);
+		_set_append(jobp->host, &jobp->host_link, jobp);
+
 		debug_printf("queue_add %p %s\n", (void *)jobp, iri->uri);
 		return jobp;
 	}
@@ -357,54 +1256,158 @@ JOB *queue_add(MGET_IRI *iri)
 void queue_del(JOB *job)
 {
 	debug_printf("queue_del %p\n", (void *)job);
+	_set_remove(&job->link);
+	_set_remove(&job->host_link);
 	job_free(job);
 	mget_list_remove(&queue, job);
 }
 
-struct find_free_job_context {
-	JOB **job_out;
-	PART **part_out;
-};
+// the parts of <job> have been (re-)created: the ones not done wait for a downloader
 
-// did I say, that I like nested function instead using contexts !?
-// gcc, IBM and Intel support nested functions, just clang refuses it
+void queue_index_parts(JOB *job)
+{
+	int it;
+
+	job->free_parts.first = job->free_parts.last = NULL;
+	job->free_parts.count = 0;
+
+	for (it = 0; it < mget_vector_size(job->parts); it++) {
+		PART *part = mget_vector_get(job->parts, it);
+
+		part->free_link.set = NULL; // the links of new parts are not valid yet
+		if (!part->inuse && !part->done)
+			_set_append(&job->free_parts, &part->free_link, part);
+	}
+
+	_set_remove(&job->host_link);
+
+	if (job->free_parts.count)
+		_set_append(&ready, &job->link, job);
+	else
+		_set_append(&inflight, &job->link, job);
+}
 
-static int find_free_job(struct find_free_job_context *context, JOB *job)
+// a downloader takes <job> or, if not NULL, <part> of it
+
+void queue_take(JOB *job, PART *part)
 {
-	// log_printf("%p %p %p %d\n",part_out,job,job->parts,job->inuse);
-	if (context->part_out && job->parts) {
-		int it;
-		// log_printf("nparts %d\n",vec_size(job->parts));
-
-		for (it = 0; it < mget_vector_size(job->parts); it++) {
-			PART *part = mget_vector_get(job->parts, it);
-			if (!part->inuse) {
-				part->inuse = 1;
-				*context->part_out = part;
-				*context->job_out = job;
-				debug_printf("queue_get part %d/%d %s\n", it + 1, mget_vector_size(job->parts), job->name);
-				return 1;
+	if (part) {
+		part->inuse = 1;
+		_set_remove(&part->free_link);
+
+		if (!job->free_parts.count)
+			_job_inflight(job);
+	} else {
+		job->inuse = 1;
+		_job_inflight(job);
+	}
+}
+
+// a downloader is done with <part> of <job>. if it is not complete, it is downloaded again first.
+
+void queue_release_part(JOB *job, PART *part)
+{
+	part->inuse = 0;
+
+	if (!part->done) {
+		_set_prepend(&job->free_parts, &part->free_link, part);
+		_set_prepend(&ready, &job->link, job);
+	}
+}
+
+// hand out the next job or part waiting for a downloader.
+// jobs for which <full> returns non-zero (e.g. their host has as many downloaders as allowed)
+// stay in the queue. <full> is asked once for a run of jobs of the same host. NULL: take any job.
+
+int queue_get(JOB **job_out, PART **part_out, int (*full)(JOB *job))
+{
+	QUEUE_LINK *link, *next;
+	QUEUE_SET *skip = NULL;
+
+	*job_out = NULL;
+	if (part_out)
+		*part_out = NULL;
+
+	for (link = ready.first; link; link = next) {
+		JOB *job = link->owner;
+
+		next = link->next;
+
+		if (job->parts && !job->free_parts.first) {
+			_job_inflight(job);
+			continue;
+		}
+
+		if (full && (job->host == skip || full(job))) {
+			skip = job->host;
+			continue;
+		}
+
+		if (job->parts) {
+			PART *part = job->free_parts.first->owner;
+
+			queue_take(job, part);
+
+			// completed meanwhile by its endgame twin
+			if (part->done) {
+				part->inuse = 0;
+				next = ready.first;
+				continue;
 			}
+
+			*part_out = part;
+			debug_printf("queue_get part %lld %s\n", (long long)part->position, job->name);
+		} else {
+			queue_take(job, NULL);
+			debug_printf("queue_get job %s\n", job->iri->uri);
 		}
-	} else if (!job->inuse) {
-		job->inuse = 1;
-		*context->job_out = job;
-		debug_printf("queue_get job %s\n", job->iri->uri);
+
+		*job_out = job;
 		return 1;
 	}
+
 	return 0;
 }
 
-int queue_get(JOB **job_out, PART **part_out)
+// nothing left in the queue, let an idle downloader help with a part in flight.
+// jobs for which <full> returns non-zero are left alone, see queue_get().
+
+int queue_get_split(JOB **job_out, PART **part_out, off_t min_length, int (*full)(JOB *job))
 {
-	struct find_free_job_context
-	context = {job_out, part_out};
+	QUEUE_LINK *link;
 
 	*job_out = NULL;
-	if (part_out)
-		*part_out = NULL;
+	*part_out = NULL;
+
+	for (link = inflight.first; link; link = link->next) {
+		JOB *job = link->owner;
+
+		if (job->parts && (!full || !full(job)) && (*part_out = job_split_part(job, min_length))) {
+			*job_out = job;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// get up to <max> free jobs for the same scheme, host and port as <iri>, e.g. for pipelining.
+// returns the number of jobs stored in <jobs_out>.
+
+int queue_get_host(const MGET_IRI *iri, JOB **jobs_out, int max)
+{
+	QUEUE_SET *set = _host_set(iri, 0);
+	int njobs = 0;
+
+	while (set && set->first && njobs < max) {
+		JOB *job = set->first->owner;
+
+		queue_take(job, NULL);
+		jobs_out[njobs++] = job;
+		debug_printf("queue_get pipelined job %s\n", job->iri->uri);
+	}
 
-	return mget_list_browse(queue, (int(*)(void *, void *))find_free_job, &context);
+	return njobs;
 }
 
 int queue_empty(void)
@@ -412,6 +1415,13 @@ int queue_empty(void)
 	return !queue;
 }
 
+// number of jobs waiting for a downloader (jobs with parts count once)
+
+int queue_ready(void)
+{
+	return ready.count;
+}
+
 // did I say, that I like nested function instead using contexts !?
 // gcc, IBM and Intel support nested functions, just clang refuses it
 
@@ -425,4 +1435,99 @@ void queue_free(void)
 {
 	mget_list_browse(queue, (int(*)(void *, void *))queue_free_func, NULL);
 	mget_list_free(&queue);
+	mget_stringmap_free(&hosts);
+	memset(&ready, 0, sizeof(ready));
+	memset(&inflight, 0, sizeof(inflight));
+}
+
+void deque_init(JOB_DEQUE *deque)
+{
+	memset(deque, 0, sizeof(JOB_DEQUE));
+	pthread_mutex_init(&deque->mutex, NULL);
+}
+
+void deque_deinit(JOB_DEQUE *deque)
+{
+	pthread_mutex_destroy(&deque->mutex);
+	xfree(deque->entries);
+	deque->first = deque->count = deque->size = 0;
+}
+
+// done by the main thread for the owner of the deque
+
+void deque_push(JOB_DEQUE *deque, JOB *job, PART *part)
+{
+	struct _DEQUE_ENTRY *entry;
+
+	pthread_mutex_lock(&deque->mutex);
+
+	if (deque->count == deque->size) {
+		// grow the ring, the entries get in order again
+		struct _DEQUE_ENTRY *entries = xmalloc((deque->size ? deque->size * 2 : 16) * sizeof(struct _DEQUE_ENTRY));
+		int it;
+
+		for (it = 0; it < deque->count; it++)
+			entries[it] = deque->entries[(deque->first + it) % deque->size];
+
+		xfree(deque->entries);
+		deque->entries = entries;
+		deque->first = 0;
+		deque->size = deque->size ? deque->size * 2 : 16;
+	}
+
+	entry = &deque->entries[(deque->first + deque->count) % deque->size];
+	entry->job = job;
+	entry->part = part;
+	__atomic_store_n(&deque->count, deque->count + 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+// the owner takes the job it got last, e.g. a link found on the page it just downloaded
+
+int deque_pop(JOB_DEQUE *deque, JOB **job_out, PART **part_out)
+{
+	struct _DEQUE_ENTRY *entry = NULL;
+
+	// a cheap look before locking, empty deques are the rule when there is nothing to do
+	if (!__atomic_load_n(&deque->count, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->count) {
+		entry = &deque->entries[(deque->first + deque->count - 1) % deque->size];
+		*job_out = entry->job;
+		*part_out = entry->part;
+		__atomic_store_n(&deque->count, deque->count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&deque->mutex);
+
+	return entry != NULL;
+}
+
+// another downloader takes the oldest job
+
+int deque_steal(JOB_DEQUE *deque, JOB **job_out, PART **part_out)
+{
+	struct _DEQUE_ENTRY *entry = NULL;
+
+	if (!__atomic_load_n(&deque->count, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->count) {
+		entry = &deque->entries[deque->first];
+		*job_out = entry->job;
+		*part_out = entry->part;
+		deque->first = (deque->first + 1) % deque->size;
+		__atomic_store_n(&deque->count, deque->count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&deque->mutex);
+
+	return entry != NULL;
+}
+
+int deque_size(JOB_DEQUE *deque)
+{
+	return __atomic_load_n(&deque->count, __ATOMIC_RELAXED);
 }
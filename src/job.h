@@ -27,15 +27,26 @@
 #ifndef _MGET_JOB_H
 #define _MGET_JOB_H
 
+#include <pthread.h>
+
 #include <libmget.h>
 
+#include "channel.h"
+
 typedef struct {
 	MGET_IRI
 		*iri;
+	long long
+		bytes, // bytes received from this mirror
+		millis, // time spent on the requests that got them
+		latency; // sum of the times to the response headers
 	int
-		priority;
+		priority,
+		requests, // number of finished requests
+		errors; // number of requests that did not complete their part
 	char
-		location[3];
+		location[3],
+		demoted; // failing mirror, only used if there is nothing else
 } MIRROR;
 
 typedef struct {
@@ -44,25 +55,67 @@ typedef struct {
 		hash_hex[128+1];
 } HASH;
 
-// Metalink piece, for checksumming after download
+// checksum of a range of the file, computed while the data comes in
+typedef struct {
+	struct _HASH_CONTEXT
+		*ctx;
+	off_t
+		hashed; // bytes hashed so far, in order from the start of the range. -1: not possible
+	char
+		busy, // a downloader is feeding data
+		result; // 1 = checksum ok, -1 = checksum failed, 0 = not (completely) seen
+} STREAM_HASH;
+
+// Metalink piece, checksummed while downloading, else after download
 typedef struct {
 	HASH
 		hash;
+	STREAM_HASH
+		stream;
 	off_t
 		position;
 	off_t
 		length;
 } PIECE;
 
+// link of a job or part into one of the scheduler's sets, see job.c
+typedef struct _QUEUE_LINK {
+	struct _QUEUE_LINK
+		*prev,
+		*next;
+	struct _QUEUE_SET
+		*set; // the set it is linked into or NULL
+	void
+		*owner; // the job or part
+} QUEUE_LINK;
+
+// double linked set of jobs or parts, in the order they get their turn
+typedef struct _QUEUE_SET {
+	QUEUE_LINK
+		*first,
+		*last;
+	int
+		count;
+} QUEUE_SET;
+
 // file part to download
-typedef struct {
+typedef struct _PART {
 	off_t
 		position;
 	off_t
-		length;
+		length; // shrinks when the back of the part is split off
+	off_t
+		received; // bytes of the part written (or being written) so far
+	struct _PART
+		*twin; // endgame: the other part downloading the same range
+	QUEUE_LINK
+		free_link; // in the job's set of parts waiting for a downloader
+	int
+		mirror; // index of the mirror to start with
 	char
 		inuse,
-		done;
+		done,
+		endgame; // part races its twin
 } PART;
 
 typedef struct {
@@ -79,32 +132,89 @@ typedef struct {
 	const char
 		*name,
 		*local_filename;
+	char
+		*state_pieces; // verified pieces in the state file, see job_save_state()
+	QUEUE_LINK
+		link, // in the set of ready or in-flight jobs
+		host_link; // in the set of ready jobs for the same scheme, host and port
+	QUEUE_SET
+		free_parts, // parts waiting for a downloader
+		*host; // ready jobs for the same scheme, host and port
+	HASH
+		*stream_type; // checksum of the complete file that is computed in stream
+	STREAM_HASH
+		stream; // while the file comes in in order
 	off_t
 		size; // total size of the file
+	long long
+		state_saved; // time of the last job_save_state() in ms
 	int
-		mirror_pos, // where to look up the next mirror to use
+		fd, // shared by the downloaders writing parts, -1 if not open
+		mirror_pos, // number of mirror selections, see job_mirror_select()
 		piece_pos, // where to look up the next piece to download
 		redirection_level; // number of redirections occurred to create this job
 	char
 		inuse,
-		hash_ok; // checksum of complete file is ok
+		hash_ok, // checksum of complete file is ok
+		failed; // a part could not be downloaded, the file is incomplete
 } JOB;
 
+// jobs (or parts) a downloader has taken from the queue in advance.
+// the owner works from the back, idle downloaders steal from the front.
+typedef struct {
+	pthread_mutex_t
+		mutex;
+	struct _DEQUE_ENTRY {
+		JOB
+			*job;
+		PART
+			*part;
+	}
+		*entries;
+	int
+		first,
+		count,
+		size;
+} JOB_DEQUE;
+
 JOB
 	*queue_add(MGET_IRI *iri);
 PART
 	*job_add_part(JOB *job, PART *part);
 int
 	queue_empty(void) G_GNUC_MGET_PURE,
-	queue_get(JOB **job_out, PART **part_out);
+	queue_ready(void) G_GNUC_MGET_PURE,
+	queue_get(JOB **job_out, PART **part_out, int (*full)(JOB *job)),
+	queue_get_host(const MGET_IRI *iri, JOB **jobs_out, int max),
+	queue_get_split(JOB **job_out, PART **part_out, off_t min_length, int (*full)(JOB *job)),
+	job_parts_done(JOB *job),
+	job_mirror_select(JOB *job, int hint, int avoid),
+	job_part_finished(PART *part, off_t length),
+	deque_pop(JOB_DEQUE *deque, JOB **job_out, PART **part_out),
+	deque_steal(JOB_DEQUE *deque, JOB **job_out, PART **part_out),
+	deque_size(JOB_DEQUE *deque);
+size_t
+	job_part_reserve(PART *part, off_t offset, size_t length);
 void
+	job_part_failed(JOB *job, PART *part),
+	queue_take(JOB *job, PART *part),
+	queue_release_part(JOB *job, PART *part),
+	queue_index_parts(JOB *job),
 	job_create_parts(JOB *job),
+	job_create_segments(JOB *job, int nparts, off_t min_length),
 	job_sort_mirrors(JOB *job),
+	job_mirror_report(JOB *job, int index, off_t bytes, long long millis, long long latency, int ok),
 	job_free(JOB *job),
-	job_validate_file(JOB *job),
+	job_validate_file(JOB *job, CHANNEL *channel, int id),
+	job_hash_data(JOB *job, off_t position, const char *data, size_t length),
+	job_hash_failed(JOB *job, off_t position, size_t length),
+	job_save_state(JOB *job, int force),
 //	job_resume(JOB *job),
 	queue_del(JOB *job),
-	queue_free(void);
+	queue_free(void),
+	deque_init(JOB_DEQUE *deque),
+	deque_push(JOB_DEQUE *deque, JOB *job, PART *part),
+	deque_deinit(JOB_DEQUE *deque);
 
 
 #endif /* _MGET_JOB_H */
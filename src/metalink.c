@@ -38,8 +38,10 @@
 #include "metalink.h"
 
 struct metalink_context {
+	CHANNEL
+		*channel;
 	int
-		sockfd,
+		id,
 		priority;
 	char
 		hash[128],
@@ -49,6 +51,14 @@ struct metalink_context {
 		length;
 };
 
+static void _send_hash(struct metalink_context *ctx, int type, long long length)
+{
+	MESSAGE msg = { .type = type, .id = ctx->id, .number = length, .text = strdup(ctx->hash) };
+
+	strcpy(msg.tag, ctx->hash_type);
+	channel_send(ctx->channel, &msg);
+}
+
 static void _metalink4_parse(void *context, int flags, const char *dir, const char *attr, const char *value)
 {
 	struct metalink_context *ctx = context;
@@ -61,7 +71,9 @@ static void _metalink4_parse(void *context, int flags, const char *dir, const ch
 	if (attr) {
 		if (dir[14] == 0) { // /metalink/file
 			if (!strcasecmp(attr, "name")) {
-				dprintf(ctx->sockfd, "chunk name %s\n", value);
+				MESSAGE msg = { .type = MSG_METALINK_NAME, .id = ctx->id, .text = strdup(value) };
+
+				channel_send(ctx->channel, &msg);
 			}
 		} else if (!strcasecmp(dir + 14, "/pieces")) {
 			if (!strcasecmp(attr, "type")) {
@@ -86,28 +98,36 @@ static void _metalink4_parse(void *context, int flags, const char *dir, const ch
 		if (!strcasecmp(dir + 14, "/pieces/hash")) {
 			sscanf(value, "%127s", ctx->hash);
 			if (ctx->length && *ctx->hash_type && *ctx->hash)
-				dprintf(ctx->sockfd, "chunk piece %lld %s %s\n", ctx->length, ctx->hash_type, ctx->hash);
+				_send_hash(ctx, MSG_METALINK_PIECE, ctx->length);
 			*ctx->hash = 0;
 		} else if (!strcasecmp(dir + 14, "/hash")) {
 			sscanf(value, "%127s", ctx->hash);
 			if (*ctx->hash_type && *ctx->hash)
-				dprintf(ctx->sockfd, "chunk hash %s %s\n", ctx->hash_type, ctx->hash);
+				_send_hash(ctx, MSG_METALINK_HASH, 0);
 			*ctx->hash_type = *ctx->hash = 0;
 		} else if (!strcasecmp(dir + 14, "/size")) {
-			dprintf(ctx->sockfd, "chunk size %lld\n", atoll(value));
+			MESSAGE msg = { .type = MSG_METALINK_SIZE, .id = ctx->id, .number = atoll(value) };
+
+			channel_send(ctx->channel, &msg);
 		} else if (!strcasecmp(dir + 14, "/url")) {
-			dprintf(ctx->sockfd, "chunk mirror %s %u %s\n", ctx->location, ctx->priority, value);
+			MESSAGE msg = { .type = MSG_METALINK_MIRROR, .id = ctx->id, .number = ctx->priority };
+
+			if ((msg.iri = mget_iri_parse(value, NULL))) {
+				strcpy(msg.tag, ctx->location);
+				channel_send(ctx->channel, &msg);
+			}
 			strcpy(ctx->location, "-");
 			ctx->priority = 999999;
 		}
 	}
 }
 
-void metalink4_parse(int sockfd, MGET_HTTP_RESPONSE *resp)
+void metalink4_parse(CHANNEL *channel, int id, MGET_HTTP_RESPONSE *resp)
 {
 	struct metalink_context ctx;
 
-	ctx.sockfd = sockfd;
+	ctx.channel = channel;
+	ctx.id = id;
 	ctx.priority = 999999;
 	*ctx.hash = 0,
 		*ctx.hash_type = 0,
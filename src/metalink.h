@@ -39,7 +39,9 @@
 
 #include <libmget.h>
 
+#include "channel.h"
+
 void
-	metalink4_parse(int sockfd, MGET_HTTP_RESPONSE *resp) G_GNUC_MGET_NONNULL((2));
+	metalink4_parse(CHANNEL *channel, int id, MGET_HTTP_RESPONSE *resp) G_GNUC_MGET_NONNULL((1,3));
 
 #endif /* _MGET_METALINK_H */
@@ -40,9 +40,11 @@
 #include <errno.h>
 #include <ctype.h>
 #include <time.h>
-#include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include <libmget.h>
 
@@ -52,24 +54,48 @@
 #include "printf.h"
 #include "options.h"
 #include "metalink.h"
+#include "channel.h"
 #include "blacklist.h"
 
+// with --segments, files are only split into parts of at least this size.
+// idle downloaders split parts in flight down to this size, below that they race for the rest.
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+
+// busy downloaders get at most this many jobs in advance (found links first), the rest waits in the queue.
+// they take the next job themselves, idle downloaders steal from them.
+#define DEQUE_MAX 64
+// the main thread tops up the deque of a busy downloader to this many jobs from the queue
+#define DEQUE_REFILL 2
+
+// a part that could not be downloaded is requested again after this many ms, twice as long with each try
+#define RETRY_BACKOFF 500
+
 typedef struct {
 	pthread_t
 		tid;
 	JOB
-		*job;
+		*job,
+		*main_job, // the job as far as the main thread knows, NULL: waiting for 'go' (see MSG_READY)
+		**pipeline; // jobs for the same host, to be requested together with job (--http-pipelining)
 	PART
-		*part;
+		*part,
+		*main_part;
+	JOB_DEQUE
+		deque; // jobs taken in advance, see take_job()
+	int
+		*load; // downloaders on the host of main_job, see host_load()
 	MGET_HTTP_CONNECTION
 		*conn;
-	char
-		*buf;
-	size_t
-		bufsize;
+	CHANNEL
+		*channel; // commands from the main thread
+	long long
+		started, // ms, start of the current part request
+		latency; // ms until the response header of the current part request came in
 	int
-		sockfd[2],
-		id;
+		id,
+		npipeline,
+		victim, // the downloader to steal from first
+		mirror; // index of the mirror the current part request went to
 } DOWNLOADER;
 
 //static HTTP_RESPONSE
@@ -78,17 +104,29 @@ static void
 	download_part(DOWNLOADER *downloader),
 	save_file(MGET_HTTP_RESPONSE *resp, const char *fname),
 	append_file(MGET_HTTP_RESPONSE *resp, const char *fname),
-	html_parse(int sockfd, const char *data, const char *encoding, MGET_IRI *iri),
-	html_parse_localfile(int sockfd, const char *fname, const char *encoding, MGET_IRI *iri),
-	css_parse(int sockfd, const char *data, const char *encoding, MGET_IRI *iri),
-	css_parse_localfile(int sockfd, const char *fname, const char *encoding, MGET_IRI *iri);
+	html_parse(DOWNLOADER *downloader, const char *data, const char *encoding, MGET_IRI *iri),
+	html_parse_localfile(DOWNLOADER *downloader, const char *fname, const char *encoding, MGET_IRI *iri),
+	css_parse(DOWNLOADER *downloader, const char *data, const char *encoding, MGET_IRI *iri),
+	css_parse_localfile(DOWNLOADER *downloader, const char *fname, const char *encoding, MGET_IRI *iri);
 MGET_HTTP_RESPONSE
 	*http_get(MGET_IRI *iri, PART *part, DOWNLOADER *downloader);
 
 static DOWNLOADER
 	*downloader;
+static CHANNEL
+	*main_channel; // messages from the downloaders
+static int
+	nidle; // downloaders waiting for 'go'
+static MGET_STRINGMAP
+	*host_loads; // "scheme://host:port" -> number of downloaders working there
+static unsigned long long
+	nrequests; // HTTP requests sent, to relate the connections opened to
+static int
+	nready; // jobs waiting in the queue, published by the main thread for take_job()
 static void
-	*downloader_thread(void *p);
+	*downloader_thread(void *p),
+	epoll_engine_start(void),
+	epoll_engine_stop(void);
 long long
 	quota;
 static int
@@ -202,25 +240,244 @@ static const char * G_GNUC_MGET_NONNULL_ALL get_local_filename(MGET_IRI *iri)
 	return fname;
 }
 
+// hosts that broke a pipelined connection (closed it early or misbehaved),
+// they get one request at a time.
+static MGET_STRINGMAP
+	*pipelining_refused;
+static pthread_mutex_t
+	pipelining_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int pipelining_allowed(const MGET_IRI *iri)
+{
+	int allowed;
+
+	pthread_mutex_lock(&pipelining_mutex);
+	allowed = !pipelining_refused || !mget_stringmap_get(pipelining_refused, iri->host);
+	pthread_mutex_unlock(&pipelining_mutex);
+
+	return allowed;
+}
+
+static void pipelining_refuse(const MGET_IRI *iri)
+{
+	pthread_mutex_lock(&pipelining_mutex);
+	if (!pipelining_refused)
+		pipelining_refused = mget_stringmap_create(16);
+	if (!mget_stringmap_get(pipelining_refused, iri->host)) {
+		info_printf(_("Pipelining disabled for %s\n"), iri->host);
+		mget_stringmap_put_ident(pipelining_refused, iri->host);
+	}
+	pthread_mutex_unlock(&pipelining_mutex);
+}
+
+// reserve more jobs for the downloader's host, their requests go out on the same connection
+
+static void reserve_pipeline(DOWNLOADER *downloader)
+{
+	if (downloader->pipeline && !downloader->part && pipelining_allowed(downloader->job->iri))
+		downloader->npipeline = queue_get_host(downloader->job->iri, downloader->pipeline, config.http_pipelining - 1);
+}
+
+// the number of downloaders working on the host of <job> (main thread).
+// jobs for a host are kept on the downloaders that are there already, they reuse their connections.
+// Metalink jobs download from their mirrors and are not counted (NULL).
+
+static int *host_load(JOB *job)
+{
+	const char
+		*scheme = job->iri->scheme ? job->iri->scheme : "",
+		*host = job->iri->host ? job->iri->host : "",
+		*port = job->iri->resolv_port ? job->iri->resolv_port : "";
+	char key[strlen(scheme) + strlen(host) + strlen(port) + 8];
+	int *load;
+
+	if (job->mirrors)
+		return NULL;
+
+	snprintf(key, sizeof(key), "%s://%s:%s", scheme, host, port);
+
+	if (!host_loads)
+		host_loads = mget_stringmap_create(128);
+
+	if (!(load = mget_stringmap_get(host_loads, key))) {
+		int none = 0;
+
+		// kept when it drops to 0, there is one per host
+		mget_stringmap_put(host_loads, key, &none, sizeof(none));
+		load = mget_stringmap_get(host_loads, key);
+	}
+
+	return load;
+}
+
+// with --max-host-connections, a job for a host that has as many downloaders as allowed
+// waits for one of them (main thread)
+
+static int host_full(JOB *job)
+{
+	int *load = host_load(job);
+
+	return load && *load >= config.max_host_connections;
+}
+
+// the main thread learned what the downloader works on, NULL: it waits for 'go'
+
+static void set_main_job(DOWNLOADER *d, JOB *job, PART *part)
+{
+	if (d->load)
+		(*d->load)--;
+
+	if (!d->main_job && job)
+		nidle--;
+	else if (d->main_job && !job)
+		nidle++;
+
+	d->main_job = job;
+	d->main_part = part;
+
+	if ((d->load = job ? host_load(job) : NULL))
+		(*d->load)++;
+}
+
+// take the next of the jobs reserved for the downloader's host
+
+static int get_pipelined_job(DOWNLOADER *downloader)
+{
+	if (!downloader->npipeline)
+		return 0;
+
+	downloader->job = downloader->pipeline[0];
+	downloader->part = NULL;
+	memmove(downloader->pipeline, downloader->pipeline + 1, --downloader->npipeline * sizeof(JOB *));
+	return 1;
+}
+
+// take the oldest job from another downloader's deque, starting with the last one that had some.
+// the jobs in a deque are for the host of its owner. with <capped>, hosts that have as many
+// downloaders as --max-host-connections allows are left alone (main thread only).
+
+static int steal_job(DOWNLOADER *thief, int capped)
+{
+	int it, n;
+
+	for (it = 0; it < config.num_threads; it++) {
+		n = (thief->victim + it) % config.num_threads;
+
+		if (capped && downloader[n].load && *downloader[n].load >= config.max_host_connections)
+			continue;
+
+		if (n != thief->id && deque_steal(&downloader[n].deque, &thief->job, &thief->part)) {
+			thief->victim = n;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// get the next job for an idle downloader (main thread), reserved (pipelined) jobs come first.
+// these and the jobs in its deque are for the host it just left, it does not add to the load there.
+
+static int get_job(DOWNLOADER *downloader)
+{
+	int (*full)(JOB *job) = config.max_host_connections ? host_full : NULL;
+
+	if (get_pipelined_job(downloader))
+		return 1;
+
+	// pushed after the downloader looked into its deque the last time
+	if (deque_pop(&downloader->deque, &downloader->job, &downloader->part))
+		return 1;
+
+	if (!queue_get(&downloader->job, &downloader->part, full)) {
+		// nothing queued any more, take over what busy downloaders got in advance
+		if (steal_job(downloader, full != NULL))
+			return 1;
+
+		// help with the largest part in flight
+		return queue_get_split(&downloader->job, &downloader->part, MIN_SEGMENT_SIZE, full);
+	}
+
+	reserve_pipeline(downloader);
+	return 1;
+}
+
+// the downloader continues with the next job itself, without a round trip through the main thread:
+// reserved (pipelined) jobs first, then the newest job of its deque, then the oldest of another deque.
+
+static int take_job(DOWNLOADER *downloader)
+{
+	if (config.quota && quota >= config.quota)
+		return 0;
+
+	if (get_pipelined_job(downloader))
+		return 1;
+
+	if (deque_pop(&downloader->deque, &downloader->job, &downloader->part))
+		return 1;
+
+	// a stolen job is for the host of the victim, where a connection is in use already.
+	// queued jobs go first, the main thread hands them out (see get_job()).
+	// it also keeps track of the downloaders per host for --max-host-connections.
+	if (__atomic_load_n(&nready, __ATOMIC_RELAXED) || config.max_host_connections)
+		return 0;
+
+	return steal_job(downloader, 0);
+}
+
+// the current job is done: tell the main thread and go on with the next one, if there is any.
+// returns 0 if the downloader has to wait for 'go'.
+
+static int job_done(DOWNLOADER *downloader)
+{
+	MESSAGE msg = { .type = MSG_READY, .id = downloader->id };
+
+	if (take_job(downloader)) {
+		msg.job = downloader->job;
+		msg.part = downloader->part;
+	} else {
+		// other downloaders might need the connection, unless pipelined responses are outstanding
+		if (downloader->conn && !downloader->conn->pending)
+			http_pool_checkin(&downloader->conn);
+
+		downloader->job = NULL;
+		downloader->part = NULL;
+	}
+
+	channel_send(main_channel, &msg);
+
+	return msg.job != NULL;
+}
+
+// let an idle downloader work on downloader->job / downloader->part (main thread)
+
+static void start_downloader(DOWNLOADER *d)
+{
+	set_main_job(d, d->job, d->part);
+	channel_send_type(d->channel, d->id, MSG_GO);
+}
+
 static int schedule_download(JOB *job, PART *part)
 {
 	if (config.quota && quota >= config.quota)
 		return 0;
 
-	if (job) {
+	// with --max-host-connections, more downloaders would just wait for a connection
+	if (job && config.max_host_connections && host_full(job))
+		return 0;
+
+	if (job && nidle) {
 		static int offset;
 		int n;
 
 		for (n = 0; n < config.num_threads; n++) {
-			if (downloader[offset].job == NULL) {
+			if (!downloader[offset].main_job) {
 				downloader[offset].job = job;
 				downloader[offset].part = part;
-				if (part)
-					part->inuse = 1;
-				else
-					job->inuse = 1;
+				queue_take(job, part);
 
-				dprintf(downloader[offset].sockfd[0], "go\n");
+				reserve_pipeline(&downloader[offset]);
+				start_downloader(&downloader[offset]);
 				return 1;
 			}
 
@@ -232,6 +489,133 @@ static int schedule_download(JOB *job, PART *part)
 	return 0;
 }
 
+// give a job to a busy downloader on the same host in advance (main thread), see take_job().
+// it reuses its connection. if there is none, the job waits in the queue for the next free downloader.
+
+static int push_job(JOB *job)
+{
+	DOWNLOADER *d = NULL;
+	int *load = host_load(job), n, size, min_size = DEQUE_MAX;
+
+	if ((config.quota && quota >= config.quota) || !load || !*load)
+		return 0;
+
+	for (n = 0; n < config.num_threads; n++) {
+		if (downloader[n].load == load && (size = deque_size(&downloader[n].deque)) < min_size) {
+			d = &downloader[n];
+			min_size = size;
+		}
+	}
+
+	if (!d)
+		return 0;
+
+	queue_take(job, NULL);
+	deque_push(&d->deque, job, NULL);
+	return 1;
+}
+
+// keep a busy downloader from running dry, so that it doesn't have to wait for the main thread.
+// only jobs for the host it is connected to, the others are handed out by get_job().
+
+static void refill_deque(DOWNLOADER *d)
+{
+	JOB *job;
+
+	if (!d->load || (config.quota && quota >= config.quota))
+		return;
+
+	while (deque_size(&d->deque) < DEQUE_REFILL && queue_get_host(d->main_job->iri, &job, 1))
+		deque_push(&d->deque, job, NULL);
+}
+
+// a Metalink file has to be checked. <d> reported the job, but might be busy with the next one.
+
+static void check_job(DOWNLOADER *d, JOB *job)
+{
+	MESSAGE msg = { .type = MSG_CHECK, .job = job };
+	int n;
+
+	for (n = 0; d->main_job && nidle && n < config.num_threads; n++) {
+		if (!downloader[n].main_job)
+			d = &downloader[n];
+	}
+
+	msg.id = d->id;
+	channel_send(d->channel, &msg);
+}
+
+// downloader <d> is done with <job> / <part> or has checked <job> (main thread)
+
+static void job_finished(DOWNLOADER *d, JOB *job, PART *part)
+{
+	// log_printf("got job %p %d\n",job->pieces,job->hash_ok);
+	if ((!job->pieces && !job->parts) || job->hash_ok) {
+		// download of single-part file complete, remove from job queue
+		// log_printf("- '%s' completed\n",downloader[n].job->uri);
+		queue_del(job);
+	} else if (part) {
+		// if not done, something was wrong and the part gets loaded again
+		queue_release_part(job, part);
+		if (part->done) {
+			// remember the verified pieces, in case we are interrupted
+			job_save_state(job, 0);
+
+			// check if all parts are done (downloaded + hash-checked)
+			if (job_parts_done(job)) {
+				if (job->failed) {
+					// the state file stays for a later try.
+					// segmented downloads are removed when the size probe is done.
+					error_printf(_("Failed to download '%s'\n"), job->name);
+					job_save_state(job, 1);
+					if (job->mirrors || !job->inuse)
+						queue_del(job);
+				} else if (mget_vector_size(job->hashes) > 0) {
+					// check integrity of complete file
+					check_job(d, job);
+				} else if (!job->inuse) {
+					// segmented download complete, unless the size probe is still running
+					queue_del(job);
+				}
+			}
+		}
+	} else if (job->parts && !job->mirrors) {
+		// the size probe of a segmented download (no mirrors) is done, the parts are scheduled already
+		job->inuse = 0;
+		if (job_parts_done(job))
+			queue_del(job);
+	} else if (job->size <= 0) {
+		debug_printf("File length %llu - remove job\n", (unsigned long long)job->size);
+		queue_del(job);
+	} else if (!job->mirrors) {
+		debug_printf("File length %llu - remove job\n", (unsigned long long)job->size);
+		queue_del(job);
+	} else if (!job->parts) {
+		// just loaded a metalink file.
+		// an existing file is checked by a downloader, that reports back with 'checked'.
+		// after the check, the parts to download (again) are known.
+		check_job(d, job);
+	} else {
+		// start or resume downloading
+		queue_index_parts(job);
+
+		if (!mget_vector_size(job->parts)) {
+			// all pieces are ok, but the checksum of the file is not
+			error_printf(_("Failed to verify '%s'\n"), job->name);
+			queue_del(job);
+		} else {
+			int it;
+
+			// sort mirrors by priority to download from highest priority first
+			job_sort_mirrors(job);
+
+			for (it = 0; it < mget_vector_size(job->parts); it++)
+				if (schedule_download(job, mget_vector_get(job->parts, it)) == 0)
+					break; // now all downloaders have a job
+		}
+	}
+}
+
 // Since quota may change at any time in a threaded environment,
 // we have to modify and check the quota in one (protected) step.
 static long long quota_modify_read(size_t nbytes)
@@ -248,6 +632,24 @@ static long long quota_modify_read(size_t nbytes)
 	return old_quota;
 }
 
+// queue <iri> unless it is known already (main thread).
+// used for URLs from the command line, from input files, for links found in documents and for redirects.
+
+static JOB *add_iri_to_queue(MGET_IRI *iri)
+{
+	JOB *job = queue_add(blacklist_add(iri));
+
+	if (job) {
+		if (!config.output_document)
+			job->local_filename = get_local_filename(job->iri);
+
+		// no downloader has to wait for the DNS lookup when the job gets its turn
+		http_prefetch(job->iri);
+	}
+
+	return job;
+}
+
 static JOB *add_url_to_queue(const char *url, MGET_IRI *base, const char *encoding)
 {
 	MGET_IRI *iri;
@@ -270,12 +672,7 @@ static JOB *add_url_to_queue(const char *url, MGET_IRI *base, const char *encodi
 		return NULL;
 	}
 
-	job = queue_add(blacklist_add(iri));
-
-	if (job) {
-		if (!config.output_document)
-			job->local_filename = get_local_filename(job->iri);
-
+	if ((job = add_iri_to_queue(iri))) {
 		if (config.recursive && !config.span_hosts) {
 			// only download content from hosts given on the command line or from input file
 			if (!mget_stringmap_get(config.exclude_domains, job->iri->host))
@@ -297,11 +694,11 @@ static void nop(int sig)
 
 int main(int argc, const char *const *argv)
 {
-	int n, rc, maxfd, nfds, inputfd = -1;
+	int n, rc, inputfd = -1;
 	size_t bufsize = 0;
 	char *buf = NULL;
 	pthread_attr_t attr;
-	fd_set rset;
+	struct pollfd pollfds[2];
 	struct sigaction sig_action;
 
 #if ENABLE_NLS != 0
@@ -428,11 +825,11 @@ int main(int argc, const char *const *argv)
 	if (config.input_file) {
 		if (config.force_html) {
 			// read URLs from HTML file
-			html_parse_localfile(-1, config.input_file, config.remote_encoding, config.base);
+			html_parse_localfile(NULL, config.input_file, config.remote_encoding, config.base);
 		}
 		else if (config.force_css) {
 			// read URLs from CSS file
-			css_parse_localfile(-1, config.input_file, config.remote_encoding, config.base);
+			css_parse_localfile(NULL, config.input_file, config.remote_encoding, config.base);
 		}
 		else if (strcmp(config.input_file, "-")) {
 			int fd;
@@ -461,260 +858,253 @@ int main(int argc, const char *const *argv)
 
 	downloader = xcalloc(config.num_threads, sizeof(DOWNLOADER));
 
+	// room for the links of some pages, senders wait while it is full
+	main_channel = channel_create(4096);
+
 	for (n = 0; n < config.num_threads; n++) {
 		downloader[n].id = n;
 
-		// create two-way communication path
-		socketpair(AF_UNIX, SOCK_STREAM, 0, downloader[n].sockfd);
+		// the main thread sends one command at a time ('go' or 'check')
+		downloader[n].channel = channel_create(4);
+		deque_init(&downloader[n].deque);
+		downloader[n].victim = n + 1;
 
-		// reading & writing to pipe must not block
-		fcntl(downloader[n].sockfd[0], F_SETFL, O_NDELAY);
-		fcntl(downloader[n].sockfd[1], F_SETFL, O_NDELAY);
+		if (config.engine == ENGINE_THREADS) {
+			// init thread attributes
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+			// pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
 
-		// init thread attributes
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		// pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
-		pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+			if ((rc = pthread_create(&downloader[n].tid, &attr, downloader_thread, &downloader[n])) != 0) {
+				error_printf(_("Failed to start downloader, error %d\n"), rc);
+			}
 
-		if ((rc = pthread_create(&downloader[n].tid, &attr, downloader_thread, &downloader[n])) != 0) {
-			error_printf(_("Failed to start downloader, error %d\n"), rc);
-			close(downloader[n].sockfd[0]);
-			close(downloader[n].sockfd[1]);
+			pthread_attr_destroy(&attr);
 		}
 
-		pthread_attr_destroy(&attr);
+		// pipelining is done by http_get(), the epoll engine sends one request at a time
+		if (config.http_pipelining > 1 && config.engine == ENGINE_THREADS)
+			downloader[n].pipeline = xmalloc((config.http_pipelining - 1) * sizeof(JOB *));
 
-		if (queue_get(&downloader[n].job, NULL)) {
-			dprintf(downloader[n].sockfd[0], "go\n");
-		}
 	}
 
-	while (!queue_empty() || inputfd != -1) {
+	nidle = config.num_threads;
+
+	// with the epoll engine, the commands wait in the channels until the workers are started
+	for (n = 0; n < config.num_threads; n++) {
+		if (get_job(&downloader[n]))
+			start_downloader(&downloader[n]);
+	}
+
+	if (config.engine == ENGINE_EPOLL)
+		epoll_engine_start();
+
+	while (!terminate && (!queue_empty() || inputfd != -1)) {
+		MESSAGE msg;
+		int idle;
+
 		if (config.quota && quota >= config.quota) {
 			info_printf(_("Quota of %llu bytes reached - stopping.\n"), config.quota);
 			break;
 		}
 
-		FD_ZERO(&rset);
-		for (maxfd = n = 0; n < config.num_threads; n++) {
-			FD_SET(downloader[n].sockfd[0], &rset);
-			if (downloader[n].sockfd[0] > maxfd)
-				maxfd = downloader[n].sockfd[0];
-		}
-		if (inputfd != -1) {
-			FD_SET(inputfd, &rset);
-			if (inputfd > maxfd)
-				maxfd = inputfd;
-		}
+		// sleep only if no message is pending, but don't let the messages starve the input
+		if ((idle = channel_idle(main_channel)) || inputfd != -1) {
+			pollfds[0].fd = channel_get_fd(main_channel);
+			pollfds[0].events = POLLIN;
+			pollfds[1].fd = inputfd; // poll() ignores -1
+			pollfds[1].events = POLLIN;
 
-		// later, set timeout here
-		if ((nfds = select(maxfd + 1, &rset, NULL, NULL, NULL)) <= 0) {
-			// timeout or error
-			if (nfds == -1) {
+			// later, set timeout here
+			if (poll(pollfds, 2, idle ? -1 : 0) == -1) {
 				if (errno == EINTR) break;
-				error_printf(_("Failed to select, error %d\n"), errno);
+				error_printf(_("Failed to poll, error %d\n"), errno);
+				continue;
+			}
+
+			if (inputfd != -1 && pollfds[1].revents) {
+				ssize_t len;
+
+				while ((len = mget_fdgetline(&buf, &bufsize, inputfd)) > 0) {
+					JOB *job = add_url_to_queue(buf, config.base, config.local_encoding);
+					schedule_download(job, NULL);
+				}
+
+				// input closed, don't read from it any more
+				if (len == -1)
+					inputfd = -1;
 			}
-			continue;
 		}
 
-		if (inputfd != -1 && FD_ISSET(inputfd, &rset)) {
-			ssize_t len;
+		while (!terminate && channel_receive(main_channel, &msg)) {
+			JOB *job = downloader[msg.id].main_job;
+			PART *part = downloader[msg.id].main_part;
 
-			while ((len = mget_fdgetline(&buf, &bufsize, inputfd)) > 0) {
-				JOB *job = add_url_to_queue(buf, config.base, config.local_encoding);
-				schedule_download(job, NULL);
+			n = msg.id;
+			debug_printf("- [%d] message %d\n", n, msg.type);
+
+			switch (msg.type) {
+			case MSG_STATUS:
+				if (msg.job)
+					job = msg.job;
+				if (job && job->iri->uri)
+					info_printf("status '%s' for %s\n", msg.text, job->iri->uri);
+				else
+					info_printf("status '%s'\n", msg.text);
+				break;
+
+			case MSG_READY:
+				// the message tells which job the downloader took next, if any
+				set_main_job(&downloader[n], msg.job, msg.part);
+
+				if (job)
+					job_finished(&downloader[n], job, part);
+
+				if (!downloader[n].main_job) {
+					if ((!config.quota || quota < config.quota) && get_job(&downloader[n]))
+						start_downloader(&downloader[n]);
+				} else
+					refill_deque(&downloader[n]);
+				break;
+
+			case MSG_CHECKED:
+				job_finished(&downloader[n], msg.job, NULL);
+				break;
+
+			case MSG_METALINK_MIRROR:
+			{
+				MIRROR mirror;
+
+				if (!job->mirrors)
+					job->mirrors = mget_vector_create(4, 4, NULL);
+
+				memset(&mirror, 0, sizeof(MIRROR));
+				strlcpy(mirror.location, msg.tag, sizeof(mirror.location));
+				mirror.priority = (int)msg.number;
+				mirror.iri = msg.iri;
+				msg.iri = NULL;
+				mget_vector_add(job->mirrors, &mirror, sizeof(MIRROR));
+				break;
 			}
 
-			// input closed, don't read from it any more
-			if (len == -1)
-				inputfd = -1;
+			case MSG_METALINK_HASH:
+			{
+				// hashes for the complete file
+				HASH hash;
 
-			nfds--;
-		}
+				if (!job->hashes)
+					job->hashes = mget_vector_create(4, 4, NULL);
 
-		for (n = 0; n < config.num_threads && nfds > 0 && !terminate; n++) {
-			if (FD_ISSET(downloader[n].sockfd[0], &rset)) {
-				while (!terminate && mget_fdgetline(&downloader[n].buf, &downloader[n].bufsize, downloader[n].sockfd[0]) > 0) {
-					JOB *job = downloader[n].job;
-					PART *part = downloader[n].part;
-					char *buf = downloader[n].buf;
-					int pos;
-
-					debug_printf("- [%d] %s\n", n, buf);
-
-					if (!strncmp(buf, "sts ", 4)) {
-						if (job && job->iri->uri)
-							info_printf("status '%s' for %s\n", buf + 4, job->iri->uri);
-						else
-							info_printf("status '%s'\n", buf + 4);
-					} else if (!strcmp(buf, "ready")) {
-						if (job) {
-							downloader[n].part = NULL;
-							// log_printf("got job %p %d\n",job->pieces,job->hash_ok);
-							if (!job->pieces || job->hash_ok) {
-								// download of single-part file complete, remove from job queue
-								// log_printf("- '%s' completed\n",downloader[n].job->uri);
-								queue_del(job);
-							} else if (part) {
-								if (part->done) {
-									// check if all parts are done (downloaded + hash-checked)
-									int all_done = 1, it;
-									for (it = 0; it < mget_vector_size(job->parts); it++) {
-										PART *part = mget_vector_get(job->parts, it);
-										if (!part->done) {
-											all_done = 0;
-											break;
-										}
-									}
-									// log_printf("all_done=%d\n",all_done);
-									if (all_done && mget_vector_size(job->hashes) > 0) {
-										// check integrity of complete file
-										dprintf(downloader[n].sockfd[0], "check\n");
-										continue;
-									}
-								} else part->inuse = 0; // something was wrong, reload again
-							} else if (job->size <= 0) {
-								debug_printf("File length %llu - remove job\n", (unsigned long long)job->size);
-								queue_del(job);
-							} else if (!job->mirrors) {
-								debug_printf("File length %llu - remove job\n", (unsigned long long)job->size);
-								queue_del(job);
-							} else {
-								// log_printf("just loaded metalink file\n");
-								// just loaded a metalink file, create parts and sort mirrors
-								// job_create_parts(job);
-
-								// start or resume downloading
-								job_validate_file(job);
-
-								if (job->hash_ok) {
-									// file ok or download of non-chunked file complete, remove from job queue
-									// log_printf("- '%s' completed\n",downloader[n].job->uri);
-									queue_del(job);
-								} else {
-									int it;
-
-									// sort mirrors by priority to download from highest priority first
-									job_sort_mirrors(job);
-
-									for (it = 0; it < mget_vector_size(job->parts); it++)
-										if (schedule_download(job, mget_vector_get(job->parts, it)) == 0)
-											break; // now all downloaders have a job
-								}
-							}
-						}
+				memset(&hash, 0, sizeof(HASH));
+				strlcpy(hash.type, msg.tag, sizeof(hash.type));
+				strlcpy(hash.hash_hex, msg.text, sizeof(hash.hash_hex));
+				mget_vector_add(job->hashes, &hash, sizeof(HASH));
+				break;
+			}
 
-						if (!config.quota || (config.quota && config.quota > quota)) {
-							if (queue_get(&downloader[n].job, &downloader[n].part))
-								dprintf(downloader[n].sockfd[0], "go\n");
-						}
-					} else if (!strncmp(buf, "chunk ", 6)) {
-						if (!strncasecmp(buf + 6, "mirror ", 7)) {
-							MIRROR mirror;
-
-							if (!job->mirrors)
-								job->mirrors = mget_vector_create(4, 4, NULL);
-
-							memset(&mirror, 0, sizeof(MIRROR));
-							pos = 0;
-							if (sscanf(buf + 13, "%2s %6d %n", mirror.location, &mirror.priority, &pos) >= 2 && pos) {
-								mirror.iri = mget_iri_parse(buf + 13 + pos, NULL);
-								mget_vector_add(job->mirrors, &mirror, sizeof(MIRROR));
-							} else
-								error_printf(_("Failed to parse metalink mirror '%s'\n"), buf);
-						} else if (!strncasecmp(buf + 6, "hash ", 5)) {
-							// hashes for the complete file
-							HASH hash;
-
-							if (!job->hashes)
-								job->hashes = mget_vector_create(4, 4, NULL);
-
-							memset(&hash, 0, sizeof(HASH));
-							if (sscanf(buf + 11, "%15s %127s", hash.type, hash.hash_hex) == 2) {
-								mget_vector_add(job->hashes, &hash, sizeof(HASH));
-							} else
-								error_printf(_("Failed to parse metalink hash '%s'\n"), buf);
-						} else if (!strncasecmp(buf + 6, "piece ", 6)) {
-							// hash for a piece of the file
-							PIECE piece, *piecep;
-
-							if (!job->pieces)
-								job->pieces = mget_vector_create(32, 32, NULL);
-
-							memset(&piece, 0, sizeof(PIECE));
-							if (sscanf(buf + 12, "%15llu %15s %127s", (unsigned long long *)&piece.length, piece.hash.type, piece.hash.hash_hex) == 3) {
-								piecep = mget_vector_get(job->pieces, mget_vector_size(job->pieces) - 1);
-								if (piecep)
-									piece.position = piecep->position + piecep->length;
-								mget_vector_add(job->pieces, &piece, sizeof(PIECE));
-							} else
-								error_printf(_("Failed to parse metalink piece '%s'\n"), buf);
-						} else if (!strncasecmp(buf + 6, "name ", 5)) {
-							job->name = strdup(buf + 11);
-						} else if (!strncasecmp(buf + 6, "size ", 5)) {
-							job->size = atoll(buf + 11);
-						}
-					} else if (!strncmp(buf, "add uri ", 8) || !strncmp(buf, "redirect ", 9)) {
-						JOB *new_job;
-						MGET_IRI *iri;
-						char *p, *encoding;
-
-						if (*buf == 'r') {
-							if (job->redirection_level >= config.max_redirect) {
-								continue;
-							}
-							encoding = buf + 9;
-						} else
-							encoding = buf + 8;
-
-						for (p = encoding; *p != ' '; p++);
-						*p = 0;
-
-						if (*encoding == '-')
-							encoding = NULL;
-						
-						iri = mget_iri_parse(p + 1, encoding);
-
-						if (config.recursive && !config.span_hosts) {
-							// only download content from given hosts
-							if (!iri->host || !mget_stringmap_get(config.domains, iri->host) || mget_stringmap_get(config.exclude_domains, iri->host)) {
-								info_printf("URI '%s' not followed\n", iri->uri);
-								mget_iri_free(&iri);
-							}
-						}
+			case MSG_METALINK_PIECE:
+			{
+				// hash for a piece of the file
+				PIECE piece, *piecep;
+
+				if (!job->pieces)
+					job->pieces = mget_vector_create(32, 32, NULL);
+
+				memset(&piece, 0, sizeof(PIECE));
+				piece.length = (off_t)msg.number;
+				strlcpy(piece.hash.type, msg.tag, sizeof(piece.hash.type));
+				strlcpy(piece.hash.hash_hex, msg.text, sizeof(piece.hash.hash_hex));
+				piecep = mget_vector_get(job->pieces, mget_vector_size(job->pieces) - 1);
+				if (piecep)
+					piece.position = piecep->position + piecep->length;
+				mget_vector_add(job->pieces, &piece, sizeof(PIECE));
+				break;
+			}
 
-						if ((new_job = queue_add(blacklist_add(iri)))) {
-							if (!config.output_document)
-								new_job->local_filename = get_local_filename(new_job->iri);
-							if (*buf == 'r') {
-								new_job->redirection_level = job->redirection_level + 1;
-								new_job->referer = job->referer;
-							} else {
-								new_job->referer = job->iri;
-							}
-							schedule_download(new_job, NULL);
-						}
+			case MSG_METALINK_NAME:
+				job->name = msg.text;
+				msg.text = NULL;
+				break;
+
+			case MSG_METALINK_SIZE:
+				job->size = (off_t)msg.number;
+				break;
+
+			case MSG_SEGMENTS:
+			{
+				// the server accepts byte ranges: download the file in parts from now on
+				int it;
+
+				xfree(job->name);
+				job->name = msg.text;
+				msg.text = NULL;
+				job->size = (off_t)msg.number;
+				job_create_segments(job, config.segments, MIN_SEGMENT_SIZE);
+
+				for (it = 0; it < mget_vector_size(job->parts); it++)
+					if (schedule_download(job, mget_vector_get(job->parts, it)) == 0)
+						break; // now all downloaders have a job
+				break;
+			}
+
+			case MSG_ADD_URI:
+			case MSG_REDIRECT:
+			{
+				JOB *new_job;
+				MGET_IRI *iri = msg.iri;
+
+				msg.iri = NULL;
+
+				if (msg.type == MSG_REDIRECT && job->redirection_level >= config.max_redirect) {
+					mget_iri_free(&iri);
+					break;
+				}
+
+				if (config.recursive && !config.span_hosts) {
+					// only download content from given hosts
+					if (!iri->host || !mget_stringmap_get(config.domains, iri->host) || mget_stringmap_get(config.exclude_domains, iri->host)) {
+						info_printf("URI '%s' not followed\n", iri->uri);
+						mget_iri_free(&iri);
 					}
 				}
-				nfds--;
+
+				if ((new_job = add_iri_to_queue(iri))) {
+					if (msg.type == MSG_REDIRECT) {
+						new_job->redirection_level = job->redirection_level + 1;
+						new_job->referer = job->referer;
+					} else {
+						new_job->referer = job->iri;
+					}
+					// nobody is idle: a downloader on the same host takes it later on
+					if (!schedule_download(new_job, NULL))
+						push_job(new_job);
+				}
+				break;
 			}
+			}
+
+			channel_free_message(&msg);
 		}
+
+		__atomic_store_n(&nready, queue_ready(), __ATOMIC_RELAXED);
 	}
 
 	xfree(buf);
 
+	// downloaders must not wait for room in the channel any more
+	channel_close(main_channel);
+
 	// stop downloaders
+	if (config.engine == ENGINE_EPOLL)
+		epoll_engine_stop();
+
 	for (n = 0; n < config.num_threads; n++) {
-		close(downloader[n].sockfd[0]);
-		close(downloader[n].sockfd[1]);
-		http_close(&downloader[n].conn);
-		xfree(downloader[n].buf);
-		if (pthread_kill(downloader[n].tid, SIGTERM) == -1)
+		if (config.engine == ENGINE_THREADS && pthread_kill(downloader[n].tid, SIGTERM) == -1)
 			error_printf(_("Failed to kill downloader #%d\n"), n);
 	}
 
-	for (n = 0; n < config.num_threads; n++) {
+	for (n = 0; n < config.num_threads && config.engine == ENGINE_THREADS; n++) {
 		//		struct timespec ts;
 		//		clock_gettime(CLOCK_REALTIME, &ts);
 		//		ts.tv_sec += 1;
@@ -726,16 +1116,39 @@ int main(int argc, const char *const *argv)
 			error_printf(_("Failed to wait for downloader #%d (%d %d)\n"), n, rc, errno);
 	}
 
+	// the downloaders are gone, their connections can be closed
+	for (n = 0; n < config.num_threads; n++) {
+		http_pool_close(&downloader[n].conn);
+		xfree(downloader[n].pipeline);
+		channel_free(&downloader[n].channel);
+		deque_deinit(&downloader[n].deque);
+	}
+	channel_free(&main_channel);
+
 	if (config.save_cookies)
 		mget_cookie_save(config.save_cookies, config.keep_session_cookies);
 
+	if (config.tls_resume && config.tls_session_file)
+		mget_ssl_session_cache_save(config.tls_session_file);
+
 	if (config.delete_after && config.output_document)
 		unlink(config.output_document);
 
-	if (config.debug)
+	if (config.debug) {
+		unsigned long long hits, misses;
+
 		blacklist_print();
 
+		mget_tcp_get_dns_cache_stats(&hits, &misses);
+		debug_printf("DNS cache: %llu hits, %llu misses\n", hits, misses);
+
+		http_get_connection_stats(&hits);
+		debug_printf("HTTP connections: %llu opened for %llu requests\n", hits, nrequests);
+	}
+
 	// freeing to avoid disguising valgrind output
+	mget_stringmap_free(&pipelining_refused);
+	mget_stringmap_free(&host_loads);
 	mget_cookie_free_public_suffixes();
 	mget_cookie_free_cookies();
 	mget_ssl_deinit();
@@ -747,174 +1160,198 @@ int main(int argc, const char *const *argv)
 	return EXIT_SUCCESS;
 }
 
-void *downloader_thread(void *p)
-{
-	DOWNLOADER *downloader = p;
-	JOB *job;
-	char *buf = NULL;
-	size_t bufsize = 0;
-	fd_set rset;
-	int nfds;
-	//	unsigned int seed=(unsigned int)(time(NULL)|pthread_self());
-	int sockfd = downloader->sockfd[1];
-
-	downloader->tid = pthread_self(); // to avoid race condition
+// process the final response of a (non-part) download:
+// store cookies, follow Metalink information, save the body and parse it for URLs.
 
-	while (!terminate) {
-		FD_ZERO(&rset);
-		FD_SET(sockfd, &rset);
+static void G_GNUC_MGET_NONNULL_ALL process_response(DOWNLOADER *downloader, MGET_HTTP_RESPONSE *resp)
+{
+	JOB *job = downloader->job;
 
-		// later, set timeout here
-		if ((nfds = select(sockfd + 1, &rset, NULL, NULL, NULL)) <= 0) {
-			// timeout or error
-			if (nfds == -1) {
-				if (errno == EINTR || errno == EBADF) break;
-				error_printf(_("Failed to select, error %d\n"), errno);
+	mget_cookie_normalize_cookies(job->iri, resp->cookies); // sanitize cookies
+	mget_cookie_store_cookies(resp->cookies); // store cookies
+
+	// check if we got a RFC 6249 Metalink response
+	// HTTP/1.1 302 Found
+	// Date: Fri, 20 Apr 2012 15:00:40 GMT
+	// Server: Apache/2.2.22 (Linux/SUSE) mod_ssl/2.2.22 OpenSSL/1.0.0e DAV/2 SVN/1.7.4 mod_wsgi/3.3 Python/2.7.2 mod_asn/1.5 mod_mirrorbrain/2.17.0 mod_fastcgi/2.4.2
+	// X-Prefix: 87.128.0.0/10
+	// X-AS: 3320
+	// X-MirrorBrain-Mirror: ftp.suse.com
+	// X-MirrorBrain-Realm: country
+	// Link: <http://go-oo.mirrorbrain.org/evolution/stable/Evolution-2.24.0.exe.meta4>; rel=describedby; type="application/metalink4+xml"
+	// Link: <http://go-oo.mirrorbrain.org/evolution/stable/Evolution-2.24.0.exe.torrent>; rel=describedby; type="application/x-bittorrent"
+	// Link: <http://ftp.suse.com/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=1; geo=de
+	// Link: <http://ftp.hosteurope.de/mirror/ftp.suse.com/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=2; geo=de
+	// Link: <http://ftp.isr.ist.utl.pt/pub/MIRRORS/ftp.suse.com/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=3; geo=pt
+	// Link: <http://suse.mirrors.tds.net/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=4; geo=us
+	// Link: <http://ftp.kddilabs.jp/Linux/distributions/ftp.suse.com/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=5; geo=jp
+	// Digest: MD5=/sr/WFcZH1MKTyt3JHL2tA==
+	// Digest: SHA=pvNwuuHWoXkNJMYSZQvr3xPzLZY=
+	// Digest: SHA-256=5QgXpvMLXWCi1GpNZI9mtzdhFFdtz6tuNwCKIYbbZfU=
+	// Location: http://ftp.suse.com/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe
+	// Content-Type: text/html; charset=iso-8859-1
+
+	if (resp->links) {
+		// Found a Metalink answer (RFC 6249 Metalink/HTTP: Mirrors and Hashes).
+		// We try to find and download the .meta4 file (RFC 5854).
+		// If we can't find the .meta4, download from the link with the highest priority.
+
+		MGET_HTTP_LINK *top_link = NULL, *metalink = NULL;
+		int it;
+
+		for (it = 0; it < mget_vector_size(resp->links); it++) {
+			MGET_HTTP_LINK *link = mget_vector_get(resp->links, it);
+			if (link->rel == link_rel_describedby) {
+				if (!strcasecmp(link->type, "application/metalink4+xml")) {
+					// found a link to a metalink4 description
+					metalink = link;
+					break;
+				}
+			} else if (link->rel == link_rel_duplicate) {
+				if (!top_link || top_link->pri > link->pri)
+					// just save the top priority link
+					top_link = link;
 			}
-			continue;
 		}
 
-		while (!terminate && mget_fdgetline(&buf, &bufsize, sockfd) > 0) {
-			debug_printf("+ [%d] %s\n", downloader->id, buf);
-			job = downloader->job;
-			if (!strcmp(buf, "check")) {
-				dprintf(sockfd, "sts %s checking...\n", job->name);
-				job_validate_file(job);
-				if (job->hash_ok)
-					debug_printf("sts check ok");
-				else
-					debug_printf("sts check failed");
-				dprintf(sockfd, "ready\n");
-			} else if (!strcmp(buf, "go")) {
-				MGET_HTTP_RESPONSE *resp = NULL;
-
-				if (!downloader->part) {
-					int tries = 0;
-
-					do {
-						dprintf(sockfd, "sts Downloading...\n");
-						resp = http_get(job->iri, NULL, downloader);
-					} while (!resp && ++tries < 3);
-
-					if (!resp)
-						goto ready;
-
-					mget_cookie_normalize_cookies(job->iri, resp->cookies); // sanitize cookies
-					mget_cookie_store_cookies(resp->cookies); // store cookies
-
-					// check if we got a RFC 6249 Metalink response
-					// HTTP/1.1 302 Found
-					// Date: Fri, 20 Apr 2012 15:00:40 GMT
-					// Server: Apache/2.2.22 (Linux/SUSE) mod_ssl/2.2.22 OpenSSL/1.0.0e DAV/2 SVN/1.7.4 mod_wsgi/3.3 Python/2.7.2 mod_asn/1.5 mod_mirrorbrain/2.17.0 mod_fastcgi/2.4.2
-					// X-Prefix: 87.128.0.0/10
-					// X-AS: 3320
-					// X-MirrorBrain-Mirror: ftp.suse.com
-					// X-MirrorBrain-Realm: country
-					// Link: <http://go-oo.mirrorbrain.org/evolution/stable/Evolution-2.24.0.exe.meta4>; rel=describedby; type="application/metalink4+xml"
-					// Link: <http://go-oo.mirrorbrain.org/evolution/stable/Evolution-2.24.0.exe.torrent>; rel=describedby; type="application/x-bittorrent"
-					// Link: <http://ftp.suse.com/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=1; geo=de
-					// Link: <http://ftp.hosteurope.de/mirror/ftp.suse.com/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=2; geo=de
-					// Link: <http://ftp.isr.ist.utl.pt/pub/MIRRORS/ftp.suse.com/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=3; geo=pt
-					// Link: <http://suse.mirrors.tds.net/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=4; geo=us
-					// Link: <http://ftp.kddilabs.jp/Linux/distributions/ftp.suse.com/projects/go-oo/evolution/stable/Evolution-2.24.0.exe>; rel=duplicate; pri=5; geo=jp
-					// Digest: MD5=/sr/WFcZH1MKTyt3JHL2tA==
-					// Digest: SHA=pvNwuuHWoXkNJMYSZQvr3xPzLZY=
-					// Digest: SHA-256=5QgXpvMLXWCi1GpNZI9mtzdhFFdtz6tuNwCKIYbbZfU=
-					// Location: http://ftp.suse.com/pub/projects/go-oo/evolution/stable/Evolution-2.24.0.exe
-					// Content-Type: text/html; charset=iso-8859-1
-
-					if (resp->links) {
-						// Found a Metalink answer (RFC 6249 Metalink/HTTP: Mirrors and Hashes).
-						// We try to find and download the .meta4 file (RFC 5854).
-						// If we can't find the .meta4, download from the link with the highest priority.
-
-						MGET_HTTP_LINK *top_link = NULL, *metalink = NULL;
-						int it;
-
-						for (it = 0; it < mget_vector_size(resp->links); it++) {
-							MGET_HTTP_LINK *link = mget_vector_get(resp->links, it);
-							if (link->rel == link_rel_describedby) {
-								if (!strcasecmp(link->type, "application/metalink4+xml")) {
-									// found a link to a metalink4 description
-									metalink = link;
-									break;
-								}
-							} else if (link->rel == link_rel_duplicate) {
-								if (!top_link || top_link->pri > link->pri)
-									// just save the top priority link
-									top_link = link;
-							}
-						}
-
-						if (metalink) {
-							// found a link to a metalink4 description, create a new job
-							dprintf(sockfd, "add uri - %s\n", metalink->uri);
-							goto ready;
-						} else if (top_link) {
-							// no metalink4 description found, create a new job
-							dprintf(sockfd, "add uri - %s\n", top_link->uri);
-							goto ready;
-						}
-					}
-
-					if (resp->content_type) {
-						if (!strcasecmp(resp->content_type, "application/metalink4+xml")) {
-							dprintf(sockfd, "sts get metalink info\n");
-							// save_file(resp, job->local_filename, O_TRUNC);
-							metalink4_parse(sockfd, resp);
-							goto ready;
-						}
-					}
-
-					if (resp->code == 200) {
-						save_file(resp, config.output_document ? config.output_document : job->local_filename);
-
-						if (config.recursive) {
-							if (resp->content_type) {
-								if (!strcasecmp(resp->content_type, "text/html")) {
-									html_parse(sockfd, resp->body->data, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
-								} else if (!strcasecmp(resp->content_type, "application/xhtml+xml")) {
-									// xml_parse(sockfd, resp, job->iri);
-								} else if (!strcasecmp(resp->content_type, "text/css")) {
-									css_parse(sockfd, resp->body->data, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
-								}
-							}
-						}
-					}
-					else if (resp->code == 206 && config.continue_download) { // partial content
-						append_file(resp, config.output_document ? config.output_document : job->local_filename);
-					}
-					else if (resp->code == 304 && config.timestamping) { // local document is up-to-date
-						if (config.recursive) {
-							const char *ext = strrchr(job->local_filename, '.');
-
-							if (ext) {
-								if (!strcasecmp(ext, ".html") || !strcasecmp(ext, ".htm")) {
-									html_parse_localfile(sockfd, job->local_filename, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
-								} else if (!strcasecmp(ext, ".css")) {
-									css_parse_localfile(sockfd, job->local_filename, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
-								}
-							}
-						}
-					}
+		if (metalink) {
+			// found a link to a metalink4 description, create a new job
+			channel_send_iri(main_channel, downloader->id, MSG_ADD_URI, mget_iri_parse(metalink->uri, NULL));
+			return;
+		} else if (top_link) {
+			// no metalink4 description found, create a new job
+			channel_send_iri(main_channel, downloader->id, MSG_ADD_URI, mget_iri_parse(top_link->uri, NULL));
+			return;
+		}
+	}
 
-				} else {
-					// download metalink part
-					download_part(downloader);
-				}
+	if (resp->content_type) {
+		if (!strcasecmp(resp->content_type, "application/metalink4+xml")) {
+			channel_printf(main_channel, downloader->id, "get metalink info");
+			// save_file(resp, job->local_filename, O_TRUNC);
+			metalink4_parse(main_channel, downloader->id, resp);
+			return;
+		}
+	}
 
-				// regular download
-ready:
-				if (resp) {
-					dprintf(sockfd, "sts %d %s\n", resp->code, resp->reason);
-					http_free_response(&resp);
+	if (resp->code == 200) {
+		// body is only kept in memory if it has not been streamed into the output file yet
+		if (resp->body)
+			save_file(resp, config.output_document ? config.output_document : job->local_filename);
+
+		if (config.recursive && resp->body) {
+			if (resp->content_type) {
+				if (!strcasecmp(resp->content_type, "text/html")) {
+					html_parse(downloader, resp->body->data, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
+				} else if (!strcasecmp(resp->content_type, "application/xhtml+xml")) {
+					// xml_parse(downloader, resp, job->iri);
+				} else if (!strcasecmp(resp->content_type, "text/css")) {
+					css_parse(downloader, resp->body->data, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
 				}
-				dprintf(sockfd, "ready\n");
 			}
 		}
 	}
+	else if (resp->code == 206 && config.continue_download) { // partial content
+		if (resp->body)
+			append_file(resp, config.output_document ? config.output_document : job->local_filename);
+	}
+	else if (resp->code == 304 && config.timestamping) { // local document is up-to-date
+		if (config.recursive) {
+			const char *ext = strrchr(job->local_filename, '.');
+
+			if (ext) {
+				if (!strcasecmp(ext, ".html") || !strcasecmp(ext, ".htm")) {
+					html_parse_localfile(downloader, job->local_filename, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
+				} else if (!strcasecmp(ext, ".css")) {
+					css_parse_localfile(downloader, job->local_filename, resp->content_type_encoding ? resp->content_type_encoding : config.remote_encoding, job->iri);
+				}
+			}
+		}
+	}
+}
 
-	xfree(buf);
+// integrity check of a complete Metalink download
+
+static void G_GNUC_MGET_NONNULL_ALL check_file(DOWNLOADER *downloader, JOB *job)
+{
+	MESSAGE msg = { .type = MSG_STATUS, .id = downloader->id, .job = job };
+
+	if (asprintf(&msg.text, "%s checking...", job->name) != -1)
+		channel_send(main_channel, &msg);
+
+	job_validate_file(job, main_channel, downloader->id);
+	if (job->hash_ok)
+		debug_printf("sts check ok");
+	else
+		debug_printf("sts check failed");
+
+	msg.type = MSG_CHECKED;
+	msg.text = NULL;
+	channel_send(main_channel, &msg);
+}
+
+// download downloader->job / downloader->part
+
+static void G_GNUC_MGET_NONNULL_ALL download_job(DOWNLOADER *downloader)
+{
+	JOB *job = downloader->job;
+	MGET_HTTP_RESPONSE *resp = NULL;
+
+	if (!downloader->part) {
+		int tries = 0;
+
+		do {
+			channel_printf(main_channel, downloader->id, "Downloading...");
+			resp = http_get(job->iri, NULL, downloader);
+		} while (!resp && ++tries < 3);
+
+		if (resp)
+			process_response(downloader, resp);
+	} else {
+		// download metalink part
+		download_part(downloader);
+	}
+
+	if (resp) {
+		channel_printf(main_channel, downloader->id, "%d %s", resp->code, resp->reason);
+		http_free_response(&resp);
+	}
+}
+
+void *downloader_thread(void *p)
+{
+	DOWNLOADER *downloader = p;
+	MESSAGE msg;
+	struct pollfd pollfd = { .fd = channel_get_fd(downloader->channel), .events = POLLIN };
+	//	unsigned int seed=(unsigned int)(time(NULL)|pthread_self());
+
+	downloader->tid = pthread_self(); // to avoid race condition
+
+	while (!terminate) {
+		// later, set timeout here
+		if (channel_idle(downloader->channel) && poll(&pollfd, 1, -1) == -1) {
+			if (errno == EINTR) break;
+			error_printf(_("Failed to poll, error %d\n"), errno);
+			continue;
+		}
+
+		while (!terminate && channel_receive(downloader->channel, &msg)) {
+			debug_printf("+ [%d] message %d\n", downloader->id, msg.type);
+			if (msg.type == MSG_CHECK) {
+				check_file(downloader, msg.job);
+			} else if (msg.type == MSG_GO) {
+				// go on with the next job until there is none left, checks are done in between
+				do {
+					download_job(downloader);
+
+					while (!terminate && channel_receive(downloader->channel, &msg)) {
+						if (msg.type == MSG_CHECK)
+							check_file(downloader, msg.job);
+					}
+				} while (!terminate && job_done(downloader));
+			}
+		}
+	}
 
 	return NULL;
 }
@@ -926,8 +1363,8 @@ struct html_context {
 		*encoding;
 	mget_buffer_t
 		uri_buf;
-	int
-		sockfd;
+	DOWNLOADER
+		*downloader; // NULL: add the URIs to the queue directly
 	char
 		base_allocated,
 		encoding_allocated;
@@ -975,7 +1412,8 @@ static void _html_parse(void *context, int flags, const char *dir, const char *a
 				// add it to be downloaded, replace old base
 				MGET_IRI *iri = mget_iri_parse(val, ctx->encoding);
 				if (iri) {
-					dprintf(ctx->sockfd, "add uri %s %s\n", ctx->encoding ? ctx->encoding : "-", val);
+					if (ctx->downloader)
+						channel_send_iri(main_channel, ctx->downloader->id, MSG_ADD_URI, mget_iri_parse(val, ctx->encoding));
 
 					if (ctx->base_allocated)
 						mget_iri_free(&ctx->base);
@@ -1037,15 +1475,10 @@ static void _html_parse(void *context, int flags, const char *dir, const char *a
 				// log_printf("%02X %s %s=%s\n",flags,dir,attr,val);
 				if (mget_iri_relative_to_abs(ctx->base, val, len, &ctx->uri_buf)) {
 					// info_printf("%.*s -> %s\n", (int)len, val, ctx->uri_buf.data);
-					if (ctx->sockfd >= 0) {
-						dprintf(ctx->sockfd, "add uri %s %s\n", ctx->encoding ? ctx->encoding : "-", ctx->uri_buf.data);
+					if (ctx->downloader) {
+						channel_send_iri(main_channel, ctx->downloader->id, MSG_ADD_URI, mget_iri_parse(ctx->uri_buf.data, ctx->encoding));
 					} else {
-						JOB *job;
-
-						if ((job = queue_add(blacklist_add(mget_iri_parse(ctx->uri_buf.data, ctx->encoding))))) {
-							if (!config.output_document)
-								job->local_filename = get_local_filename(job->iri);
-						}
+						add_iri_to_queue(mget_iri_parse(ctx->uri_buf.data, ctx->encoding));
 					}
 				} else {
 					error_printf(_("Cannot resolve relative URI %.*s\n"), (int)len, val);
@@ -1057,11 +1490,11 @@ static void _html_parse(void *context, int flags, const char *dir, const char *a
 
 // use the xml parser, being prepared that HTML is not XML
 
-void html_parse(int sockfd, const char *data, const char *encoding, MGET_IRI *iri)
+void html_parse(DOWNLOADER *downloader, const char *data, const char *encoding, MGET_IRI *iri)
 {
 	// create scheme://authority that will be prepended to relative paths
 	char uri_sbuf[1024];
-	struct html_context context = { .base = iri, .sockfd = sockfd, .encoding = encoding };
+	struct html_context context = { .base = iri, .downloader = downloader, .encoding = encoding };
 
 	mget_buffer_init(&context.uri_buf, uri_sbuf, sizeof(uri_sbuf));
 
@@ -1081,11 +1514,11 @@ void html_parse(int sockfd, const char *data, const char *encoding, MGET_IRI *ir
 	mget_buffer_deinit(&context.uri_buf);
 }
 
-void html_parse_localfile(int sockfd, const char *fname, const char *encoding, MGET_IRI *iri)
+void html_parse_localfile(DOWNLOADER *downloader, const char *fname, const char *encoding, MGET_IRI *iri)
 {
 	// create scheme://authority that will be prepended to relative paths
 	char uri_sbuf[1024];
-	struct html_context context = { .base = iri, .sockfd = sockfd, .encoding = encoding };
+	struct html_context context = { .base = iri, .downloader = downloader, .encoding = encoding };
 
 	mget_buffer_init(&context.uri_buf, uri_sbuf, sizeof(uri_sbuf));
 
@@ -1110,8 +1543,8 @@ struct css_context {
 		*encoding;
 	mget_buffer_t
 		uri_buf;
-	int
-		sockfd;
+	DOWNLOADER
+		*downloader; // NULL: add the URIs to the queue directly
 	char
 		encoding_allocated;
 };
@@ -1135,15 +1568,10 @@ static void _css_parse_uri(void *context, const char *url, size_t len, size_t po
 	if (len > 1 || (len == 1 && *url != '#')) {
 		// ignore e.g. href='#'
 		if (mget_iri_relative_to_abs(ctx->base, url, len, &ctx->uri_buf)) {
-			if (ctx->sockfd >= 0) {
-				dprintf(ctx->sockfd, "add uri - %s\n", ctx->uri_buf.data);
+			if (ctx->downloader) {
+				channel_send_iri(main_channel, ctx->downloader->id, MSG_ADD_URI, mget_iri_parse(ctx->uri_buf.data, NULL));
 			} else {
-				JOB *job;
-
-				if ((job = queue_add(blacklist_add(mget_iri_parse(ctx->uri_buf.data, ctx->encoding))))) {
-					if (!config.output_document)
-						job->local_filename = get_local_filename(job->iri);
-				}
+				add_iri_to_queue(mget_iri_parse(ctx->uri_buf.data, ctx->encoding));
 			}
 		} else {
 			error_printf(_("Cannot resolve relative URI %.*s\n"), (int)len, url);
@@ -1151,11 +1579,11 @@ static void _css_parse_uri(void *context, const char *url, size_t len, size_t po
 	}
 }
 
-void css_parse(int sockfd, const char *data, const char *encoding, MGET_IRI *base)
+void css_parse(DOWNLOADER *downloader, const char *data, const char *encoding, MGET_IRI *base)
 {
 	// create scheme://authority that will be prepended to relative paths
 	char uri_buf[1024];
-	struct css_context context = { .base = base, .sockfd = sockfd, .encoding = encoding };
+	struct css_context context = { .base = base, .downloader = downloader, .encoding = encoding };
 
 	mget_buffer_init(&context.uri_buf, uri_buf, sizeof(uri_buf));
 
@@ -1170,11 +1598,11 @@ void css_parse(int sockfd, const char *data, const char *encoding, MGET_IRI *bas
 	mget_buffer_deinit(&context.uri_buf);
 }
 
-void css_parse_localfile(int sockfd, const char *fname, const char *encoding, MGET_IRI *base)
+void css_parse_localfile(DOWNLOADER *downloader, const char *fname, const char *encoding, MGET_IRI *base)
 {
 	// create scheme://authority that will be prepended to relative paths
 	char uri_buf[1024];
-	struct css_context context = { .base = base, .sockfd = sockfd, .encoding = encoding };
+	struct css_context context = { .base = base, .downloader = downloader, .encoding = encoding };
 
 	mget_buffer_init(&context.uri_buf, uri_buf, sizeof(uri_buf));
 
@@ -1228,43 +1656,72 @@ static void set_file_mtime(int fd, time_t modified)
 		error_printf (_("Failed to set file date: %s\n"), strerror (errno));
 }
 
-static void G_GNUC_MGET_NONNULL((1)) _save_file(MGET_HTTP_RESPONSE *resp, const char *fname, int flag)
+// output file for a response body
+struct output {
+	const char
+		*fname; // name of the file actually written to
+	char
+		*alloced_fname;
+	long long
+		nbytes; // number of body bytes written so far
+	off_t
+		position; // file offset of the body (parts only)
+	PART
+		*part; // the part being written (parts only)
+	JOB
+		*job; // the job of the part
+	int
+		fd,
+		flag;
+	char
+		to_stdout,
+		positional; // write with pwrite() at position + nbytes
+};
+
+// open the output file for <resp>, respecting -O, --clobber, --adjust-extension, etc.
+// <length> is the number of body bytes to be accounted for --quota (if already known).
+// returns the file descriptor or -1 if the body should not or could not be saved.
+
+static int G_GNUC_MGET_NONNULL((1,2)) _open_output(struct output *out, MGET_HTTP_RESPONSE *resp, const char *fname, int flag, size_t length)
 {
-	char *alloced_fname = NULL;
 	int fd, multiple, fnum;
 	size_t fname_length = 0;
 
+	memset(out, 0, sizeof(*out));
+	out->fd = -1;
+
 	if (config.spider || !fname)
-		return;
+		return -1;
 
 	// - optimistic approach expects data being written without error
 	// - to be Wget compatible: quota_modify_read() returns old quota value
-	if (config.quota && quota_modify_read(config.save_headers ? resp->header->length + resp->body->length : resp->body->length) >= config.quota)
-		return;
+	if (config.quota && quota_modify_read(config.save_headers ? resp->header->length + length : length) >= config.quota)
+		return -1;
 
 	if (fname == config.output_document) {
 		// <fname> can only be NULL if config.delete_after is set
 		if (!strcmp(fname, "-")) {
-			size_t rc;
+			out->to_stdout = 1;
+			out->fname = "STDOUT";
+			out->fd = STDOUT_FILENO;
 
 			if (config.save_headers) {
+				size_t rc;
+
 				if ((rc = fwrite(resp->header->data, 1, resp->header->length, stdout)) != resp->header->length)
 					error_printf(_("Failed to write to STDOUT (%zu, errno=%d)\n"), rc, errno);
 			}
 
-			if ((rc = fwrite(resp->body->data, 1, resp->body->length, stdout)) != resp->body->length)
-				error_printf(_("Failed to write to STDOUT (%zu, errno=%d)\n"), rc, errno);
-
-			return;
+			return out->fd;
 		}
 
 		if (config.delete_after)
-			return;
+			return -1;
 
 		flag = O_APPEND;
 	}
 
-	if (config.adjust_extension && resp && resp->content_type) {
+	if (config.adjust_extension && resp->content_type) {
 		const char *ext;
 
 		if (!strcasecmp(resp->content_type, "text/html")) {
@@ -1278,10 +1735,10 @@ static void G_GNUC_MGET_NONNULL((1)) _save_file(MGET_HTTP_RESPONSE *resp, const
 			size_t ext_length = strlen(ext);
 
 			if ((fname_length = strlen(fname)) >= ext_length && strcasecmp(fname + fname_length - ext_length, ext)) {
-				alloced_fname = xmalloc(fname_length + ext_length + 1);
-				strcpy(alloced_fname, fname);
-				strcpy(alloced_fname + fname_length, ext);
-				fname = alloced_fname;
+				out->alloced_fname = xmalloc(fname_length + ext_length + 1);
+				strcpy(out->alloced_fname, fname);
+				strcpy(out->alloced_fname + fname_length, ext);
+				fname = out->alloced_fname;
 			}
 		}
 	}
@@ -1303,47 +1760,108 @@ static void G_GNUC_MGET_NONNULL((1)) _save_file(MGET_HTTP_RESPONSE *resp, const
 
 	fd = open(fname, O_WRONLY | flag | O_CREAT, 0644);
 
-	for (fnum = 0; fnum < 999;) { // just prevent endless loop
+	for (fnum = 0; fd == -1 && multiple && errno == EEXIST && fnum < 999;) { // just prevent endless loop
 		char unique[fname_length + 1];
 
-		if (fd != -1) {
-			ssize_t rc;
+		snprintf(unique, sizeof(unique), "%s.%d", fname, ++fnum);
+		if ((fd = open(unique, O_WRONLY | flag | O_CREAT, 0644)) != -1) {
+			char *p = strdup(unique);
 
-			if (config.save_headers) {
-				if ((rc = write(fd, resp->header->data, resp->header->length)) != (ssize_t)resp->header->length)
-					error_printf(_("Failed to write file %s (%zd, errno=%d)\n"), fnum ? unique : fname, rc, errno);
-			}
+			xfree(out->alloced_fname);
+			fname = out->alloced_fname = p;
+		}
+	}
 
-			if ((rc = write(fd, resp->body->data, resp->body->length)) != (ssize_t)resp->body->length)
-				error_printf(_("Failed to write file %s (%zd, errno=%d)\n"), fnum ? unique : fname, rc, errno);
+	if (fd == -1) {
+		if (errno == EEXIST && fnum < 999)
+			error_printf(_("File '%s' already there; not retrieving.\n"), fname);
+		else
+			error_printf(_("Failed to open '%s' (errno=%d)\n"), fname, errno);
 
-			if ((flag & (O_TRUNC | O_EXCL)) && resp->last_modified)
-				set_file_mtime(fd, resp->last_modified);
+		xfree(out->alloced_fname);
+		return -1;
+	}
 
-			if (flag == O_APPEND)
-				info_printf("appended to '%s'\n", fnum ? unique : fname);
-			else
-				info_printf("saved '%s'\n", fnum ? unique : fname);
+	out->fname = fname;
+	out->fd = fd;
+	out->flag = flag;
 
-			close(fd);
+	if (config.save_headers) {
+		ssize_t rc;
+
+		if ((rc = write(fd, resp->header->data, resp->header->length)) != (ssize_t)resp->header->length)
+			error_printf(_("Failed to write file %s (%zd, errno=%d)\n"), fname, rc, errno);
+	}
+
+	return fd;
+}
+
+// returns the number of bytes written, less than <length> on error
+
+static size_t G_GNUC_MGET_NONNULL_ALL _write_output(struct output *out, const char *data, size_t length)
+{
+	size_t nbytes = length;
+
+	if (out->positional) {
+		ssize_t rc;
+
+		if ((rc = pwrite(out->fd, data, length, out->position + out->nbytes)) != (ssize_t)length) {
+			error_printf(_("Failed to write file %s (%zd, errno=%d)\n"), out->fname, rc, errno);
+			nbytes = rc > 0 ? (size_t)rc : 0;
 		}
-		else if (multiple && (fd == -1 && errno == EEXIST)) {
-			snprintf(unique, sizeof(unique), "%s.%d", fname, ++fnum);
-			fd = open(unique, O_WRONLY | flag | O_CREAT, 0644);
-			continue;
+	} else if (out->to_stdout) {
+		size_t rc;
+
+		if ((rc = fwrite(data, 1, length, stdout)) != length) {
+			error_printf(_("Failed to write to STDOUT (%zu, errno=%d)\n"), rc, errno);
+			nbytes = rc;
 		}
+	} else {
+		ssize_t rc;
 
-		break;
+		if ((rc = write(out->fd, data, length)) != (ssize_t)length) {
+			error_printf(_("Failed to write file %s (%zd, errno=%d)\n"), out->fname, rc, errno);
+			nbytes = rc > 0 ? (size_t)rc : 0;
+		}
 	}
 
-	if (fd == -1) {
-		if (errno == EEXIST && fnum < 999)
-			error_printf(_("File '%s' already there; not retrieving.\n"), fname);
-		else
-			error_printf(_("Failed to open '%s' (errno=%d)\n"), fname, errno);
+	out->nbytes += nbytes;
+
+	return nbytes;
+}
+
+static void G_GNUC_MGET_NONNULL_ALL _close_output(struct output *out, MGET_HTTP_RESPONSE *resp)
+{
+	if (out->fd == -1 || out->to_stdout)
+		return;
+
+	if (out->positional) {
+		out->fd = -1; // belongs to the job, see open_part_file()
+		return;
 	}
 
-	xfree(alloced_fname);
+	if ((out->flag & (O_TRUNC | O_EXCL)) && resp->last_modified)
+		set_file_mtime(out->fd, resp->last_modified);
+
+	if (out->flag == O_APPEND)
+		info_printf("appended to '%s'\n", out->fname);
+	else
+		info_printf("saved '%s'\n", out->fname);
+
+	close(out->fd);
+	out->fd = -1;
+
+	xfree(out->alloced_fname);
+}
+
+static void G_GNUC_MGET_NONNULL((1)) _save_file(MGET_HTTP_RESPONSE *resp, const char *fname, int flag)
+{
+	struct output out;
+
+	if (_open_output(&out, resp, fname, flag, resp->body->length) != -1) {
+		_write_output(&out, resp->body->data, resp->body->length);
+		_close_output(&out, resp);
+	}
 }
 
 static void G_GNUC_MGET_NONNULL((1)) save_file(MGET_HTTP_RESPONSE *resp, const char *fname)
@@ -1356,47 +1874,481 @@ static void G_GNUC_MGET_NONNULL((1)) append_file(MGET_HTTP_RESPONSE *resp, const
 	_save_file(resp, fname, O_APPEND);
 }
 
-//void download_part(int sockfd, JOB *job, PART *part)
+static int _get_body_file(void *context, const char *data, size_t length)
+{
+	struct output *out = context;
+	off_t position = out->position + (off_t)out->nbytes;
+	size_t nbytes;
+
+	// without an output file, the data is just read and thrown away
+	if (out->fd != -1 && length) {
+		// a part must not overwrite the following one, which might have been split off meanwhile
+		if (out->part && !(length = job_part_reserve(out->part, (off_t)out->nbytes, length)))
+			return -1; // done by someone else, stop reading
+
+		if (config.quota)
+			quota_modify_read(length);
+
+		nbytes = _write_output(out, data, length);
+
+		// Metalink checksums are computed while the data comes in, from what is in the file
+		if (out->part) {
+			job_hash_data(out->job, position, data, nbytes);
+
+			if (nbytes < length) {
+				// the part is incomplete and the data on disk can't be trusted
+				job_hash_failed(out->job, position + (off_t)nbytes, length - nbytes);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// reserve the disk space of a file that is going to be written in parts.
+// written in random order, the file would end up badly fragmented.
+
+static void G_GNUC_MGET_NONNULL_ALL preallocate_file(int fd, const char *fname, off_t size)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+	if (posix_fallocate(fd, 0, size) == 0)
+		return;
+#endif
+
+	// at least avoid growing the file with each part
+	if (ftruncate(fd, size) == -1)
+		error_printf(_("Failed to set size of %s to %llu bytes (errno=%d)\n"), fname, (unsigned long long)size, errno);
+}
+
+static pthread_mutex_t
+	part_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// all parts of a job are written with pwrite() through one file descriptor,
+// opened by the first part. it is closed by job_free().
+
+static int G_GNUC_MGET_NONNULL_ALL open_part_file(JOB *job)
+{
+	int fd;
+
+	pthread_mutex_lock(&part_file_mutex);
+
+	if (job->fd == -1) {
+		if ((job->fd = open(job->name, O_WRONLY | O_CREAT, 0644)) == -1)
+			error_printf(_("Failed to write open %s\n"), job->name);
+		else if (job->size > 0)
+			preallocate_file(job->fd, job->name, job->size);
+	}
+
+	fd = job->fd;
+
+	pthread_mutex_unlock(&part_file_mutex);
+
+	return fd;
+}
+
+// with --segments, large files are downloaded in parts by several downloaders.
+// the server has to accept byte ranges and tell us the size of the file in advance.
+
+static int G_GNUC_MGET_NONNULL_ALL segmented_download(MGET_HTTP_RESPONSE *resp)
+{
+	return config.segments > 1 && !config.output_document && !config.save_headers &&
+		resp->accept_ranges && resp->major == 1 && resp->content_length_valid &&
+		resp->transfer_encoding == transfer_encoding_identity &&
+		resp->content_encoding == mget_content_encoding_identity &&
+		resp->content_length >= 2 * MIN_SEGMENT_SIZE;
+}
+
+// Decide where the body of a response goes.
+// Bodies that are going to be parsed (Metalink, HTML/CSS when downloading recursively),
+// as well as bodies of non-final responses (redirections, errors) are kept in memory (resp->body).
+// All other bodies are written to the output file as they come in, to keep memory
+// usage independent of the file size. In this case resp->body stays NULL.
+// Parts are written into the file at their position.
+// Returns 1 if the body has to be written to <out>, 0 if it has to be appended to resp->body,
+// -1 if the body is not wanted (the connection can't be reused then).
+
+static int G_GNUC_MGET_NONNULL((1,2,4)) http_open_body(MGET_HTTP_RESPONSE *resp, struct output *out, PART *part, DOWNLOADER *downloader)
+{
+	JOB *job = downloader->job;
+	int flag;
+
+	if (part)
+		downloader->latency = mget_get_timemillis() - downloader->started;
+
+	if (part && resp->code == 206) {
+		memset(out, 0, sizeof(*out));
+		out->fname = job->name;
+		out->position = part->position;
+		out->part = part;
+		out->job = job;
+		out->positional = 1;
+		out->fd = open_part_file(job);
+
+		return 1;
+	}
+
+	// e.g. the complete file (200) or an error page, nothing of it belongs into the part
+	if (part) {
+		resp->keep_alive = 0;
+		return -1;
+	}
+
+	if (!part && resp->code == 200)
+		flag = O_TRUNC;
+	else if (!part && resp->code == 206 && config.continue_download)
+		flag = O_APPEND;
+	else
+		flag = 0;
+
+	if (flag && resp->content_type) {
+		if (!strcasecmp(resp->content_type, "application/metalink4+xml"))
+			flag = 0;
+		else if (config.recursive && (!strcasecmp(resp->content_type, "text/html") || !strcasecmp(resp->content_type, "text/css")))
+			flag = 0;
+	}
+
+	if (!flag) {
+		resp->body = mget_buffer_alloc(102400);
+		return 0;
+	}
+
+	_open_output(out, resp, config.output_document ? config.output_document : job->local_filename, flag, 0);
+
+	if (flag == O_TRUNC && out->fd != -1 && segmented_download(resp)) {
+		MESSAGE msg = { .type = MSG_SEGMENTS, .id = downloader->id, .number = (long long)resp->content_length, .text = strdup(out->fname) };
+
+		// the main thread creates the parts, this response just told us the size
+		preallocate_file(out->fd, out->fname, (off_t)resp->content_length);
+		channel_send(main_channel, &msg);
+
+		close(out->fd);
+		out->fd = -1;
+		xfree(out->alloced_fname);
+		return -1;
+	}
+
+	return 1;
+}
+
+// the body has been read completely (or the connection broke)
+
+static void G_GNUC_MGET_NONNULL_ALL http_close_body(MGET_HTTP_RESPONSE *resp, struct output *out)
+{
+	if (resp->body) {
+		resp->content_length = resp->body->length;
+	} else {
+		resp->content_length = (size_t)out->nbytes;
+		_close_output(out, resp);
+	}
+}
+
+// returns 0 if the body has been read completely, -1 on error
+
+static int G_GNUC_MGET_NONNULL((1,2,4)) http_get_body(MGET_HTTP_CONNECTION *conn, MGET_HTTP_RESPONSE *resp, PART *part, DOWNLOADER *downloader)
+{
+	struct output out;
+	int rc;
+
+	if ((rc = http_open_body(resp, &out, part, downloader)) == -1) {
+		resp->content_length = 0;
+		return -1;
+	}
+
+	if (rc) {
+		if (out.fd != -1 && !out.to_stdout && !out.positional) {
+			// nobody looks at the data, let the library move it into the file (zero-copy if possible)
+			rc = http_get_response_body_fd(conn, resp, out.fd);
+			out.nbytes = (long long)resp->content_length;
+			if (config.quota)
+				quota_modify_read(resp->content_length);
+		} else
+			rc = http_get_response_body_cb(conn, resp, _get_body_file, &out);
+	} else
+		rc = http_get_response_body(conn, resp, resp->body);
+
+	http_close_body(resp, &out);
+
+	return rc;
+}
+
+// the body of a part response has been written into the file at the part's position
+
+static void G_GNUC_MGET_NONNULL_ALL check_part(PART *part, MGET_HTTP_RESPONSE *msg)
+{
+	mget_cookie_store_cookies(msg->cookies); // sanitize and store cookies
+
+	debug_printf("# part %d body=%zu/%llu bytes\n", msg->code, msg->content_length, (unsigned long long)part->length);
+
+	// a part that has been shortened by a split is complete as well
+	if (msg->code == 206 && !msg->body)
+		job_part_finished(part, (off_t)msg->content_length);
+}
+
+// account the request for a part to the mirror it went to, <msg> is NULL if there was no response
+
+static void G_GNUC_MGET_NONNULL((1)) mirror_report(DOWNLOADER *downloader, MGET_HTTP_RESPONSE *msg)
+{
+	off_t bytes = 0;
+
+	if (!downloader->job->mirrors)
+		return;
+
+	if (msg && msg->code == 206 && !msg->body)
+		bytes = (off_t)msg->content_length;
+
+	job_mirror_report(downloader->job, downloader->mirror, bytes,
+		mget_get_timemillis() - downloader->started, msg ? downloader->latency : 0, downloader->part->done);
+}
+
+// pick the mirror for the next request of the downloader's part, see job_mirror_select().
+// <avoid> is the mirror that just failed or -1.
+
+static MGET_IRI * G_GNUC_MGET_NONNULL_ALL mirror_select(DOWNLOADER *downloader, int avoid)
+{
+	MIRROR *mirror;
+
+	downloader->mirror = job_mirror_select(downloader->job, downloader->part->mirror, avoid);
+	mirror = mget_vector_get(downloader->job->mirrors, downloader->mirror);
+
+	return mirror->iri;
+}
+
+// number of requests for a part before it is given up: each mirror once, but at least 3
+
+static int G_GNUC_MGET_NONNULL_ALL part_max_tries(JOB *job)
+{
+	int n = job->mirrors ? mget_vector_size(job->mirrors) : 0;
+
+	return n > 3 ? n : 3;
+}
+
+// parts of Metalink downloads come from the fastest mirrors, see job_mirror_select().
+// parts of segmented downloads (no mirrors) from the job's URL
 
 void download_part(DOWNLOADER *downloader)
 {
 	JOB *job = downloader->job;
 	PART *part = downloader->part;
-	int mirror_index = downloader->id % mget_vector_size(job->mirrors);
+	int avoid = -1, tries = 0, wait;
 
-	dprintf(downloader->sockfd[1], "sts downloading part...\n");
-	do {
+	channel_printf(main_channel, downloader->id, "downloading part...");
+	while (!part->done && !terminate) {
 		MGET_HTTP_RESPONSE *msg;
-		MIRROR *mirror = mget_vector_get(job->mirrors, mirror_index);
+		MGET_IRI *iri = job->mirrors ? mirror_select(downloader, avoid) : job->iri;
 
-		mirror_index = (mirror_index + 1) % mget_vector_size(job->mirrors);
+		downloader->started = mget_get_timemillis();
+		downloader->latency = 0;
 
-		msg = http_get(mirror->iri, part, downloader);
-		if (msg) {
-			mget_cookie_store_cookies(msg->cookies); // sanitize and store cookies
+		msg = http_get(iri, part, downloader);
+		if (msg)
+			check_part(part, msg);
 
-			if (msg->body) {
-				int fd;
+		mirror_report(downloader, msg);
+		http_free_response(&msg);
 
-				debug_printf("# body=%zd/%llu bytes\n", msg->body->length, (unsigned long long)part->length);
-				if ((fd = open(job->name, O_WRONLY | O_CREAT, 0644)) != -1) {
-					if (lseek(fd, part->position, SEEK_SET) != -1) {
-						ssize_t nbytes;
+		if (part->done)
+			break;
 
-						if ((nbytes = write(fd, msg->body->data, msg->body->length)) == (ssize_t)msg->body->length)
-							part->done = 1; // set this when downloaded ok
-						else
-							error_printf(_("Failed to write %zd bytes (%zd)\n"), msg->body->length, nbytes);
-					} else error_printf(_("Failed to lseek to %llu\n"), (unsigned long long)part->position);
-					close(fd);
-				} else error_printf(_("Failed to write open %s\n"), job->name);
+		if (++tries >= part_max_tries(job)) {
+			error_printf(_("Failed to download part of '%s' after %d tries\n"), job->name, tries);
+			job_part_failed(job, part);
+			break;
+		}
 
-			} else
-				debug_printf("# empty body\n");
+		avoid = downloader->mirror;
+
+		// don't hammer a server that just failed, but stop waiting when terminating
+		for (wait = RETRY_BACKOFF << (tries - 1); wait > 0 && !terminate; wait -= 100) {
+			const struct timespec ts = {0, 100 * 1000 * 1000};
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+// create a GET request for <iri>, respecting the options and the state of the download.
+// pending authentication challenges are answered and freed.
+
+static MGET_HTTP_REQUEST * G_GNUC_MGET_NONNULL((1,3,4)) create_request(MGET_IRI *iri, PART *part, JOB *job, MGET_VECTOR **challenges)
+{
+	MGET_HTTP_REQUEST *req = http_create_request(iri, "GET");
+
+	__atomic_add_fetch(&nrequests, 1, __ATOMIC_RELAXED);
+
+	if (config.continue_download || config.timestamping) {
+		const char *local_filename = job->local_filename;
+
+		if (config.continue_download)
+			http_add_header_printf(req, "Range: bytes=%llu-",
+				get_file_size(local_filename));
+
+		if (config.timestamping) {
+			time_t mtime = get_file_mtime(local_filename);
+
+			if (mtime) {
+				char http_date[32];
+
+				http_print_date(mtime + 1, http_date, sizeof(http_date));
+				http_add_header(req, "If-Modified-Since", http_date);
+			}
+		}
+	}
+
+	// 20.06.2012: www.google.de only sends gzip responses with one of the
+	// following header lines in the request.
+	// User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.5) Gecko/20100101 Firefox/10.0.5 Iceweasel/10.0.5
+	// User-Agent: Mozilla/5.0 (X11; Linux) KHTML/4.8.3 (like Gecko) Konqueror/4.8
+	// User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/536.11 (KHTML, like Gecko) Chrome/20.0.1132.34 Safari/536.11
+	// User-Agent: Opera/9.80 (X11; Linux x86_64; U; en) Presto/2.10.289 Version/12.00
+	// User-Agent: Wget/1.13.4 (linux-gnu)
+	//
+	// Accept: prefer XML over HTML
+	http_add_header_printf(req,
+		/*				"Accept-Encoding: gzip\r\n"\
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.5) Gecko/20100101 Firefox/10.0.5 Iceweasel/10.0.5\r\n"\
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,/;q=0.8\r\n"
+		"Accept-Language: en-us,en;q=0.5\r\n");
+		 */
+		"Accept-Encoding: %s\r\n", mget_decompress_accept_encoding());
+
+	http_add_header_line(req, "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n");
+
+//	if (config.spider && !config.recursive)
+//		http_add_header_if_modified_since(time(NULL));
+//		http_add_header_line(req, "If-Modified-Since: Wed, 29 Aug 2012 00:00:00 GMT\r\n");
+
+	if (config.user_agent)
+		http_add_header(req, "User-Agent", config.user_agent);
+
+	if (config.keep_alive)
+		http_add_header_line(req, "Connection: keep-alive\r\n");
+
+	if (!config.cache)
+		http_add_header_line(req, "Pragma: no-cache\r\n");
+
+	if (config.referer)
+		http_add_header(req, "Referer", config.referer);
+	else if (job->referer) {
+		MGET_IRI *referer = job->referer;
+		char sbuf[256];
+		mget_buffer_t buf;
+
+		mget_buffer_init(&buf, sbuf, sizeof(sbuf));
+
+		mget_buffer_strcat(&buf, referer->scheme);
+		mget_buffer_memcat(&buf, "://", 3);
+		mget_buffer_strcat(&buf, referer->host);
+		mget_buffer_memcat(&buf, "/", 1);
+		mget_iri_get_escaped_resource(referer, &buf);
+
+		http_add_header(req, "Referer", buf.data);
+		mget_buffer_deinit(&buf);
+	}
+
+	if (*challenges) {
+		// There might be more than one challenge, we could select the securest one.
+		// For simplicity and testing we just take the first for now.
+		// the following adds an Authorization: HTTP header
+//		http_add_credentials(req, vec_get(*challenges, 0), config.username, config.password);
+		http_add_credentials(req, mget_vector_get(*challenges, 0), config.http_username, config.http_password);
+		http_free_challenges(challenges);
+	}
+
+	if (part)
+		http_add_header_printf(req, "Range: bytes=%llu-%llu",
+			(unsigned long long) part->position, (unsigned long long) part->position + part->length - 1);
+
+	// add cookies
+	if (config.cookies) {
+		const char *cookie_string;
+
+		if ((cookie_string = mget_cookie_create_request_header(iri))) {
+			http_add_header(req, "Cookie", cookie_string);
+			xfree(cookie_string);
+		}
+	}
+
+	return req;
+}
+
+// check a response to a GET request.
+// returns 1 if <resp> is the final response to be processed by the caller,
+// 0 if the request has to be sent again (e.g. with credentials). <resp> has been freed then.
+
+static int G_GNUC_MGET_NONNULL_ALL check_response(MGET_IRI *iri, MGET_HTTP_RESPONSE **resp, DOWNLOADER *downloader, MGET_VECTOR **challenges)
+{
+	if (config.server_response)
+		info_printf("# got header %zd bytes:\n%s\n\n", (*resp)->header->length, (*resp)->header->data);
+
+	// server doesn't support keep-alive or want us to close the connection
+	if (!(*resp)->keep_alive)
+		http_pool_close(&downloader->conn);
 
-			http_free_response(&msg);
+	if ((*resp)->code == 302 && (*resp)->links && (*resp)->digests)
+		return 1; // 302 with Metalink information
+
+	if ((*resp)->code == 401 && !*challenges) { // Unauthorized
+		if ((*challenges = (*resp)->challenges)) {
+			(*resp)->challenges = NULL;
+			http_free_response(resp);
+			return 0; // try again with credentials
 		}
-	} while (!part->done);
+		return 1;
+	}
+
+	// 304 Not Modified
+	if ((*resp)->code / 100 == 2 || (*resp)->code / 100 >= 4 || (*resp)->code == 304)
+		return 1; // final response
+
+	if ((*resp)->location) {
+		char uri_buf_static[1024];
+		mget_buffer_t uri_buf;
+
+		mget_cookie_normalize_cookies(iri, (*resp)->cookies);
+		mget_cookie_store_cookies((*resp)->cookies);
+
+		mget_buffer_init(&uri_buf, uri_buf_static, sizeof(uri_buf_static));
+
+		mget_iri_relative_to_abs(iri, (*resp)->location, strlen((*resp)->location), &uri_buf);
+
+		channel_send_iri(main_channel, downloader->id, MSG_REDIRECT, mget_iri_parse(uri_buf.data, NULL));
+
+		mget_buffer_deinit(&uri_buf);
+		return 1;
+	}
+
+	http_free_response(resp);
+
+	return 0;
+}
+
+// send the request for <iri>.
+// with pipelining, the requests for the reserved jobs are sent along with it.
+// their responses are read by the following calls of http_get().
+
+static int G_GNUC_MGET_NONNULL_ALL send_request(MGET_HTTP_CONNECTION *conn, MGET_HTTP_REQUEST *req, MGET_IRI *iri, DOWNLOADER *downloader)
+{
+	MGET_HTTP_REQUEST *reqs[downloader->npipeline + 1];
+	int nreqs = 0, it, rc;
+
+	reqs[nreqs++] = req;
+
+	// HTTP/2 multiplexes the requests of all downloaders anyway
+	if (downloader->npipeline && !conn->h2 && pipelining_allowed(iri)) {
+		for (it = 0; it < downloader->npipeline; it++) {
+			JOB *job = downloader->pipeline[it];
+			MGET_VECTOR *challenges = NULL;
+
+			reqs[nreqs++] = create_request(job->iri, NULL, job, &challenges);
+		}
+	}
+
+	rc = http_send_requests(conn, reqs, nreqs);
+
+	for (it = 1; it < nreqs; it++)
+		http_free_request(&reqs[it]);
+
+	return rc;
 }
 
 MGET_HTTP_RESPONSE *http_get(MGET_IRI *iri, PART *part, DOWNLOADER *downloader)
@@ -1404,178 +2356,602 @@ MGET_HTTP_RESPONSE *http_get(MGET_IRI *iri, PART *part, DOWNLOADER *downloader)
 	MGET_HTTP_CONNECTION *conn;
 	MGET_HTTP_RESPONSE *resp = NULL;
 	MGET_VECTOR *challenges = NULL;
+	unsigned int flags = config.save_headers || config.server_response ? MGET_HTTP_RESPONSE_KEEPHEADER : 0;
+	int resend = 0;
 //	int max_redirect = 3;
 
 	while (iri) {
+		// a request sent again (e.g. with credentials) would be answered after the pipelined ones
+		if (resend && downloader->conn && downloader->conn->pending)
+			http_pool_close(&downloader->conn);
+
 		if (downloader->conn && !mget_strcmp(downloader->conn->esc_host, iri->host) &&
 			downloader->conn->scheme == iri->scheme &&
 			!mget_strcmp(downloader->conn->port, iri->resolv_port))
 		{
 			info_printf("reuse connection %s\n", downloader->conn->esc_host);
 		} else {
-			if (downloader->conn) {
-				info_printf("close connection %s\n", downloader->conn->esc_host);
-				http_close(&downloader->conn);
-			}
-			downloader->conn = http_open(iri);
-			if (downloader->conn) {
+			// keep-alive connections go back to the pool, other downloaders might need them
+			http_pool_checkin(&downloader->conn);
+
+			if ((downloader->conn = http_pool_checkout(iri)))
+				info_printf("reuse connection %s\n", downloader->conn->esc_host);
+			else if ((downloader->conn = http_pool_open(iri)))
 				info_printf("opened connection %s\n", downloader->conn->esc_host);
-			}
 		}
 		conn = downloader->conn;
 
 		if (conn) {
-			MGET_HTTP_REQUEST *req;
+			if (conn->pending) {
+				// the request has been sent together with a previous one (pipelining)
+				resp = http_get_response_header(conn, NULL, flags);
+			} else {
+				MGET_HTTP_REQUEST *req = create_request(iri, part, downloader->job, &challenges);
 
-			req = http_create_request(iri, "GET");
+				if (send_request(conn, req, iri, downloader) == 0)
+					resp = http_get_response_header(conn, req, flags);
 
-			if (config.continue_download || config.timestamping) {
-				const char *local_filename = downloader->job->local_filename;
+				http_free_request(&req);
+			}
 
-				if (config.continue_download)
-					http_add_header_printf(req, "Range: bytes=%llu-",
-						get_file_size(local_filename));
+			// the state of the connection is unknown after an incomplete body
+			if (resp && http_get_body(conn, resp, part, downloader))
+				resp->keep_alive = 0;
+		} else break;
 
-				if (config.timestamping) {
-					time_t mtime = get_file_mtime(local_filename);
+		if (!resp) {
+			// the current request is still counted as pending
+			if (conn->pending > 1)
+				pipelining_refuse(iri);
+			http_pool_close(&downloader->conn);
+			break;
+		}
 
-					if (mtime) {
-						char http_date[32];
+		// the server closes the connection with pipelined requests left
+		if (!resp->keep_alive && conn->pending)
+			pipelining_refuse(iri);
 
-						http_print_date(mtime + 1, http_date, sizeof(http_date));
-						http_add_header(req, "If-Modified-Since", http_date);
-					}
-				}
-			}
+		if (check_response(iri, &resp, downloader, &challenges))
+			break;
 
-			// 20.06.2012: www.google.de only sends gzip responses with one of the
-			// following header lines in the request.
-			// User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.5) Gecko/20100101 Firefox/10.0.5 Iceweasel/10.0.5
-			// User-Agent: Mozilla/5.0 (X11; Linux) KHTML/4.8.3 (like Gecko) Konqueror/4.8
-			// User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/536.11 (KHTML, like Gecko) Chrome/20.0.1132.34 Safari/536.11
-			// User-Agent: Opera/9.80 (X11; Linux x86_64; U; en) Presto/2.10.289 Version/12.00
-			// User-Agent: Wget/1.13.4 (linux-gnu)
-			//
-			// Accept: prefer XML over HTML
-			http_add_header_line(req,
-				/*				"Accept-Encoding: gzip\r\n"\
-				"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.5) Gecko/20100101 Firefox/10.0.5 Iceweasel/10.0.5\r\n"\
-				"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,/;q=0.8\r\n"
-				"Accept-Language: en-us,en;q=0.5\r\n");
-				 */
-				"Accept-Encoding: gzip, deflate\r\n");
-
-			http_add_header_line(req, "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n");
-
-//			if (config.spider && !config.recursive)
-//				http_add_header_if_modified_since(time(NULL));
-//				http_add_header_line(req, "If-Modified-Since: Wed, 29 Aug 2012 00:00:00 GMT\r\n");
-
-			if (config.user_agent)
-				http_add_header(req, "User-Agent", config.user_agent);
-
-			if (config.keep_alive)
-				http_add_header_line(req, "Connection: keep-alive\r\n");
-
-			if (!config.cache)
-				http_add_header_line(req, "Pragma: no-cache\r\n");
-
-			if (config.referer)
-				http_add_header(req, "Referer", config.referer);
-			else if (downloader->job->referer) {
-				MGET_IRI *referer = downloader->job->referer;
-				char sbuf[256];
-				mget_buffer_t buf;
-
-				mget_buffer_init(&buf, sbuf, sizeof(sbuf));
-
-				mget_buffer_strcat(&buf, referer->scheme);
-				mget_buffer_memcat(&buf, "://", 3);
-				mget_buffer_strcat(&buf, referer->host);
-				mget_buffer_memcat(&buf, "/", 1);
-				mget_iri_get_escaped_resource(referer, &buf);
-
-				http_add_header(req, "Referer", buf.data);
-				mget_buffer_deinit(&buf);
-			}
+		resend = 1;
+	}
 
-			if (challenges) {
-				// There might be more than one challenge, we could select the securest one.
-				// For simplicity and testing we just take the first for now.
-				// the following adds an Authorization: HTTP header
-//				http_add_credentials(req, vec_get(challenges, 0), config.username, config.password);
-				http_add_credentials(req, mget_vector_get(challenges, 0), config.http_username, config.http_password);
-				http_free_challenges(&challenges);
-			}
+	http_free_challenges(&challenges);
+
+	// the connection is kept for the next job, which is likely for the same host (see push_job()).
+	// it goes back to the pool when the downloader switches hosts or has nothing to do.
+	return resp;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/*
+ * Event driven download engine (--engine=epoll).
+ *
+ * Instead of one blocking thread per downloader, each downloader slot becomes a
+ * transfer state machine driven by non-blocking sockets.
+ * A small number of worker threads (one per CPU core) waits on epoll for the
+ * transfer sockets and the downloaders' command channels.
+ * The communication with the main thread is the same as with downloader_thread().
+ */
+
+enum {
+	TRANSFER_IDLE,
+	TRANSFER_CONNECTING,
+	TRANSFER_SENDING,
+	TRANSFER_RECEIVING,
+	TRANSFER_NEXT, // the downloader took the next job, started by the worker loop
+	TRANSFER_WAITING // backing off before a part is requested again
+};
+
+typedef struct {
+	MGET_IRI
+		*iri;
+	MGET_HTTP_RESPONSE_READER
+		*reader;
+	MGET_HTTP_RESPONSE
+		*resp;
+	MGET_VECTOR
+		*challenges;
+	struct output
+		out;
+	long long
+		deadline; // ms, 0 = no timeout
+	size_t
+		nsent; // request bytes sent so far
+	int
+		epfd,
+		fd, // socket currently registered with epfd or -1
+		events,
+		tries;
+	char
+		state;
+} TRANSFER;
+
+typedef struct {
+	pthread_t
+		tid;
+	int
+		epfd,
+		id,
+		nnext; // transfers in state TRANSFER_NEXT
+} WORKER;
+
+static TRANSFER
+	*transfers;
+static WORKER
+	*workers;
+static int
+	nworkers;
+
+static void
+	transfer_request(DOWNLOADER *downloader),
+	transfer_io(DOWNLOADER *downloader);
+
+// epoll event data: downloader id << 1, lowest bit set for transfer sockets
+#define EVENT_DATA(id, is_transfer) ((uint64_t)(id) << 1 | (is_transfer))
+
+static void transfer_set_deadline(TRANSFER *t, int timeout)
+{
+	t->deadline = timeout > 0 ? mget_get_timemillis() + timeout : 0;
+}
+
+// (un)register a transfer socket. <fd> = -1 removes the current one.
+// this has to be done before the socket is closed, since a new socket may get the same number.
+
+static void transfer_watch(DOWNLOADER *downloader, int fd, int events)
+{
+	TRANSFER *t = &transfers[downloader->id];
+	struct epoll_event ev = { .events = events, .data.u64 = EVENT_DATA(downloader->id, 1) };
+
+	if (t->fd != -1 && t->fd != fd) {
+		epoll_ctl(t->epfd, EPOLL_CTL_DEL, t->fd, NULL);
+		t->fd = -1;
+	}
+
+	if (fd == -1)
+		return;
+
+	if (t->fd == fd) {
+		if (t->events != events && epoll_ctl(t->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+			error_printf(_("Failed to modify epoll event (%d)\n"), errno);
+	} else if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		error_printf(_("Failed to add epoll event (%d)\n"), errno);
+
+	t->fd = fd;
+	t->events = events;
+}
+
+static void transfer_close_connection(DOWNLOADER *downloader)
+{
+	transfer_watch(downloader, -1, 0);
+	http_pool_close(&downloader->conn);
+}
+
+// Metalink parts are downloaded from the fastest mirrors, like download_part() does.
+// <avoid> is the mirror that just failed or -1.
+
+static MGET_IRI *transfer_select_iri(DOWNLOADER *downloader, int avoid)
+{
+	if (!downloader->part || !downloader->job->mirrors)
+		return downloader->job->iri;
+
+	return mirror_select(downloader, avoid);
+}
+
+// the transfer is over: continue with the next job, if the downloader has one.
+// it is started from the worker loop, a chain of failing jobs must not recurse.
+
+static void transfer_next(DOWNLOADER *downloader)
+{
+	// the connection is reused if the next job is for the same host
+	if (job_done(downloader)) {
+		transfers[downloader->id].state = TRANSFER_NEXT;
+		workers[downloader->id % nworkers].nnext++;
+	}
+}
+
+// try again after a failure or an incomplete part, like http_get() and download_part() do
+
+static void transfer_retry(DOWNLOADER *downloader)
+{
+	TRANSFER *t = &transfers[downloader->id];
+
+	if (downloader->part) {
+		if (terminate || downloader->part->done) {
+			// the endgame twin completed the part
+		} else if (++t->tries < part_max_tries(downloader->job)) {
+			// the request is sent by transfer_check_timeout()
+			t->iri = transfer_select_iri(downloader, downloader->job->mirrors ? downloader->mirror : -1);
+			t->state = TRANSFER_WAITING;
+			transfer_set_deadline(t, RETRY_BACKOFF << (t->tries - 1));
+			return;
+		} else {
+			error_printf(_("Failed to download part of '%s' after %d tries\n"), downloader->job->name, t->tries);
+			job_part_failed(downloader->job, downloader->part);
+		}
+	} else if (++t->tries < 3) {
+		channel_printf(main_channel, downloader->id, "Downloading...");
+		transfer_request(downloader);
+		return;
+	}
+
+	http_free_challenges(&t->challenges);
+	t->state = TRANSFER_IDLE;
+	transfer_next(downloader);
+}
+
+static void transfer_failed(DOWNLOADER *downloader)
+{
+	TRANSFER *t = &transfers[downloader->id];
+
+	http_response_reader_free(&t->reader);
+	http_free_response(&t->resp);
+	transfer_close_connection(downloader);
+	t->state = TRANSFER_IDLE;
+
+	if (downloader->part)
+		mirror_report(downloader, NULL);
+
+	transfer_retry(downloader);
+}
+
+// the response has been read completely (or the connection broke within the body)
+
+static void transfer_done(DOWNLOADER *downloader)
+{
+	TRANSFER *t = &transfers[downloader->id];
+	PART *part = downloader->part;
+
+	// the decompressor might still hold data for the body
+	http_response_reader_free(&t->reader);
+	http_close_body(t->resp, &t->out);
+	transfer_watch(downloader, -1, 0);
+	t->state = TRANSFER_IDLE;
+
+	if (!check_response(t->iri, &t->resp, downloader, &t->challenges)) {
+		transfer_request(downloader); // e.g. again with credentials
+		return;
+	}
+
+	if (part) {
+		check_part(part, t->resp);
+		mirror_report(downloader, t->resp);
+		http_free_response(&t->resp);
+
+		if (!part->done) {
+			transfer_retry(downloader);
+			return;
+		}
+	} else {
+		process_response(downloader, t->resp);
+		channel_printf(main_channel, downloader->id, "%d %s", t->resp->code, t->resp->reason);
+		http_free_response(&t->resp);
+	}
+
+	http_free_challenges(&t->challenges);
+	transfer_next(downloader);
+}
+
+// send a request for t->iri, reusing the connection if possible
+
+static void transfer_request(DOWNLOADER *downloader)
+{
+	TRANSFER *t = &transfers[downloader->id];
+	MGET_IRI *iri = t->iri;
+	MGET_HTTP_REQUEST *req;
+	ssize_t nbytes;
+
+	downloader->started = mget_get_timemillis();
+	downloader->latency = 0;
+
+	if (downloader->conn && !mget_strcmp(downloader->conn->esc_host, iri->host) &&
+		downloader->conn->scheme == iri->scheme &&
+		!mget_strcmp(downloader->conn->port, iri->resolv_port))
+	{
+		info_printf("reuse connection %s\n", downloader->conn->esc_host);
+	} else {
+		if (downloader->conn) {
+			transfer_watch(downloader, -1, 0);
+			http_pool_checkin(&downloader->conn);
+		}
+
+		// waiting for the pool limits would block all transfers of this worker
+		if ((downloader->conn = http_pool_checkout(iri))) {
+			info_printf("reuse connection %s\n", downloader->conn->esc_host);
+		} else if ((downloader->conn = http_open_async(iri))) {
+			info_printf("opened connection %s\n", downloader->conn->esc_host);
+		} else {
+			if (downloader->part)
+				mirror_report(downloader, NULL);
+			transfer_retry(downloader);
+			return;
+		}
+	}
+
+	req = create_request(iri, downloader->part, downloader->job, &t->challenges);
+	nbytes = http_request_to_buffer(req, downloader->conn->buf);
+	http_free_request(&req);
+
+	if (nbytes < 0) {
+		error_printf(_("Failed to create request buffer\n"));
+		transfer_failed(downloader);
+		return;
+	}
+
+	t->nsent = 0;
+	t->state = TRANSFER_CONNECTING;
+	transfer_set_deadline(t, config.connect_timeout);
+
+	transfer_io(downloader);
+}
+
+// a "go" command from the main thread or the next job the downloader took itself
+
+static void transfer_start(DOWNLOADER *downloader)
+{
+	TRANSFER *t = &transfers[downloader->id];
+
+	t->tries = 0;
 
-			if (part)
-				http_add_header_printf(req, "Range: bytes=%llu-%llu",
-					(unsigned long long) part->position, (unsigned long long) part->position + part->length - 1);
+	if (downloader->part)
+		channel_printf(main_channel, downloader->id, "downloading part...");
+	else
+		channel_printf(main_channel, downloader->id, "Downloading...");
 
-			// add cookies
-			if (config.cookies) {
-				const char *cookie_string;
+	t->iri = transfer_select_iri(downloader, -1);
+	transfer_request(downloader);
+}
+
+// drive the transfer as far as possible without blocking
+
+static void transfer_io(DOWNLOADER *downloader)
+{
+	TRANSFER *t = &transfers[downloader->id];
+	MGET_HTTP_CONNECTION *conn = downloader->conn;
+	ssize_t nbytes;
+	int rc;
+
+	switch (t->state) {
+	case TRANSFER_CONNECTING:
+		// the socket is closed when connecting to the next address fails
+		transfer_watch(downloader, -1, 0);
+
+		if ((rc = mget_tcp_connect_continue(conn->tcp)) < 0) {
+			transfer_failed(downloader);
+			return;
+		}
+
+		if (rc) {
+			transfer_watch(downloader, mget_tcp_get_sockfd(conn->tcp), rc == MGET_IO_READABLE ? EPOLLIN : EPOLLOUT);
+			return;
+		}
+
+		t->state = TRANSFER_SENDING;
+		transfer_set_deadline(t, config.read_timeout);
+		// fallthrough
+
+	case TRANSFER_SENDING:
+		if ((nbytes = mget_tcp_write(conn->tcp, conn->buf->data + t->nsent, conn->buf->length - t->nsent)) < 0) {
+			transfer_failed(downloader);
+			return;
+		}
+
+		if ((t->nsent += nbytes) < conn->buf->length) {
+			transfer_watch(downloader, mget_tcp_get_sockfd(conn->tcp), EPOLLOUT);
+			return;
+		}
 
-				if ((cookie_string = mget_cookie_create_request_header(iri))) {
-					http_add_header(req, "Cookie", cookie_string);
-					xfree(cookie_string);
+		debug_printf("# sent %zu bytes:\n%s", t->nsent, conn->buf->data);
+		conn->buf->length = 0; // the buffer now takes the response
+
+		t->reader = http_response_reader_alloc(conn, NULL, config.save_headers || config.server_response ? MGET_HTTP_RESPONSE_KEEPHEADER : 0);
+		t->state = TRANSFER_RECEIVING;
+		transfer_set_deadline(t, config.read_timeout);
+		transfer_watch(downloader, mget_tcp_get_sockfd(conn->tcp), EPOLLIN);
+		return;
+
+	case TRANSFER_RECEIVING:
+		for (;;) {
+			switch (http_response_reader_read(t->reader)) {
+			case MGET_HTTP_READER_AGAIN:
+				transfer_set_deadline(t, config.read_timeout);
+				return;
+
+			case MGET_HTTP_READER_HEADER:
+				t->resp = http_response_reader_get_response(t->reader);
+
+				switch (http_open_body(t->resp, &t->out, downloader->part, downloader)) {
+				case 1:
+					http_response_reader_set_body_cb(t->reader, _get_body_file, &t->out);
+					break;
+				case 0:
+					http_response_reader_set_body(t->reader, t->resp->body);
+					break;
+				default:
+					// the body is not wanted (segmented download)
+					t->resp->keep_alive = 0;
+					transfer_done(downloader);
+					return;
 				}
+				break;
+
+			case MGET_HTTP_READER_DONE:
+				transfer_done(downloader);
+				return;
+
+			default:
+				if (t->resp) {
+					// process what we got, like http_get() does
+					t->resp->keep_alive = 0;
+					transfer_done(downloader);
+				} else
+					transfer_failed(downloader);
+				return;
 			}
+		}
+
+	default: // TRANSFER_IDLE, TRANSFER_NEXT, TRANSFER_WAITING: stale event
+		return;
+	}
+}
+
+static void transfer_check_timeout(DOWNLOADER *downloader, long long now)
+{
+	TRANSFER *t = &transfers[downloader->id];
+
+	if (t->state == TRANSFER_IDLE || !t->deadline || now < t->deadline)
+		return;
+
+	if (t->state == TRANSFER_WAITING) {
+		transfer_request(downloader);
+		return;
+	}
+
+	error_printf(_("Timeout on connection to %s\n"), t->iri->host);
+
+	if (t->resp) {
+		t->resp->keep_alive = 0;
+		transfer_done(downloader);
+	} else
+		transfer_failed(downloader);
+}
+
+// commands from the main thread, see downloader_thread()
+
+static void transfer_command(DOWNLOADER *downloader)
+{
+	MESSAGE msg;
+
+	// the channel's fd stays readable until channel_idle() resets it
+	do {
+		while (!terminate && channel_receive(downloader->channel, &msg)) {
+			debug_printf("+ [%d] message %d\n", downloader->id, msg.type);
 
-			if (http_send_request(conn, req) == 0) {
-				resp = http_get_response(conn, req, config.save_headers || config.server_response ? MGET_HTTP_RESPONSE_KEEPHEADER : 0);
+			if (msg.type == MSG_CHECK) {
+				check_file(downloader, msg.job);
+			} else if (msg.type == MSG_GO) {
+				transfer_start(downloader);
 			}
+		}
+	} while (!terminate && !channel_idle(downloader->channel));
+}
 
-			http_free_request(&req);
-		} else break;
+static void *epoll_worker(void *p)
+{
+	WORKER *worker = p;
+	struct epoll_event events[64];
+	long long now, last_check = mget_get_timemillis();
+	int nfds, it, n;
 
-		if (!resp) {
-			http_close(&downloader->conn);
-			break;
+	while (!terminate) {
+		// downloaders that went on with their next job
+		while (worker->nnext && !terminate) {
+			worker->nnext = 0;
+			for (n = worker->id; n < config.num_threads && !terminate; n += nworkers) {
+				if (transfers[n].state == TRANSFER_NEXT)
+					transfer_start(&downloader[n]);
+			}
 		}
 
-		if (config.server_response)
-			info_printf("# got header %zd bytes:\n%s\n\n", resp->header->length, resp->header->data);
+		if ((nfds = epoll_wait(worker->epfd, events, countof(events), 1000)) == -1) {
+			if (errno == EINTR || errno == EBADF) break;
+			error_printf(_("Failed to epoll_wait, error %d\n"), errno);
+			continue;
+		}
 
-		// server doesn't support keep-alive or want us to close the connection
-		if (!resp->keep_alive)
-			http_close(&downloader->conn);
+		for (it = 0; it < nfds && !terminate; it++) {
+			DOWNLOADER *d = &downloader[events[it].data.u64 >> 1];
 
-		if (resp->code == 302 && resp->links && resp->digests)
-			break; // 302 with Metalink information
+			if (events[it].data.u64 & 1)
+				transfer_io(d);
+			else
+				transfer_command(d);
+		}
 
-		if (resp->code == 401 && !challenges) { // Unauthorized
-			if ((challenges = resp->challenges)) {
-				resp->challenges = NULL;
-				http_free_response(&resp);
-				continue; // try again with credentials
-			}
-			break;
+		// check timeouts once per second
+		if ((now = mget_get_timemillis()) - last_check >= 1000) {
+			for (n = worker->id; n < config.num_threads && !terminate; n += nworkers)
+				transfer_check_timeout(&downloader[n], now);
+			last_check = now;
 		}
+	}
+
+	return NULL;
+}
 
-		// 304 Not Modified
-		if (resp->code / 100 == 2 || resp->code / 100 >= 4 || resp->code == 304)
-			break; // final response
+static void epoll_engine_start(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n, rc;
 
-		if (resp->location) {
-			char uri_buf_static[1024];
-			mget_buffer_t uri_buf;
+	nworkers = ncpus > 0 && ncpus < config.num_threads ? (int)ncpus : config.num_threads;
+	workers = xcalloc(nworkers, sizeof(WORKER));
+	transfers = xcalloc(config.num_threads, sizeof(TRANSFER));
 
-			mget_cookie_normalize_cookies(iri, resp->cookies);
-			mget_cookie_store_cookies(resp->cookies);
+	for (n = 0; n < nworkers; n++) {
+		workers[n].id = n;
+		if ((workers[n].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+			error_printf_exit(_("Failed to create epoll instance (%d)\n"), errno);
+	}
 
-			mget_buffer_init(&uri_buf, uri_buf_static, sizeof(uri_buf_static));
+	// downloader n is served by worker n % nworkers
+	for (n = 0; n < config.num_threads; n++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT_DATA(n, 0) };
 
-			mget_iri_relative_to_abs(iri, resp->location, strlen(resp->location), &uri_buf);
+		transfers[n].fd = -1;
+		transfers[n].epfd = workers[n % nworkers].epfd;
 
-			dprintf(downloader->sockfd[1], "redirect - %s\n", uri_buf.data);
+		if (epoll_ctl(transfers[n].epfd, EPOLL_CTL_ADD, channel_get_fd(downloader[n].channel), &ev) == -1)
+			error_printf(_("Failed to add epoll event (%d)\n"), errno);
+	}
 
-			mget_buffer_deinit(&uri_buf);
-			break;
-		}
+	for (n = 0; n < nworkers; n++) {
+		if ((rc = pthread_create(&workers[n].tid, NULL, epoll_worker, &workers[n])) != 0)
+			error_printf_exit(_("Failed to start downloader, error %d\n"), rc);
+	}
+}
 
-		http_free_response(&resp);
+static void epoll_engine_stop(void)
+{
+	int n;
+
+	for (n = 0; n < nworkers; n++) {
+		if (pthread_kill(workers[n].tid, SIGTERM) == -1)
+			error_printf(_("Failed to kill downloader worker #%d\n"), n);
 	}
 
-	return resp;
+	for (n = 0; n < nworkers; n++) {
+		int rc;
+
+		if ((rc = pthread_join(workers[n].tid, NULL)) != 0)
+			error_printf(_("Failed to wait for downloader worker #%d (%d %d)\n"), n, rc, errno);
+		close(workers[n].epfd);
+	}
+
+	for (n = 0; n < config.num_threads; n++) {
+		TRANSFER *t = &transfers[n];
+
+		if (t->resp && t->reader)
+			http_close_body(t->resp, &t->out);
+		http_response_reader_free(&t->reader);
+		http_free_response(&t->resp);
+		http_free_challenges(&t->challenges);
+	}
+
+	xfree(transfers);
+	xfree(workers);
 }
+
+#else
+
+static void epoll_engine_start(void)
+{
+}
+
+static void epoll_engine_stop(void)
+{
+}
+
+#endif // HAVE_SYS_EPOLL_H
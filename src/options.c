@@ -102,12 +102,18 @@ static int G_GNUC_MGET_NORETURN print_help(G_GNUC_MGET_UNUSED option_t opt, G_GN
 		"  -r  --recursive         Recursive download. (default: off)\n"
 		"  -H  --span-hosts        Span hosts that were not given on the command line. (default: off)\n"
 		"      --num-threads       Max. concurrent download threads. (default: 5) (NEW!)\n"
+		"      --segments          Download large files in up to this number of parts in parallel,\n"
+		"                          if the server accepts byte ranges. 0 = off. (default: 0) (NEW!)\n"
+		"      --engine            Download engine, 'threads' (one thread per download) or 'epoll'\n"
+		"                          (--num-threads downloads driven by one thread per CPU core). (default: threads) (NEW!)\n"
 		"      --max-redirect      Max. number of redirections to follow. (default: 20)\n"
 		"  -T  --timeout           General network timeout in seconds.\n"
 		"      --dns-timeout       DNS lookup timeout in seconds.\n"
 		"      --connect-timeout   Connect timeout in seconds.\n"
 		"      --read-timeout      Read and write timeout in seconds.\n"
 		"      --dns-caching       Enable DNS cache. (default: on)\n"
+		"      --dns-cache-ttl     Seconds to keep resolved addresses in the DNS cache, -1: forever. (default: 300)\n"
+		"      --dns-negative-ttl  Seconds to remember unresolvable hosts, 0: don't. (default: 60)\n"
 		"  -O  --output-document   File where downloaded content is written to, '-'  for STDOUT.\n"
 		"      --spider            Enable web spider mode. (default: off)\n"
 		"      --proxy             Enable support for *_proxy environment variables. (default: on)\n"
@@ -141,6 +147,12 @@ static int G_GNUC_MGET_NORETURN print_help(G_GNUC_MGET_UNUSED option_t opt, G_GN
 		"                          Download the list with:\n"
 		"                          mget -O suffixes.txt http://mxr.mozilla.org/mozilla-central/source/netwerk/dns/effective_tld_names.dat?raw=1\n"
 		"      --http-keep-alive   Keep connection open for further requests. (default: on)\n"
+		"      --http-pipelining   Max. number of requests sent at once on a keep-alive connection, 0 = off. (default: 0)\n"
+		"      --http2             Use HTTP/2 with HTTPS servers that support it, one connection shared by all\n"
+		"                          downloads per host. Needs --engine=threads. (default: off)\n"
+		"      --max-connections   Max. number of open connections, shared by all downloads. (default: 2 * --num-threads)\n"
+		"      --max-host-connections Max. number of open connections per host, more downloads for the host\n"
+		"                          wait for the downloaders that are connected. (default: unlimited)\n"
 		"      --save-headers      Save the response headers in front of the response data. (default: off)\n"
 		"      --referer           Include Referer: url in HTTP requets. (default: off)\n"
 		"  -E  --adjust-extension  Append extension to saved file (.html or .css). (default: off)\n"
@@ -160,6 +172,8 @@ static int G_GNUC_MGET_NORETURN print_help(G_GNUC_MGET_UNUSED option_t opt, G_GN
 		"      --ca-directory      Directory with PEM CA certificates.\n"
 		"      --random-file       File to be used as source of random data.\n"
 		"      --egd-file          File to be used as socket for random data from Entropy Gathering Daemon.\n"
+		"      --tls-resume        Resume TLS sessions with servers seen before. (default: on)\n"
+		"      --tls-session-file  File to load and save TLS sessions, to resume them in later runs.\n"
 		"\n");
 	puts(
 		"Directory options:\n"
@@ -342,6 +356,20 @@ static int parse_n_option(G_GNUC_MGET_UNUSED option_t opt, G_GNUC_MGET_UNUSED co
 	return 0;
 }
 
+static int parse_engine(option_t opt, G_GNUC_MGET_UNUSED const char *const *argv, const char *val)
+{
+	if (!val || !strcasecmp(val, "threads"))
+		*((char *)opt->var) = ENGINE_THREADS;
+#ifdef HAVE_SYS_EPOLL_H
+	else if (!strcasecmp(val, "epoll"))
+		*((char *)opt->var) = ENGINE_EPOLL;
+#endif
+	else
+		error_printf_exit("Unknown download engine '%s'\n", val);
+
+	return 0;
+}
+
 static int parse_prefer_family(G_GNUC_MGET_UNUSED option_t opt, G_GNUC_MGET_UNUSED const char *const *argv, const char *val)
 {
 	if (!val || !strcasecmp(val, "none"))
@@ -364,9 +392,12 @@ struct config config = {
 	.max_redirect = 20,
 	.num_threads = 5,
 	.dns_caching = 1,
+	.dns_cache_ttl = 300,
+	.dns_negative_ttl = 60,
 	.user_agent = "Mget/"PACKAGE_VERSION,
 	.verbose = 1,
 	.check_certificate=1,
+	.tls_resume = 1,
 	.cert_type = MGET_SSL_X509_FMT_PEM,
 	.private_key_type = MGET_SSL_X509_FMT_PEM,
 	.secure_protocol = "AUTO",
@@ -406,9 +437,12 @@ static const struct option options[] = {
 	{ "directories", &config.directories, parse_bool, 0, 0},
 	{ "directory-prefix", &config.directory_prefix, parse_string, 1, 'P'},
 	{ "dns-cache", &config.dns_caching, parse_bool, 0, 0},
+	{ "dns-cache-ttl", &config.dns_cache_ttl, parse_integer, 1, 0},
+	{ "dns-negative-ttl", &config.dns_negative_ttl, parse_integer, 1, 0},
 	{ "dns-timeout", &config.dns_timeout, parse_timeout, 1, 0},
 	{ "domains", &config.domains, parse_stringset, 1, 'D'},
 	{ "egd-file", &config.egd_file, parse_string, 1, 0},
+	{ "engine", &config.engine, parse_engine, 1, 0},
 	{ "exclude-domains", &config.exclude_domains, parse_stringset, 1, 0},
 	{ "force-css", &config.force_css, parse_bool, 0, 0},
 	{ "force-directories", &config.force_directories, parse_bool, 0, 'x'},
@@ -418,8 +452,10 @@ static const struct option options[] = {
 	{ "html-extension", &config.adjust_extension, parse_bool, 0, 0}, // obsolete, replaced by --adjust-extension
 	{ "http-keep-alive", &config.keep_alive, parse_bool, 0, 0},
 	{ "http-password", &config.http_password, parse_string, 1, 0},
+	{ "http-pipelining", &config.http_pipelining, parse_integer, 1, 0},
 	{ "http-proxy", &config.http_proxy, parse_string, 1, 0},
 	{ "http-user", &config.http_username, parse_string, 1, 0},
+	{ "http2", &config.http2, parse_bool, 0, 0},
 	{ "https-proxy", &config.https_proxy, parse_string, 1, 0},
 	{ "inet4-only", &config.inet4_only, parse_bool, 0, '4'},
 	{ "inet6-only", &config.inet6_only, parse_bool, 0, '6'},
@@ -427,6 +463,8 @@ static const struct option options[] = {
 	{ "keep-session-cookies", &config.keep_session_cookies, parse_bool, 0, 0},
 	{ "load-cookies", &config.load_cookies, parse_string, 1, 0},
 	{ "local-encoding", &config.local_encoding, parse_string, 1, 0},
+	{ "max-connections", &config.max_connections, parse_integer, 1, 0},
+	{ "max-host-connections", &config.max_host_connections, parse_integer, 1, 0},
 	{ "max-redirect", &config.max_redirect, parse_integer, 1, 0},
 	{ "n", NULL, parse_n_option, 1, 'n'}, // special Wget compatibility option
 	{ "num-threads", &config.num_threads, parse_integer, 1, 0},
@@ -447,12 +485,15 @@ static const struct option options[] = {
 	{ "save-cookies", &config.save_cookies, parse_string, 1, 0},
 	{ "save-headers", &config.save_headers, parse_bool, 0, 0},
 	{ "secure-protocol", &config.secure_protocol, parse_string, 1, 0},
+	{ "segments", &config.segments, parse_integer, 1, 0},
 	{ "server-response", &config.server_response, parse_bool, 0, 'S'},
 	{ "span-hosts", &config.span_hosts, parse_bool, 0, 'H'},
 	{ "spider", &config.spider, parse_bool, 0, 0},
 	{ "strict-comments", &config.strict_comments, parse_bool, 0, 0},
 	{ "timeout", NULL, parse_timeout, 1, 'T'},
 	{ "timestamping", &config.timestamping, parse_bool, 0, 'N'},
+	{ "tls-resume", &config.tls_resume, parse_bool, 0, 0},
+	{ "tls-session-file", &config.tls_session_file, parse_string, 1, 0},
 	{ "use-server-timestamp", &config.use_server_timestamps, parse_bool, 0, 0},
 	{ "user", &config.username, parse_string, 1, 0},
 	{ "user-agent", &config.user_agent, parse_string, 1, 'U'},
@@ -883,6 +924,11 @@ int init(int argc, const char *const *argv)
 	if (config.num_threads < 1)
 		config.num_threads = 1;
 
+	if (config.max_connections <= 0)
+		config.max_connections = config.num_threads * 2;
+	else if (config.max_connections < config.num_threads)
+		config.max_connections = config.num_threads; // else downloaders would just wait
+
 	// truncate output document
 	if (config.output_document && strcmp(config.output_document,"-")) {
 		int fd = open(config.output_document, O_WRONLY | O_TRUNC);
@@ -920,6 +966,8 @@ int init(int argc, const char *const *argv)
 	mget_tcp_set_connect_timeout(config.connect_timeout);
 	mget_tcp_set_dns_timeout(config.dns_timeout);
 	mget_tcp_set_dns_caching(config.dns_caching);
+	mget_tcp_set_dns_cache_ttl(config.dns_cache_ttl);
+	mget_tcp_set_dns_negative_ttl(config.dns_negative_ttl);
 	mget_tcp_set_bind_address(config.bind_address);
 	if (config.inet4_only)
 		mget_tcp_set_family(MGET_NET_FAMILY_IPV4);
@@ -930,10 +978,22 @@ int init(int argc, const char *const *argv)
 
 	mget_iri_set_defaultpage(config.default_page);
 
+	// connection pool shared by the downloaders
+	http_pool_set_limits(config.max_host_connections, config.max_connections);
+	if (!config.keep_alive)
+		http_pool_set_idle_timeout(0);
+
+	// the epoll engine only speaks HTTP/1.1
+	if (config.http2 && config.engine == ENGINE_THREADS)
+		http_set_http2(1);
+
 	// SSL settings
 	mget_ssl_set_config_int(MGET_SSL_CHECK_CERTIFICATE, config.check_certificate);
 	mget_ssl_set_config_int(MGET_SSL_CERT_TYPE, config.cert_type);
 	mget_ssl_set_config_int(MGET_SSL_PRIVATE_KEY_TYPE, config.private_key_type);
+	mget_ssl_set_config_int(MGET_SSL_SESSION_CACHE, config.tls_resume);
+	if (config.tls_resume && config.tls_session_file)
+		mget_ssl_session_cache_load(config.tls_session_file);
 	mget_ssl_set_config_string(MGET_SSL_SECURE_PROTOCOL, config.secure_protocol);
 	mget_ssl_set_config_string(MGET_SSL_CA_DIRECTORY, config.ca_directory);
 	mget_ssl_set_config_string(MGET_SSL_CA_CERT, config.ca_cert);
@@ -948,6 +1008,7 @@ int init(int argc, const char *const *argv)
 
 void deinit(void)
 {
+	http_pool_free(); // closes idle connections
 	mget_tcp_set_dns_caching(0); // frees DNS cache
 	mget_tcp_set_bind_address(NULL); // free bind address
 
@@ -959,6 +1020,7 @@ void deinit(void)
 	xfree(config.user_agent);
 	xfree(config.output_document);
 	xfree(config.ca_cert);
+	xfree(config.tls_session_file);
 	xfree(config.ca_directory);
 	xfree(config.cert_file);
 	xfree(config.egd_file);
@@ -31,6 +31,10 @@
 
 #include <libmget.h>
 
+// download engines, see --engine
+#define ENGINE_THREADS 0 // one thread per download
+#define ENGINE_EPOLL   1 // event driven downloads, one thread per CPU core
+
 struct config {
 	MGET_IRI
 		*base;
@@ -62,6 +66,7 @@ struct config {
 		*egd_file,
 		*private_key,
 		*random_file,
+		*tls_session_file,
 		*secure_protocol; // auto, SSLv2, SSLv3, TLSv1
 	MGET_STRINGMAP
 		*domains,
@@ -73,8 +78,14 @@ struct config {
 		cut_directories,
 		connect_timeout, // ms
 		dns_timeout, // ms
+		dns_cache_ttl, // s
+		dns_negative_ttl, // s
 		read_timeout, // ms
 		max_redirect,
+		http_pipelining, // max. number of requests in flight per connection
+		max_connections,
+		max_host_connections,
+		segments, // max. number of parts of a single file downloaded in parallel
 		num_threads;
 	char
 		force_css,
@@ -96,13 +107,16 @@ struct config {
 		continue_download,
 		server_response,
 		keep_alive,
+		http2,
 		keep_session_cookies,
 		cookies,
 		spider,
 		dns_caching,
 		check_certificate,
+		tls_resume,
 		cert_type, // SSL_X509_FMT_PEM or SSL_X509_FMT_DER (=ASN1)
 		private_key_type, // SSL_X509_FMT_PEM or SSL_X509_FMT_DER (=ASN1)
+		engine, // ENGINE_THREADS or ENGINE_EPOLL
 		span_hosts,
 		recursive,
 		verbose,
@@ -0,0 +1,111 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * testing performance of the message channel between downloaders and main thread
+ *
+ * usage: channel_perf [number of senders] [messages per sender]
+ * each sender reports the same link as many times, like downloaders parsing HTML pages do.
+ * the main thread receives them and wakes up via poll(), as in mget.c.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <libmget.h>
+
+#include "../src/channel.h"
+
+static CHANNEL
+	*channel;
+static int
+	nmessages = 1000000;
+
+static void *sender(void *p)
+{
+	MESSAGE msg = { .type = MSG_ADD_URI, .id = (int)(ptrdiff_t)p };
+	int it;
+
+	for (it = 0; it < nmessages; it++) {
+		msg.number = it;
+		channel_send(channel, &msg);
+	}
+
+	return NULL;
+}
+
+int main(int argc, const char *const *argv)
+{
+	int nsenders = argc > 1 ? atoi(argv[1]) : 4, it;
+	long long received = 0, expected, start, millis, sum = 0, wakeups = 0;
+	pthread_t *tids;
+
+	if (argc > 2)
+		nmessages = atoi(argv[2]);
+
+	expected = (long long)nsenders * nmessages;
+	channel = channel_create(4096);
+	tids = calloc(nsenders, sizeof(pthread_t));
+
+	start = mget_get_timemillis();
+
+	for (it = 0; it < nsenders; it++)
+		pthread_create(&tids[it], NULL, sender, (void *)(ptrdiff_t)it);
+
+	while (received < expected) {
+		MESSAGE msg;
+
+		if (channel_idle(channel)) {
+			struct pollfd pollfd = { .fd = channel_get_fd(channel), .events = POLLIN };
+
+			poll(&pollfd, 1, -1);
+			wakeups++;
+		}
+
+		while (channel_receive(channel, &msg)) {
+			sum += msg.number;
+			received++;
+		}
+	}
+
+	for (it = 0; it < nsenders; it++)
+		pthread_join(tids[it], NULL);
+
+	millis = mget_get_timemillis() - start;
+
+	printf("%d senders, %lld messages in %lld ms (%.0f ns/message), %lld wakeups\n",
+		nsenders, received, millis, millis * 1e6 / (received ? received : 1), wakeups);
+
+	channel_free(&channel);
+	free(tids);
+
+	if (sum != nsenders * ((long long)nmessages * (nmessages - 1) / 2)) {
+		printf("Failed: messages got lost\n");
+		return 1;
+	}
+
+	return 0;
+}
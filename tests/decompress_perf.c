@@ -0,0 +1,218 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * testing performance of gzip decompression
+ *
+ * usage: decompress_perf [file...]
+ * the files (default: generated HTML-like text) are gzipped in memory and decompressed
+ * from 16 KB pieces, as they come from the network, into a memory buffer:
+ *  - reference: the former implementation (10 KB output buffer, Z_SYNC_FLUSH)
+ *  - callback:  mget_decompress() with put_data() callback
+ *  - buffer:    mget_decompress() in whole-buffer mode (mget_decompress_set_output())
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include <libmget.h>
+
+#define PIECE_SIZE 16384
+#define ROUNDS 10
+
+static size_t calls;
+
+static int _get_body(void *context, const char *data, size_t length)
+{
+	mget_buffer_memcat((mget_buffer_t *)context, data, length);
+	calls++;
+	return 0;
+}
+
+// the gzip decompression as it was before: 10 KB stack buffer, Z_SYNC_FLUSH, put_data() per 10 KB
+static int _reference_decompress(z_stream *strm, char *src, size_t srclen, mget_buffer_t *body)
+{
+	char dst[10240];
+	int status;
+
+	strm->next_in = (unsigned char *)src;
+	strm->avail_in = srclen;
+
+	do {
+		strm->next_out = (unsigned char *)dst;
+		strm->avail_out = sizeof(dst);
+
+		status = inflate(strm, Z_SYNC_FLUSH);
+		if ((status == Z_OK || status == Z_STREAM_END) && strm->avail_out < sizeof(dst))
+			_get_body(body, dst, sizeof(dst) - strm->avail_out);
+	} while (status == Z_OK && !strm->avail_out);
+
+	return status == Z_OK || status == Z_STREAM_END ? 0 : -1;
+}
+
+static char *_gzip(const char *data, size_t length, size_t *gzlength)
+{
+	z_stream strm;
+	char *gz = malloc(deflateBound(NULL, length) + 32);
+
+	memset(&strm, 0, sizeof(strm));
+	deflateInit2(&strm, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	strm.next_in = (unsigned char *)data;
+	strm.avail_in = length;
+	strm.next_out = (unsigned char *)gz;
+	strm.avail_out = deflateBound(&strm, length) + 32;
+	deflate(&strm, Z_FINISH);
+	*gzlength = strm.total_out;
+	deflateEnd(&strm);
+
+	return gz;
+}
+
+static char *_generate_html(size_t length)
+{
+	static const char *words[] = {
+		"<div class=\"item\">", "</div>\n", "<a href=\"/article/", "\">", "</a>", "<p>", "</p>\n",
+		"the", "download", "server", "network", "connection", "response", "header", "content",
+		"compression", "performance", "mirror", "<span>", "</span>", "<li>", "</li>\n", " "
+	};
+	char *data = malloc(length + 64), *p = data;
+	unsigned seed = 1;
+
+	while ((size_t)(p - data) < length) {
+		seed = seed * 1103515245 + 12345;
+		p += sprintf(p, "%s%s", words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))], (seed >> 8) & 1 ? " " : "");
+		if (!((seed >> 4) & 31))
+			p += sprintf(p, "%u", seed >> 20);
+	}
+
+	return data;
+}
+
+static char *_read_file(const char *fname, size_t *length)
+{
+	struct stat st;
+	char *buf;
+	ssize_t nbytes;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Failed to open %s\n", fname);
+		return NULL;
+	}
+
+	buf = malloc(st.st_size + 1);
+	nbytes = read(fd, buf, st.st_size);
+	*length = nbytes > 0 ? (size_t)nbytes : 0;
+	close(fd);
+
+	return buf;
+}
+
+static void _report(const char *name, long long millis, size_t length, int ok)
+{
+	printf("  %-10s %5lld ms  %7.1f MB/s  %8zu callbacks%s\n", name, millis,
+		millis ? (double)length * ROUNDS / (millis * 1000.0) : 0.0, calls / ROUNDS, ok ? "" : "  (WRONG OUTPUT)");
+}
+
+int main(int argc, const char *const *argv)
+{
+	int it, nfiles = argc > 1 ? argc - 1 : 1;
+
+	for (it = 0; it < nfiles; it++) {
+		mget_buffer_t *body = mget_buffer_alloc(102400);
+		MGET_DECOMPRESSOR *dc;
+		z_stream strm;
+		size_t length, gzlength, pos, n;
+		char *data, *gz;
+		long long start;
+		int round;
+
+		if (argc > 1) {
+			if (!(data = _read_file(argv[it + 1], &length)))
+				continue;
+		} else {
+			length = 64 * 1024 * 1024;
+			data = _generate_html(length);
+		}
+
+		gz = _gzip(data, length, &gzlength);
+		printf("%s: %zu bytes, gzipped %zu bytes\n", argc > 1 ? argv[it + 1] : "generated HTML", length, gzlength);
+
+		// decompress into a fresh buffer each time, like a body in memory
+		calls = 0;
+		start = mget_get_timemillis();
+		for (round = 0; round < ROUNDS; round++) {
+			mget_buffer_free(&body);
+			body = mget_buffer_alloc(102400);
+			memset(&strm, 0, sizeof(strm));
+			inflateInit2(&strm, 15 + 32);
+			for (pos = 0; pos < gzlength; pos += n) {
+				n = gzlength - pos < PIECE_SIZE ? gzlength - pos : PIECE_SIZE;
+				_reference_decompress(&strm, gz + pos, n, body);
+			}
+			inflateEnd(&strm);
+		}
+		_report("reference", mget_get_timemillis() - start, length, body->length == length && !memcmp(body->data, data, length));
+
+		calls = 0;
+		start = mget_get_timemillis();
+		for (round = 0; round < ROUNDS; round++) {
+			mget_buffer_free(&body);
+			body = mget_buffer_alloc(102400);
+			dc = mget_decompress_open(mget_content_encoding_gzip, _get_body, body);
+			for (pos = 0; pos < gzlength; pos += n) {
+				n = gzlength - pos < PIECE_SIZE ? gzlength - pos : PIECE_SIZE;
+				mget_decompress(dc, gz + pos, n);
+			}
+			mget_decompress_close(dc);
+		}
+		_report("callback", mget_get_timemillis() - start, length, body->length == length && !memcmp(body->data, data, length));
+
+		calls = 0;
+		start = mget_get_timemillis();
+		for (round = 0; round < ROUNDS; round++) {
+			mget_buffer_free(&body);
+			body = mget_buffer_alloc(102400);
+			dc = mget_decompress_open(mget_content_encoding_gzip, _get_body, body);
+			mget_decompress_set_output(dc, body);
+			for (pos = 0; pos < gzlength; pos += n) {
+				n = gzlength - pos < PIECE_SIZE ? gzlength - pos : PIECE_SIZE;
+				mget_decompress(dc, gz + pos, n);
+			}
+			mget_decompress_close(dc);
+		}
+		_report("buffer", mget_get_timemillis() - start, length, body->length == length && !memcmp(body->data, data, length));
+
+		mget_buffer_free(&body);
+		free(gz);
+		free(data);
+	}
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * testing performance of the chunked transfer decoder
+ *
+ * usage: http_chunked_perf [body size in MB]
+ * a body is chunk encoded with chunk sizes from 1 byte up to 64 KB, sent by a forked
+ * server on the loopback interface and read with http_get_response_body_cb().
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <libmget.h>
+
+struct sink {
+	size_t
+		bytes,
+		calls;
+};
+
+static int _count_body(void *context, const char *data, size_t length)
+{
+	struct sink *sink = context;
+
+	(void)data;
+	sink->bytes += length;
+	sink->calls++;
+	return 0;
+}
+
+static char *_encode(size_t body_size, size_t chunk_size, size_t *length)
+{
+	char *data = malloc(body_size + (body_size / chunk_size + 1) * 32), *p = data;
+	size_t n, left;
+
+	for (left = body_size; left; left -= n) {
+		n = left < chunk_size ? left : chunk_size;
+		p += sprintf(p, "%zx\r\n", n);
+		memset(p, 'x', n);
+		p += n;
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	p += sprintf(p, "0\r\n\r\n");
+
+	*length = p - data;
+	return data;
+}
+
+// answer one request with <data> and exit
+
+static void _serve(int sockfd, const char *data, size_t length)
+{
+	static const char header[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+	char buf[1024];
+	ssize_t nbytes;
+	int fd;
+
+	// _exit() to not flush the parent's stdio buffers a second time
+	if ((fd = accept(sockfd, NULL, NULL)) == -1)
+		_exit(1);
+
+	// read the request, else the close might reset the connection
+	if (read(fd, buf, sizeof(buf)) <= 0 || write(fd, header, sizeof(header) - 1) <= 0)
+		_exit(1);
+
+	for (; length; data += nbytes, length -= nbytes) {
+		if ((nbytes = write(fd, data, length)) <= 0)
+			_exit(1);
+	}
+
+	close(fd);
+	_exit(0);
+}
+
+int main(int argc, const char *const *argv)
+{
+	static const size_t chunk_sizes[] = { 1, 16, 256, 4096, 65536 };
+	size_t body_size = (argc > 1 ? (size_t)atoi(argv[1]) : 16) * 1024 * 1024;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char url[64];
+	unsigned it;
+	int sockfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+		|| bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(sockfd, 1) == -1
+		|| getsockname(sockfd, (struct sockaddr *)&addr, &addrlen) == -1)
+	{
+		fprintf(stderr, "Failed to set up server socket\n");
+		return 1;
+	}
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/", ntohs(addr.sin_port));
+
+	for (it = 0; it < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); it++) {
+		MGET_IRI *iri = mget_iri_parse(url, NULL);
+		MGET_HTTP_CONNECTION *conn;
+		MGET_HTTP_REQUEST *req;
+		MGET_HTTP_RESPONSE *resp = NULL;
+		struct sink sink = { 0, 0 };
+		long long start, millis;
+		size_t length;
+		char *data = _encode(body_size, chunk_sizes[it], &length);
+		pid_t pid;
+
+		if ((pid = fork()) == 0)
+			_serve(sockfd, data, length);
+
+		start = mget_get_timemillis();
+
+		req = http_create_request(iri, "GET");
+		if (!(conn = http_open(iri)) || http_send_request(conn, req)
+			|| !(resp = http_get_response_header(conn, req, 0))
+			|| http_get_response_body_cb(conn, resp, _count_body, &sink))
+		{
+			fprintf(stderr, "Failed to get chunked body\n");
+			kill(pid, SIGTERM);
+		}
+
+		millis = mget_get_timemillis() - start;
+
+		printf("chunk size %6zu: %zu bytes in %lld ms (%.1f MB/s), %zu callbacks\n",
+			chunk_sizes[it], sink.bytes, millis,
+			millis ? sink.bytes / (millis * 1000.0) : 0.0, sink.calls);
+
+		waitpid(pid, NULL, 0);
+		http_free_response(&resp);
+		http_free_request(&req);
+		if (conn)
+			http_close(&conn);
+		mget_iri_free(&iri);
+		free(data);
+	}
+
+	close(sockfd);
+
+	return 0;
+}
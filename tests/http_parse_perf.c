@@ -0,0 +1,270 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * testing performance of the HTTP response header parser
+ *
+ * usage: http_parse_perf [-n iterations] [header files...]
+ * without files, a built-in corpus of response headers as sent by popular servers is used.
+ * a header file contains one response header, e.g. saved by 'curl -D' or 'mget -S'.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libmget.h>
+
+static const char *corpus[] = {
+	// nginx, static file
+	"HTTP/1.1 200 OK\r\n"
+	"Server: nginx/1.18.0 (Ubuntu)\r\n"
+	"Date: Mon, 12 Oct 2020 08:15:42 GMT\r\n"
+	"Content-Type: text/html\r\n"
+	"Content-Length: 612\r\n"
+	"Last-Modified: Tue, 21 Apr 2020 14:09:01 GMT\r\n"
+	"Connection: keep-alive\r\n"
+	"ETag: \"5e9efe7d-264\"\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"\r\n",
+
+	// Apache, dynamic page
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Mon, 12 Oct 2020 08:16:03 GMT\r\n"
+	"Server: Apache/2.4.41 (Ubuntu)\r\n"
+	"Vary: Accept-Encoding,Cookie\r\n"
+	"Cache-Control: max-age=3, must-revalidate\r\n"
+	"Content-Encoding: gzip\r\n"
+	"Content-Length: 18453\r\n"
+	"Keep-Alive: timeout=5, max=100\r\n"
+	"Connection: Keep-Alive\r\n"
+	"Content-Type: text/html; charset=UTF-8\r\n"
+	"\r\n",
+
+	// CDN in front of a web application
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Mon, 12 Oct 2020 08:16:27 GMT\r\n"
+	"Content-Type: text/html; charset=utf-8\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"Connection: keep-alive\r\n"
+	"Set-Cookie: __cfduid=d41d8cd98f00b204e9800998ecf8427e1602490587; expires=Wed, 11-Nov-20 08:16:27 GMT; path=/; domain=.example.com; HttpOnly; SameSite=Lax\r\n"
+	"Cache-Control: private, max-age=0, no-store, no-cache, must-revalidate, post-check=0, pre-check=0\r\n"
+	"Expires: Thu, 01 Jan 1970 00:00:01 GMT\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"X-Frame-Options: SAMEORIGIN\r\n"
+	"X-Content-Type-Options: nosniff\r\n"
+	"Strict-Transport-Security: max-age=15552000; includeSubDomains\r\n"
+	"CF-Cache-Status: DYNAMIC\r\n"
+	"cf-request-id: 05c1b2a3e400000d3d5a8f2000000001\r\n"
+	"Server: cloudflare\r\n"
+	"CF-RAY: 5e0c2a1b9d3c0d3d-FRA\r\n"
+	"Content-Encoding: gzip\r\n"
+	"\r\n",
+
+	// object storage
+	"HTTP/1.1 200 OK\r\n"
+	"x-amz-id-2: ef0wH1nRz0Qd9Jw8mGMHkY3a9oXbWmXqPzD4l3aB2sT1Hc5sJqE6lO0a2u5eYv7cM8kN1rW4tQ=\r\n"
+	"x-amz-request-id: 3B3C7C725673C630\r\n"
+	"Date: Mon, 12 Oct 2020 08:17:01 GMT\r\n"
+	"Last-Modified: Fri, 09 Oct 2020 17:43:05 GMT\r\n"
+	"ETag: \"fba9dede5f27731c9771645a39863328\"\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Content-Type: application/octet-stream\r\n"
+	"Content-Length: 434234\r\n"
+	"Server: AmazonS3\r\n"
+	"\r\n",
+
+	// redirect
+	"HTTP/1.1 301 Moved Permanently\r\n"
+	"Server: nginx\r\n"
+	"Date: Mon, 12 Oct 2020 08:17:12 GMT\r\n"
+	"Content-Type: text/html\r\n"
+	"Content-Length: 162\r\n"
+	"Connection: keep-alive\r\n"
+	"Location: https://www.example.org/download/\r\n"
+	"\r\n",
+
+	// big site with many cookies and security headers
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Mon, 12 Oct 2020 08:17:30 GMT\r\n"
+	"Expires: -1\r\n"
+	"Cache-Control: private, max-age=0\r\n"
+	"Content-Type: text/html; charset=ISO-8859-1\r\n"
+	"P3P: CP=\"This is not a P3P policy! See g.co/p3phelp for more info.\"\r\n"
+	"Server: gws\r\n"
+	"X-XSS-Protection: 0\r\n"
+	"X-Frame-Options: SAMEORIGIN\r\n"
+	"Set-Cookie: 1P_JAR=2020-10-12-08; expires=Wed, 11-Nov-2020 08:17:30 GMT; path=/; domain=.example.com; Secure\r\n"
+	"Set-Cookie: NID=204=Xk2mPq0a1B9cD8eF7gH6iJ5kL4mN3oP2qR1sT0uV9wX8yZ7aB6cD5eF4gH3iJ2kL1mN0oP9qR8sT7uV6wX5yZ4; expires=Tue, 13-Apr-2021 08:17:30 GMT; path=/; domain=.example.com; HttpOnly\r\n"
+	"Alt-Svc: h3-Q050=\":443\"; ma=2592000,h3-29=\":443\"; ma=2592000,h3-27=\":443\"; ma=2592000,h3-T051=\":443\"; ma=2592000,h3-T050=\":443\"; ma=2592000,h3-Q046=\":443\"; ma=2592000,h3-Q043=\":443\"; ma=2592000,quic=\":443\"; ma=2592000; v=\"46,43\"\r\n"
+	"Accept-Ranges: none\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"\r\n",
+
+	// code hosting, raw file
+	"HTTP/1.1 200 OK\r\n"
+	"Connection: keep-alive\r\n"
+	"Content-Length: 5362\r\n"
+	"Cache-Control: max-age=300\r\n"
+	"Content-Security-Policy: default-src 'none'; style-src 'unsafe-inline'; sandbox\r\n"
+	"Content-Type: text/plain; charset=utf-8\r\n"
+	"ETag: W/\"0b1b3a7c4e2f0d1e5f6a7b8c9d0e1f2a3b4c5d6e7f8091a2b3c4d5e6f708192a\"\r\n"
+	"Strict-Transport-Security: max-age=31536000\r\n"
+	"X-Content-Type-Options: nosniff\r\n"
+	"X-Frame-Options: deny\r\n"
+	"X-XSS-Protection: 1; mode=block\r\n"
+	"Via: 1.1 varnish\r\n"
+	"Date: Mon, 12 Oct 2020 08:18:02 GMT\r\n"
+	"X-Served-By: cache-fra19150-FRA\r\n"
+	"X-Cache: HIT\r\n"
+	"X-Cache-Hits: 1\r\n"
+	"X-Timer: S1602490682.123456,VS0,VE1\r\n"
+	"Vary: Authorization,Accept-Encoding,Origin\r\n"
+	"Access-Control-Allow-Origin: *\r\n"
+	"Expires: Mon, 12 Oct 2020 08:23:02 GMT\r\n"
+	"Source-Age: 12\r\n"
+	"\r\n",
+
+	// not found
+	"HTTP/1.1 404 Not Found\r\n"
+	"Date: Mon, 12 Oct 2020 08:18:21 GMT\r\n"
+	"Server: Apache\r\n"
+	"Content-Length: 196\r\n"
+	"Content-Type: text/html; charset=iso-8859-1\r\n"
+	"\r\n",
+
+	// authentication required
+	"HTTP/1.1 401 Unauthorized\r\n"
+	"Date: Mon, 12 Oct 2020 08:18:40 GMT\r\n"
+	"Server: Apache\r\n"
+	"WWW-Authenticate: Digest realm=\"private\", nonce=\"x4SsxL+wBQA=2b1d3f0a4f1e5e2c7a8b9c0d1e2f3a4b5c6d7e8f\", algorithm=MD5, qop=\"auth\"\r\n"
+	"Content-Length: 381\r\n"
+	"Content-Type: text/html; charset=iso-8859-1\r\n"
+	"\r\n",
+
+	// HTTP/2 response as converted by _h2_get_response_header()
+	"HTTP/2.0 200 \r\n"
+	"content-type: image/png\r\n"
+	"content-length: 13504\r\n"
+	"date: Mon, 12 Oct 2020 08:19:00 GMT\r\n"
+	"last-modified: Thu, 01 Oct 2020 11:52:13 GMT\r\n"
+	"etag: \"34c0-5b09a5e7c4d40\"\r\n"
+	"cache-control: public, max-age=31536000\r\n"
+	"server: ECS (dcb/7EA3)\r\n"
+	"x-cache: HIT\r\n"
+	"\r\n",
+};
+
+static char *_read_file(const char *fname)
+{
+	struct stat st;
+	char *buf;
+	ssize_t nbytes;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "Failed to open %s (%d)\n", fname, errno);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return NULL;
+	}
+
+	if ((nbytes = read(fd, buf, st.st_size)) < 0)
+		nbytes = 0;
+	buf[nbytes] = 0;
+
+	close(fd);
+	return buf;
+}
+
+int main(int argc, const char *const *argv)
+{
+	const char **headers = corpus;
+	char **work;
+	size_t *lengths, bytes = 0;
+	int nheaders = sizeof(corpus) / sizeof(corpus[0]), iterations = 100000, it, n;
+	long long start, millis;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		iterations = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc > 1) {
+		headers = calloc(argc - 1, sizeof(char *));
+		for (nheaders = 0, it = 1; it < argc; it++) {
+			if ((headers[nheaders] = _read_file(argv[it])))
+				nheaders++;
+		}
+		if (!nheaders)
+			return 1;
+	}
+
+	// http_parse_response() modifies the header, so we parse copies
+	work = calloc(nheaders, sizeof(char *));
+	lengths = calloc(nheaders, sizeof(size_t));
+	for (n = 0; n < nheaders; n++) {
+		lengths[n] = strlen(headers[n]) + 1;
+		work[n] = malloc(lengths[n]);
+	}
+
+	start = mget_get_timemillis();
+
+	for (it = 0; it < iterations; it++) {
+		for (n = 0; n < nheaders; n++) {
+			MGET_HTTP_RESPONSE *resp;
+
+			memcpy(work[n], headers[n], lengths[n]);
+			if (!(resp = http_parse_response(work[n]))) {
+				fprintf(stderr, "Failed to parse header #%d\n", n);
+				return 1;
+			}
+			http_free_response(&resp);
+			bytes += lengths[n] - 1;
+		}
+	}
+
+	millis = mget_get_timemillis() - start;
+
+	printf("%d headers parsed %d times in %lld ms (%.1f MB/s, %.0f ns per header)\n",
+		nheaders, iterations, millis,
+		millis ? bytes / (millis * 1000.0) : 0.0,
+		(double)millis * 1000000 / ((double)iterations * nheaders));
+
+	for (n = 0; n < nheaders; n++)
+		free(work[n]);
+	free(work);
+	free(lengths);
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright(c) 2012 Tim Ruehsen
+ *
+ * This file is part of MGet.
+ *
+ * Mget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Mget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Mget.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * testing performance of the job queue
+ *
+ * usage: job_queue_perf [max. exponent]
+ * 10^3 up to 10^exponent (default 6) jobs for 1000 hosts are queued, then taken
+ * one after the other like the main loop does on 'ready', half of them together
+ * with pipelined jobs for the same host. each job has a segment of parts every 1000th.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libmget.h>
+
+#include "../src/job.h"
+
+#define NHOSTS 1000
+
+int main(int argc, const char *const *argv)
+{
+	MGET_IRI *iris[NHOSTS];
+	int exponent = argc > 1 ? atoi(argv[1]) : 6, it;
+	long long njobs;
+
+	for (it = 0; it < NHOSTS; it++) {
+		char url[64];
+
+		snprintf(url, sizeof(url), "http://host%d.example.com/", it);
+		iris[it] = mget_iri_parse(url, NULL);
+	}
+
+	for (njobs = 1000; exponent >= 3; exponent--, njobs *= 10) {
+		JOB *job, *pipeline[4];
+		PART *part;
+		long long n, taken = 0, start, add_millis, get_millis;
+		int npipelined;
+
+		start = mget_get_timemillis();
+		for (n = 0; n < njobs; n++) {
+			job = queue_add(iris[n % NHOSTS]);
+
+			if (n % 1000 == 999) {
+				job->size = 16 * 1024 * 1024;
+				job_create_segments(job, 8, 1024 * 1024);
+			}
+		}
+		add_millis = mget_get_timemillis() - start;
+
+		start = mget_get_timemillis();
+		while (queue_get(&job, &part, NULL)) {
+			npipelined = !part && taken % 2 ? queue_get_host(job->iri, pipeline, 4) : 0;
+			taken += 1 + npipelined;
+
+			// the downloader reports back
+			if (part) {
+				part->done = 1;
+				queue_release_part(job, part);
+				if (job_parts_done(job))
+					queue_del(job);
+			} else
+				queue_del(job);
+
+			for (it = 0; it < npipelined; it++)
+				queue_del(pipeline[it]);
+		}
+		get_millis = mget_get_timemillis() - start;
+
+		printf("%9lld jobs: add %6lld ms (%4.0f ns/job), get+del %6lld ms (%4.0f ns/job), %lld taken\n",
+			njobs, add_millis, add_millis * 1e6 / njobs, get_millis, get_millis * 1e6 / njobs, taken);
+
+		if (!queue_empty()) {
+			printf("Failed: queue not empty\n");
+			return 1;
+		}
+	}
+
+	for (it = 0; it < NHOSTS; it++)
+		mget_iri_free(&iris[it]);
+
+	queue_free();
+
+	return 0;
+}
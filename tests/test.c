@@ -37,12 +37,20 @@
 #include <string.h>
 #include <dirent.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
 
 #include <libmget.h>
 #include "../libmget/private.h"
 
 #include "../src/options.h"
 #include "../src/log.h"
+#include "../src/job.h"
 
 // number of elements within an array
 #define countof(a) (sizeof(a)/sizeof(*(a)))
@@ -1157,6 +1165,941 @@ static void test_stringmap(void)
 
 }
 
+static void test_http_keep_alive(void)
+{
+	static const struct test_data {
+		const char
+			*response,
+			*reason;
+		char
+			keep_alive;
+	} test_data[] = {
+		{ "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", "OK", 1 },
+		{ "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n", "OK", 0 },
+		{ "HTTP/1.1 200 OK\r\nConnection: Upgrade\r\n\r\n", "OK", 1 },
+		{ "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n", "OK", 0 },
+		{ "HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\n\r\n", "OK", 1 },
+		{ "HTTP/1.1 404 \r\nConnection: close\r\n\r\n", "", 0 },
+		{ "HTTP/2.0 200 \r\nserver: nghttpd\r\n", "", 1 },
+	};
+	unsigned it;
+
+	for (it = 0; it < countof(test_data); it++) {
+		const struct test_data *t = &test_data[it];
+		char *buf = strdup(t->response);
+		MGET_HTTP_RESPONSE *resp = http_parse_response(buf);
+
+		if (resp && resp->keep_alive == t->keep_alive && !strcmp(resp->reason, t->reason))
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [%u]: keep_alive(%s) -> %d '%s' (expected %d '%s')\n", it, t->response,
+				resp ? resp->keep_alive : -1, resp ? resp->reason : "", t->keep_alive, t->reason);
+		}
+
+		http_free_response(&resp);
+		xfree(buf);
+	}
+}
+
+static void test_http_parse_response(void)
+{
+	static const struct test_data {
+		const char
+			*response,
+			*content_type,
+			*content_type_encoding;
+		long long
+			content_length;
+		short
+			code;
+		char
+			transfer_encoding,
+			accept_ranges;
+	} test_data[] = {
+		{ "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\nContent-Length: 7\r\n\r\n",
+			"text/html", "UTF-8", 7, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 200 OK\ncontent-type: text/css;charset=\"iso-8859-1\"\ncontent-length: 12\n\n",
+			"text/css", "iso-8859-1", 12, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 200 OK\r\nCONTENT-TYPE: text/plain; format=flowed; Charset = koi8-r\r\nTransfer-Encoding: chunked\r\n",
+			"text/plain", "koi8-r", -1, 200, transfer_encoding_chunked, 0 },
+		{ "HTTP/1.1 200 OK\r\nX-Content-Length: 5\r\nContent-Lengtx: 6\r\nContent-Type:\r\n text/xml\r\n\r\n",
+			"text/xml", NULL, -1, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 200 OK\r\nContent-Type: application/vnd.openxmlformats-officedocument.wordprocessingml.document\r\n\r\n",
+			"application/vnd.openxmlformats-officedocument.wordprocessingml.document", NULL, -1, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 204 No Content", NULL, NULL, -1, 204, transfer_encoding_identity, 0 },
+		{ "HTTP/2 304\r\ncontent-length: 0\r\n", NULL, NULL, 0, 304, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\nContent-Length: 2\r\n", NULL, NULL, 1, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\nContent-Length: 3\r\n\r\n", NULL, NULL, 3, 200, transfer_encoding_identity, 1 },
+		{ "HTTP/1.1 200 OK\r\naccept-ranges: none\r\nDigest: MD5=x\r\n\r\n", NULL, NULL, -1, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1 200 OK\r\nAccept-Ranges: bytesx\r\n\r\n", NULL, NULL, -1, 200, transfer_encoding_identity, 0 },
+		{ "HTTP/1.1200 OK\r\n\r\n", NULL, NULL, -1, -1, 0, 0 },
+		{ "HTTP/x.1 200 OK\r\n\r\n", NULL, NULL, -1, -1, 0, 0 },
+		{ "<html>\r\n", NULL, NULL, -1, -1, 0, 0 },
+	};
+	unsigned it;
+
+	for (it = 0; it < countof(test_data); it++) {
+		const struct test_data *t = &test_data[it];
+		char *buf = strdup(t->response);
+		MGET_HTTP_RESPONSE *resp = http_parse_response(buf);
+
+		if (t->code == -1 ? !resp : (resp && resp->code == t->code
+			&& !mget_strcmp(resp->content_type, t->content_type)
+			&& !mget_strcmp(resp->content_type_encoding, t->content_type_encoding)
+			&& (t->content_length == -1 ? !resp->content_length_valid : (resp->content_length_valid && resp->content_length == (size_t)t->content_length))
+			&& resp->transfer_encoding == t->transfer_encoding
+			&& resp->accept_ranges == t->accept_ranges))
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [%u]: http_parse_response(%s) -> %d '%s' '%s' %zu\n", it, t->response,
+				resp ? resp->code : -1, resp ? resp->content_type : "", resp ? resp->content_type_encoding : "",
+				resp ? resp->content_length : 0);
+		}
+
+		http_free_response(&resp);
+		xfree(buf);
+	}
+}
+
+struct body_context {
+	mget_buffer_t
+		*body;
+	int
+		calls,
+		stop; // return -1 from this call on
+};
+
+static int _collect_body(void *context, const char *data, size_t length)
+{
+	struct body_context *ctx = context;
+
+	mget_buffer_memcat(ctx->body, data, length);
+	return ++ctx->calls == ctx->stop ? -1 : 0;
+}
+
+static void test_http_chunked(void)
+{
+	static const struct test_data {
+		const char
+			*data,
+			*body,
+			*left; // what stays in the connection buffer, e.g. a pipelined response
+		int
+			calls,
+			result;
+	} test_data[] = {
+		{ "5\r\nHello\r\n0\r\n\r\n", "Hello", "", 1, 0 },
+		{ "1\r\nH\r\n1\r\ne\r\n3;ext=x\r\nllo\r\n0\r\n\r\n", "Hello", "", 1, 0 },
+		{ "1\nH\n4\nello\n0\nX-Trailer: 1\n\nHTTP/1.1", "Hello", "HTTP/1.1", 1, 0 },
+		{ "a\r\n0123456789\r\nA\r\nabcdefghij\r\n0\r\nTrailer: x\r\n\r\nHTTP/1.1 200", "0123456789abcdefghij", "HTTP/1.1 200", 1, 0 },
+		{ "0\r\n\r\n", "", "", 0, 0 },
+		{ "123456789abcdef01\r\nX\r\n0\r\n\r\n", "", "", 0, -1 },
+	};
+	MGET_HTTP_CONNECTION conn;
+	MGET_HTTP_RESPONSE resp;
+	struct body_context ctx = { .body = mget_buffer_alloc(256) };
+	unsigned it;
+	int rc;
+
+	for (it = 0; it < countof(test_data); it++) {
+		const struct test_data *t = &test_data[it];
+
+		memset(&conn, 0, sizeof(conn));
+		memset(&resp, 0, sizeof(resp));
+		conn.buf = mget_buffer_alloc(256);
+		mget_buffer_strcpy(conn.buf, t->data);
+		resp.code = 200;
+		resp.transfer_encoding = transfer_encoding_chunked;
+		mget_buffer_strcpy(ctx.body, "");
+		ctx.calls = 0;
+
+		// the complete response is in the connection buffer, so no socket is needed
+		rc = http_get_response_body_cb(&conn, &resp, _collect_body, &ctx);
+
+		if (rc == t->result && (rc || (!strcmp(ctx.body->data, t->body) && ctx.calls == t->calls
+			&& !strcmp(conn.buf->data, t->left) && resp.content_length == strlen(t->body))))
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [%u]: chunked(%s) -> %d '%s' %d calls, left '%s' (expected %d '%s' %d calls, left '%s')\n",
+				it, t->data, rc, ctx.body->data, ctx.calls, conn.buf->data, t->result, t->body, t->calls, t->left);
+		}
+
+		mget_buffer_free(&conn.buf);
+	}
+
+	// the callback stops reading after the first of two large chunks
+	memset(&conn, 0, sizeof(conn));
+	memset(&resp, 0, sizeof(resp));
+	conn.buf = mget_buffer_alloc(16384);
+	for (it = 0; it < 2; it++) {
+		mget_buffer_strcat(conn.buf, "1388\r\n");
+		mget_buffer_memset_append(conn.buf, 'x', 5000);
+		mget_buffer_strcat(conn.buf, "\r\n");
+	}
+	mget_buffer_strcat(conn.buf, "0\r\n\r\n");
+	resp.code = 200;
+	resp.transfer_encoding = transfer_encoding_chunked;
+	mget_buffer_strcpy(ctx.body, "");
+	ctx.calls = 0;
+	ctx.stop = 1;
+
+	rc = http_get_response_body_cb(&conn, &resp, _collect_body, &ctx);
+
+	if (rc == -1 && ctx.calls == 1 && ctx.body->length == 5000)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed: chunked body not stopped by callback -> %d, %d calls, %zu bytes\n", rc, ctx.calls, ctx.body->length);
+	}
+
+	mget_buffer_free(&conn.buf);
+	mget_buffer_free(&ctx.body);
+}
+
+static void test_decompress(void)
+{
+	static const struct test_data {
+		const char
+			*name, // as in Content-Encoding
+			*data;
+		size_t
+			length;
+		int
+			encoding;
+	} test_data[] = {
+		{ "gzip",
+			"\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\xed\xca\x5b\x16\x42\x50\x00\x00\xc0\xff"
+			"\x56\x73\x23\xc5\x72\xd0\x8b\xf2\x8a\x84\xd5\xb7\x0f\x67\xe6\x7b\xc2\x31\x8a\x4f"
+			"\xc9\xf9\x92\x66\x79\x51\x5e\x6f\xf7\xc7\xb3\xaa\x5f\xef\xa6\xed\xfa\xe1\x33\x4e"
+			"\xdf\xf9\xb7\xac\xdb\x21\x48\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92"
+			"\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\xd2\xfe\xd3"
+			"\x1f\x18\x7e\x8a\x2c\x5c\x2b\x00\x00", 109, mget_content_encoding_gzip },
+		{ "deflate",
+			"\xed\xca\x5b\x16\x42\x50\x00\x00\xc0\xff\x56\x73\x23\xc5\x72\xd0\x8b\xf2\x8a\x84"
+			"\xd5\xb7\x0f\x67\xe6\x7b\xc2\x31\x8a\x4f\xc9\xf9\x92\x66\x79\x51\x5e\x6f\xf7\xc7"
+			"\xb3\xaa\x5f\xef\xa6\xed\xfa\xe1\x33\x4e\xdf\xf9\xb7\xac\xdb\x21\x48\x92\x24\x49"
+			"\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24\x49\x92\x24"
+			"\x49\x92\x24\x49\x92\x24\x49\xd2\xfe\xd3\x1f", 91, mget_content_encoding_deflate },
+		{ "br",
+			"\x1b\x5b\x2b\xf8\x65\x70\x5e\x5f\x4b\x70\x8b\xd4\xc1\x38\x31\x68\x98\x78\x11\x00"
+			"\x88\x30\xa1\x8c\x0b\xa9\xb4\xb1\xce\x87\x98\x72\xa9\xad\x8f\xb9\xb6\xfd\x38\xaf"
+			"\xfb\x79\xbf\x1f\x00", 45, mget_content_encoding_brotli },
+		{ "zstd",
+			"\x28\xb5\x2f\xfd\x64\x5c\x2a\x75\x01\x00\x54\x02\x30\x31\x32\x33\x34\x35\x36\x37"
+			"\x38\x39\x61\x62\x63\x64\x65\x66\x67\x68\x69\x6a\x6b\x6c\x6d\x6e\x6f\x70\x71\x72"
+			"\x73\x74\x75\x76\x77\x78\x79\x7a\x0a\x01\x00\xa5\x59\x88\x57\x4f\xe3\xd3\x28\x61", 60, mget_content_encoding_zstd },
+	};
+	struct body_context ctx = { .body = mget_buffer_alloc(16384) };
+	MGET_DECOMPRESSOR *dc;
+	mget_buffer_t *expected = mget_buffer_alloc(16384);
+	const char *accept = mget_decompress_accept_encoding();
+	char outbuf[1000];
+	unsigned it, step;
+	size_t pos, n;
+	int rc;
+
+	// the compressed data is 300 times this line, more than the decompressors' output buffer
+	for (it = 0; it < 300; it++)
+		mget_buffer_strcat(expected, "0123456789abcdefghijklmnopqrstuvwxyz\n");
+
+	for (it = 0; it < countof(test_data); it++) {
+		const struct test_data *t = &test_data[it];
+		char data[128];
+
+		// brotli and zstd are optional
+		if (!strstr(accept, t->name))
+			continue;
+
+		// decompress in one piece and in pieces of 1 byte, with a small output buffer
+		// and directly into the body buffer
+		for (step = 0; step < 4; step++) {
+			mget_buffer_strcpy(ctx.body, "");
+			memcpy(data, t->data, t->length);
+
+			dc = mget_decompress_open(t->encoding, _collect_body, &ctx);
+			if (step == 2)
+				mget_decompress_set_buffer(dc, outbuf, sizeof(outbuf));
+			else if (step == 3)
+				mget_decompress_set_output(dc, ctx.body);
+			for (rc = 0, pos = 0; !rc && pos < t->length; pos += n) {
+				n = step ? 1 : t->length;
+				rc = mget_decompress(dc, data + pos, n);
+			}
+			mget_decompress_close(dc);
+
+			if (!rc && ctx.body->length == expected->length && !memcmp(ctx.body->data, expected->data, expected->length))
+				ok++;
+			else {
+				failed++;
+				info_printf("Failed [%u]: decompress(%s, step %u) -> %d, %zu bytes (expected %zu)\n",
+					it, t->name, step, rc, ctx.body->length, expected->length);
+			}
+		}
+	}
+
+	mget_buffer_free(&expected);
+	mget_buffer_free(&ctx.body);
+}
+
+static void test_dns_cache(void)
+{
+	struct addrinfo *ai1, *ai2;
+	unsigned long long hits, misses, hits2, misses2;
+
+	mget_tcp_set_dns_caching(1);
+	mget_tcp_get_dns_cache_stats(&hits, &misses);
+
+	// numeric hosts are resolved without network access
+	ai1 = mget_tcp_resolve("127.0.0.1", "80");
+	ai2 = mget_tcp_resolve("127.0.0.1", "80");
+	mget_tcp_get_dns_cache_stats(&hits2, &misses2);
+
+	if (ai1 && ai1 == ai2 && hits2 == hits + 1 && misses2 == misses + 1)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [dns cache]: %p %p, hits %llu -> %llu, misses %llu -> %llu\n",
+			(void *)ai1, (void *)ai2, hits, hits2, misses, misses2);
+	}
+
+	mget_tcp_addrinfo_free(&ai1);
+	mget_tcp_addrinfo_free(&ai2);
+
+	// expired entries are resolved again, the old addrinfo stays valid until it is released
+	mget_tcp_set_dns_cache_ttl(0);
+	ai1 = mget_tcp_resolve("127.0.0.2", "80");
+	ai2 = mget_tcp_resolve("127.0.0.2", "80");
+	mget_tcp_get_dns_cache_stats(&hits, &misses);
+	mget_tcp_set_dns_cache_ttl(300);
+
+	if (hits == hits2 && misses == misses2 + 2 && ai1 && ai2 && ai1 != ai2 && ai1->ai_family == AF_INET)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [dns cache ttl]: hits %llu -> %llu, misses %llu -> %llu\n", hits2, hits, misses2, misses);
+	}
+
+	mget_tcp_addrinfo_free(&ai1);
+	mget_tcp_addrinfo_free(&ai2);
+}
+
+static void test_http_body_fd(void)
+{
+	static const struct test_data {
+		const char
+			*readahead, // read together with the response header
+			*data, // sent by the server afterwards
+			*body,
+			*left; // what stays in the connection buffer, e.g. a pipelined response
+		long long
+			content_length; // -1: body ends when the server closes the connection
+		int
+			result;
+	} test_data[] = {
+		{ "", "0123456789", "0123456789", "", 10, 0 },
+		{ "Hello", " World", "Hello World", "", 11, 0 },
+		{ "Hello World", "", "Hello World", "", 11, 0 },
+		{ "Hello WorldHTTP/1.1 200", "", "Hello World", "HTTP/1.1 200", 11, 0 },
+		{ "Hel", "lo World", "Hello World", "", -1, 0 },
+		{ "", "Hello", "Hello", "", -1, 0 },
+		{ "", "", "", "", -1, 0 },
+		{ "Hel", "lo", "Hello", "", 11, -1 },
+	};
+	const char *fname = ".test_body_fd";
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	MGET_HTTP_CONNECTION conn;
+	MGET_HTTP_RESPONSE resp;
+	struct addrinfo *ai = NULL;
+	char port[16], body[64];
+	unsigned it;
+	int listenfd, serverfd, fd, rc;
+	ssize_t n;
+
+	// MGET_TCP can't wrap a socketpair(), so a loopback connection stands in for the server
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+		|| bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listenfd, 1)
+		|| getsockname(listenfd, (struct sockaddr *)&addr, &addrlen))
+	{
+		failed++;
+		info_printf("Failed: no loopback listener for the body tests (%d)\n", errno);
+		if (listenfd != -1)
+			close(listenfd);
+		return;
+	}
+
+	snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+	ai = mget_tcp_resolve("127.0.0.1", port);
+
+	for (it = 0; it < countof(test_data); it++) {
+		const struct test_data *t = &test_data[it];
+
+		memset(&conn, 0, sizeof(conn));
+		memset(&resp, 0, sizeof(resp));
+		resp.code = 200;
+		resp.keep_alive = 1;
+		resp.content_length = t->content_length >= 0 ? (size_t)t->content_length : 0;
+		resp.content_length_valid = t->content_length >= 0;
+
+		if (!ai || !(conn.tcp = mget_tcp_connect(ai, NULL)) || (serverfd = accept(listenfd, NULL, NULL)) == -1) {
+			failed++;
+			info_printf("Failed [%u]: no loopback connection for the body test (%d)\n", it, errno);
+			mget_tcp_close(&conn.tcp);
+			continue;
+		}
+
+		mget_tcp_set_timeout(conn.tcp, 1000); // a broken reader must not hang the test
+		conn.buf = mget_buffer_alloc(256);
+		mget_buffer_strcpy(conn.buf, t->readahead);
+		if (*t->data && write(serverfd, t->data, strlen(t->data)) != (ssize_t)strlen(t->data))
+			info_printf("Failed to send body data (%d)\n", errno);
+
+		// the body ends with the connection, or it is shorter than announced
+		if (t->content_length < 0 || t->result)
+			shutdown(serverfd, SHUT_WR);
+
+		if ((fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+			failed++;
+			info_printf("Failed [%u]: body_fd() can't open %s (%d)\n", it, fname, errno);
+		} else {
+			rc = http_get_response_body_fd(&conn, &resp, fd);
+			n = pread(fd, body, sizeof(body) - 1, 0);
+			body[n > 0 ? n : 0] = 0;
+			close(fd);
+
+			if (rc == t->result && !strcmp(body, t->body) && resp.content_length == strlen(t->body)
+				&& !strcmp(conn.buf->data, t->left) && resp.keep_alive == (t->content_length >= 0))
+				ok++;
+			else {
+				failed++;
+				info_printf("Failed [%u]: body_fd(%s|%s) -> %d '%s' (%zu), left '%s' (expected %d '%s', left '%s')\n",
+					it, t->readahead, t->data, rc, body, resp.content_length, conn.buf->data, t->result, t->body, t->left);
+			}
+		}
+
+		close(serverfd);
+		mget_tcp_close(&conn.tcp);
+		mget_buffer_free(&conn.buf);
+	}
+
+	mget_tcp_addrinfo_free(&ai);
+	close(listenfd);
+	unlink(fname);
+}
+
+static void test_tls_session_file(void)
+{
+	const char *fname = ".test_tls_sessions";
+	char buf[256] = "";
+	struct stat st;
+	FILE *fp;
+	int n;
+
+	// the data is not checked before it is used for a handshake
+	if ((fp = fopen(fname, "w"))) {
+		fprintf(fp, "# comment\nexample.com %lld AAECAwQFBgc=\nexpired.org 1000 AAECAwQFBgc=\n", (long long)time(NULL) + 3600);
+		fclose(fp);
+	}
+
+	if ((n = mget_ssl_session_cache_load(fname)) == 1)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [tls session load]: %d sessions (expected 1)\n", n);
+	}
+
+	if (!mget_ssl_session_cache_save(fname) && !stat(fname, &st) && !(st.st_mode & 077) && (fp = fopen(fname, "r"))) {
+		n = 0;
+		while (fgets(buf, sizeof(buf), fp)) {
+			if (!strncmp(buf, "example.com ", 12) && strstr(buf, " AAECAwQFBgc="))
+				n++;
+			else if (*buf != '#' && *buf != '\n')
+				n += 100;
+		}
+		fclose(fp);
+	} else
+		n = -1;
+
+	if (n == 1)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [tls session save]: %d\n", n);
+	}
+
+	unlink(fname);
+}
+
+static void test_hpack(void)
+{
+	// RFC 7541 C.1
+	static const struct int_data {
+		const char
+			*data;
+		size_t
+			length,
+			value;
+		int
+			prefix_bits;
+	} int_data[] = {
+		{ "\x0a", 1, 10, 5 },
+		{ "\xea", 1, 10, 5 }, // the bits before the prefix belong to someone else
+		{ "\x1f\x9a\x0a", 3, 1337, 5 },
+		{ "\x2a", 1, 42, 8 },
+		{ "\x1f\x9a", 2, 0, 5 }, // truncated
+	};
+	// RFC 7541 C.4 and C.6
+	static const struct huffman_data {
+		const char
+			*data,
+			*string;
+		size_t
+			length;
+	} huffman_data[] = {
+		{ "\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff", "www.example.com", 12 },
+		{ "\xa8\xeb\x10\x64\x9c\xbf", "no-cache", 6 },
+		{ "\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f", "custom-key", 8 },
+		{ "\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf", "custom-value", 9 },
+		{ "\x64\x02", "302", 2 },
+		{ "\xae\xc3\x77\x1a\x4b", "private", 5 },
+		{ "\xd0\x7a\xbe\x94\x10\x54\xd4\x44\xa8\x20\x05\x95\x04\x0b\x81\x66\xe0\x82\xa6\x2d\x1b\xff",
+			"Mon, 21 Oct 2013 20:13:21 GMT", 22 },
+		{ "\x9d\x29\xad\x17\x18\x63\xc7\x8f\x0b\x97\xc8\xe9\xae\x82\xae\x43\xd3", "https://www.example.com", 17 },
+		{ "\x00", NULL, 1 }, // padding not taken from EOS
+		{ "\xff\xff\xff\xff", NULL, 4 }, // EOS
+		{ "\x1f\xff", NULL, 2 }, // padding longer than 7 bits
+	};
+	// RFC 7541 C.5 and C.6, responses with a dynamic table of 256 bytes, entries are evicted
+	static const struct block_data {
+		const char
+			*data;
+		size_t
+			length;
+		const char
+			*header;
+		size_t
+			table_size;
+		int
+			status;
+	} block_data[] = {
+		{ "\x3f\xe1\x01" // dynamic table size update to 256, instead of SETTINGS_HEADER_TABLE_SIZE
+		  "\x48\x03\x33\x30\x32\x58\x07\x70\x72\x69\x76\x61\x74\x65\x61\x1d\x4d\x6f\x6e\x2c\x20\x32\x31\x20"
+		  "\x4f\x63\x74\x20\x32\x30\x31\x33\x20\x32\x30\x3a\x31\x33\x3a\x32\x31\x20\x47\x4d\x54\x6e\x17\x68"
+		  "\x74\x74\x70\x73\x3a\x2f\x2f\x77\x77\x77\x2e\x65\x78\x61\x6d\x70\x6c\x65\x2e\x63\x6f\x6d", 73,
+			"\r\ncache-control: private\r\ndate: Mon, 21 Oct 2013 20:13:21 GMT\r\nlocation: https://www.example.com", 222, 302 },
+		{ "\x48\x03\x33\x30\x37\xc1\xc0\xbf", 8,
+			"\r\ncache-control: private\r\ndate: Mon, 21 Oct 2013 20:13:21 GMT\r\nlocation: https://www.example.com", 222, 307 },
+		{ "\x88\xc1\x61\x1d\x4d\x6f\x6e\x2c\x20\x32\x31\x20\x4f\x63\x74\x20\x32\x30\x31\x33\x20\x32\x30\x3a"
+		  "\x31\x33\x3a\x32\x32\x20\x47\x4d\x54\xc0\x5a\x04\x67\x7a\x69\x70\x77\x38\x66\x6f\x6f\x3d\x41\x53"
+		  "\x44\x4a\x4b\x48\x51\x4b\x42\x5a\x58\x4f\x51\x57\x45\x4f\x50\x49\x55\x41\x58\x51\x57\x45\x4f\x49"
+		  "\x55\x3b\x20\x6d\x61\x78\x2d\x61\x67\x65\x3d\x33\x36\x30\x30\x3b\x20\x76\x65\x72\x73\x69\x6f\x6e"
+		  "\x3d\x31", 98,
+			"\r\ncache-control: private\r\ndate: Mon, 21 Oct 2013 20:13:22 GMT\r\nlocation: https://www.example.com"
+			"\r\ncontent-encoding: gzip\r\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1", 215, 200 },
+		{ "\x3f\xe1\x01"
+		  "\x48\x82\x64\x02\x58\x85\xae\xc3\x77\x1a\x4b\x61\x96\xd0\x7a\xbe\x94\x10\x54\xd4\x44\xa8\x20\x05"
+		  "\x95\x04\x0b\x81\x66\xe0\x82\xa6\x2d\x1b\xff\x6e\x91\x9d\x29\xad\x17\x18\x63\xc7\x8f\x0b\x97\xc8"
+		  "\xe9\xae\x82\xae\x43\xd3", 57,
+			"\r\ncache-control: private\r\ndate: Mon, 21 Oct 2013 20:13:21 GMT\r\nlocation: https://www.example.com", 222, 302 },
+		{ "\x48\x83\x64\x0e\xff\xc1\xc0\xbf", 8,
+			"\r\ncache-control: private\r\ndate: Mon, 21 Oct 2013 20:13:21 GMT\r\nlocation: https://www.example.com", 222, 307 },
+		{ "\x88\xc1\x61\x96\xd0\x7a\xbe\x94\x10\x54\xd4\x44\xa8\x20\x05\x95\x04\x0b\x81\x66\xe0\x84\xa6\x2d"
+		  "\x1b\xff\xc0\x5a\x83\x9b\xd9\xab\x77\xad\x94\xe7\x82\x1d\xd7\xf2\xe6\xc7\xb3\x35\xdf\xdf\xcd\x5b"
+		  "\x39\x60\xd5\xaf\x27\x08\x7f\x36\x72\xc1\xab\x27\x0f\xb5\x29\x1f\x95\x87\x31\x60\x65\xc0\x03\xed"
+		  "\x4e\xe5\xb1\x06\x3d\x50\x07", 79,
+			"\r\ncache-control: private\r\ndate: Mon, 21 Oct 2013 20:13:22 GMT\r\nlocation: https://www.example.com"
+			"\r\ncontent-encoding: gzip\r\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1", 215, 200 },
+		{ "\x3f\x21\x40\x01\x61\x28" // size update to 64, an entry of 73 bytes doesn't fit
+		  "0123456789012345678901234567890123456789", 46, "\r\na: 0123456789012345678901234567890123456789", 0, 0 },
+		{ "\x3f\xe2\x1f", 3, "", 0, -1 }, // size update beyond SETTINGS_HEADER_TABLE_SIZE (4096)
+		{ "\xc0", 1, "", 0, -1 }, // index not in the table
+	};
+	struct _MGET_HTTP2 *h2 = NULL;
+	mget_buffer_t *buf = mget_buffer_alloc(256);
+	const unsigned char *p;
+	size_t value;
+	unsigned it;
+	int rc;
+
+	for (it = 0; it < countof(int_data); it++) {
+		const struct int_data *t = &int_data[it];
+
+		p = (const unsigned char *)t->data;
+		rc = http2_hpack_decode_int(&p, p + t->length, t->prefix_bits, &value);
+
+		if (t->value ? (rc == 0 && value == t->value && p == (const unsigned char *)t->data + t->length) : rc == -1)
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [hpack int %u]: %d %zu (expected %zu)\n", it, rc, value, t->value);
+		}
+	}
+
+	for (it = 0; it < countof(huffman_data); it++) {
+		const struct huffman_data *t = &huffman_data[it];
+
+		mget_buffer_strcpy(buf, "");
+		rc = http2_hpack_huffman_decode((const unsigned char *)t->data, t->length, buf);
+
+		if (t->string ? (rc == 0 && !strcmp(buf->data, t->string)) : rc == -1)
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [hpack huffman %u]: %d '%s' (expected '%s')\n", it, rc, buf->data, t->string ? t->string : "error");
+		}
+	}
+
+	// each of C.5 and C.6 is a sequence on one connection
+	for (it = 0; it < countof(block_data); it++) {
+		const struct block_data *t = &block_data[it];
+
+		if (it % 3 == 0) {
+			http2_session_free(&h2);
+			h2 = http2_session_alloc();
+		}
+
+		mget_buffer_strcpy(buf, "");
+		rc = http2_hpack_decode(h2, (const unsigned char *)t->data, t->length, buf);
+
+		if (rc == t->status && (rc == -1 || (!strcmp(buf->data, t->header) && http2_hpack_table_size(h2) == t->table_size)))
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [hpack block %u]: %d '%s' table %zu (expected %d '%s' table %zu)\n",
+				it, rc, buf->data, http2_hpack_table_size(h2), t->status, t->header, t->table_size);
+		}
+	}
+
+	http2_session_free(&h2);
+	mget_buffer_free(&buf);
+}
+
+// pass a frame of <type> to the HTTP/2 session <h2>, as if it came from the server
+
+static int _h2_frame(struct _MGET_HTTP2 *h2, int type, int flags, unsigned id, const char *payload, size_t length)
+{
+	unsigned char frame[9 + length];
+
+	frame[0] = (unsigned char)(length >> 16);
+	frame[1] = (unsigned char)(length >> 8);
+	frame[2] = (unsigned char)length;
+	frame[3] = (unsigned char)type;
+	frame[4] = (unsigned char)flags;
+	frame[5] = (unsigned char)(id >> 24);
+	frame[6] = (unsigned char)(id >> 16);
+	frame[7] = (unsigned char)(id >> 8);
+	frame[8] = (unsigned char)id;
+	memcpy(frame + 9, payload, length);
+
+	return http2_handle_frame(h2, frame);
+}
+
+static void test_http2_frames(void)
+{
+	// type, flags, stream id, payload, expected result. each row on a new session.
+	static const struct frame_data {
+		const char
+			*payload;
+		size_t
+			length;
+		unsigned
+			id;
+		int
+			type,
+			flags,
+			result;
+	} frame_data[] = {
+		{ "data", 4, 0, 0x0, 0x1, -1 }, // DATA on stream 0
+		{ "data", 4, 3, 0x0, 0x1, 0 }, // DATA for a stream nobody waits for
+		{ "\x05" "data", 5, 3, 0x0, 0x8, -1 }, // more padding than data
+		{ "\x88", 1, 0, 0x1, 0x4, -1 }, // HEADERS on stream 0
+		{ "\x88", 1, 1, 0x1, 0x4, 0 }, // HEADERS, decoded for an unknown stream as well
+		{ "\xbe", 1, 1, 0x1, 0x4, -1 }, // HEADERS with an index not in the table
+		{ "\x00\x00\x00\x00\x00\x00\x00\x00", 8, 0, 0x6, 0, 0 }, // PING
+		{ "\x00\x00\x00\x00", 4, 0, 0x6, 0, -1 },
+		{ "\x00\x03\x00\x00\x00\x64", 6, 0, 0x4, 0, 0 }, // SETTINGS
+		{ "\x00\x03\x00\x00\x00", 5, 0, 0x4, 0, -1 },
+		{ "\x00\x03\x00\x00\x00\x64", 6, 1, 0x4, 0, -1 },
+		{ "\x00\x00\x00\x01\x00\x00\x00\x00", 8, 1, 0x5, 0x4, -1 }, // PUSH_PROMISE, push is disabled
+		{ "", 0, 1, 0x9, 0x4, -1 }, // CONTINUATION without HEADERS
+	};
+	struct _MGET_HTTP2 *h2;
+	char *block;
+	unsigned it;
+	int rc, n;
+
+	for (it = 0; it < countof(frame_data); it++) {
+		const struct frame_data *t = &frame_data[it];
+
+		h2 = http2_session_alloc();
+		rc = _h2_frame(h2, t->type, t->flags, t->id, t->payload, t->length);
+		http2_session_free(&h2);
+
+		if (rc == t->result)
+			ok++;
+		else {
+			failed++;
+			info_printf("Failed [http2 frame %u]: type %d on stream %u -> %d (expected %d)\n", it, t->type, t->id, rc, t->result);
+		}
+	}
+
+	// a header block must not be interrupted by other frames
+	h2 = http2_session_alloc();
+	rc = _h2_frame(h2, 0x1, 0, 1, "\x88", 1);
+	if (rc == 0 && _h2_frame(h2, 0x6, 0, 0, "\0\0\0\0\0\0\0\0", 8) == -1)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [http2 interrupted header block]\n");
+	}
+	http2_session_free(&h2);
+
+	// the header block is complete after CONTINUATION, the entry goes into the dynamic table
+	h2 = http2_session_alloc();
+	rc = _h2_frame(h2, 0x1, 0, 1, "\x88\x40\x01", 3);
+	if (rc == 0 && _h2_frame(h2, 0x9, 0x4, 1, "a\x01" "b", 3) == 0 && http2_hpack_table_size(h2) == 34)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [http2 continuation]: table %zu\n", http2_hpack_table_size(h2));
+	}
+	http2_session_free(&h2);
+
+	// endless CONTINUATION frames are a protocol error
+	block = xcalloc(1, 16384);
+	h2 = http2_session_alloc();
+	rc = _h2_frame(h2, 0x1, 0, 1, block, 16384);
+	for (n = 0; rc == 0 && n < 100; n++)
+		rc = _h2_frame(h2, 0x9, 0, 1, block, 16384);
+	http2_session_free(&h2);
+	xfree(block);
+
+	if (rc == -1 && n < 100)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [http2 header block size]: %d after %d CONTINUATION frames\n", rc, n);
+	}
+}
+
+static const char
+	*full_host; // host that has as many downloaders as allowed
+static int
+	full_calls;
+
+static int _host_full(JOB *job)
+{
+	full_calls++;
+	return !strcmp(job->iri->host, full_host);
+}
+
+static void test_queue_get(void)
+{
+	static const char *urls[] = {
+		"http://a.example.com/1", "http://a.example.com/2", "http://b.example.com/1", "http://a.example.com/3",
+	};
+	MGET_IRI *iris[countof(urls)];
+	JOB *jobs[countof(urls)], *job;
+	PART *part;
+	unsigned it;
+	int rc;
+
+	for (it = 0; it < countof(urls); it++) {
+		iris[it] = mget_iri_parse(urls[it], NULL);
+		jobs[it] = queue_add(iris[it]);
+	}
+
+	// jobs for a full host stay in the queue, the host is asked once for a run of its jobs
+	full_host = "a.example.com";
+	full_calls = 0;
+	rc = queue_get(&job, &part, _host_full);
+
+	if (rc == 1 && job == jobs[2] && !part && full_calls == 2 && queue_ready() == 3)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [queue_get full host]: %d %s, %d calls, %d ready\n",
+			rc, job ? job->iri->uri : "-", full_calls, queue_ready());
+	}
+
+	rc = queue_get(&job, &part, _host_full);
+
+	if (rc == 0 && !job && full_calls == 3)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [queue_get all hosts full]: %d %s, %d calls\n", rc, job ? job->iri->uri : "-", full_calls);
+	}
+
+	// the jobs are handed out in order when the host has room again
+	for (it = 0; it < countof(urls) && queue_get(&job, &part, NULL); it++) {
+		if (job != jobs[it == 2 ? 3 : it])
+			break;
+	}
+
+	if (it == 3 && queue_ready() == 0)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [queue_get order]: %u jobs in order, %d ready\n", it, queue_ready());
+	}
+
+	queue_free();
+	for (it = 0; it < countof(urls); it++)
+		mget_iri_free(&iris[it]);
+}
+
+static void test_job_parts(void)
+{
+	MGET_IRI *iri = mget_iri_parse("http://example.com/file", NULL);
+	JOB *job = queue_add(iri), *job2;
+	PART *part, *part2, *twin;
+	size_t n;
+	int rc;
+
+	job->size = 1000;
+	job_create_segments(job, 1, 100);
+	queue_get(&job2, &part, NULL);
+	n = job_part_reserve(part, 0, 100);
+
+	// the back half of what is left of the largest part in flight is split off
+	rc = queue_get_split(&job2, &part2, 100, NULL);
+
+	if (rc == 1 && job2 == job && n == 100 && part2 && part2->inuse && !part2->endgame && !part2->twin
+		&& part2->position == 550 && part2->length == 450 && part->length == 550 && part2->mirror == part->mirror + 1)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job split part]: %d, %lld+%lld, %lld\n", rc,
+			part2 ? (long long)part2->position : -1, part2 ? (long long)part2->length : -1, (long long)part->length);
+	}
+
+	if (!part2)
+		goto out;
+
+	// the downloader of the shortened part stops at the split
+	n = job_part_reserve(part, 500, 100);
+
+	if (n == 50 && !job_part_finished(part, 550 - 1) && job_part_finished(part, 550))
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job part reserve]: %zu bytes reserved\n", n);
+	}
+
+	// less than 2 * min_length left: the rest of the part is raced from the next mirror
+	job_part_reserve(part2, 0, 150);
+	rc = queue_get_split(&job2, &twin, 200, NULL);
+
+	if (rc == 1 && twin && twin->endgame && twin->twin == part2 && part2->twin == twin
+		&& twin->position == 700 && twin->length == 300 && part2->length == 450 && twin->mirror == part2->mirror + 1)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job endgame]: %d, %lld+%lld\n", rc,
+			twin ? (long long)twin->position : -1, twin ? (long long)twin->length : -1);
+	}
+
+	if (!twin)
+		goto out;
+
+	// the twin that finishes first completes both, the other one gets nothing more to write
+	n = job_part_reserve(twin, 0, 300);
+	rc = job_part_finished(twin, 300);
+
+	if (n == 300 && rc == 1 && part2->done && job_part_reserve(part2, 150, 100) == 0 && job_part_finished(part2, 250)
+		&& !queue_get_split(&job2, &part, 1, NULL))
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job endgame winner]: %zu, %d, done %d\n", n, rc, part2->done);
+	}
+
+out:
+	queue_free();
+	mget_iri_free(&iri);
+}
+
+static void test_job_mirrors(void)
+{
+	static const char *urls[] = {
+		"http://m0.example.com/file", "http://m1.example.com/file", "http://m2.example.com/file", "http://m3.example.com/file",
+	};
+	MGET_IRI *iri = mget_iri_parse("http://example.com/file.meta4", NULL);
+	JOB *job = queue_add(iri);
+	MIRROR mirror, *m0;
+	int it, hits[countof(urls)] = { 0 }, pick, pick2;
+
+	job->mirrors = mget_vector_create(4, 4, NULL);
+	for (it = 0; it < (int)countof(urls); it++) {
+		memset(&mirror, 0, sizeof(MIRROR));
+		mirror.iri = mget_iri_parse(urls[it], NULL);
+		mget_vector_add(job->mirrors, &mirror, sizeof(MIRROR));
+	}
+	m0 = mget_vector_get(job->mirrors, 0);
+
+	// as long as nothing has been measured, the mirrors are used in turn
+	pick = job_mirror_select(job, 5, -1);
+	pick2 = job_mirror_select(job, 1, 1);
+
+	if (pick == 1 && pick2 == 2)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job mirror turn]: %d %d\n", pick, pick2);
+	}
+
+	// a mirror is demoted after 3 errors (MIRROR_MAX_ERRORS), if they are the majority of its requests
+	job_mirror_report(job, 0, 1000000, 1000, 10, 1);
+	job_mirror_report(job, 0, 0, 1000, 10, 0);
+	job_mirror_report(job, 0, 0, 1000, 10, 0);
+	pick = m0->demoted;
+	job_mirror_report(job, 0, 0, 1000, 10, 0);
+	pick2 = m0->demoted;
+
+	if (!pick && pick2 && m0->errors == 3)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job mirror demotion]: %d %d %d\n", pick, pick2, m0->demoted);
+	}
+
+	// m1 is the fastest, m2 is slower and has the fewest requests,
+	// m3 has even fewer, but is more than MIRROR_SLOW_FACTOR times slower than m1
+	for (it = 0; it < 4; it++)
+		job_mirror_report(job, 1, 8000000, 1000, 10, 1);
+	for (it = 0; it < 2; it++)
+		job_mirror_report(job, 2, 2000000, 1000, 10, 1);
+	job_mirror_report(job, 3, 100000, 1000, 10, 1);
+
+	// every MIRROR_EXPLORE-th selection goes to the least measured mirror that is not too slow
+	for (it = 0; it < 80; it++)
+		hits[job_mirror_select(job, 0, -1)]++;
+
+	if (hits[0] == 0 && hits[1] == 70 && hits[2] == 10 && hits[3] == 0)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job mirror explore]: %d %d %d %d\n", hits[0], hits[1], hits[2], hits[3]);
+	}
+
+	// the mirror that just failed is avoided, a demoted mirror is only chosen if there is no other
+	pick = job_mirror_select(job, 0, 1);
+
+	if (pick == 2)
+		ok++;
+	else {
+		failed++;
+		info_printf("Failed [job mirror avoid]: %d\n", pick);
+	}
+
+	queue_free();
+	mget_iri_free(&iri);
+}
+
 int main(int argc, const char * const *argv)
 {
 	init(argc, argv); // allows us to test with options (e.g. with --debug)
@@ -1180,6 +2123,18 @@ int main(int argc, const char * const *argv)
 	test_iri_relative_to_absolute();
 	test_iri_compare();
 	test_parser();
+	test_http_keep_alive();
+	test_http_parse_response();
+	test_http_chunked();
+	test_decompress();
+	test_dns_cache();
+	test_http_body_fd();
+	test_tls_session_file();
+	test_hpack();
+	test_http2_frames();
+	test_queue_get();
+	test_job_parts();
+	test_job_mirrors();
 
 	test_cookies();
 	mget_cookie_free_public_suffixes();